@@ -0,0 +1,245 @@
+use bincc::analysis::{
+    CFGGenerator, CFSComparator, FVec, Graph, SemanticComparator, StructureBlock,
+    StructureSignature, CFG, CFS,
+};
+use bincc::disasm::radare2::BareCFG;
+use bincc::disasm::{Architecture, Statement, StatementFamily};
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, BenchmarkId};
+use criterion::{Criterion, Throughput};
+use fnv::FnvHashMap;
+use std::collections::HashMap;
+
+// amount of if-then blocks of the functions used in the scaling benchmarks
+const SIZES: [usize; 3] = [8, 64, 512];
+// amount of functions inserted in the comparators. Their signatures have about 8600 nodes in
+// total, enough for CFSComparator::insert_all to split them among several threads
+const FUNCTIONS: usize = 256;
+const ARCH: Architecture = Architecture::X86(64);
+// offset of the first statement of every function
+const BASE: u64 = 0x1000;
+// size in bytes of a single if-then block
+const STRIDE: u64 = 12;
+
+// statements of a function composed by a sequence of if-then blocks.
+// every fourth block ends with a loop jumping back three blocks.
+fn function(blocks: usize) -> Vec<Statement> {
+    let mut stmts = Vec::with_capacity(blocks * 4 + 1);
+    for i in 0..blocks as u64 {
+        let base = BASE + i * STRIDE;
+        stmts.push(Statement::new(base, StatementFamily::CMP, "cmp eax, ebx"));
+        let jump = format!("je 0x{:x}", base + 8);
+        stmts.push(Statement::new(base + 2, StatementFamily::CJMP, &jump));
+        stmts.push(Statement::new(base + 4, StatementFamily::MOV, "mov eax, 1"));
+        if i % 4 == 3 {
+            let jump = format!("jne 0x{:x}", base - 3 * STRIDE);
+            stmts.push(Statement::new(base + 8, StatementFamily::CJMP, &jump));
+        } else {
+            stmts.push(Statement::new(base + 8, StatementFamily::MOV, "mov ebx, 2"));
+        }
+    }
+    let end = BASE + blocks as u64 * STRIDE;
+    stmts.push(Statement::new(end, StatementFamily::RET, "ret"));
+    stmts
+}
+
+// same function of `function(blocks)`, as retrieved from the disassembler
+fn bare_function(blocks: usize) -> BareCFG {
+    let mut bare = BareCFG {
+        root: Some(BASE),
+        blocks: Vec::with_capacity(blocks * 3 + 1),
+        edges: Vec::with_capacity(blocks * 4),
+    };
+    for i in 0..blocks as u64 {
+        let base = BASE + i * STRIDE;
+        let next = base + STRIDE;
+        bare.blocks
+            .extend([(base, 4), (base + 4, 4), (base + 8, 4)]);
+        bare.edges
+            .extend([(base, base + 8), (base, base + 4), (base + 4, base + 8)]);
+        if i % 4 == 3 {
+            bare.edges.push((base + 8, base - 3 * STRIDE));
+        }
+        bare.edges.push((base + 8, next));
+    }
+    bare.blocks.push((BASE + blocks as u64 * STRIDE, 1));
+    bare
+}
+
+fn cfg(blocks: usize) -> CFG {
+    let stmts = function(blocks);
+    let end = stmts.last().unwrap().get_offset() + 1;
+    CFG::new(&stmts, end, ARCH)
+}
+
+fn tree(blocks: usize) -> StructureBlock {
+    CFS::new(&cfg(blocks)).get_tree().unwrap()
+}
+
+fn bench_cfg(c: &mut Criterion) {
+    let mut group = c.benchmark_group("CFG::new");
+    for size in SIZES {
+        let stmts = function(size);
+        let end = stmts.last().unwrap().get_offset() + 1;
+        group.throughput(Throughput::Elements(stmts.len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &stmts, |b, stmts| {
+            b.iter(|| CFG::new(black_box(stmts), end, ARCH))
+        });
+    }
+    group.finish();
+    let mut group = c.benchmark_group("CFG::from");
+    for size in SIZES {
+        let bare = bare_function(size);
+        group.throughput(Throughput::Elements(bare.blocks.len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &bare, |b, bare| {
+            b.iter_batched(|| bare.clone(), CFG::from, BatchSize::SmallInput)
+        });
+    }
+    group.finish();
+}
+
+fn bench_graph(c: &mut Criterion) {
+    let mut group = c.benchmark_group("Graph");
+    for size in SIZES {
+        let cfg = cfg(size);
+        group.throughput(Throughput::Elements(cfg.len() as u64));
+        group.bench_with_input(BenchmarkId::new("scc", size), &cfg, |b, cfg| {
+            b.iter(|| cfg.scc())
+        });
+        group.bench_with_input(BenchmarkId::new("predecessors", size), &cfg, |b, cfg| {
+            b.iter(|| cfg.predecessors())
+        });
+        group.bench_with_input(BenchmarkId::new("bfs", size), &cfg, |b, cfg| {
+            b.iter(|| cfg.bfs().count())
+        });
+        group.bench_with_input(BenchmarkId::new("dfs_preorder", size), &cfg, |b, cfg| {
+            b.iter(|| cfg.dfs_preorder().count())
+        });
+        group.bench_with_input(BenchmarkId::new("dfs_postorder", size), &cfg, |b, cfg| {
+            b.iter(|| cfg.dfs_postorder().count())
+        });
+    }
+    group.finish();
+}
+
+fn bench_cfs(c: &mut Criterion) {
+    let mut group = c.benchmark_group("CFS::new");
+    // the reduction is superlinear, so the biggest inputs take seconds per iteration
+    group.sample_size(10);
+    for size in SIZES {
+        let cfg = cfg(size);
+        group.throughput(Throughput::Elements(cfg.len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &cfg, |b, cfg| {
+            b.iter(|| CFS::new(black_box(cfg)))
+        });
+    }
+    group.finish();
+    // generated functions mixing every region shape, including loops and intervals
+    let mut group = c.benchmark_group("CFS::new/synthetic");
+    group.sample_size(10);
+    let mut generator = CFGGenerator::new(0);
+    for size in SIZES {
+        let cfg = generator.generate(size);
+        group.throughput(Throughput::Elements(cfg.len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &cfg, |b, cfg| {
+            b.iter(|| CFS::new(black_box(cfg)))
+        });
+    }
+    group.finish();
+    // the signature fingerprints every subtree, replacing structural_hash in the comparators
+    let mut group = c.benchmark_group("StructureSignature::new");
+    for size in SIZES {
+        let tree = tree(size);
+        group.throughput(Throughput::Elements(tree.len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &tree, |b, tree| {
+            b.iter(|| StructureSignature::new(black_box(tree)))
+        });
+    }
+    group.finish();
+}
+
+fn bench_fvec(c: &mut Criterion) {
+    let mut group = c.benchmark_group("FVec::new");
+    for size in SIZES {
+        let stmts = function(size);
+        let mut opcodes = HashMap::new();
+        group.throughput(Throughput::Elements(stmts.len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(size), &stmts, |b, stmts| {
+            b.iter_batched(
+                || stmts.clone(),
+                |stmts| FVec::new(stmts, &mut opcodes, false),
+                BatchSize::SmallInput,
+            )
+        });
+    }
+    group.finish();
+    let mut opcodes = HashMap::new();
+    let a = FVec::new(function(64), &mut opcodes, false);
+    let b = FVec::new(function(63), &mut opcodes, false);
+    c.bench_function("FVec::cosine_similarity", |bencher| {
+        bencher.iter(|| black_box(&a).cosine_similarity(black_box(&b)))
+    });
+}
+
+// string cache with a name for every binary and function id used in the comparators
+fn string_cache() -> FnvHashMap<u32, String> {
+    (0..FUNCTIONS as u32)
+        .map(|id| (id, format!("function_{}", id)))
+        .collect()
+}
+
+fn bench_comparators(c: &mut Criterion) {
+    // functions of different sizes, so only some of them are clones
+    let trees = (0..FUNCTIONS)
+        .map(|i| StructureSignature::new(&tree(1 + i % 16)))
+        .collect::<Vec<_>>();
+    let string_cache = string_cache();
+    let mut group = c.benchmark_group("CFSComparator");
+    group.throughput(Throughput::Elements(FUNCTIONS as u64));
+    group.bench_function("insert", |b| {
+        b.iter(|| {
+            let mut comps = CFSComparator::new(3);
+            for (id, tree) in trees.iter().enumerate() {
+                comps.insert(0, id as u32, tree);
+            }
+            comps
+        })
+    });
+    let functions = trees
+        .iter()
+        .enumerate()
+        .map(|(id, tree)| (0, id as u32, tree))
+        .collect::<Vec<_>>();
+    group.bench_function("insert_all", |b| {
+        b.iter(|| {
+            let mut comps = CFSComparator::new(3);
+            comps.insert_all(&functions);
+            comps
+        })
+    });
+    let mut comps = CFSComparator::new(3);
+    comps.insert_all(&functions);
+    group.bench_function("clones", |b| b.iter(|| comps.clones(&string_cache)));
+    group.finish();
+    let mut opcodes = HashMap::new();
+    let fvecs = (0..FUNCTIONS)
+        .map(|i| FVec::new(function(1 + i % 16), &mut opcodes, false))
+        .collect::<Vec<_>>();
+    let mut group = c.benchmark_group("SemanticComparator");
+    group.throughput(Throughput::Elements(FUNCTIONS as u64));
+    let mut comps = SemanticComparator::new(0.99);
+    for (id, fvec) in fvecs.iter().enumerate() {
+        comps.insert(0, id as u32, fvec, None);
+    }
+    group.bench_function("clones", |b| b.iter(|| comps.clones(&string_cache)));
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_cfg,
+    bench_graph,
+    bench_cfs,
+    bench_fvec,
+    bench_comparators
+);
+criterion_main!(benches);
@@ -39,7 +39,7 @@ impl Display for BlockType {
 /// A group of [`StructureBlock`] with the same [`BlockType`] label.
 #[derive(Debug, PartialEq, Eq, Hash)]
 pub struct NestedBlock {
-    pub(crate) offset: u64,
+    pub(crate) offset: u32,
     pub(crate) block_type: BlockType,
     pub(crate) content: Vec<StructureBlock>,
     pub(crate) depth: u32,
@@ -51,7 +51,7 @@ impl NestedBlock {
         let old_depth = children.iter().fold(0, |max, val| max.max(val.depth()));
         let offset = children
             .iter()
-            .fold(u64::MAX, |min, val| min.min(val.offset()));
+            .fold(u32::MAX, |min, val| min.min(val.offset()));
         NestedBlock {
             offset,
             block_type: label,
@@ -169,7 +169,7 @@ impl StructureBlock {
     }
 
     /// Returns the offset of the first basic block contained in this cluster.
-    pub fn offset(&self) -> u64 {
+    pub fn offset(&self) -> u32 {
         match self {
             StructureBlock::Basic(bb) => bb.offset,
             StructureBlock::Nested(nb) => nb.offset,
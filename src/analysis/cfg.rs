@@ -1,6 +1,7 @@
 use crate::analysis::Graph;
 use crate::disasm::radare2::BareCFG;
 use crate::disasm::{Architecture, JumpType, Statement, StatementFamily};
+use crate::trace;
 use fnv::FnvHashMap;
 use lazy_static::lazy_static;
 use parse_int::parse;
@@ -14,9 +15,9 @@ use std::io::{ErrorKind, Read, Write};
 use std::path::Path;
 
 /// Offset of an artificially created exit node.
-pub const SINK_ADDR: u64 = u64::MAX;
+pub const SINK_ADDR: u32 = u32::MAX;
 /// Offset of an artificially created entry point.
-pub const ENTRY_ADDR: u64 = 0;
+pub const ENTRY_ADDR: u32 = 0;
 /// Shape of the root in the exported/imported graphviz dot.
 const EXTERN_DOT_ROOT: &str = "rect";
 /// Shape of the sink/extended entry point in the exported/imported graphviz dot.
@@ -38,6 +39,8 @@ const EXTERN_DOT_JUMP_COLOUR: &str = "dodgerblue";
 pub struct CFG {
     pub(super) root: Option<BasicBlock>,
     pub(super) edges: HashMap<BasicBlock, Vec<BasicBlock>>,
+    // address the offsets of the basic blocks are relative to
+    pub(super) base: u64,
 }
 
 /// Minimum portion of code without any jump.
@@ -50,13 +53,16 @@ pub struct CFG {
 /// terminating with a jump.
 ///
 /// This class does not contains the actual statements, rather than their offsets in the original
-/// code.
+/// code. Offsets are relative to the lowest address of the function, returned by [CFG::base()],
+/// so a basic block fits in 8 bytes; the absolute address can be obtained with
+/// [BasicBlock::address()].
 #[derive(Debug, Copy, Clone, Eq, PartialEq, Hash, Ord, PartialOrd)]
 pub struct BasicBlock {
-    /// Offset, in the original code, of the **first** instruction belonging to this basic block.
-    pub offset: u64,
+    /// Offset, relative to the base of the CFG, of the **first** instruction belonging to this
+    /// basic block.
+    pub offset: u32,
     /// Length of the basic block in bytes.
-    pub length: u64,
+    pub length: u32,
 }
 
 impl BasicBlock {
@@ -75,6 +81,11 @@ impl BasicBlock {
         self.length == 0 && self.offset == ENTRY_ADDR
     }
 
+    /// Returns the address of this basic block in the original code, given the base of its CFG.
+    pub fn address(&self, base: u64) -> u64 {
+        base + self.offset as u64
+    }
+
     /// Creates a new sink block.
     pub fn new_sink() -> BasicBlock {
         BasicBlock {
@@ -93,8 +104,9 @@ impl BasicBlock {
 }
 
 impl Display for BasicBlock {
+    // the offset is relative to the base of the CFG, use address() for the original one
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
-        write!(f, "{}", self.offset)
+        write!(f, "+0x{:x}", self.offset)
     }
 }
 
@@ -106,19 +118,36 @@ impl Default for BasicBlock {
 
 impl From<BareCFG> for CFG {
     fn from(bare: BareCFG) -> Self {
+        let _span = trace::span("CFG::from");
         let root_addr = bare.root.unwrap_or(0x0);
+        let base = bare
+            .blocks
+            .iter()
+            .map(|(first, _)| *first)
+            .min()
+            .unwrap_or(0);
+        // blocks not fitting the relative representation are discarded like unresolved ones
         let bbs = bare
             .blocks
             .iter()
             .cloned()
-            .map(|(first, length)| {
-                (
-                    first,
-                    BasicBlock {
-                        offset: first,
-                        length,
-                    },
-                )
+            .filter_map(|(first, length)| {
+                let offset = u32::try_from(first - base)
+                    .ok()
+                    .filter(|&offset| offset != SINK_ADDR);
+                match (offset, u32::try_from(length)) {
+                    (Some(offset), Ok(length)) => Some((first, BasicBlock { offset, length })),
+                    _ => {
+                        log::warn!(
+                            "Discarding the basic block at 0x{:x} (length {}), as it is too far \
+                             from the function base 0x{:x}. Continuing, but the CFG may be wrong",
+                            first,
+                            length,
+                            base
+                        );
+                        None
+                    }
+                }
             })
             .collect::<HashMap<_, _>>();
         let mut marked = HashSet::with_capacity(bbs.len());
@@ -143,16 +172,12 @@ impl From<BareCFG> for CFG {
             .for_each(|(_, val)| {
                 edges.insert(*val, Vec::with_capacity(0));
             });
-        let mut root = bbs
-            .iter()
-            .map(|(_, bb)| bb)
-            .find(|&bb| bb.offset == root_addr)
-            .cloned();
+        let mut root = bbs.get(&root_addr).cloned();
         if root.is_none() && !bbs.is_empty() {
             // if the root written in the BareCFG does not exists (weird), pick the lowest offset
-            root = bbs.iter().map(|(_, bb)| bb).min().cloned();
+            root = bbs.values().min().cloned();
         }
-        CFG { root, edges }
+        CFG { root, edges, base }
     }
 }
 
@@ -235,11 +260,23 @@ impl CFG {
         }
     }
 
+    /// Returns the address the offsets of the basic blocks are relative to.
+    ///
+    /// This is the lowest address of the function, usually its entry point.
+    pub fn base(&self) -> u64 {
+        self.base
+    }
+
+    /// Returns the number of edges in the CFG.
+    pub fn edges_len(&self) -> usize {
+        self.edges.values().map(Vec::len).sum()
+    }
+
     /// Converts the current CFG into a Graphviz dot representation.
     ///
     /// The generated file contains also each Basic Blocks starting and ending offset.
     /// This information is recorded as comment for each node in the form
-    /// `(start offset, end offset)`.
+    /// `(start offset, end offset)`, while the base of the CFG is recorded as comment of the graph.
     ///
     /// This method assumes that every node is reachable from the root. If this is not true, all
     /// unreachable nodes will be considered as a single node with ID [usize::MAX].
@@ -286,8 +323,9 @@ impl CFG {
             }
         }
         format!(
-            "digraph{{\ngraph[bgcolor={},fontsize=8,splines=\"ortho\"];\n{}\n{}\n{}\n}}\n",
+            "digraph{{\ngraph[bgcolor={},fontsize=8,splines=\"ortho\",comment=\"{}\"];\n{}\n{}\n{}\n}}\n",
             EXTERN_DOT_BG_COLOUR,
+            self.base,
             "node[fillcolor=gray,style=filled,shape=box];\nedge[arrowhead=normal];\n",
             nodes_string.join("\n"),
             edges_string.join("\n")
@@ -315,15 +353,20 @@ impl CFG {
                 EXTERN_DOT_SINK, EXTERN_DOT_ROOT
             );
             let mut root = None;
+            let mut base = 0;
             let node_re = Regex::new(&nodes_re_str).unwrap();
             lazy_static! {
                 static ref DOT_EDGES_RE: Regex = Regex::new(r#"(\d+)->(\d+)(?:\[.*];)?"#).unwrap();
+                static ref DOT_BASE_RE: Regex =
+                    Regex::new(r#"^graph\[.*comment="(\d+)"];"#).unwrap();
             }
             while let Some(line) = lines.pop() {
-                if let Some(cap) = node_re.captures(line) {
+                if let Some(cap) = DOT_BASE_RE.captures(line) {
+                    base = cap.get(1).unwrap().as_str().parse::<u64>()?;
+                } else if let Some(cap) = node_re.captures(line) {
                     let id = cap.get(1).unwrap().as_str().parse::<usize>()?;
-                    let offset = cap.get(2).unwrap().as_str().parse::<u64>()?;
-                    let length = cap.get(3).unwrap().as_str().parse::<u64>()?;
+                    let offset = cap.get(2).unwrap().as_str().parse::<u32>()?;
+                    let length = cap.get(3).unwrap().as_str().parse::<u32>()?;
                     let node = BasicBlock { offset, length };
                     if let Some(shape) = cap.get(4) {
                         if shape.as_str() == EXTERN_DOT_ROOT {
@@ -367,7 +410,7 @@ impl CFG {
             for exit in exits {
                 edges.insert(exit, Vec::with_capacity(0));
             }
-            Ok(CFG { root, edges })
+            Ok(CFG { root, edges, base })
         } else {
             Err(Box::new(std::io::Error::new(
                 ErrorKind::InvalidInput,
@@ -655,6 +698,7 @@ mod tests {
             CFG {
                 root: cfg.root,
                 edges,
+                base: cfg.base,
             }
         } else {
             cfg
@@ -679,6 +723,7 @@ mod tests {
         CFG {
             root: Some(nodes[0]),
             edges,
+            base: 0,
         }
     }
 
@@ -700,6 +745,7 @@ mod tests {
         CFG {
             root: Some(nodes[0]),
             edges,
+            base: 0,
         }
     }
 
@@ -708,15 +754,15 @@ mod tests {
         //expected
         let nodes = [
             BasicBlock {
-                offset: 0x1000,
+                offset: 0x0,
                 length: 20,
             },
             BasicBlock {
-                offset: 0x1014,
+                offset: 0x14,
                 length: 2,
             },
             BasicBlock {
-                offset: 0x1016,
+                offset: 0x16,
                 length: 5,
             },
         ];
@@ -729,20 +775,21 @@ mod tests {
             root: Some(
                 [
                     BasicBlock {
-                        offset: 0x1000,
+                        offset: 0x0,
                         length: 20,
                     },
                     BasicBlock {
-                        offset: 0x1014,
+                        offset: 0x14,
                         length: 2,
                     },
                     BasicBlock {
-                        offset: 0x1016,
+                        offset: 0x16,
                         length: 5,
                     },
                 ][0],
             ),
             edges,
+            base: 0x1000,
         };
         //conversion
         let bare = BareCFG {
@@ -771,7 +818,7 @@ mod tests {
         let arch = Architecture::X86(64);
         let cfg = CFG::new(&stmts, 0x625, arch);
         assert!(cfg.root().is_some());
-        assert_eq!(cfg.root().unwrap().offset, 0x61C);
+        assert_eq!(cfg.root().unwrap().address(cfg.base()), 0x61C);
     }
 
     #[test]
@@ -820,6 +867,7 @@ mod tests {
         let arch = Architecture::X86(64);
         let cfg = CFG::new(&stmts, 0x619, arch);
         assert_eq!(cfg.len(), 3);
+        assert_eq!(cfg.edges_len(), 3);
     }
 
     #[test]
@@ -865,10 +913,10 @@ mod tests {
         let node1 = cfg.next(node0);
         let node2 = cfg.next(node1);
         let node3 = cfg.cond(node1);
-        assert_eq!(node0.unwrap().offset, 0x610);
-        assert_eq!(node1.unwrap().offset, 0x614);
-        assert_eq!(node2.unwrap().offset, 0x61D);
-        assert_eq!(node3.unwrap().offset, 0x620);
+        assert_eq!(node0.unwrap().address(cfg.base()), 0x610);
+        assert_eq!(node1.unwrap().address(cfg.base()), 0x614);
+        assert_eq!(node2.unwrap().address(cfg.base()), 0x61D);
+        assert_eq!(node3.unwrap().address(cfg.base()), 0x620);
         assert!(cfg.next(node2).is_none());
         assert!(cfg.cond(node2).is_none());
         assert!(cfg.next(node3).is_none());
@@ -897,10 +945,10 @@ mod tests {
         let node1 = cfg.next(node0);
         let node2 = cfg.cond(node0);
         let node3 = cfg.next(node1);
-        assert_eq!(node0.unwrap().offset, 0x61E);
-        assert_eq!(node1.unwrap().offset, 0x62E);
-        assert_eq!(node2.unwrap().offset, 0x633);
-        assert_eq!(node3.unwrap().offset, 0x638);
+        assert_eq!(node0.unwrap().address(cfg.base()), 0x61E);
+        assert_eq!(node1.unwrap().address(cfg.base()), 0x62E);
+        assert_eq!(node2.unwrap().address(cfg.base()), 0x633);
+        assert_eq!(node3.unwrap().address(cfg.base()), 0x638);
         assert!(cfg.cond(node1).is_none());
         assert!(cfg.cond(node2).is_none());
         assert!(cfg.next(node3).is_none());
@@ -954,13 +1002,15 @@ mod tests {
         assert!(cfg.cond(node2).is_none());
         assert!(cfg.next(node3).is_none());
         assert!(cfg.cond(node3).is_none());
-        assert_eq!(node0.unwrap().offset, 0x610);
+        assert_eq!(cfg.base(), 0x610);
+        assert_eq!(node0.unwrap().offset, 0x0);
         assert_eq!(node0.unwrap().length, 8);
-        assert_eq!(node1.unwrap().offset, 0x618);
+        assert_eq!(node1.unwrap().offset, 0x8);
         assert_eq!(node1.unwrap().length, 12);
-        assert_eq!(node2.unwrap().offset, 0x624);
+        assert_eq!(node2.unwrap().offset, 0x14);
         assert_eq!(node2.unwrap().length, 4);
-        assert_eq!(node3.unwrap().offset, 0x628);
+        assert_eq!(node3.unwrap().offset, 0x18);
+        assert_eq!(node3.unwrap().address(cfg.base()), 0x628);
         assert_eq!(node3.unwrap().length, 8);
     }
 
@@ -985,6 +1035,23 @@ mod tests {
         let arch = Architecture::X86(64);
         let cfg = CFG::new(&stmts, 0x3FD1A7EF56C, arch);
         assert_eq!(cfg.len(), 6);
+        assert_eq!(cfg.base(), 0x3FD1A7EF534);
+    }
+
+    #[test]
+    fn from_bare_cfg_out_of_range() {
+        // a block more than 4 GiB away from the others cannot be represented
+        let bare = BareCFG {
+            root: Some(0x1000),
+            blocks: vec![(0x1000, 4), (0x1004, 4), (0x2_0000_1000, 4)],
+            edges: vec![(0x1000, 0x1004), (0x1004, 0x2_0000_1000)],
+        };
+        let cfg = CFG::from(bare);
+        assert_eq!(cfg.base(), 0x1000);
+        assert_eq!(cfg.len(), 2);
+        assert!(cfg.next(cfg.next(cfg.root())).is_none());
+        // blocks are displayed relative to the base
+        assert_eq!(cfg.next(cfg.root()).unwrap().to_string(), "+0x4");
     }
 
     #[test]
@@ -1112,6 +1179,7 @@ mod tests {
         let cfg = CFG {
             root: None,
             edges: HashMap::new(),
+            base: 0,
         };
         let cfg_with_eep = cfg.add_entry_point();
         assert!(cfg_with_eep.is_empty());
@@ -1135,6 +1203,7 @@ mod tests {
         let cfg = CFG {
             root: None,
             edges: HashMap::new(),
+            base: 0,
         };
         let cfg_only_reachables = reachable(cfg);
         assert!(cfg_only_reachables.is_empty());
@@ -1227,6 +1296,6 @@ mod tests {
         let arch = Architecture::X86(64);
         let cfg = CFG::new(&stmts, 0x62C, arch);
         assert!(cfg.root().is_some());
-        assert_eq!(cfg.root().unwrap().offset, 0x61C);
+        assert_eq!(cfg.root().unwrap().address(cfg.base()), 0x61C);
     }
 }
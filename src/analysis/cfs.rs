@@ -1,5 +1,6 @@
 use crate::analysis::blocks::StructureBlock;
 use crate::analysis::{BasicBlock, BlockType, DirectedGraph, Graph, NestedBlock, CFG};
+use crate::trace;
 use fnv::FnvHashSet;
 use maplit::hashset;
 use std::cmp::{max, Ordering};
@@ -19,12 +20,122 @@ use std::sync::Arc;
 // decrease the node amount.
 const BUILD_TOLERANCE: usize = 32;
 
+/// Names of the reduction rules applied while building a [`CFS`], in the order they are tried.
+pub const REDUCTION_RULES: [&str; 8] = [
+    "self_loop",
+    "loop",
+    "if_then",
+    "if_else",
+    "sequence",
+    "switch",
+    "proper_interval",
+    "improper_interval",
+];
+
+/// Amount of buckets in the histograms of [`ReductionSummary`].
+pub const HISTOGRAM_BUCKETS: usize = 16;
+
+/// Counters collected while building a single [`CFS`].
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ReductionStats {
+    /// Amount of reductions applied.
+    pub iterations: usize,
+    /// Amount of times each rule was applied, in the order of [`REDUCTION_RULES`].
+    pub rules: [usize; 8],
+    /// Amount of times a rule was tried, successfully or not.
+    pub attempts: usize,
+    /// True if the construction was stopped because too many reductions in a row did not
+    /// decrease the amount of nodes.
+    pub tolerance_exceeded: bool,
+    /// Amount of nodes left in the graph when the construction ended.
+    ///
+    /// This is 1 if the construction succeeded.
+    pub remaining_nodes: usize,
+}
+
+/// [`ReductionStats`] aggregated over several functions.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct ReductionSummary {
+    /// Amount of functions.
+    pub functions: usize,
+    /// Total amount of reductions applied.
+    pub iterations: usize,
+    /// Total amount of times each rule was applied, in the order of [`REDUCTION_RULES`].
+    pub rules: [usize; 8],
+    /// Total amount of times a rule was tried.
+    pub attempts: usize,
+    /// Amount of functions whose construction was stopped by the tolerance.
+    pub tolerance_exceeded: usize,
+    /// Amount of functions whose construction ended with more than one node.
+    pub incomplete: usize,
+    /// Histogram of the reductions applied to each function.
+    ///
+    /// The first bucket counts the functions with no reductions, the bucket `i` the ones with
+    /// at least `2^(i-1)` and less than `2^i` reductions. The last bucket contains all the
+    /// bigger values.
+    pub iterations_histogram: [usize; HISTOGRAM_BUCKETS],
+    /// Histogram of the nodes left in the incomplete functions, with the same buckets of
+    /// `iterations_histogram`.
+    pub remaining_histogram: [usize; HISTOGRAM_BUCKETS],
+}
+
+impl ReductionSummary {
+    /// Adds the counters of a single function.
+    pub fn add(&mut self, stats: &ReductionStats) {
+        self.functions += 1;
+        self.iterations += stats.iterations;
+        self.attempts += stats.attempts;
+        for (total, count) in self.rules.iter_mut().zip(stats.rules) {
+            *total += count;
+        }
+        self.tolerance_exceeded += stats.tolerance_exceeded as usize;
+        self.iterations_histogram[histogram_bucket(stats.iterations)] += 1;
+        if stats.remaining_nodes > 1 {
+            self.incomplete += 1;
+            self.remaining_histogram[histogram_bucket(stats.remaining_nodes)] += 1;
+        }
+    }
+
+    /// Adds all the counters of another summary.
+    pub fn merge(&mut self, other: &ReductionSummary) {
+        self.functions += other.functions;
+        self.iterations += other.iterations;
+        self.attempts += other.attempts;
+        self.tolerance_exceeded += other.tolerance_exceeded;
+        self.incomplete += other.incomplete;
+        for (total, count) in self.rules.iter_mut().zip(other.rules) {
+            *total += count;
+        }
+        for (total, count) in self
+            .iterations_histogram
+            .iter_mut()
+            .zip(other.iterations_histogram)
+        {
+            *total += count;
+        }
+        for (total, count) in self
+            .remaining_histogram
+            .iter_mut()
+            .zip(other.remaining_histogram)
+        {
+            *total += count;
+        }
+    }
+}
+
+// bucket of the histograms containing the given value
+fn histogram_bucket(value: usize) -> usize {
+    let bits = (usize::BITS - value.leading_zeros()) as usize;
+    bits.min(HISTOGRAM_BUCKETS - 1)
+}
+
 #[derive(Clone)]
 /// A High-Level control flow structure, representing a function in form of [`StructureBlock`]
 /// tree.
 pub struct CFS {
     cfg: CFG,
     tree: DirectedGraph<StructureBlock>,
+    stats: ReductionStats,
 }
 
 impl CFS {
@@ -33,14 +144,34 @@ impl CFS {
     /// This procedure is **NOT** guaranteed to complete successfully. If the procedure fails, the
     /// [`CFS::get_tree`] method will return [`None`].
     pub fn new(cfg: &CFG) -> CFS {
+        let _span = trace::span("CFS::new");
         let sinked_cfg = cfg.clone();
-        let tree = build_cfs(&sinked_cfg);
+        let (tree, stats) = build_cfs(&sinked_cfg);
         CFS {
             cfg: sinked_cfg,
             tree,
+            stats,
         }
     }
 
+    /// Returns the counters collected while building the [`CFS`].
+    pub fn stats(&self) -> &ReductionStats {
+        &self.stats
+    }
+
+    /// Returns the amount of reductions applied while building the [`CFS`].
+    pub fn iterations(&self) -> usize {
+        self.stats.iterations
+    }
+
+    /// Returns true if the construction was stopped because too many reductions in a row did not
+    /// decrease the amount of nodes.
+    ///
+    /// When this happens the [`CFS`] is usually incomplete, and [`CFS::get_tree`] returns [`None`].
+    pub fn tolerance_exceeded(&self) -> bool {
+        self.stats.tolerance_exceeded
+    }
+
     /// Returns the final result of the [`CFS`] creation.
     ///
     /// If the process fails, a graph will be created, otherwise a tree will be created.
@@ -222,7 +353,7 @@ fn reduce_switch<'a>(
             next = Some(exit);
             let block = Arc::new(NestedBlock::new(
                 BlockType::Switch,
-                components.iter().copied().cloned().collect(),
+                switch_children(node, &components),
             ));
             Some(Reduction {
                 old: components,
@@ -239,7 +370,7 @@ fn reduce_switch<'a>(
                 next = Some(exit_set.into_iter().next().unwrap());
                 let block = Arc::new(NestedBlock::new(
                     BlockType::Switch,
-                    components.iter().copied().cloned().collect(),
+                    switch_children(node, &components),
                 ));
                 Some(Reduction {
                     old: components,
@@ -255,6 +386,21 @@ fn reduce_switch<'a>(
     }
 }
 
+// children of a switch: the head followed by the cases sorted by offset, so the resulting block
+// does not depend on the iteration order of the components
+fn switch_children(
+    head: &StructureBlock,
+    components: &HashSet<&StructureBlock>,
+) -> Vec<StructureBlock> {
+    let mut cases = components
+        .iter()
+        .filter(|&&x| x != head)
+        .map(|&x| x.clone())
+        .collect::<Vec<_>>();
+    cases.sort_unstable_by_key(StructureBlock::offset);
+    std::iter::once(head.clone()).chain(cases).collect()
+}
+
 fn reduce_sequence<'a>(
     node: &'a StructureBlock,
     graph: &'a DirectedGraph<StructureBlock>,
@@ -814,11 +960,12 @@ impl<'a> LoopHelper<'a> {
     }
 }
 
-fn build_cfs(cfg: &CFG) -> DirectedGraph<StructureBlock> {
+fn build_cfs(cfg: &CFG) -> (DirectedGraph<StructureBlock>, ReductionStats) {
     let nonat_cfg = remove_natural_loops(&cfg.scc(), &cfg.predecessors(), cfg.clone())
         .add_sink()
         .add_entry_point();
     let mut current_tolerance = 0;
+    let mut stats = ReductionStats::default();
     let mut graph = deep_copy(&nonat_cfg);
     let mut prev_len = nonat_cfg.len();
     loop {
@@ -840,14 +987,17 @@ fn build_cfs(cfg: &CFG) -> DirectedGraph<StructureBlock> {
                 reduce_improper_interval,
             ];
             let mut reduced = None;
-            for reduction in &reductions {
+            for (rule, reduction) in reductions.iter().enumerate() {
+                stats.attempts += 1;
                 reduced = (reduction)(node, &graph, &preds, &loop_helper);
                 if reduced.is_some() {
+                    stats.rules[rule] += 1;
                     break;
                 }
             }
             if let Some(reduction) = reduced {
                 graph = remap_nodes(reduction, &graph);
+                stats.iterations += 1;
                 if graph.len() < prev_len {
                     current_tolerance = 0;
                     prev_len = graph.len();
@@ -869,7 +1019,9 @@ fn build_cfs(cfg: &CFG) -> DirectedGraph<StructureBlock> {
         .into_iter()
         .filter(|(node, _)| visit.contains(node))
         .collect();
-    graph
+    stats.tolerance_exceeded = current_tolerance >= BUILD_TOLERANCE;
+    stats.remaining_nodes = graph.len();
+    (graph, stats)
 }
 
 fn deep_copy(cfg: &CFG) -> DirectedGraph<StructureBlock> {
@@ -981,6 +1133,7 @@ fn remove_edges(input_set: HashSet<BasicBlock>, targets: HashSet<BasicBlock>, cf
     CFG {
         root: cfg.root,
         edges: done,
+        base: cfg.base,
     }
 }
 
@@ -1101,7 +1254,9 @@ fn remove_natural_loops(
 
 #[cfg(test)]
 mod tests {
-    use crate::analysis::{cfs, BasicBlock, BlockType, Graph, CFG, CFS};
+    use crate::analysis::{
+        cfs, BasicBlock, BlockType, Graph, ReductionStats, ReductionSummary, CFG, CFS,
+    };
     use std::collections::HashMap;
 
     macro_rules! create_cfg {
@@ -1125,6 +1280,7 @@ mod tests {
             CFG {
                 root,
                 edges,
+                base: 0,
             }
         }
     };
@@ -1134,6 +1290,7 @@ mod tests {
         CFG {
             root: None,
             edges: HashMap::default(),
+            base: 0,
         }
     }
 
@@ -1165,12 +1322,54 @@ mod tests {
         let cfg = create_cfg! {};
         let cfs = CFS::new(&cfg);
         assert!(cfs.get_tree().is_none());
+        assert_eq!(cfs.iterations(), 0);
+    }
+
+    #[test]
+    fn reduction_summary() {
+        let mut summary = ReductionSummary::default();
+        let complete = ReductionStats {
+            iterations: 5,
+            rules: [1, 0, 0, 0, 4, 0, 0, 0],
+            attempts: 20,
+            tolerance_exceeded: false,
+            remaining_nodes: 1,
+        };
+        let incomplete = ReductionStats {
+            iterations: 32,
+            rules: [32, 0, 0, 0, 0, 0, 0, 0],
+            attempts: 40,
+            tolerance_exceeded: true,
+            remaining_nodes: 3,
+        };
+        summary.add(&complete);
+        let mut other = ReductionSummary::default();
+        other.add(&incomplete);
+        other.add(&ReductionStats::default());
+        summary.merge(&other);
+        assert_eq!(summary.functions, 3);
+        assert_eq!(summary.iterations, 37);
+        assert_eq!(summary.rules, [33, 0, 0, 0, 4, 0, 0, 0]);
+        assert_eq!(summary.attempts, 60);
+        assert_eq!(summary.tolerance_exceeded, 1);
+        assert_eq!(summary.incomplete, 1);
+        // 0 -> bucket 0, 5 -> bucket 3 (4..8), 32 -> bucket 6 (32..64)
+        assert_eq!(summary.iterations_histogram[0], 1);
+        assert_eq!(summary.iterations_histogram[3], 1);
+        assert_eq!(summary.iterations_histogram[6], 1);
+        assert_eq!(summary.remaining_histogram[2], 1);
     }
 
     #[test]
     fn reduce_sequence() {
         let cfg = create_cfg! { 0 => [1], 1 => [2], 2 => [3], 3 => [4], 4 => [] };
         let cfs = CFS::new(&cfg);
+        let stats = cfs.stats();
+        assert!(stats.iterations > 0);
+        assert_eq!(stats.rules[4], stats.iterations);
+        assert!(stats.attempts >= stats.iterations);
+        assert!(!cfs.tolerance_exceeded());
+        assert_eq!(stats.remaining_nodes, 1);
         let sequence = cfs.get_tree().unwrap();
         assert_eq!(sequence.len(), 5);
         assert_eq!(sequence.depth(), 1);
@@ -1211,6 +1410,34 @@ mod tests {
         assert_eq!(children[1].len(), 6);
     }
 
+    #[test]
+    fn switch_children_order() {
+        // the components are collected in a HashSet with a random seed, so the switch is built
+        // several times to catch an order depending on the iteration
+        for _ in 0..16 {
+            let cfg = create_cfg! {
+                0 => [1],
+                1 => [6, 3, 5, 2, 4],
+                2 => [7],
+                3 => [7],
+                4 => [7],
+                5 => [7],
+                6 => [7],
+                7 => []
+            };
+            let cfs = CFS::new(&cfg);
+            let sequence = cfs.get_tree().unwrap();
+            let switch = &sequence.children()[1];
+            assert_eq!(switch.block_type(), BlockType::Switch);
+            let offsets = switch
+                .children()
+                .iter()
+                .map(|child| child.offset())
+                .collect::<Vec<_>>();
+            assert_eq!(offsets, vec![1, 2, 3, 4, 5, 6]);
+        }
+    }
+
     #[test]
     fn switch_fallthrough_single() {
         let cfg = create_cfg! { 0 => [1, 2, 3], 1 => [2], 2 => [4], 3 => [4], 4 => [] };
@@ -1,9 +1,9 @@
-use crate::analysis::blocks::StructureBlock;
+use crate::analysis::{StructureSignature, Subtree};
 use crate::disasm::Statement;
+use crate::trace;
 use fnv::FnvHashMap;
 use std::collections::{HashMap, HashSet};
 use std::hash::Hash;
-use std::{collections::hash_map::DefaultHasher, hash::Hasher};
 
 #[derive(Debug, Clone, PartialEq, Eq, Hash)]
 /// Contains all the binaries and function names belonging to the same clone class.
@@ -12,12 +12,31 @@ use std::{collections::hash_map::DefaultHasher, hash::Hasher};
 pub struct CloneClass<'a> {
     binaries: Vec<&'a str>,
     functions: Vec<&'a str>,
-    structures: Option<Vec<&'a StructureBlock>>,
+    // binary and function ids, as given when inserting in the comparator.
+    ids: Vec<(u32, u32)>,
+    structures: Option<Vec<Subtree<'a>>>,
     // used by the iterator to know the current index.
     iterator_index: usize,
 }
 
 impl<'a> CloneClass<'a> {
+    // Creates a new clone class. Ids and, if present, structures should have the same length as
+    // the binaries and functions.
+    pub(crate) fn new(
+        binaries: Vec<&'a str>,
+        functions: Vec<&'a str>,
+        ids: Vec<(u32, u32)>,
+        structures: Option<Vec<Subtree<'a>>>,
+    ) -> CloneClass<'a> {
+        CloneClass {
+            binaries,
+            functions,
+            ids,
+            structures,
+            iterator_index: 0,
+        }
+    }
+
     /// Returns the amount of cloned functions contained in this class.
     pub fn len(&self) -> usize {
         self.binaries.len()
@@ -36,9 +55,17 @@ impl<'a> CloneClass<'a> {
             .zip(self.functions.iter().copied())
     }
 
-    /// Returns the depth of the [`StructureBlock`] represented by this clone class.
+    /// Iterate the binary and function ids contained in this clone class.
+    ///
+    /// The ids are the ones given when inserting the functions in the comparator, and are returned
+    /// in the same order of [`CloneClass::iter_names`].
+    pub fn iter_ids(&self) -> impl Iterator<Item = (u32, u32)> + '_ {
+        self.ids.iter().copied()
+    }
+
+    /// Returns the depth of the structure represented by this clone class.
     ///
-    /// Returns 0 if there is no [`StructureBlock`] associated with this clone class
+    /// Returns 0 if there is no structure associated with this clone class
     /// (i.e. in case of semantic analysis).
     pub fn depth(&self) -> u32 {
         if let Some(structures) = &self.structures {
@@ -50,7 +77,7 @@ impl<'a> CloneClass<'a> {
 }
 
 impl<'a> Iterator for CloneClass<'a> {
-    type Item = (&'a str, &'a str, Option<&'a StructureBlock>);
+    type Item = (&'a str, &'a str, Option<Subtree<'a>>);
 
     fn next(&mut self) -> Option<Self::Item> {
         if self.iterator_index < self.binaries.len() {
@@ -70,15 +97,37 @@ impl<'a> Iterator for CloneClass<'a> {
 struct CloneCandidate<'a> {
     bin_id: u32,
     func_id: u32,
-    structure: &'a StructureBlock,
+    structure: Subtree<'a>,
+}
+
+// the index of the CFSComparator is split in shards by the top bits of the fingerprint
+const SHARD_BITS: u32 = 6;
+const SHARDS: usize = 1 << SHARD_BITS;
+// minimum amount of functions or candidates given to each thread, as spawning threads for less
+// is slower than doing the work in a single one
+const ITEMS_PER_THREAD: usize = 256;
+
+// a shard of the CFSComparator index, mapping each fingerprint to its candidates
+type Shard<'a> = FnvHashMap<u64, Vec<CloneCandidate<'a>>>;
+
+fn shard_of(fingerprint: u64) -> usize {
+    (fingerprint >> (u64::BITS - SHARD_BITS)) as usize
 }
 
 /// Compares several CFS and discovers binary clones.
+///
+/// The CFS hashes are indexed in several shards, selected by the hash prefix, so functions can be
+/// inserted with [`CFSComparator::insert_all`] and clones extracted with
+/// [`CFSComparator::clones`] by several threads, each one owning a subset of the shards.
 pub struct CFSComparator<'a> {
-    /// Contains the CFS hashes and the possible clone with that hash
-    hashes: FnvHashMap<u64, Vec<CloneCandidate<'a>>>,
+    /// Contains the CFS hashes and the possible clone with that hash, split by hash prefix
+    shards: Vec<Shard<'a>>,
+    /// Amount of candidates in all the shards
+    candidates: usize,
     /// Discard CFSs smaller than this length
     mindepth: u32,
+    /// Maximum amount of threads used, the available parallelism if None
+    threads: Option<usize>,
 }
 
 impl<'a> CFSComparator<'a> {
@@ -86,74 +135,234 @@ impl<'a> CFSComparator<'a> {
     ///
     ///  The threshold `mindepth` (called `θ` in the paper) is the minimum number of nested nodes
     ///  contained in the CFS.
+    ///
+    /// The comparator uses as many threads as the available parallelism, see
+    /// [`CFSComparator::with_threads`] to change it.
     pub fn new(mindepth: u32) -> Self {
         CFSComparator {
-            hashes: FnvHashMap::default(),
+            shards: (0..SHARDS).map(|_| Shard::default()).collect(),
+            candidates: 0,
             mindepth,
+            threads: None,
+        }
+    }
+
+    /// Sets the maximum amount of threads used by the comparator.
+    ///
+    /// The result of the comparison does not depend on the amount of threads.
+    pub fn with_threads(mut self, threads: usize) -> Self {
+        self.threads = Some(threads.max(1));
+        self
+    }
+
+    // amount of threads to use for the given amount of work items.
+    // The available parallelism is queried only if the work is worth more than one thread
+    fn workers(&self, items: usize) -> usize {
+        let useful = items / ITEMS_PER_THREAD;
+        if useful <= 1 {
+            return 1;
         }
+        let threads = self.threads.unwrap_or_else(|| {
+            std::thread::available_parallelism()
+                .map(|threads| threads.get())
+                .unwrap_or(1)
+        });
+        threads.min(useful)
     }
 
     /// Inserts a new function in the comparator.
     ///
     /// The actual comparison is done by calling the [`CFSComparator::clones`] function.
     ///
-    /// binary_id and function_id are unique identifiers for a binary or a function.
-    pub fn insert(&mut self, binary_id: u32, function_id: u32, structure: &'a StructureBlock) {
-        let mut stack = vec![structure];
-        while let Some(node) = stack.pop() {
-            if node.depth() >= self.mindepth {
-                let candidate = CloneCandidate {
-                    bin_id: binary_id,
-                    func_id: function_id,
-                    structure: node,
-                };
-                let mut hasher = DefaultHasher::new();
-                node.structural_hash(&mut hasher);
-                let hash = hasher.finish();
-                self.hashes
-                    .entry(hash)
-                    .and_modify(|e| e.push(candidate.clone()))
-                    .or_insert_with(|| vec![candidate.clone()]);
-                stack.extend(node.children().iter());
+    /// binary_id and function_id are unique identifiers for a binary or a function. The structure
+    /// is given as [`StructureSignature`], as only the fingerprints of its subtrees are needed.
+    pub fn insert(&mut self, binary_id: u32, function_id: u32, signature: &'a StructureSignature) {
+        let _span = trace::span("CFSComparator::insert");
+        for subtree in signature.subtrees(self.mindepth) {
+            let candidate = CloneCandidate {
+                bin_id: binary_id,
+                func_id: function_id,
+                structure: subtree,
+            };
+            let fingerprint = subtree.fingerprint();
+            self.shards[shard_of(fingerprint)]
+                .entry(fingerprint)
+                .or_default()
+                .push(candidate);
+            self.candidates += 1;
+        }
+    }
+
+    /// Inserts several functions in the comparator, given as `(binary_id, function_id, signature)`.
+    ///
+    /// The functions are split among several threads, each one collecting the subtrees of its
+    /// functions grouped by shard. Then each shard is filled by a single thread, so no lock is
+    /// needed. The result is the same of calling [`CFSComparator::insert`] for each function, in
+    /// order.
+    ///
+    /// The work is measured in signature nodes, as every node is visited to find the subtrees,
+    /// so a few large functions are split among threads as well as many small ones.
+    pub fn insert_all(&mut self, functions: &[(u32, u32, &'a StructureSignature)]) {
+        let _span = trace::span("CFSComparator::insert_all");
+        let nodes = functions
+            .iter()
+            .map(|(_, _, signature)| signature.nodes().len())
+            .sum::<usize>();
+        let threads = self.workers(nodes);
+        if threads == 1 {
+            for &(binary_id, function_id, signature) in functions {
+                self.insert(binary_id, function_id, signature);
+            }
+            return;
+        }
+        let mindepth = self.mindepth;
+        // contiguous chunks with about the same amount of nodes, to keep the insertion order
+        let nodes_per_thread = nodes.div_ceil(threads);
+        let mut split = Vec::with_capacity(threads);
+        let (mut start, mut chunk_nodes) = (0, 0);
+        for (index, (_, _, signature)) in functions.iter().enumerate() {
+            chunk_nodes += signature.nodes().len();
+            if chunk_nodes >= nodes_per_thread {
+                split.push(&functions[start..=index]);
+                (start, chunk_nodes) = (index + 1, 0);
             }
         }
+        if start < functions.len() {
+            split.push(&functions[start..]);
+        }
+        // candidates of each chunk of functions, grouped by shard
+        let chunks = std::thread::scope(|scope| {
+            let handles = split
+                .into_iter()
+                .map(|chunk| {
+                    scope.spawn(move || {
+                        let mut grouped = (0..SHARDS).map(|_| Vec::new()).collect::<Vec<_>>();
+                        for &(bin_id, func_id, signature) in chunk {
+                            for structure in signature.subtrees(mindepth) {
+                                let fingerprint = structure.fingerprint();
+                                grouped[shard_of(fingerprint)].push((
+                                    fingerprint,
+                                    CloneCandidate {
+                                        bin_id,
+                                        func_id,
+                                        structure,
+                                    },
+                                ));
+                            }
+                        }
+                        grouped
+                    })
+                })
+                .collect::<Vec<_>>();
+            handles
+                .into_iter()
+                .map(|handle| handle.join().unwrap())
+                .collect::<Vec<_>>()
+        });
+        // transposed, so each shard has the candidates of every chunk, in order
+        let mut by_shard = (0..SHARDS).map(|_| Vec::new()).collect::<Vec<_>>();
+        for grouped in chunks {
+            for (shard, candidates) in grouped.into_iter().enumerate() {
+                self.candidates += candidates.len();
+                by_shard[shard].push(candidates);
+            }
+        }
+        let shards_per_thread = SHARDS.div_ceil(threads);
+        std::thread::scope(|scope| {
+            let mut by_shard = by_shard.into_iter();
+            for shards in self.shards.chunks_mut(shards_per_thread) {
+                let inserted = by_shard.by_ref().take(shards.len()).collect::<Vec<_>>();
+                scope.spawn(move || {
+                    for (shard, chunks) in shards.iter_mut().zip(inserted) {
+                        for (fingerprint, candidate) in chunks.into_iter().flatten() {
+                            shard.entry(fingerprint).or_default().push(candidate);
+                        }
+                    }
+                });
+            }
+        });
     }
 
     /// Retrieves the clone class from this comparator.
     ///
     /// The various functions to be checcked for clones should be inserted by calling
     /// [`CFSComparator::insert`] prior to this function.
+    ///
+    /// The shards are processed in parallel, and the classes are returned sorted by the hash of
+    /// their structure, so the result does not depend on the amount of threads.
     pub fn clones<'b: 'a>(&self, string_cache: &'b FnvHashMap<u32, String>) -> Vec<CloneClass<'a>> {
-        let mut retval = HashSet::new();
-        for class_candidate in self.hashes.values() {
-            let class_len = class_candidate.len();
-            if class_len > 1 {
-                let mut binaries = Vec::with_capacity(class_len);
-                let mut functions = Vec::with_capacity(class_len);
-                let mut structures = Vec::with_capacity(class_len);
-                for clone in class_candidate {
-                    binaries.push(string_cache.get(&clone.bin_id).unwrap().as_str());
-                    functions.push(string_cache.get(&clone.func_id).unwrap().as_str());
-                    structures.push(clone.structure);
-                }
-                retval.insert(CloneClass {
-                    binaries,
-                    functions,
-                    structures: Some(structures),
-                    iterator_index: 0,
-                });
-            }
+        let _span = trace::span("CFSComparator::clones");
+        let threads = self.workers(self.candidates);
+        let shards_per_thread = SHARDS.div_ceil(threads);
+        if threads == 1 {
+            return self
+                .shards
+                .iter()
+                .flat_map(|shard| shard_clones(shard, string_cache))
+                .collect();
         }
-        retval.into_iter().collect()
+        std::thread::scope(|scope| {
+            let handles = self
+                .shards
+                .chunks(shards_per_thread)
+                .map(|shards| {
+                    scope.spawn(move || {
+                        shards
+                            .iter()
+                            .flat_map(|shard| shard_clones(shard, string_cache))
+                            .collect::<Vec<_>>()
+                    })
+                })
+                .collect::<Vec<_>>();
+            handles
+                .into_iter()
+                .flat_map(|handle| handle.join().unwrap())
+                .collect()
+        })
     }
 }
 
+// clone classes of a single shard, sorted by hash
+fn shard_clones<'a>(
+    shard: &Shard<'a>,
+    string_cache: &'a FnvHashMap<u32, String>,
+) -> Vec<CloneClass<'a>> {
+    let mut buckets = shard
+        .iter()
+        .filter(|(_, candidates)| candidates.len() > 1)
+        .collect::<Vec<_>>();
+    buckets.sort_unstable_by_key(|(fingerprint, _)| **fingerprint);
+    buckets
+        .into_iter()
+        .map(|(_, class_candidate)| {
+            let class_len = class_candidate.len();
+            let mut binaries = Vec::with_capacity(class_len);
+            let mut functions = Vec::with_capacity(class_len);
+            let mut ids = Vec::with_capacity(class_len);
+            let mut structures = Vec::with_capacity(class_len);
+            for clone in class_candidate {
+                binaries.push(string_cache.get(&clone.bin_id).unwrap().as_str());
+                functions.push(string_cache.get(&clone.func_id).unwrap().as_str());
+                ids.push((clone.bin_id, clone.func_id));
+                structures.push(clone.structure);
+            }
+            CloneClass {
+                binaries,
+                functions,
+                ids,
+                structures: Some(structures),
+                iterator_index: 0,
+            }
+        })
+        .collect()
+}
+
 /// Compares several [`FVec`]s and discovers binary clones.
 pub struct SemanticComparator<'a> {
     bin_id: Vec<u32>,
     fun_id: Vec<u32>,
     fvec: Vec<&'a FVec>,
-    structures: Vec<&'a StructureBlock>,
+    structures: Vec<Subtree<'a>>,
     min_similarity: f32,
 }
 
@@ -182,7 +391,7 @@ impl<'a> SemanticComparator<'a> {
         binary_id: u32,
         function_id: u32,
         fvec: &'a FVec,
-        structure: Option<&'a StructureBlock>,
+        structure: Option<Subtree<'a>>,
     ) {
         self.bin_id.push(binary_id);
         self.fun_id.push(function_id);
@@ -200,11 +409,13 @@ impl<'a> SemanticComparator<'a> {
     where
         'a: 'b,
     {
+        let _span = trace::span("SemanticComparator::clones");
         let mut retval = HashSet::new();
         let use_structures = self.fvec.len() == self.structures.len();
         for a in self.fvec.iter() {
             let mut binaries = Vec::new();
             let mut functions = Vec::new();
+            let mut ids = Vec::new();
             let mut structures = Vec::new();
             for (index_b, b) in self.fvec.iter().enumerate() {
                 if a.cosine_similarity(b) > self.min_similarity {
@@ -212,6 +423,7 @@ impl<'a> SemanticComparator<'a> {
                     let func_b = string_cache.get(&self.fun_id[index_b]).unwrap().as_str();
                     binaries.push(bin_b);
                     functions.push(func_b);
+                    ids.push((self.bin_id[index_b], self.fun_id[index_b]));
                     if use_structures {
                         structures.push(self.structures[index_b]);
                     }
@@ -221,6 +433,7 @@ impl<'a> SemanticComparator<'a> {
                 retval.insert(CloneClass {
                     binaries,
                     functions,
+                    ids,
                     structures: if use_structures {
                         Some(structures)
                     } else {
@@ -250,6 +463,7 @@ impl FVec {
         opcode_map: &mut HashMap<String, u16>,
         cross_arch: bool,
     ) -> Self {
+        let _span = trace::span("FVec::new");
         let mut count = FnvHashMap::default();
         let stmts_no = stmts.len();
         for stmt in stmts {
@@ -273,6 +487,23 @@ impl FVec {
         }
     }
 
+    /// Creates a frequency vector from pairs of opcode identifier and frequency.
+    ///
+    /// This is the inverse of [`FVec::frequencies`], and is used to restore a vector saved
+    /// elsewhere. As for [`FVec::new`], opcode identifiers should be unique for each opcode.
+    pub fn from_frequencies<I: IntoIterator<Item = (u16, f32)>>(frequencies: I) -> Self {
+        FVec {
+            sparse: frequencies.into_iter().collect(),
+        }
+    }
+
+    /// Returns the pairs of opcode identifier and frequency contained in this vector.
+    ///
+    /// The order of the pairs is unspecified.
+    pub fn frequencies(&self) -> impl Iterator<Item = (u16, f32)> + '_ {
+        self.sparse.iter().map(|(id, frequency)| (*id, *frequency))
+    }
+
     /// Returns the cosine similarity of two similarity vectors.
     ///
     /// **NOTE:**The `opcode_map` used to create the two FVec must be the same.
@@ -303,7 +534,9 @@ impl FVec {
 mod tests {
     use std::collections::HashMap;
 
-    use crate::analysis::{CFSComparator, FVec, SemanticComparator, CFG, CFS};
+    use crate::analysis::{
+        CFGGenerator, CFSComparator, FVec, SemanticComparator, StructureSignature, CFG, CFS,
+    };
     use crate::disasm::{Architecture, Statement, StatementFamily};
     use fnv::FnvHashMap;
 
@@ -358,7 +591,7 @@ mod tests {
     fn structural_cloned_full() {
         let stmts = create_function();
         let cfg = CFG::new(&stmts, 0x6C, Architecture::X86(64)).add_sink();
-        let cfs = CFS::new(&cfg).get_tree().unwrap();
+        let cfs = StructureSignature::new(&CFS::new(&cfg).get_tree().unwrap());
         let mut diff = CFSComparator::new(7);
         diff.insert(0, 10, &cfs);
         diff.insert(1, 11, &cfs);
@@ -370,13 +603,16 @@ mod tests {
         assert_eq!(clones.len(), 1);
         let class = &clones[0];
         assert_eq!(class.len(), 5);
+        let mut ids = class.iter_ids().collect::<Vec<_>>();
+        ids.sort_unstable();
+        assert_eq!(ids, vec![(0, 10), (1, 11), (2, 12), (3, 13), (4, 14)]);
     }
 
     #[test]
     fn structural_cloned_partial() {
         let mut stmts = create_function();
         let cfg0 = CFG::new(&stmts, 0x6C, Architecture::X86(64)).add_sink();
-        let cfs0 = CFS::new(&cfg0).get_tree().unwrap();
+        let cfs0 = StructureSignature::new(&CFS::new(&cfg0).get_tree().unwrap());
         let string_cache = create_string_cache();
         let mut diff = CFSComparator::new(2);
         diff.insert(0, 10, &cfs0);
@@ -387,7 +623,7 @@ mod tests {
         stmts[11] = Statement::new(0x2C, StatementFamily::NOP, "nop");
         stmts[12] = Statement::new(0x30, StatementFamily::NOP, "nop");
         let cfg1 = CFG::new(&stmts, 0x6C, Architecture::X86(64)).add_sink();
-        let cfs1 = CFS::new(&cfg1).get_tree().unwrap();
+        let cfs1 = StructureSignature::new(&CFS::new(&cfg1).get_tree().unwrap());
         diff.insert(1, 11, &cfs1);
         let clones = diff.clones(&string_cache);
         assert_eq!(clones.len(), 2);
@@ -395,6 +631,63 @@ mod tests {
         assert_eq!(clones[1].depth(), 2);
     }
 
+    #[test]
+    fn structural_threads_deterministic() {
+        let mut generator = CFGGenerator::new(11);
+        let signatures = (0..1200)
+            .map(|i| generator.generate(1 + i % 8).add_sink())
+            .map(|cfg| StructureSignature::new(&CFS::new(&cfg).get_tree().unwrap()))
+            .collect::<Vec<_>>();
+        let functions = signatures
+            .iter()
+            .enumerate()
+            .map(|(i, signature)| (i as u32 % 3, 3 + i as u32, signature))
+            .collect::<Vec<_>>();
+        let string_cache = (0..1203)
+            .map(|id| (id, id.to_string()))
+            .collect::<FnvHashMap<_, _>>();
+        let mut sequential = CFSComparator::new(2).with_threads(1);
+        for &(bin, func, signature) in &functions {
+            sequential.insert(bin, func, signature);
+        }
+        let expected = sequential.clones(&string_cache);
+        assert!(!expected.is_empty());
+        for threads in [2, 4] {
+            let mut parallel = CFSComparator::new(2).with_threads(threads);
+            parallel.insert_all(&functions);
+            assert_eq!(parallel.clones(&string_cache), expected);
+        }
+    }
+
+    #[test]
+    fn few_large_functions_parallel() {
+        let mut generator = CFGGenerator::new(5);
+        let signatures = (0..3)
+            .map(|_| generator.generate(150).add_sink())
+            .map(|cfg| StructureSignature::new(&CFS::new(&cfg).get_tree().unwrap()))
+            .collect::<Vec<_>>();
+        let functions = signatures
+            .iter()
+            .enumerate()
+            .map(|(i, signature)| (i as u32, 3 + i as u32, signature))
+            .collect::<Vec<_>>();
+        let string_cache = (0..6)
+            .map(|id| (id, id.to_string()))
+            .collect::<FnvHashMap<_, _>>();
+        let mut sequential = CFSComparator::new(2).with_threads(1);
+        sequential.insert_all(&functions);
+        let mut parallel = CFSComparator::new(2).with_threads(4);
+        // three functions, but enough nodes to use more than one thread
+        let nodes = signatures.iter().map(|s| s.nodes().len()).sum::<usize>();
+        assert!(parallel.workers(nodes) > 1);
+        parallel.insert_all(&functions);
+        assert_eq!(parallel.candidates, sequential.candidates);
+        assert_eq!(
+            parallel.clones(&string_cache),
+            sequential.clones(&string_cache)
+        );
+    }
+
     #[test]
     fn semantic_clone_full() {
         let stmts = create_function();
@@ -430,4 +723,15 @@ mod tests {
         let clones = diff.clones(&string_cache);
         assert_eq!(clones.len(), 0);
     }
+
+    #[test]
+    fn fvec_frequencies_roundtrip() {
+        let stmts = create_function();
+        let mut opcode_map = HashMap::new();
+        let fvec = FVec::new(stmts, &mut opcode_map, false);
+        let restored = FVec::from_frequencies(fvec.frequencies());
+        assert!((fvec.cosine_similarity(&restored) - 1.0).abs() < 1e-6);
+        let total = restored.frequencies().map(|(_, f)| f).sum::<f32>();
+        assert!((total - 1.0).abs() < 1e-6);
+    }
 }
@@ -0,0 +1,536 @@
+use crate::analysis::{FVec, StructureSignature};
+use std::collections::HashMap;
+use std::io;
+use std::io::{ErrorKind, Write};
+
+/// Magic number at the beginning of each export.
+pub const EXPORT_MAGIC: &[u8; 8] = b"BINCCEX1";
+/// Version of the export format.
+pub const EXPORT_VERSION: u32 = 2;
+
+const KIND_END: u32 = 0;
+const KIND_BINARY: u32 = 1;
+const KIND_OPCODE: u32 = 2;
+const KIND_FUNCTION: u32 = 3;
+
+// length of the data padded to a multiple of 8 bytes
+fn padded(len: usize) -> usize {
+    (len + 7) & !7
+}
+
+/// Writes the features of each function in a compact binary format.
+///
+/// The export is a stream of records, so it can be written while the analysis is running and
+/// read sequentially or directly from a memory mapped file. All the integers are little endian.
+///
+/// The file starts with a 16 bytes header:
+///
+/// | offset | type     | content                      |
+/// |--------|----------|------------------------------|
+/// | 0      | [u8; 8]  | magic number `BINCCEX1`      |
+/// | 8      | u32      | format version, currently 2  |
+/// | 12     | u32      | reserved, always 0           |
+///
+/// The header is followed by the records. Every record starts with an 8 bytes prefix containing
+/// the record kind (u32) and the length of the payload in bytes (u32). The payload follows, and is
+/// zero-padded to a multiple of 8 bytes, so every record (and every u64 field) is 8 bytes aligned.
+/// Readers should skip records of unknown kind by using the length.
+///
+/// The following kinds are defined:
+///
+/// - `0` (end): the last record of the file. Its payload is a u64 containing the amount of records
+///   written before it. A file without this record has been truncated.
+/// - `1` (binary): written before the functions of the binary.
+///   - u32 binary id
+///   - u32 architecture bits
+///   - u64 file size
+///   - u64 FNV-1a hash of the file content
+///   - u32 path length in bytes (`P`)
+///   - u32 architecture name length in bytes (`A`)
+///   - `P` bytes of UTF-8 path, followed by `A` bytes of UTF-8 architecture name
+/// - `2` (opcode): written before the first function using the opcode.
+///   - u32 opcode id
+///   - u32 name length in bytes (`N`)
+///   - `N` bytes of UTF-8 opcode name (the mnemonic, or the family in cross-architecture mode)
+/// - `3` (function):
+///   - u32 id of the binary containing the function
+///   - u32 name length in bytes (`N`)
+///   - u64 function offset
+///   - u32 amount of subtrees (`S`)
+///   - u32 amount of opcodes in the frequency vector (`F`)
+///   - `S` times 16 bytes: u64 structural fingerprint, u32 depth, u32 reserved
+///   - `F` times 8 bytes: u32 opcode id, f32 frequency
+///   - `N` bytes of UTF-8 function name
+///
+/// Subtrees are the nodes of the function [`StructureSignature`] in post-order (the root last),
+/// limited to the ones with a minimum depth. Two subtrees with the same fingerprint have the same
+/// structure, as in the [`CFSComparator`](crate::analysis::CFSComparator). Fingerprints are the
+/// ones of [`SignatureNode`](crate::analysis::SignatureNode), calculated with FNV, so they are
+/// comparable between exports created by different builds or on different platforms. Version 1
+/// of the format used a hash specific to each build and listed the subtrees in preorder.
+pub struct ExportWriter<W: Write> {
+    out: W,
+    // ids of the opcodes already written
+    opcodes: Vec<bool>,
+    // amount of records written
+    records: u64,
+    // reused to build each record payload
+    payload: Vec<u8>,
+}
+
+impl<W: Write> ExportWriter<W> {
+    /// Creates a new writer, writing the header to the output.
+    ///
+    /// The output should be buffered, as each record is written with several calls.
+    pub fn new(mut out: W) -> Result<Self, io::Error> {
+        out.write_all(EXPORT_MAGIC)?;
+        out.write_all(&EXPORT_VERSION.to_le_bytes())?;
+        out.write_all(&0_u32.to_le_bytes())?;
+        Ok(ExportWriter {
+            out,
+            opcodes: Vec::new(),
+            records: 0,
+            payload: Vec::new(),
+        })
+    }
+
+    // writes the record contained in the payload buffer
+    fn write_record(&mut self, kind: u32) -> Result<(), io::Error> {
+        let len = self.payload.len();
+        self.payload.resize(padded(len), 0);
+        self.out.write_all(&kind.to_le_bytes())?;
+        self.out.write_all(&(len as u32).to_le_bytes())?;
+        self.out.write_all(&self.payload)?;
+        self.payload.clear();
+        self.records += 1;
+        Ok(())
+    }
+
+    /// Writes the information about a binary.
+    ///
+    /// This should be called before writing the functions of the binary.
+    pub fn write_binary(
+        &mut self,
+        id: u32,
+        path: &str,
+        arch: &str,
+        bits: u32,
+        size: u64,
+        hash: u64,
+    ) -> Result<(), io::Error> {
+        self.payload.extend_from_slice(&id.to_le_bytes());
+        self.payload.extend_from_slice(&bits.to_le_bytes());
+        self.payload.extend_from_slice(&size.to_le_bytes());
+        self.payload.extend_from_slice(&hash.to_le_bytes());
+        self.payload
+            .extend_from_slice(&(path.len() as u32).to_le_bytes());
+        self.payload
+            .extend_from_slice(&(arch.len() as u32).to_le_bytes());
+        self.payload.extend_from_slice(path.as_bytes());
+        self.payload.extend_from_slice(arch.as_bytes());
+        self.write_record(KIND_BINARY)
+    }
+
+    /// Writes the opcodes of the given map that were not written yet.
+    ///
+    /// The map is the same used to create the [`FVec`]s, and this should be called before writing
+    /// the functions using the new opcodes.
+    pub fn write_opcodes(&mut self, opcodes: &HashMap<String, u16>) -> Result<(), io::Error> {
+        let written = self.opcodes.iter().filter(|written| **written).count();
+        if written == opcodes.len() {
+            return Ok(());
+        }
+        for (name, id) in opcodes {
+            let index = *id as usize;
+            if index >= self.opcodes.len() {
+                self.opcodes.resize(index + 1, false);
+            }
+            if !self.opcodes[index] {
+                self.opcodes[index] = true;
+                self.payload.extend_from_slice(&(*id as u32).to_le_bytes());
+                self.payload
+                    .extend_from_slice(&(name.len() as u32).to_le_bytes());
+                self.payload.extend_from_slice(name.as_bytes());
+                self.write_record(KIND_OPCODE)?;
+            }
+        }
+        Ok(())
+    }
+
+    /// Writes the features of a function.
+    ///
+    /// Only the subtrees of the structure with depth greater or equal than `min_depth` are
+    /// written. Returns an error with kind [`ErrorKind::InvalidInput`] if the frequency vector
+    /// contains an opcode not yet written with [`ExportWriter::write_opcodes`].
+    pub fn write_function(
+        &mut self,
+        binary_id: u32,
+        name: &str,
+        offset: u64,
+        structure: Option<&StructureSignature>,
+        min_depth: u32,
+        fvec: Option<&FVec>,
+    ) -> Result<(), io::Error> {
+        let subtrees = structure
+            .map(|structure| {
+                structure
+                    .subtrees(min_depth)
+                    .map(|node| (node.fingerprint(), node.depth()))
+                    .collect::<Vec<_>>()
+            })
+            .unwrap_or_default();
+        let mut frequencies = fvec
+            .map(|fvec| fvec.frequencies().collect::<Vec<_>>())
+            .unwrap_or_default();
+        frequencies.sort_unstable_by_key(|(id, _)| *id);
+        if frequencies
+            .iter()
+            .any(|(id, _)| !self.opcodes.get(*id as usize).copied().unwrap_or(false))
+        {
+            return Err(io::Error::new(
+                ErrorKind::InvalidInput,
+                "opcode used before being written",
+            ));
+        }
+        self.payload.extend_from_slice(&binary_id.to_le_bytes());
+        self.payload
+            .extend_from_slice(&(name.len() as u32).to_le_bytes());
+        self.payload.extend_from_slice(&offset.to_le_bytes());
+        self.payload
+            .extend_from_slice(&(subtrees.len() as u32).to_le_bytes());
+        self.payload
+            .extend_from_slice(&(frequencies.len() as u32).to_le_bytes());
+        for (fingerprint, depth) in subtrees {
+            self.payload.extend_from_slice(&fingerprint.to_le_bytes());
+            self.payload.extend_from_slice(&depth.to_le_bytes());
+            self.payload.extend_from_slice(&0_u32.to_le_bytes());
+        }
+        for (id, frequency) in frequencies {
+            self.payload.extend_from_slice(&(id as u32).to_le_bytes());
+            self.payload.extend_from_slice(&frequency.to_le_bytes());
+        }
+        self.payload.extend_from_slice(name.as_bytes());
+        self.write_record(KIND_FUNCTION)
+    }
+
+    /// Writes the end record and flushes the output, returning it.
+    pub fn finish(mut self) -> Result<W, io::Error> {
+        let records = self.records;
+        self.payload.extend_from_slice(&records.to_le_bytes());
+        self.write_record(KIND_END)?;
+        self.out.flush()?;
+        Ok(self.out)
+    }
+}
+
+/// A record read from an export.
+#[derive(Debug, Clone, PartialEq)]
+pub enum ExportRecord<'a> {
+    /// Information about a binary.
+    Binary {
+        /// Unique identifier of the binary.
+        id: u32,
+        /// Path of the binary.
+        path: &'a str,
+        /// Name of the binary architecture.
+        arch: &'a str,
+        /// Bits of the binary architecture.
+        bits: u32,
+        /// Size of the binary, in bytes.
+        size: u64,
+        /// FNV hash of the binary content.
+        hash: u64,
+    },
+    /// Name of an opcode used in the frequency vectors.
+    Opcode {
+        /// Identifier of the opcode.
+        id: u32,
+        /// Name of the opcode.
+        name: &'a str,
+    },
+    /// Features of a function.
+    Function {
+        /// Identifier of the binary containing the function.
+        binary_id: u32,
+        /// Name of the function.
+        name: &'a str,
+        /// Offset of the function.
+        offset: u64,
+        /// Fingerprint and depth of each subtree.
+        subtrees: Vec<(u64, u32)>,
+        /// Opcode identifier and frequency of the frequency vector.
+        fvec: Vec<(u32, f32)>,
+    },
+}
+
+/// Reads the records of an export written by [`ExportWriter`].
+///
+/// The reader works on a byte slice, for example a memory mapped file. Each item is a record, or
+/// an error if the data is malformed or truncated. Records of unknown kind are skipped.
+pub struct ExportReader<'a> {
+    data: &'a [u8],
+    pos: usize,
+    finished: bool,
+}
+
+fn malformed() -> io::Error {
+    io::Error::new(ErrorKind::InvalidData, "inconsistent data")
+}
+
+// bound-checked little endian readers
+fn u32_at(data: &[u8], pos: usize) -> Result<u32, io::Error> {
+    data.get(pos..pos + 4)
+        .map(|bytes| u32::from_le_bytes(bytes.try_into().unwrap()))
+        .ok_or_else(malformed)
+}
+
+fn u64_at(data: &[u8], pos: usize) -> Result<u64, io::Error> {
+    data.get(pos..pos + 8)
+        .map(|bytes| u64::from_le_bytes(bytes.try_into().unwrap()))
+        .ok_or_else(malformed)
+}
+
+fn str_at(data: &[u8], pos: usize, len: usize) -> Result<&str, io::Error> {
+    let bytes = data.get(pos..pos + len).ok_or_else(malformed)?;
+    std::str::from_utf8(bytes).map_err(|_| malformed())
+}
+
+impl<'a> ExportReader<'a> {
+    /// Creates a new reader, checking the header of the export.
+    pub fn new(data: &'a [u8]) -> Result<Self, io::Error> {
+        if data.len() < 16 || &data[..8] != EXPORT_MAGIC {
+            return Err(io::Error::new(
+                ErrorKind::InvalidInput,
+                "unexpected input filetype",
+            ));
+        }
+        if u32_at(data, 8)? != EXPORT_VERSION {
+            return Err(io::Error::new(
+                ErrorKind::InvalidInput,
+                "unsupported export version",
+            ));
+        }
+        Ok(ExportReader {
+            data,
+            pos: 16,
+            finished: false,
+        })
+    }
+
+    fn parse(kind: u32, payload: &'a [u8]) -> Result<Option<ExportRecord<'a>>, io::Error> {
+        let record = match kind {
+            KIND_BINARY => {
+                let path_len = u32_at(payload, 24)? as usize;
+                let arch_len = u32_at(payload, 28)? as usize;
+                Some(ExportRecord::Binary {
+                    id: u32_at(payload, 0)?,
+                    bits: u32_at(payload, 4)?,
+                    size: u64_at(payload, 8)?,
+                    hash: u64_at(payload, 16)?,
+                    path: str_at(payload, 32, path_len)?,
+                    arch: str_at(payload, 32 + path_len, arch_len)?,
+                })
+            }
+            KIND_OPCODE => {
+                let name_len = u32_at(payload, 4)? as usize;
+                Some(ExportRecord::Opcode {
+                    id: u32_at(payload, 0)?,
+                    name: str_at(payload, 8, name_len)?,
+                })
+            }
+            KIND_FUNCTION => {
+                let name_len = u32_at(payload, 4)? as usize;
+                let subtrees_no = u32_at(payload, 16)? as usize;
+                let fvec_no = u32_at(payload, 20)? as usize;
+                let subtrees = (0..subtrees_no)
+                    .map(|i| Ok((u64_at(payload, 24 + i * 16)?, u32_at(payload, 32 + i * 16)?)))
+                    .collect::<Result<Vec<_>, io::Error>>()?;
+                let fvec_start = 24 + subtrees_no * 16;
+                let fvec = (0..fvec_no)
+                    .map(|i| {
+                        let pos = fvec_start + i * 8;
+                        Ok((
+                            u32_at(payload, pos)?,
+                            f32::from_bits(u32_at(payload, pos + 4)?),
+                        ))
+                    })
+                    .collect::<Result<Vec<_>, io::Error>>()?;
+                Some(ExportRecord::Function {
+                    binary_id: u32_at(payload, 0)?,
+                    offset: u64_at(payload, 8)?,
+                    name: str_at(payload, fvec_start + fvec_no * 8, name_len)?,
+                    subtrees,
+                    fvec,
+                })
+            }
+            _ => None,
+        };
+        Ok(record)
+    }
+}
+
+impl<'a> Iterator for ExportReader<'a> {
+    type Item = Result<ExportRecord<'a>, io::Error>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        while !self.finished {
+            if self.pos >= self.data.len() {
+                self.finished = true;
+                return Some(Err(io::Error::new(
+                    ErrorKind::UnexpectedEof,
+                    "truncated export",
+                )));
+            }
+            let header = u32_at(self.data, self.pos).and_then(|kind| {
+                let len = u32_at(self.data, self.pos + 4)? as usize;
+                let payload = self
+                    .data
+                    .get(self.pos + 8..self.pos + 8 + len)
+                    .ok_or_else(malformed)?;
+                Ok((kind, payload))
+            });
+            let (kind, payload) = match header {
+                Ok(header) => header,
+                Err(error) => {
+                    self.finished = true;
+                    return Some(Err(error));
+                }
+            };
+            self.pos += 8 + padded(payload.len());
+            if kind == KIND_END {
+                self.finished = true;
+                return None;
+            }
+            match ExportReader::parse(kind, payload) {
+                Ok(Some(record)) => return Some(Ok(record)),
+                Ok(None) => continue,
+                Err(error) => {
+                    self.finished = true;
+                    return Some(Err(error));
+                }
+            }
+        }
+        None
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::analysis::{
+        ExportReader, ExportRecord, ExportWriter, FVec, StructureSignature, CFG, CFS,
+    };
+    use crate::disasm::{Architecture, Statement, StatementFamily};
+    use std::collections::HashMap;
+    use std::io::ErrorKind;
+
+    fn create_function() -> Vec<Statement> {
+        vec![
+            Statement::new(0x00, StatementFamily::CMP, "test eax, eax"),
+            Statement::new(0x04, StatementFamily::CJMP, "je 0x10"),
+            Statement::new(0x08, StatementFamily::ADD, "add ebx, 5"),
+            Statement::new(0x0C, StatementFamily::JMP, "jmp 0x14"),
+            Statement::new(0x10, StatementFamily::SUB, "sub ebx, 5"),
+            Statement::new(0x14, StatementFamily::CMP, "cmp eax, ebx"),
+            Statement::new(0x18, StatementFamily::CJMP, "jne 0x00"),
+            Statement::new(0x1C, StatementFamily::RET, "ret"),
+        ]
+    }
+
+    #[test]
+    fn write_and_read() {
+        let stmts = create_function();
+        let cfg = CFG::new(&stmts, 0x20, Architecture::X86(64)).add_sink();
+        let cfs = StructureSignature::new(&CFS::new(&cfg).get_tree().unwrap());
+        let mut opcodes = HashMap::new();
+        let fvec = FVec::new(stmts, &mut opcodes, false);
+        let mut writer = ExportWriter::new(Vec::new()).unwrap();
+        writer
+            .write_binary(7, "/bin/true", "x86", 64, 1024, 0xCAFE)
+            .unwrap();
+        writer.write_opcodes(&opcodes).unwrap();
+        writer
+            .write_function(7, "main", 0x1000, Some(&cfs), 1, Some(&fvec))
+            .unwrap();
+        writer
+            .write_function(7, "é", 0x2000, None, 1, None)
+            .unwrap();
+        let data = writer.finish().unwrap();
+        assert_eq!(data.len() % 8, 0);
+        let records = ExportReader::new(&data)
+            .unwrap()
+            .collect::<Result<Vec<_>, _>>()
+            .unwrap();
+        assert_eq!(records.len(), 3 + opcodes.len());
+        assert_eq!(
+            records[0],
+            ExportRecord::Binary {
+                id: 7,
+                path: "/bin/true",
+                arch: "x86",
+                bits: 64,
+                size: 1024,
+                hash: 0xCAFE
+            }
+        );
+        let names = records
+            .iter()
+            .filter_map(|record| match record {
+                ExportRecord::Opcode { id, name } => Some((name.to_string(), *id as u16)),
+                _ => None,
+            })
+            .collect::<HashMap<_, _>>();
+        assert_eq!(names, opcodes);
+        match &records[records.len() - 2] {
+            ExportRecord::Function {
+                binary_id,
+                name,
+                offset,
+                subtrees,
+                fvec: frequencies,
+            } => {
+                assert_eq!(*binary_id, 7);
+                assert_eq!(*name, "main");
+                assert_eq!(*offset, 0x1000);
+                // subtrees are in post-order, so the root is the last one
+                let root = cfs.root();
+                assert_eq!(
+                    *subtrees.last().unwrap(),
+                    (root.fingerprint(), root.depth())
+                );
+                let total = frequencies.iter().map(|(_, f)| f).sum::<f32>();
+                assert!((total - 1.0).abs() < 1e-6);
+            }
+            _ => panic!("expected a function"),
+        }
+        match &records[records.len() - 1] {
+            ExportRecord::Function { name, subtrees, .. } => {
+                assert_eq!(*name, "é");
+                assert!(subtrees.is_empty());
+            }
+            _ => panic!("expected a function"),
+        }
+    }
+
+    #[test]
+    fn opcodes_written_first() {
+        let mut opcodes = HashMap::new();
+        let fvec = FVec::new(create_function(), &mut opcodes, false);
+        let mut writer = ExportWriter::new(Vec::new()).unwrap();
+        let error = writer
+            .write_function(0, "main", 0, None, 1, Some(&fvec))
+            .unwrap_err();
+        assert_eq!(error.kind(), ErrorKind::InvalidInput);
+    }
+
+    #[test]
+    fn detect_truncated() {
+        let mut writer = ExportWriter::new(Vec::new()).unwrap();
+        writer.write_binary(0, "a", "x86", 32, 0, 0).unwrap();
+        let data = writer.finish().unwrap();
+        let truncated = &data[..data.len() - 16];
+        let records = ExportReader::new(truncated).unwrap().collect::<Vec<_>>();
+        assert_eq!(records.len(), 2);
+        assert!(records[1].is_err());
+        assert!(ExportReader::new(b"digraph{\n}\n").is_err());
+    }
+}
@@ -0,0 +1,571 @@
+use crate::analysis::{CloneClass, StructureSignature};
+use crate::trace;
+use fnv::FnvHashMap;
+use std::cmp::Reverse;
+use std::collections::hash_map::Entry;
+use std::collections::BinaryHeap;
+use std::fs::{self, File};
+use std::io;
+use std::io::{BufReader, BufWriter, ErrorKind, Read, Seek, SeekFrom, Write};
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+/// Size in bytes of a [`CloneRecord`] written to disk.
+const RECORD_SIZE: usize = 24;
+/// Size of the read buffer for each sorted run during the merge.
+const RUN_BUFFER_SIZE: usize = 1 << 16;
+/// Maximum amount of sorted runs merged at once.
+const MAX_FAN_IN: usize = 64;
+
+// used to give an unique name to the directory of each comparator in the same process
+static COMPARATOR_COUNTER: AtomicUsize = AtomicUsize::new(0);
+
+/// A single subtree of a function structure, as stored by the [`ExternalCFSComparator`].
+#[derive(Debug, Copy, Clone, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub struct CloneRecord {
+    /// Structural hash of the subtree.
+    pub fingerprint: u64,
+    /// Depth of the subtree.
+    pub depth: u32,
+    /// Unique identifier of the binary containing the subtree.
+    pub bin_id: u32,
+    /// Unique identifier of the function containing the subtree.
+    pub func_id: u32,
+    /// Index of the subtree in the [`StructureSignature::nodes`] of the function.
+    pub node_ref: u32,
+}
+
+impl CloneRecord {
+    fn to_bytes(self) -> [u8; RECORD_SIZE] {
+        let mut bytes = [0; RECORD_SIZE];
+        bytes[0..8].copy_from_slice(&self.fingerprint.to_le_bytes());
+        bytes[8..12].copy_from_slice(&self.depth.to_le_bytes());
+        bytes[12..16].copy_from_slice(&self.bin_id.to_le_bytes());
+        bytes[16..20].copy_from_slice(&self.func_id.to_le_bytes());
+        bytes[20..24].copy_from_slice(&self.node_ref.to_le_bytes());
+        bytes
+    }
+
+    fn from_bytes(bytes: &[u8; RECORD_SIZE]) -> CloneRecord {
+        let u32_at = |i: usize| u32::from_le_bytes(bytes[i..i + 4].try_into().unwrap());
+        CloneRecord {
+            fingerprint: u64::from_le_bytes(bytes[0..8].try_into().unwrap()),
+            depth: u32_at(8),
+            bin_id: u32_at(12),
+            func_id: u32_at(16),
+            node_ref: u32_at(20),
+        }
+    }
+}
+
+// every node of a structure, in preorder
+#[cfg(test)]
+pub(crate) fn preorder(
+    structure: &crate::analysis::StructureBlock,
+) -> Vec<&crate::analysis::StructureBlock> {
+    let mut retval = Vec::new();
+    let mut stack = vec![structure];
+    while let Some(node) = stack.pop() {
+        retval.push(node);
+        stack.extend(node.children().iter().rev());
+    }
+    retval
+}
+
+/// Compares several CFS and discovers binary clones, using the disk to store the hashes.
+///
+/// This comparator yields the same clones of the [`CFSComparator`](crate::analysis::CFSComparator),
+/// but keeps in memory at most a configurable amount of [`CloneRecord`]s. When the limit is
+/// reached, the records are sorted and written to disk as a *run*. The clone classes are then
+/// extracted by merging all the runs, so records with the same fingerprint are read one after
+/// the other. At most 64 runs are merged at once: if there are more, they are first
+/// merged in several passes into longer runs.
+///
+/// The structures are not retained either: each inserted [`StructureSignature`] is appended to a
+/// file in the same directory, and read back only while reporting the clone classes containing
+/// it. A record refers to its structure with the ids of binary and function, and the index of the
+/// subtree in the function signature.
+///
+/// The memory used is then bounded by the records buffer, the read buffers of the merge (64 KiB
+/// for each one of the at most 64 runs) and an offset for each inserted function.
+pub struct ExternalCFSComparator {
+    /// Discard CFSs smaller than this length
+    mindepth: u32,
+    /// Maximum amount of records kept in memory before being written to disk
+    max_records: usize,
+    /// Records not yet written to disk
+    buffer: Vec<CloneRecord>,
+    /// Directory containing the sorted runs
+    dir: PathBuf,
+    /// Sorted runs not yet merged
+    runs: Vec<PathBuf>,
+    /// Amount of runs created so far, used to name them
+    created_runs: usize,
+    /// File containing the signatures of the inserted functions
+    signatures: BufWriter<File>,
+    /// Bytes written so far in the signatures file
+    signatures_len: u64,
+    /// Offset of each signature in the signatures file, by binary and function id
+    offsets: FnvHashMap<(u32, u32), u64>,
+    /// Amount of functions inserted so far
+    functions: usize,
+}
+
+impl ExternalCFSComparator {
+    /// Creates a new comparator with the given threshold.
+    ///
+    /// The threshold `mindepth` (called `θ` in the paper) is the minimum number of nested nodes
+    /// contained in the CFS.
+    ///
+    /// The sorted runs and the signatures will be written in a new directory created inside
+    /// `tmp_dir` and removed when the comparator is dropped. At most `max_records` records are
+    /// kept in memory, each one requiring 24 bytes. The memory for all of them is allocated by
+    /// the first insertion, so it does not grow past the limit.
+    pub fn new<S: AsRef<Path>>(
+        mindepth: u32,
+        tmp_dir: S,
+        max_records: usize,
+    ) -> Result<Self, io::Error> {
+        let dir = tmp_dir.as_ref().join(format!(
+            "bincc-{}-{}",
+            std::process::id(),
+            COMPARATOR_COUNTER.fetch_add(1, Ordering::Relaxed)
+        ));
+        fs::create_dir_all(&dir)?;
+        let signatures = BufWriter::new(File::create(dir.join("signatures"))?);
+        Ok(ExternalCFSComparator {
+            mindepth,
+            max_records: max_records.max(1),
+            buffer: Vec::new(),
+            dir,
+            runs: Vec::new(),
+            created_runs: 0,
+            signatures,
+            signatures_len: 0,
+            offsets: FnvHashMap::default(),
+            functions: 0,
+        })
+    }
+
+    /// Inserts a new function in the comparator.
+    ///
+    /// The actual comparison is done by calling the [`ExternalCFSComparator::classes`] or
+    /// [`ExternalCFSComparator::for_each_clone`] functions. The signature is written to disk, so
+    /// it can be dropped after the insertion.
+    ///
+    /// binary_id and function_id are unique identifiers for a binary or a function.
+    pub fn insert(
+        &mut self,
+        binary_id: u32,
+        function_id: u32,
+        signature: &StructureSignature,
+    ) -> Result<(), io::Error> {
+        let _span = trace::span("ExternalCFSComparator::insert");
+        if self.buffer.capacity() == 0 {
+            self.buffer.reserve_exact(self.max_records);
+        }
+        self.functions += 1;
+        let mut subtrees = signature.subtrees(self.mindepth).peekable();
+        if subtrees.peek().is_none() {
+            // never part of a clone class, no need to store it
+            return Ok(());
+        }
+        for subtree in subtrees {
+            self.buffer.push(CloneRecord {
+                fingerprint: subtree.fingerprint(),
+                depth: subtree.depth(),
+                bin_id: binary_id,
+                func_id: function_id,
+                node_ref: subtree.index() as u32,
+            });
+            if self.buffer.len() >= self.max_records {
+                self.flush()?;
+            }
+        }
+        self.offsets
+            .insert((binary_id, function_id), self.signatures_len);
+        self.signatures_len += signature.write_to(&mut self.signatures)?;
+        Ok(())
+    }
+
+    /// Returns the amount of functions inserted so far.
+    ///
+    /// Only the signatures of the functions with at least a subtree deep enough to be a clone are
+    /// written to disk.
+    pub fn functions(&self) -> usize {
+        self.functions
+    }
+
+    // returns the path of a new, empty, run
+    fn next_run(&mut self) -> PathBuf {
+        self.created_runs += 1;
+        self.dir.join(format!("run-{}", self.created_runs - 1))
+    }
+
+    // writes the records in memory to a new sorted run
+    fn flush(&mut self) -> Result<(), io::Error> {
+        let _span = trace::span("ExternalCFSComparator::flush");
+        if !self.buffer.is_empty() {
+            self.buffer.sort_unstable();
+            let path = self.next_run();
+            let mut file = BufWriter::new(File::create(&path)?);
+            for record in self.buffer.drain(..) {
+                file.write_all(&record.to_bytes())?;
+            }
+            file.flush()?;
+            self.runs.push(path);
+        }
+        Ok(())
+    }
+
+    // merges the runs in batches of MAX_FAN_IN until at most MAX_FAN_IN are left
+    fn merge_runs(&mut self) -> Result<(), io::Error> {
+        let _span = trace::span("ExternalCFSComparator::merge_runs");
+        while self.runs.len() > MAX_FAN_IN {
+            let runs = std::mem::take(&mut self.runs);
+            for batch in runs.chunks(MAX_FAN_IN) {
+                if batch.len() == 1 {
+                    self.runs.push(batch[0].clone());
+                    continue;
+                }
+                let path = self.next_run();
+                let mut merged = ExternalClasses::open(batch)?;
+                let mut file = BufWriter::new(File::create(&path)?);
+                while let Some(record) = merged.pop()? {
+                    file.write_all(&record.to_bytes())?;
+                }
+                file.flush()?;
+                for run in batch {
+                    fs::remove_file(run)?;
+                }
+                self.runs.push(path);
+            }
+        }
+        Ok(())
+    }
+
+    /// Returns an iterator over the candidate clone classes.
+    ///
+    /// Each item contains all the records sharing the same fingerprint, and only groups with at
+    /// least two records are returned. Records in each group are sorted by binary, function and
+    /// node.
+    pub fn classes(&mut self) -> Result<ExternalClasses, io::Error> {
+        self.flush()?;
+        // the records buffer is not needed during the merge
+        self.buffer = Vec::new();
+        self.merge_runs()?;
+        ExternalClasses::open(&self.runs)
+    }
+
+    /// Retrieves the clone classes from this comparator, passing them one at a time to `f`.
+    ///
+    /// The various functions to be checked for clones should be inserted by calling
+    /// [`ExternalCFSComparator::insert`] prior to this function.
+    ///
+    /// The signatures of the functions in each class are read back from disk, and dropped after
+    /// `f` returns, so the classes are never all in memory at the same time. The classes are
+    /// passed sorted by the hash of their structure.
+    pub fn for_each_clone<F>(
+        &mut self,
+        string_cache: &FnvHashMap<u32, String>,
+        mut f: F,
+    ) -> Result<(), io::Error>
+    where
+        F: FnMut(CloneClass<'_>),
+    {
+        let _span = trace::span("ExternalCFSComparator::for_each_clone");
+        self.signatures.flush()?;
+        let mut signatures = BufReader::new(File::open(self.dir.join("signatures"))?);
+        for group in self.classes()? {
+            let group = group?;
+            let mut loaded = FnvHashMap::<(u32, u32), StructureSignature>::default();
+            for record in &group {
+                let key = (record.bin_id, record.func_id);
+                if let Entry::Vacant(entry) = loaded.entry(key) {
+                    let offset = self.offsets.get(&key).ok_or_else(|| {
+                        io::Error::new(ErrorKind::InvalidData, "record of an unknown function")
+                    })?;
+                    signatures.seek(SeekFrom::Start(*offset))?;
+                    entry.insert(StructureSignature::read_from(&mut signatures)?);
+                }
+            }
+            let mut binaries = Vec::with_capacity(group.len());
+            let mut functions = Vec::with_capacity(group.len());
+            let mut ids = Vec::with_capacity(group.len());
+            let mut nodes = Vec::with_capacity(group.len());
+            for record in group {
+                let key = (record.bin_id, record.func_id);
+                let node = loaded[&key]
+                    .subtree(record.node_ref as usize)
+                    .ok_or_else(|| {
+                        io::Error::new(ErrorKind::InvalidData, "structure not matching the record")
+                    })?;
+                binaries.push(string_cache.get(&record.bin_id).unwrap().as_str());
+                functions.push(string_cache.get(&record.func_id).unwrap().as_str());
+                ids.push(key);
+                nodes.push(node);
+            }
+            f(CloneClass::new(binaries, functions, ids, Some(nodes)));
+        }
+        Ok(())
+    }
+}
+
+impl Drop for ExternalCFSComparator {
+    fn drop(&mut self) {
+        // best effort: a leftover temporary directory is not a reason to panic
+        let _ = fs::remove_dir_all(&self.dir);
+    }
+}
+
+fn read_record<R: Read>(reader: &mut R) -> Result<Option<CloneRecord>, io::Error> {
+    let mut bytes = [0; RECORD_SIZE];
+    match reader.read_exact(&mut bytes) {
+        Ok(_) => Ok(Some(CloneRecord::from_bytes(&bytes))),
+        Err(error) if error.kind() == ErrorKind::UnexpectedEof => Ok(None),
+        Err(error) => Err(error),
+    }
+}
+
+/// Iterator over the candidate clone classes of an [`ExternalCFSComparator`].
+///
+/// This iterator is created from [`ExternalCFSComparator::classes`].
+pub struct ExternalClasses {
+    readers: Vec<BufReader<File>>,
+    heap: BinaryHeap<Reverse<(CloneRecord, usize)>>,
+}
+
+impl ExternalClasses {
+    // opens the given sorted runs for merging
+    fn open(runs: &[PathBuf]) -> Result<ExternalClasses, io::Error> {
+        let mut readers = Vec::with_capacity(runs.len());
+        let mut heap = BinaryHeap::with_capacity(runs.len());
+        for (index, run) in runs.iter().enumerate() {
+            let mut reader = BufReader::with_capacity(RUN_BUFFER_SIZE, File::open(run)?);
+            if let Some(record) = read_record(&mut reader)? {
+                heap.push(Reverse((record, index)));
+            }
+            readers.push(reader);
+        }
+        Ok(ExternalClasses { readers, heap })
+    }
+
+    // pops the smallest record among all the runs, refilling the heap from the same run
+    fn pop(&mut self) -> Result<Option<CloneRecord>, io::Error> {
+        if let Some(Reverse((record, run))) = self.heap.pop() {
+            if let Some(next) = read_record(&mut self.readers[run])? {
+                self.heap.push(Reverse((next, run)));
+            }
+            Ok(Some(record))
+        } else {
+            Ok(None)
+        }
+    }
+}
+
+impl Iterator for ExternalClasses {
+    type Item = Result<Vec<CloneRecord>, io::Error>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            let first = match self.pop() {
+                Ok(Some(record)) => record,
+                Ok(None) => return None,
+                Err(error) => return Some(Err(error)),
+            };
+            let mut group = vec![first];
+            while let Some(Reverse((peek, _))) = self.heap.peek() {
+                if peek.fingerprint != first.fingerprint {
+                    break;
+                }
+                match self.pop() {
+                    Ok(Some(record)) => group.push(record),
+                    Ok(None) => break,
+                    Err(error) => return Some(Err(error)),
+                }
+            }
+            if group.len() > 1 {
+                return Some(Ok(group));
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::analysis::external::{preorder, CloneRecord, MAX_FAN_IN};
+    use crate::analysis::{
+        CFSComparator, CloneClass, ExternalCFSComparator, StructureSignature, CFG, CFS,
+    };
+    use crate::disasm::{Architecture, Statement, StatementFamily};
+    use fnv::FnvHashMap;
+    use std::error::Error;
+    use std::fs;
+    use tempfile::tempdir;
+
+    fn create_function() -> Vec<Statement> {
+        vec![
+            Statement::new(0x00, StatementFamily::CMP, "test eax, eax"),
+            Statement::new(0x04, StatementFamily::CJMP, "jg 0x38"),
+            Statement::new(0x08, StatementFamily::ADD, "add ebx, 5"),
+            Statement::new(0x0C, StatementFamily::JMP, "jmp 0x10"),
+            Statement::new(0x10, StatementFamily::CMP, "cmp eax, ebx"),
+            Statement::new(0x14, StatementFamily::CJMP, "jne 0x20"),
+            Statement::new(0x18, StatementFamily::CMP, "cmp ebx, 5"),
+            Statement::new(0x1C, StatementFamily::CJMP, "jne 0x18"),
+            Statement::new(0x20, StatementFamily::MOV, "mov ecx, [ebp+8]"),
+            Statement::new(0x24, StatementFamily::JMP, "jmp 0x28"),
+            Statement::new(0x28, StatementFamily::CMP, "cmp ecx, eax"),
+            Statement::new(0x2C, StatementFamily::MOV, "mov eax, -1"),
+            Statement::new(0x30, StatementFamily::CJMP, "jne 0x08"),
+            Statement::new(0x34, StatementFamily::RET, "ret"),
+            Statement::new(0x38, StatementFamily::ADD, "incl eax"),
+            Statement::new(0x3C, StatementFamily::MOV, "mov ebx, [ebp+20]"),
+            Statement::new(0x40, StatementFamily::CMP, "cmp eax, ebx"),
+            Statement::new(0x44, StatementFamily::CJMP, "je 0x58"),
+            Statement::new(0x48, StatementFamily::MOV, "mov ecx, [ebp+20]"),
+            Statement::new(0x4C, StatementFamily::SUB, "decl ecx"),
+            Statement::new(0x50, StatementFamily::MOV, "mov [ebp+20], ecx"),
+            Statement::new(0x54, StatementFamily::JMP, "jmp 0x38"),
+            Statement::new(0x58, StatementFamily::CMP, "test eax, eax"),
+            Statement::new(0x5C, StatementFamily::MOV, "mov eax, 0"),
+            Statement::new(0x60, StatementFamily::CJMP, "je 0x68"),
+            Statement::new(0x64, StatementFamily::MOV, "mov eax, 1"),
+            Statement::new(0x68, StatementFamily::RET, "ret"),
+        ]
+    }
+
+    fn create_string_cache() -> FnvHashMap<u32, String> {
+        let mut string_cache = FnvHashMap::default();
+        string_cache.insert(0, "bin_a".to_string());
+        string_cache.insert(1, "bin_b".to_string());
+        string_cache.insert(10, "fun_a".to_string());
+        string_cache.insert(11, "fun_b".to_string());
+        string_cache
+    }
+
+    #[test]
+    fn record_serialization() {
+        let record = CloneRecord {
+            fingerprint: 0xDEADBEEFCAFEBABE,
+            depth: 3,
+            bin_id: 1,
+            func_id: 2,
+            node_ref: 0xFFFFFFFF,
+        };
+        assert_eq!(CloneRecord::from_bytes(&record.to_bytes()), record);
+    }
+
+    #[test]
+    fn preorder_root_first() {
+        let stmts = create_function();
+        let cfg = CFG::new(&stmts, 0x6C, Architecture::X86(64)).add_sink();
+        let cfs = CFS::new(&cfg).get_tree().unwrap();
+        let visit = preorder(&cfs);
+        assert_eq!(visit[0], &cfs);
+        assert_eq!(visit[1], &cfs.children()[0]);
+    }
+
+    #[test]
+    fn same_clones_as_memory() -> Result<(), Box<dyn Error>> {
+        let mut stmts = create_function();
+        let cfg0 = CFG::new(&stmts, 0x6C, Architecture::X86(64)).add_sink();
+        let cfs0 = StructureSignature::new(&CFS::new(&cfg0).get_tree().unwrap());
+        stmts[2] = Statement::new(0x08, StatementFamily::NOP, "nop");
+        stmts[3] = Statement::new(0x0C, StatementFamily::NOP, "nop");
+        stmts[10] = Statement::new(0x28, StatementFamily::NOP, "nop");
+        stmts[11] = Statement::new(0x2C, StatementFamily::NOP, "nop");
+        stmts[12] = Statement::new(0x30, StatementFamily::NOP, "nop");
+        let cfg1 = CFG::new(&stmts, 0x6C, Architecture::X86(64)).add_sink();
+        let cfs1 = StructureSignature::new(&CFS::new(&cfg1).get_tree().unwrap());
+        let string_cache = create_string_cache();
+        let mut memory = CFSComparator::new(2);
+        memory.insert(0, 10, &cfs0);
+        memory.insert(1, 11, &cfs1);
+        let dir = tempdir()?;
+        // a single record in memory forces a run for each record
+        let mut external = ExternalCFSComparator::new(2, dir.path(), 1)?;
+        external.insert(0, 10, &cfs0)?;
+        external.insert(1, 11, &cfs1)?;
+        let expected = memory.clones(&string_cache);
+        // the names are owned, as the classes are valid only inside the callback
+        let names = |class: &CloneClass| {
+            let mut names = class
+                .iter_names()
+                .map(|(bin, fun)| format!("{}::{}", bin, fun))
+                .collect::<Vec<_>>();
+            names.sort_unstable();
+            (class.depth(), names)
+        };
+        let mut found = Vec::new();
+        external.for_each_clone(&string_cache, |class| found.push(names(&class)))?;
+        assert_eq!(found.len(), 2);
+        let mut expected = expected.iter().map(names).collect::<Vec<_>>();
+        expected.sort_unstable();
+        found.sort_unstable();
+        assert_eq!(found, expected);
+        Ok(())
+    }
+
+    #[test]
+    fn merge_in_several_passes() -> Result<(), Box<dyn Error>> {
+        let stmts = create_function();
+        let cfg = CFG::new(&stmts, 0x6C, Architecture::X86(64)).add_sink();
+        let cfs = StructureSignature::new(&CFS::new(&cfg).get_tree().unwrap());
+        let mut string_cache = FnvHashMap::default();
+        string_cache.insert(0, "bin".to_string());
+        let functions = 100;
+        for func in 1..=functions {
+            string_cache.insert(func, format!("fun_{}", func));
+        }
+        let dir = tempdir()?;
+        // a single record in memory forces a run for each record, more than the fan-in
+        let mut external = ExternalCFSComparator::new(1, dir.path(), 1)?;
+        for func in 1..=functions {
+            external.insert(0, func, &cfs)?;
+        }
+        assert_eq!(external.functions(), functions as usize);
+        let subtrees = cfs.subtrees(1).count();
+        assert!(subtrees * functions as usize > 2 * MAX_FAN_IN);
+        let mut found = Vec::new();
+        external.for_each_clone(&string_cache, |class| {
+            found.push((class.depth(), class.len()))
+        })?;
+        assert!(external.runs.len() <= MAX_FAN_IN);
+        // the merged runs are removed, leaving only the signatures and the last runs
+        assert_eq!(
+            fs::read_dir(&external.dir)?.count(),
+            external.runs.len() + 1
+        );
+        let mut memory = CFSComparator::new(1);
+        for func in 1..=functions {
+            memory.insert(0, func, &cfs);
+        }
+        let mut expected = memory
+            .clones(&string_cache)
+            .iter()
+            .map(|class| (class.depth(), class.len()))
+            .collect::<Vec<_>>();
+        expected.sort_unstable();
+        found.sort_unstable();
+        assert_eq!(found, expected);
+        Ok(())
+    }
+
+    #[test]
+    fn temporary_files_removed() -> Result<(), Box<dyn Error>> {
+        let stmts = create_function();
+        let cfg = CFG::new(&stmts, 0x6C, Architecture::X86(64)).add_sink();
+        let cfs = StructureSignature::new(&CFS::new(&cfg).get_tree().unwrap());
+        let dir = tempdir()?;
+        {
+            let mut external = ExternalCFSComparator::new(1, dir.path(), 2)?;
+            external.insert(0, 10, &cfs)?;
+            external.insert(1, 11, &cfs)?;
+            assert_eq!(external.classes()?.count(), external.classes()?.count());
+            assert!(std::fs::read_dir(dir.path())?.next().is_some());
+        }
+        assert!(std::fs::read_dir(dir.path())?.next().is_none());
+        Ok(())
+    }
+}
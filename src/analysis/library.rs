@@ -0,0 +1,406 @@
+use crate::analysis::{Graph, CFG};
+use crate::disasm::Statement;
+use fnv::{FnvHashMap, FnvHashSet, FnvHasher};
+use lazy_static::lazy_static;
+use regex::Regex;
+use std::error::Error;
+use std::fs::File;
+use std::hash::Hasher;
+use std::io;
+use std::io::{BufRead, BufReader, BufWriter, ErrorKind, Write};
+use std::path::Path;
+
+/// First line of a library signature database file.
+const LIBDB_HEADER: &str = "# bincc library signatures v2";
+/// Line following the header of a database matching functions also by their CFG shape.
+const LIBDB_MATCH_SHAPE: &str = "# match shape";
+/// Minimum amount of basic blocks required to match a function by its CFG shape alone.
+///
+/// Small CFGs (e.g. a single if-then) are too common to be attributed to a specific library.
+const SHAPE_MIN_BLOCKS: usize = 8;
+
+/// Fingerprint used to recognize a function coming from a known library.
+///
+/// The signature is composed of two hashes:
+/// - an hash of the function instructions, with the addresses in their operands masked, that
+///   matches the same code even if linked at a different address (e.g. with different call
+///   targets or RIP-relative displacements).
+/// - an hash of the [`CFG`] shape (including basic blocks length), that matches also functions
+///   with different instructions.
+///
+/// Both hashes are calculated with FNV, so they are stable between different builds and can be
+/// safely stored on disk.
+#[derive(Debug, Copy, Clone, PartialEq, Eq, Hash)]
+pub struct LibrarySignature {
+    /// Hash of the function instructions, with the addresses masked.
+    pub code_hash: u64,
+    /// Hash of the function CFG shape.
+    pub shape_hash: u64,
+    /// Amount of basic blocks in the function CFG.
+    pub blocks: usize,
+}
+
+impl LibrarySignature {
+    /// Creates the signature of a function given its statements and its [`CFG`].
+    pub fn new(stmts: &[Statement], cfg: &CFG) -> LibrarySignature {
+        LibrarySignature {
+            code_hash: code_hash(stmts),
+            shape_hash: shape_hash(cfg),
+            blocks: cfg.len(),
+        }
+    }
+}
+
+// hashes mnemonic and operands of each instruction, replacing every hexadecimal number and
+// every function named after its address with a placeholder. radare2 writes addresses, call
+// targets and displacements in hexadecimal, so they are all masked, together with the
+// hexadecimal immediates.
+fn code_hash(stmts: &[Statement]) -> u64 {
+    lazy_static! {
+        static ref RE_ADDRESS: Regex =
+            Regex::new(r"0[xX][0-9a-fA-F]+|\bfcn\.[0-9a-fA-F]+").unwrap();
+    }
+    let mut hasher = FnvHasher::default();
+    for stmt in stmts {
+        hasher.write(stmt.get_mnemonic().as_bytes());
+        hasher.write_u8(0);
+        hasher.write(RE_ADDRESS.replace_all(stmt.get_args(), "*").as_bytes());
+        hasher.write_u8(0);
+    }
+    hasher.finish()
+}
+
+// hashes the CFG without considering the absolute offsets: nodes are renumbered in preorder, and
+// for each of them the length and the renumbered children are hashed.
+fn shape_hash(cfg: &CFG) -> u64 {
+    let ids = cfg
+        .dfs_preorder()
+        .enumerate()
+        .map(|(index, node)| (node, index as u64))
+        .collect::<FnvHashMap<_, _>>();
+    let mut hasher = FnvHasher::default();
+    hasher.write_u64(ids.len() as u64);
+    for node in cfg.dfs_preorder() {
+        let children = cfg.neighbours(node);
+        hasher.write_u64(node.length as u64);
+        hasher.write_u64(children.len() as u64);
+        for child in children {
+            hasher.write_u64(*ids.get(child).unwrap_or(&u64::MAX));
+        }
+    }
+    hasher.finish()
+}
+
+/// Database of functions belonging to known libraries.
+///
+/// The database is used to skip the analysis of functions that are not interesting as clones,
+/// like the ones coming from a statically linked libc.
+///
+/// By default a function is recognized only if its instructions are identical to a known one,
+/// except for the addresses. Matching also the CFG shape, enabled with
+/// [`LibraryDB::set_match_shape`], recognizes also functions compiled differently, but may
+/// recognize unrelated functions with the same shape.
+#[derive(Debug, Clone, Default)]
+pub struct LibraryDB {
+    libraries: Vec<String>,
+    by_code: FnvHashMap<u64, u32>,
+    by_shape: FnvHashMap<u64, u32>,
+    match_shape: bool,
+    // (library id, signature) already inserted, to avoid duplicates
+    known: FnvHashSet<(u32, LibrarySignature)>,
+    // (library id, signature, function name) in insertion order, used only when saving
+    entries: Vec<(u32, LibrarySignature, String)>,
+}
+
+impl LibraryDB {
+    /// Creates a new, empty, database.
+    pub fn new() -> LibraryDB {
+        LibraryDB::default()
+    }
+
+    /// Returns the amount of signatures contained in the database.
+    pub fn len(&self) -> usize {
+        self.entries.len()
+    }
+
+    /// Returns true if the database contains no signatures.
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    /// Returns the names of the libraries contained in the database.
+    pub fn libraries(&self) -> &[String] {
+        &self.libraries
+    }
+
+    /// Returns true if functions are matched also by their CFG shape.
+    pub fn match_shape(&self) -> bool {
+        self.match_shape
+    }
+
+    /// Sets whether functions with at least 8 basic blocks are matched also by their CFG shape,
+    /// when their instructions differ from every known function.
+    ///
+    /// This setting is saved in the database file.
+    pub fn set_match_shape(&mut self, match_shape: bool) {
+        self.match_shape = match_shape;
+    }
+
+    /// Adds the signature of a function belonging to the given library.
+    ///
+    /// Returns false if the same signature was already added for the same library.
+    pub fn insert(&mut self, library: &str, function: &str, signature: LibrarySignature) -> bool {
+        let lib_id = match self.libraries.iter().position(|lib| lib == library) {
+            Some(id) => id as u32,
+            None => {
+                self.libraries.push(library.to_string());
+                (self.libraries.len() - 1) as u32
+            }
+        };
+        if !self.known.insert((lib_id, signature)) {
+            return false;
+        }
+        self.by_code.entry(signature.code_hash).or_insert(lib_id);
+        if signature.blocks >= SHAPE_MIN_BLOCKS {
+            self.by_shape.entry(signature.shape_hash).or_insert(lib_id);
+        }
+        self.entries.push((lib_id, signature, function.to_string()));
+        true
+    }
+
+    /// Returns the name of the library containing a function with the given signature.
+    ///
+    /// Returns [`None`] if the function is not known.
+    pub fn lookup(&self, signature: &LibrarySignature) -> Option<&str> {
+        let by_shape = || {
+            if self.match_shape && signature.blocks >= SHAPE_MIN_BLOCKS {
+                self.by_shape.get(&signature.shape_hash)
+            } else {
+                None
+            }
+        };
+        self.by_code
+            .get(&signature.code_hash)
+            .or_else(by_shape)
+            .map(|&lib_id| self.libraries[lib_id as usize].as_str())
+    }
+
+    /// Saves the current database to file.
+    ///
+    /// The file is a tab separated text file, with a function on each line in the form:
+    /// `library code_hash shape_hash blocks function_name`.
+    pub fn to_file<S: AsRef<Path>>(&self, filename: S) -> Result<(), io::Error> {
+        let mut file = BufWriter::new(File::create(filename)?);
+        writeln!(file, "{}", LIBDB_HEADER)?;
+        if self.match_shape {
+            writeln!(file, "{}", LIBDB_MATCH_SHAPE)?;
+        }
+        for (lib_id, sig, name) in &self.entries {
+            writeln!(
+                file,
+                "{}\t{:016x}\t{:016x}\t{}\t{}",
+                self.libraries[*lib_id as usize], sig.code_hash, sig.shape_hash, sig.blocks, name
+            )?;
+        }
+        file.flush()
+    }
+
+    /// Retrieves a database previously saved with the [`LibraryDB::to_file`] method.
+    ///
+    /// This method returns [std::io::Error] in case of malformed input or
+    /// [std::num::ParseIntError] in case the input file contains non-parsable numbers.
+    pub fn from_file<S: AsRef<Path>>(filename: S) -> Result<LibraryDB, Box<dyn Error>> {
+        let file = BufReader::new(File::open(filename)?);
+        let mut lines = file.lines();
+        match lines.next() {
+            Some(Ok(header)) if header == LIBDB_HEADER => {}
+            _ => {
+                return Err(Box::new(io::Error::new(
+                    ErrorKind::InvalidInput,
+                    "unexpected input filetype",
+                )))
+            }
+        }
+        let mut db = LibraryDB::new();
+        for line in lines {
+            let line = line?;
+            if line == LIBDB_MATCH_SHAPE {
+                db.match_shape = true;
+                continue;
+            } else if line.is_empty() {
+                continue;
+            }
+            let fields = line.splitn(5, '\t').collect::<Vec<_>>();
+            if fields.len() != 5 {
+                return Err(Box::new(io::Error::new(
+                    ErrorKind::InvalidInput,
+                    "inconsistent data",
+                )));
+            }
+            let signature = LibrarySignature {
+                code_hash: u64::from_str_radix(fields[1], 16)?,
+                shape_hash: u64::from_str_radix(fields[2], 16)?,
+                blocks: fields[3].parse::<usize>()?,
+            };
+            db.insert(fields[0], fields[4], signature);
+        }
+        Ok(db)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::analysis::{LibraryDB, LibrarySignature, CFG};
+    use crate::disasm::radare2::BareCFG;
+    use crate::disasm::{Statement, StatementFamily};
+    use std::error::Error;
+    use tempfile::NamedTempFile;
+
+    // chain of `len` blocks starting at `base`
+    fn chain(base: u64, len: u64) -> CFG {
+        let blocks = (0..len).map(|i| (base + i * 4, 4)).collect::<Vec<_>>();
+        let edges = (1..len)
+            .map(|i| (base + (i - 1) * 4, base + i * 4))
+            .collect::<Vec<_>>();
+        CFG::from(BareCFG {
+            root: Some(base),
+            blocks,
+            edges,
+        })
+    }
+
+    // function with the given instructions, one per statement
+    fn code(instructions: &[&str]) -> Vec<Statement> {
+        instructions
+            .iter()
+            .enumerate()
+            .map(|(i, ins)| Statement::new(i as u64 * 4, StatementFamily::UNK, ins))
+            .collect()
+    }
+
+    #[test]
+    fn shape_independent_from_offset() {
+        let a = LibrarySignature::new(&code(&["nop", "ret"]), &chain(0x1000, 10));
+        let b = LibrarySignature::new(&code(&["nop", "nop"]), &chain(0x8000, 10));
+        assert_ne!(a.code_hash, b.code_hash);
+        assert_eq!(a.shape_hash, b.shape_hash);
+    }
+
+    #[test]
+    fn code_independent_from_addresses() {
+        // the same function linked in two binaries, differing only in call displacements
+        let a = code(&[
+            "push rbp",
+            "lea rdi, [rip + 0x2e8f]",
+            "call 0x401130",
+            "call fcn.00401200",
+            "pop rbp",
+            "ret",
+        ]);
+        let b = code(&[
+            "push rbp",
+            "lea rdi, [rip + 0x1b3f]",
+            "call 0x5a2210",
+            "call fcn.005a2340",
+            "pop rbp",
+            "ret",
+        ]);
+        let c = code(&[
+            "push rbp",
+            "lea rsi, [rip + 0x2e8f]",
+            "call 0x401130",
+            "call fcn.00401200",
+            "pop rbp",
+            "ret",
+        ]);
+        let cfg = chain(0, 2);
+        let a = LibrarySignature::new(&a, &cfg);
+        let b = LibrarySignature::new(&b, &cfg);
+        let c = LibrarySignature::new(&c, &cfg);
+        assert_eq!(a.code_hash, b.code_hash);
+        assert_ne!(a.code_hash, c.code_hash);
+        let mut db = LibraryDB::new();
+        db.insert("libc", "puts", a);
+        assert_eq!(db.lookup(&b), Some("libc"));
+        assert_eq!(db.lookup(&c), None);
+    }
+
+    #[test]
+    fn lookup_by_code() {
+        let mut db = LibraryDB::new();
+        db.insert(
+            "libc",
+            "strlen",
+            LibrarySignature::new(&code(&["ret"]), &chain(0, 2)),
+        );
+        let found = LibrarySignature::new(&code(&["ret"]), &chain(0x400, 2));
+        let not_found = LibrarySignature::new(&code(&["nop"]), &chain(0x400, 2));
+        assert_eq!(db.lookup(&found), Some("libc"));
+        assert_eq!(db.lookup(&not_found), None);
+    }
+
+    #[test]
+    fn lookup_by_shape_only_big_functions() {
+        let mut db = LibraryDB::new();
+        db.insert(
+            "libc",
+            "small",
+            LibrarySignature::new(&code(&["int3"]), &chain(0, 3)),
+        );
+        db.insert(
+            "libssl",
+            "big",
+            LibrarySignature::new(&code(&["hlt"]), &chain(0, 20)),
+        );
+        let small = LibrarySignature::new(&code(&["ud2"]), &chain(0x400, 3));
+        let big = LibrarySignature::new(&code(&["leave"]), &chain(0x400, 20));
+        assert_eq!(db.lookup(&big), None);
+        db.set_match_shape(true);
+        assert_eq!(db.lookup(&small), None);
+        assert_eq!(db.lookup(&big), Some("libssl"));
+    }
+
+    #[test]
+    fn insert_duplicates() {
+        let mut db = LibraryDB::new();
+        let signature = LibrarySignature::new(&code(&["ret"]), &chain(0, 2));
+        assert!(db.insert("libc", "strlen", signature));
+        assert!(!db.insert("libc", "strlen", signature));
+        assert!(db.insert("libbsd", "strlen", signature));
+        assert_eq!(db.len(), 2);
+        assert_eq!(db.lookup(&signature), Some("libc"));
+    }
+
+    #[test]
+    fn save_and_retrieve() -> Result<(), Box<dyn Error>> {
+        let mut db = LibraryDB::new();
+        db.insert(
+            "libc",
+            "strlen",
+            LibrarySignature::new(&code(&["ret"]), &chain(0, 2)),
+        );
+        db.insert(
+            "libm",
+            "sin",
+            LibrarySignature::new(&code(&["nop"]), &chain(0, 12)),
+        );
+        db.set_match_shape(true);
+        let file = NamedTempFile::new()?;
+        db.to_file(file.path())?;
+        let read = LibraryDB::from_file(file.path())?;
+        assert_eq!(read.len(), 2);
+        assert!(read.match_shape());
+        assert_eq!(read.libraries(), &["libc".to_string(), "libm".to_string()]);
+        let sig = LibrarySignature::new(&code(&["int3"]), &chain(0x1000, 12));
+        assert_eq!(read.lookup(&sig), Some("libm"));
+        Ok(())
+    }
+
+    #[test]
+    fn retrieve_wrong_file() -> Result<(), Box<dyn Error>> {
+        let file = NamedTempFile::new()?;
+        std::fs::write(file.path(), "digraph{\n}\n")?;
+        assert!(LibraryDB::from_file(file.path()).is_err());
+        Ok(())
+    }
+}
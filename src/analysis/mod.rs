@@ -12,10 +12,42 @@ mod blocks;
 pub use self::blocks::BlockType;
 pub use self::blocks::NestedBlock;
 pub use self::blocks::StructureBlock;
+mod signature;
+pub use self::signature::SignatureNode;
+pub use self::signature::StructureSignature;
+pub use self::signature::Subtree;
 mod cfs;
+pub use self::cfs::ReductionStats;
+pub use self::cfs::ReductionSummary;
 pub use self::cfs::CFS;
+pub use self::cfs::HISTOGRAM_BUCKETS;
+pub use self::cfs::REDUCTION_RULES;
 mod comparator;
 pub use self::comparator::CFSComparator;
 pub use self::comparator::CloneClass;
 pub use self::comparator::FVec;
 pub use self::comparator::SemanticComparator;
+mod external;
+pub use self::external::CloneRecord;
+pub use self::external::ExternalCFSComparator;
+pub use self::external::ExternalClasses;
+mod export;
+pub use self::export::ExportReader;
+pub use self::export::ExportRecord;
+pub use self::export::ExportWriter;
+pub use self::export::EXPORT_MAGIC;
+pub use self::export::EXPORT_VERSION;
+mod library;
+pub use self::library::LibraryDB;
+pub use self::library::LibrarySignature;
+mod synthetic;
+pub use self::synthetic::CFGGenerator;
+pub use self::synthetic::SyntheticCorpus;
+pub use self::synthetic::SyntheticFunction;
+pub use self::synthetic::SYNTHETIC_REGIONS;
+mod oracle;
+pub use self::oracle::CloneSets;
+pub use self::oracle::Divergence;
+pub use self::oracle::Engine;
+pub use self::oracle::Oracle;
+pub use self::oracle::ReferenceEngine;
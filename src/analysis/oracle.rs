@@ -0,0 +1,468 @@
+use crate::analysis::{
+    BasicBlock, CFSComparator, Graph, StructureBlock, StructureSignature, SyntheticCorpus, CFG, CFS,
+};
+use fnv::{FnvHashMap, FnvHashSet};
+use std::borrow::Borrow;
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashMap;
+use std::error::Error;
+use std::hash::{Hash, Hasher};
+use std::path::{Path, PathBuf};
+
+/// Clone classes in a canonical form: each class is the sorted list of the `(binary, function)`
+/// identifiers it contains, and the classes are sorted.
+pub type CloneSets = Vec<Vec<(u32, u32)>>;
+
+/// An implementation of the structural analysis, that can be checked by an [Oracle].
+pub trait Engine {
+    /// Builds the structure of a CFG, if the CFG can be reduced to a single node.
+    fn structure(&self, cfg: &CFG) -> Option<StructureBlock>;
+
+    /// Finds the structural clones among the given functions.
+    ///
+    /// Each function is identified by its binary and function id, and only the structures with
+    /// at least `min_depth` nested levels are considered. The result does not need to be sorted.
+    fn clones(&self, functions: &[(u32, u32, StructureBlock)], min_depth: u32) -> CloneSets;
+}
+
+/// The implementation currently used by bincc: [CFS] and [CFSComparator].
+#[derive(Debug, Clone, Copy, Default)]
+pub struct ReferenceEngine;
+
+impl Engine for ReferenceEngine {
+    fn structure(&self, cfg: &CFG) -> Option<StructureBlock> {
+        CFS::new(cfg).get_tree()
+    }
+
+    fn clones(&self, functions: &[(u32, u32, StructureBlock)], min_depth: u32) -> CloneSets {
+        let string_cache = functions
+            .iter()
+            .flat_map(|(bin, func, _)| [*bin, *func])
+            .map(|id| (id, id.to_string()))
+            .collect::<FnvHashMap<_, _>>();
+        let signatures = functions
+            .iter()
+            .map(|(_, _, structure)| StructureSignature::new(structure))
+            .collect::<Vec<_>>();
+        let mut comps = CFSComparator::new(min_depth);
+        for ((bin, func, _), signature) in functions.iter().zip(&signatures) {
+            comps.insert(*bin, *func, signature);
+        }
+        comps
+            .clones(&string_cache)
+            .into_iter()
+            .map(|class| class.iter_ids().collect())
+            .collect()
+    }
+}
+
+/// A difference between the results of the reference and the candidate engine.
+#[derive(Debug, Clone)]
+pub enum Divergence {
+    /// The structures of a CFG differ.
+    Structure {
+        /// The smallest CFG found that still produces different structures.
+        cfg: CFG,
+        /// Structure built by the reference engine for the minimized CFG.
+        reference: Option<StructureBlock>,
+        /// Structure built by the candidate engine for the minimized CFG.
+        candidate: Option<StructureBlock>,
+        /// File where the minimized CFG was saved, if the oracle has a fixtures directory.
+        fixture: Option<PathBuf>,
+    },
+    /// The structures are the same, but the clone classes differ.
+    Clones {
+        /// Classes found only by the reference engine.
+        reference: CloneSets,
+        /// Classes found only by the candidate engine.
+        candidate: CloneSets,
+    },
+}
+
+/// Differential tester of a candidate [Engine] against a reference one.
+///
+/// The oracle runs both engines on the same inputs and reports any difference in the structures,
+/// compared with [StructureBlock::structural_equality], or in the clone classes, compared
+/// exactly. When the structures differ, the CFG is minimized by removing edges and contracting
+/// nodes as long as the difference persists, and saved as a Graphviz fixture that can be loaded
+/// with [CFG::from_file] and checked again with [Oracle::check_files].
+/// ```
+/// use bincc::analysis::{CFGGenerator, Oracle, ReferenceEngine};
+///
+/// let oracle = Oracle::new(ReferenceEngine, ReferenceEngine);
+/// let corpus = CFGGenerator::new(0).corpus(2, 10, 5..20, 0.2);
+/// assert!(oracle.check_corpus(corpus).is_empty());
+/// ```
+pub struct Oracle<R: Engine, C: Engine> {
+    reference: R,
+    candidate: C,
+    min_depth: u32,
+    fixtures: Option<PathBuf>,
+}
+
+impl<R: Engine, C: Engine> Oracle<R, C> {
+    /// Creates an oracle comparing the given engines.
+    ///
+    /// The clone classes are searched with a minimum depth of 1, and the diverging CFGs are not
+    /// saved.
+    pub fn new(reference: R, candidate: C) -> Self {
+        Oracle {
+            reference,
+            candidate,
+            min_depth: 1,
+            fixtures: None,
+        }
+    }
+
+    /// Sets the minimum depth of the clones compared by the oracle.
+    pub fn with_min_depth(mut self, min_depth: u32) -> Self {
+        self.min_depth = min_depth;
+        self
+    }
+
+    /// Saves each minimized diverging CFG in the given directory.
+    pub fn with_fixtures<S: AsRef<Path>>(mut self, dir: S) -> Self {
+        self.fixtures = Some(dir.as_ref().to_path_buf());
+        self
+    }
+
+    /// Checks that both engines build the same structure for a CFG.
+    pub fn check_cfg(&self, cfg: &CFG) -> Result<(), Box<Divergence>> {
+        if self.diverges(cfg) {
+            let cfg = minimize(cfg.clone(), |cfg| self.diverges(cfg));
+            let fixture = self
+                .fixtures
+                .as_ref()
+                .and_then(|dir| save_fixture(dir, &cfg));
+            Err(Box::new(Divergence::Structure {
+                reference: self.reference.structure(&cfg),
+                candidate: self.candidate.structure(&cfg),
+                cfg,
+                fixture,
+            }))
+        } else {
+            Ok(())
+        }
+    }
+
+    /// Checks a set of functions, given as `(binary id, function id, CFG)`.
+    ///
+    /// Every CFG is checked with [Oracle::check_cfg], and then the clone classes are compared
+    /// if all the structures are the same.
+    pub fn check_functions(&self, functions: &[(u32, u32, &CFG)]) -> Vec<Divergence> {
+        self.check_all(functions.iter().map(|&(bin, func, cfg)| (bin, func, cfg)))
+    }
+
+    /// Checks every function of a synthetic corpus.
+    ///
+    /// The function ids are the indices of the functions in the corpus. The functions are
+    /// generated and checked one at a time, and only their structures are kept for comparing the
+    /// clone classes.
+    pub fn check_corpus(&self, corpus: SyntheticCorpus) -> Vec<Divergence> {
+        self.check_all(
+            corpus
+                .enumerate()
+                .map(|(index, function)| (function.binary, index as u32, function.cfg)),
+        )
+    }
+
+    /// Checks the CFGs saved in the given files, as written by [CFG::to_file].
+    ///
+    /// This can be used with the fixtures saved by a previous run, or with real CFGs dumped from
+    /// the analysis of binaries. Each file is a different function of the same binary.
+    pub fn check_files<S: AsRef<Path>>(
+        &self,
+        files: &[S],
+    ) -> Result<Vec<Divergence>, Box<dyn Error>> {
+        let cfgs = files
+            .iter()
+            .map(CFG::from_file)
+            .collect::<Result<Vec<_>, _>>()?;
+        let functions = cfgs
+            .iter()
+            .enumerate()
+            .map(|(index, cfg)| (0, index as u32, cfg))
+            .collect::<Vec<_>>();
+        Ok(self.check_functions(&functions))
+    }
+
+    // checks the functions one at a time, keeping only their structures
+    fn check_all<G, I>(&self, functions: I) -> Vec<Divergence>
+    where
+        G: Borrow<CFG>,
+        I: Iterator<Item = (u32, u32, G)>,
+    {
+        let mut divergences = Vec::new();
+        let mut structures = Vec::new();
+        for (bin, func, cfg) in functions {
+            match self.check_cfg(cfg.borrow()) {
+                Ok(()) => {
+                    if let Some(structure) = self.reference.structure(cfg.borrow()) {
+                        structures.push((bin, func, structure));
+                    }
+                }
+                Err(divergence) => divergences.push(*divergence),
+            }
+        }
+        if divergences.is_empty() {
+            let reference = canonical(self.reference.clones(&structures, self.min_depth));
+            let candidate = canonical(self.candidate.clones(&structures, self.min_depth));
+            if reference != candidate {
+                let (reference, candidate) = difference(reference, candidate);
+                divergences.push(Divergence::Clones {
+                    reference,
+                    candidate,
+                });
+            }
+        }
+        divergences
+    }
+
+    // true if the two engines disagree on the structure of a CFG
+    fn diverges(&self, cfg: &CFG) -> bool {
+        match (self.reference.structure(cfg), self.candidate.structure(cfg)) {
+            (Some(reference), Some(candidate)) => !reference.structural_equality(&candidate),
+            (None, None) => false,
+            _ => true,
+        }
+    }
+}
+
+// sorts the classes and their content, so they can be compared exactly
+fn canonical(mut sets: CloneSets) -> CloneSets {
+    sets.iter_mut().for_each(|set| set.sort_unstable());
+    sets.sort_unstable();
+    sets
+}
+
+// removes the classes common to both (canonical) sets, keeping duplicates
+fn difference(reference: CloneSets, candidate: CloneSets) -> (CloneSets, CloneSets) {
+    let mut counts = HashMap::new();
+    for set in &candidate {
+        *counts.entry(set).or_insert(0_i32) += 1;
+    }
+    let mut only_reference = Vec::new();
+    for set in &reference {
+        match counts.get_mut(set) {
+            Some(count) if *count > 0 => *count -= 1,
+            _ => only_reference.push(set.clone()),
+        }
+    }
+    let mut only_candidate = Vec::new();
+    for (set, count) in counts {
+        only_candidate.extend(std::iter::repeat_n(set.clone(), count.max(0) as usize));
+    }
+    only_candidate.sort_unstable();
+    (only_reference, only_candidate)
+}
+
+// greedily shrinks a CFG while `diverges` holds, first removing edges, then contracting nodes,
+// until no single change keeps the divergence
+fn minimize<F: Fn(&CFG) -> bool>(mut cfg: CFG, diverges: F) -> CFG {
+    let mut changed = true;
+    while changed {
+        changed = false;
+        let edges = sorted_edges(&cfg);
+        for (src, dst) in edges {
+            let mut smaller = cfg.clone();
+            if let Some(children) = smaller.edges.get_mut(&src) {
+                children.retain(|child| *child != dst);
+            }
+            let smaller = reachable(smaller);
+            if diverges(&smaller) {
+                cfg = smaller;
+                changed = true;
+            }
+        }
+        let mut nodes = cfg.edges.keys().copied().collect::<Vec<_>>();
+        nodes.sort_unstable();
+        for node in nodes {
+            if Some(node) == cfg.root || !cfg.edges.contains_key(&node) {
+                continue;
+            }
+            let smaller = contract(&cfg, node);
+            if diverges(&smaller) {
+                cfg = smaller;
+                changed = true;
+            }
+        }
+    }
+    cfg
+}
+
+// every edge of the CFG, in a deterministic order
+fn sorted_edges(cfg: &CFG) -> Vec<(BasicBlock, BasicBlock)> {
+    let mut edges = cfg
+        .edges
+        .iter()
+        .flat_map(|(src, children)| children.iter().map(move |dst| (*src, *dst)))
+        .collect::<Vec<_>>();
+    edges.sort_unstable();
+    edges
+}
+
+// removes a node, connecting its predecessors to its successors
+fn contract(cfg: &CFG, node: BasicBlock) -> CFG {
+    let successors = cfg
+        .neighbours(&node)
+        .iter()
+        .copied()
+        .filter(|succ| *succ != node)
+        .collect::<Vec<_>>();
+    let mut edges = cfg.edges.clone();
+    edges.remove(&node);
+    for children in edges.values_mut() {
+        if let Some(position) = children.iter().position(|child| *child == node) {
+            children.remove(position);
+            for succ in &successors {
+                if !children.contains(succ) {
+                    children.push(*succ);
+                }
+            }
+            children.retain(|child| *child != node);
+        }
+    }
+    reachable(CFG {
+        root: cfg.root,
+        edges,
+        base: cfg.base,
+    })
+}
+
+// removes the nodes unreachable from the root
+fn reachable(mut cfg: CFG) -> CFG {
+    let visited = cfg.dfs_preorder().copied().collect::<FnvHashSet<_>>();
+    cfg.edges.retain(|node, _| visited.contains(node));
+    cfg
+}
+
+// saves a diverging CFG, named after its content so the same divergence is saved only once
+fn save_fixture(dir: &Path, cfg: &CFG) -> Option<PathBuf> {
+    let mut hasher = DefaultHasher::new();
+    cfg.root.hash(&mut hasher);
+    sorted_edges(cfg).hash(&mut hasher);
+    let path = dir.join(format!("divergence-{:016x}.dot", hasher.finish()));
+    let saved = std::fs::create_dir_all(dir).and_then(|_| cfg.to_file(&path));
+    match saved {
+        Ok(()) => Some(path),
+        Err(error) => {
+            log::error!("Failed to save {}: {}", path.display(), error);
+            None
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{difference, CloneSets, Divergence, Engine, Oracle, ReferenceEngine};
+    use crate::analysis::{BlockType, CFGGenerator, Graph, StructureBlock, CFG, CFS};
+    use std::error::Error;
+    use tempfile::TempDir;
+
+    // a broken engine, unable to reduce self loops
+    struct NoSelfLoops;
+
+    impl Engine for NoSelfLoops {
+        fn structure(&self, cfg: &CFG) -> Option<StructureBlock> {
+            let self_loop = cfg
+                .dfs_preorder()
+                .any(|node| cfg.neighbours(node).contains(node));
+            if self_loop {
+                None
+            } else {
+                CFS::new(cfg).get_tree()
+            }
+        }
+
+        fn clones(&self, functions: &[(u32, u32, StructureBlock)], min_depth: u32) -> CloneSets {
+            ReferenceEngine.clones(functions, min_depth)
+        }
+    }
+
+    // a broken engine, forgetting the last clone class
+    struct MissingClass;
+
+    impl Engine for MissingClass {
+        fn structure(&self, cfg: &CFG) -> Option<StructureBlock> {
+            ReferenceEngine.structure(cfg)
+        }
+
+        fn clones(&self, functions: &[(u32, u32, StructureBlock)], min_depth: u32) -> CloneSets {
+            let mut sets = ReferenceEngine.clones(functions, min_depth);
+            sets.sort_unstable();
+            sets.pop();
+            sets
+        }
+    }
+
+    #[test]
+    fn same_engine() {
+        let oracle = Oracle::new(ReferenceEngine, ReferenceEngine).with_min_depth(2);
+        let corpus = CFGGenerator::new(11).corpus(3, 20, 5..40, 0.3);
+        assert!(oracle.check_corpus(corpus).is_empty());
+    }
+
+    #[test]
+    fn structure_divergence_minimized() -> Result<(), Box<dyn Error>> {
+        let dir = TempDir::new()?;
+        let oracle = Oracle::new(ReferenceEngine, NoSelfLoops).with_fixtures(dir.path());
+        let cfg = CFGGenerator::new(0)
+            .with_regions(&[BlockType::Sequence, BlockType::IfThenElse, BlockType::While])
+            .generate(60);
+        assert!(oracle.check_cfg(&cfg).is_ok());
+        let cfg = (0..)
+            .map(|seed| CFGGenerator::new(seed).generate(60))
+            .find(|cfg| NoSelfLoops.structure(cfg).is_none() && CFS::new(cfg).get_tree().is_some())
+            .unwrap();
+        match oracle.check_cfg(&cfg).map_err(|divergence| *divergence) {
+            Err(Divergence::Structure {
+                cfg: minimized,
+                reference,
+                candidate,
+                fixture,
+            }) => {
+                // entry, self loop and exit
+                assert!(minimized.len() <= 3);
+                assert!(reference.is_some());
+                assert!(candidate.is_none());
+                let fixture = fixture.unwrap();
+                assert_eq!(CFG::from_file(&fixture)?, minimized);
+                let divergences = oracle.check_files(&[fixture])?;
+                assert_eq!(divergences.len(), 1);
+            }
+            _ => panic!("expected a structure divergence"),
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn clones_divergence() {
+        let oracle = Oracle::new(ReferenceEngine, MissingClass);
+        let corpus = CFGGenerator::new(2).corpus(2, 10, 5..20, 0.5);
+        let divergences = oracle.check_corpus(corpus);
+        assert_eq!(divergences.len(), 1);
+        match &divergences[0] {
+            Divergence::Clones {
+                reference,
+                candidate,
+            } => {
+                assert_eq!(reference.len(), 1);
+                assert!(candidate.is_empty());
+            }
+            _ => panic!("expected a clones divergence"),
+        }
+    }
+
+    #[test]
+    fn clone_sets_difference() {
+        let a = vec![
+            vec![(0, 1), (0, 2)],
+            vec![(0, 1), (0, 2)],
+            vec![(1, 1), (1, 3)],
+        ];
+        let b = vec![vec![(0, 1), (0, 2)], vec![(2, 2), (2, 3)]];
+        let (only_a, only_b) = difference(a, b);
+        assert_eq!(only_a, vec![vec![(0, 1), (0, 2)], vec![(1, 1), (1, 3)]]);
+        assert_eq!(only_b, vec![vec![(2, 2), (2, 3)]]);
+    }
+}
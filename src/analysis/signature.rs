@@ -0,0 +1,420 @@
+use crate::analysis::{BasicBlock, BlockType, StructureBlock};
+use fnv::FnvHasher;
+use std::hash::{Hash, Hasher};
+use std::io::{self, Read, Write};
+
+/// A single node of a [`StructureSignature`].
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct SignatureNode {
+    /// Label of the node, [`BlockType::Basic`] for the basic blocks.
+    pub block_type: BlockType,
+    /// Amount of direct children of the node.
+    pub children: u32,
+    /// Structural hash of the subtree rooted in this node.
+    ///
+    /// Two subtrees have the same fingerprint if they have the same labels and the same shape,
+    /// regardless of the offsets of their basic blocks. The hash is calculated with FNV, so it is
+    /// the same across different builds and platforms.
+    pub fingerprint: u64,
+    /// Depth of the subtree rooted in this node, as in [`StructureBlock::depth`].
+    pub depth: u32,
+    /// Index of the first node of the subtree rooted in this node.
+    pub first: u32,
+    /// Index of the first basic block of the subtree rooted in this node.
+    pub first_block: u32,
+    /// Amount of basic blocks in the subtree rooted in this node.
+    pub blocks: u32,
+}
+
+/// Compact representation of a [`StructureBlock`].
+///
+/// The nodes of the structure are stored in a single array in post-order, with the fingerprint
+/// of each subtree already calculated, and the basic blocks are stored in a separate array in the
+/// same order. Unlike the [`StructureBlock`], this requires two allocations regardless of the size
+/// of the structure, and is enough to compare structures and retrieve their basic blocks.
+///
+/// In post-order, every subtree is a contiguous range of nodes ending with its root, so a subtree
+/// is identified by the index of its root, as done by [`Subtree`].
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct StructureSignature {
+    nodes: Vec<SignatureNode>,
+    // basic blocks of the leaves, in the same order of their nodes
+    blocks: Vec<BasicBlock>,
+}
+
+// label of each block type in the fingerprint, fixed so the fingerprints do not change if the
+// enum is reordered
+fn label(block_type: BlockType) -> u8 {
+    match block_type {
+        BlockType::Basic => 0,
+        BlockType::SelfLooping => 1,
+        BlockType::Sequence => 2,
+        BlockType::IfThen => 3,
+        BlockType::IfThenElse => 4,
+        BlockType::While => 5,
+        BlockType::DoWhile => 6,
+        BlockType::Switch => 7,
+        BlockType::ProperInterval => 8,
+        BlockType::ImproperInterval => 9,
+    }
+}
+
+// inverse of label, used when reading back a serialized signature
+fn from_label(label: u8) -> Option<BlockType> {
+    match label {
+        0 => Some(BlockType::Basic),
+        1 => Some(BlockType::SelfLooping),
+        2 => Some(BlockType::Sequence),
+        3 => Some(BlockType::IfThen),
+        4 => Some(BlockType::IfThenElse),
+        5 => Some(BlockType::While),
+        6 => Some(BlockType::DoWhile),
+        7 => Some(BlockType::Switch),
+        8 => Some(BlockType::ProperInterval),
+        9 => Some(BlockType::ImproperInterval),
+        _ => None,
+    }
+}
+
+// reads a little endian u32
+fn read_u32<R: Read>(input: &mut R) -> io::Result<u32> {
+    let mut bytes = [0; 4];
+    input.read_exact(&mut bytes)?;
+    Ok(u32::from_le_bytes(bytes))
+}
+
+impl StructureSignature {
+    /// Creates the signature of a structure.
+    ///
+    /// # Examples
+    /// Basic usage:
+    /// ```
+    /// # use bincc::analysis::{StructureSignature, CFG, CFS};
+    /// # use bincc::disasm::{Architecture, Statement, StatementFamily};
+    /// let stmts = vec![
+    ///     Statement::new(0x38, StatementFamily::CMP, "cmp dword [var_4h], 0"),
+    ///     Statement::new(0x3C, StatementFamily::CJMP, "jle 0x45"),
+    ///     Statement::new(0x3E, StatementFamily::MOV, "mov eax, 0"),
+    ///     Statement::new(0x43, StatementFamily::JMP, "jmp 0x4a"),
+    ///     Statement::new(0x45, StatementFamily::MOV, "mov eax, 1"),
+    ///     Statement::new(0x4A, StatementFamily::RET, "ret"),
+    /// ];
+    /// let cfg = CFG::new(&stmts, 0x4B, Architecture::X86(64));
+    /// let structure = CFS::new(&cfg).get_tree().unwrap();
+    /// let signature = StructureSignature::new(&structure);
+    ///
+    /// assert_eq!(signature.root().depth(), structure.depth());
+    /// assert_eq!(signature.root().basic_blocks(), structure.basic_blocks());
+    /// ```
+    pub fn new(structure: &StructureBlock) -> StructureSignature {
+        let mut nodes = Vec::<SignatureNode>::new();
+        let mut blocks = Vec::new();
+        let mut stack = vec![(structure, false)];
+        // indices of the nodes whose parent was not yet visited
+        let mut pending = Vec::<u32>::new();
+        while let Some((node, expanded)) = stack.pop() {
+            if expanded || node.is_empty() {
+                let children = pending.split_off(pending.len() - node.len());
+                // every subtree starts with the first node of its first child
+                let first = children
+                    .first()
+                    .map(|&child| nodes[child as usize].first)
+                    .unwrap_or(nodes.len() as u32);
+                let first_block = children
+                    .first()
+                    .map(|&child| nodes[child as usize].first_block)
+                    .unwrap_or(blocks.len() as u32);
+                let mut hasher = FnvHasher::default();
+                // explicit little endian, as the write_* methods use the native one
+                hasher.write(&[label(node.block_type())]);
+                hasher.write(&(children.len() as u32).to_le_bytes());
+                for &child in &children {
+                    hasher.write(&nodes[child as usize].fingerprint.to_le_bytes());
+                }
+                if let StructureBlock::Basic(bb) = node {
+                    blocks.push(*bb);
+                }
+                pending.push(nodes.len() as u32);
+                nodes.push(SignatureNode {
+                    block_type: node.block_type(),
+                    children: children.len() as u32,
+                    fingerprint: hasher.finish(),
+                    depth: node.depth(),
+                    first,
+                    first_block,
+                    blocks: blocks.len() as u32 - first_block,
+                });
+            } else {
+                stack.push((node, true));
+                stack.extend(node.children().iter().rev().map(|child| (child, false)));
+            }
+        }
+        StructureSignature { nodes, blocks }
+    }
+
+    /// Returns the nodes of the structure, in post-order.
+    pub fn nodes(&self) -> &[SignatureNode] {
+        &self.nodes
+    }
+
+    /// Returns the whole structure as a subtree.
+    pub fn root(&self) -> Subtree<'_> {
+        Subtree {
+            signature: self,
+            index: self.nodes.len() - 1,
+        }
+    }
+
+    /// Returns the subtree rooted in the node with the given index, or [None] if the index is
+    /// out of bounds.
+    pub fn subtree(&self, index: usize) -> Option<Subtree<'_>> {
+        if index < self.nodes.len() {
+            Some(Subtree {
+                signature: self,
+                index,
+            })
+        } else {
+            None
+        }
+    }
+
+    /// Returns every subtree with at least the given depth, in post-order.
+    pub fn subtrees(&self, min_depth: u32) -> impl Iterator<Item = Subtree<'_>> {
+        self.nodes
+            .iter()
+            .enumerate()
+            .filter(move |(_, node)| node.depth >= min_depth)
+            .map(move |(index, _)| Subtree {
+                signature: self,
+                index,
+            })
+    }
+
+    // writes the signature in a little endian binary format, returning the amount of bytes
+    // written: the amount of nodes and basic blocks, followed by the nodes and the basic blocks
+    pub(crate) fn write_to<W: Write>(&self, out: &mut W) -> io::Result<u64> {
+        out.write_all(&(self.nodes.len() as u32).to_le_bytes())?;
+        out.write_all(&(self.blocks.len() as u32).to_le_bytes())?;
+        for node in &self.nodes {
+            out.write_all(&[label(node.block_type)])?;
+            out.write_all(&node.children.to_le_bytes())?;
+            out.write_all(&node.fingerprint.to_le_bytes())?;
+            out.write_all(&node.depth.to_le_bytes())?;
+            out.write_all(&node.first.to_le_bytes())?;
+            out.write_all(&node.first_block.to_le_bytes())?;
+            out.write_all(&node.blocks.to_le_bytes())?;
+        }
+        for block in &self.blocks {
+            out.write_all(&block.offset.to_le_bytes())?;
+            out.write_all(&block.length.to_le_bytes())?;
+        }
+        Ok(8 + self.nodes.len() as u64 * 29 + self.blocks.len() as u64 * 8)
+    }
+
+    // reads a signature written by write_to
+    pub(crate) fn read_from<R: Read>(input: &mut R) -> io::Result<StructureSignature> {
+        let node_count = read_u32(input)? as usize;
+        let block_count = read_u32(input)? as usize;
+        let mut nodes = Vec::with_capacity(node_count);
+        for _ in 0..node_count {
+            let mut label = [0; 1];
+            input.read_exact(&mut label)?;
+            let block_type = from_label(label[0])
+                .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidData, "unknown block type"))?;
+            let children = read_u32(input)?;
+            let mut fingerprint = [0; 8];
+            input.read_exact(&mut fingerprint)?;
+            nodes.push(SignatureNode {
+                block_type,
+                children,
+                fingerprint: u64::from_le_bytes(fingerprint),
+                depth: read_u32(input)?,
+                first: read_u32(input)?,
+                first_block: read_u32(input)?,
+                blocks: read_u32(input)?,
+            });
+        }
+        let mut blocks = Vec::with_capacity(block_count);
+        for _ in 0..block_count {
+            blocks.push(BasicBlock {
+                offset: read_u32(input)?,
+                length: read_u32(input)?,
+            });
+        }
+        Ok(StructureSignature { nodes, blocks })
+    }
+}
+
+/// A subtree of a [`StructureSignature`].
+///
+/// Two subtrees are equal if they are the same node of the same signature, compared by address.
+#[derive(Debug, Copy, Clone)]
+pub struct Subtree<'a> {
+    signature: &'a StructureSignature,
+    index: usize,
+}
+
+impl PartialEq for Subtree<'_> {
+    fn eq(&self, other: &Self) -> bool {
+        std::ptr::eq(self.signature, other.signature) && self.index == other.index
+    }
+}
+
+impl Eq for Subtree<'_> {}
+
+impl Hash for Subtree<'_> {
+    fn hash<H: Hasher>(&self, state: &mut H) {
+        self.index.hash(state);
+        self.fingerprint().hash(state);
+    }
+}
+
+impl<'a> Subtree<'a> {
+    /// Returns the index of the root of this subtree in [`StructureSignature::nodes`].
+    pub fn index(&self) -> usize {
+        self.index
+    }
+
+    /// Returns the root of this subtree.
+    pub fn node(&self) -> &'a SignatureNode {
+        &self.signature.nodes[self.index]
+    }
+
+    /// Returns the label of the root of this subtree.
+    pub fn block_type(&self) -> BlockType {
+        self.node().block_type
+    }
+
+    /// Returns the depth of this subtree.
+    pub fn depth(&self) -> u32 {
+        self.node().depth
+    }
+
+    /// Returns the structural hash of this subtree, see [`SignatureNode::fingerprint`].
+    pub fn fingerprint(&self) -> u64 {
+        self.node().fingerprint
+    }
+
+    // basic blocks of this subtree, in post-order
+    fn blocks(&self) -> &'a [BasicBlock] {
+        let first = self.node().first_block as usize;
+        &self.signature.blocks[first..first + self.node().blocks as usize]
+    }
+
+    /// Returns the list of basic blocks contained in this subtree, ordered by offset.
+    ///
+    /// This is the same list returned by [`StructureBlock::basic_blocks`].
+    pub fn basic_blocks(&self) -> Vec<BasicBlock> {
+        let mut retval = self.blocks().to_vec();
+        retval.sort_unstable();
+        retval
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Subtree;
+    use crate::analysis::external::preorder;
+    use crate::analysis::{
+        BlockType, CFGGenerator, NestedBlock, StructureBlock, StructureSignature, CFS,
+    };
+    use std::sync::Arc;
+
+    // rebuilds the structure represented by a subtree
+    fn to_structure(subtree: Subtree) -> StructureBlock {
+        let first = subtree.node().first as usize;
+        let mut blocks = subtree.blocks().iter();
+        let mut stack = Vec::<StructureBlock>::new();
+        for node in &subtree.signature.nodes[first..=subtree.index] {
+            if node.block_type == BlockType::Basic {
+                stack.push(StructureBlock::Basic(*blocks.next().unwrap()));
+            } else {
+                let children = stack.split_off(stack.len() - node.children as usize);
+                let nested = NestedBlock::new(node.block_type, children);
+                stack.push(StructureBlock::Nested(Arc::new(nested)));
+            }
+        }
+        stack.pop().unwrap()
+    }
+
+    fn postorder<'a>(node: &'a StructureBlock, visit: &mut Vec<&'a StructureBlock>) {
+        for child in node.children() {
+            postorder(child, visit);
+        }
+        visit.push(node);
+    }
+
+    #[test]
+    fn same_as_structure() {
+        let mut generator = CFGGenerator::new(7);
+        for blocks in [1, 8, 40, 150] {
+            let cfg = generator.generate(blocks).add_sink();
+            let structure = CFS::new(&cfg).get_tree().unwrap();
+            let signature = StructureSignature::new(&structure);
+            let mut visit = Vec::new();
+            postorder(&structure, &mut visit);
+            assert_eq!(signature.nodes().len(), visit.len());
+            assert_eq!(to_structure(signature.root()), structure);
+            for (index, node) in visit.iter().enumerate() {
+                let subtree = signature.subtree(index).unwrap();
+                assert_eq!(subtree.depth(), node.depth());
+                assert_eq!(subtree.block_type(), node.block_type());
+                assert_eq!(subtree.basic_blocks(), node.basic_blocks());
+                assert_eq!(to_structure(subtree), **node);
+            }
+            // same fingerprint if and only if same structure
+            for (a, node_a) in visit.iter().enumerate() {
+                for (b, node_b) in visit.iter().enumerate().skip(a) {
+                    let fingerprint_a = signature.subtree(a).unwrap().fingerprint();
+                    let fingerprint_b = signature.subtree(b).unwrap().fingerprint();
+                    assert_eq!(
+                        fingerprint_a == fingerprint_b,
+                        node_a.structural_equality(node_b)
+                    );
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn fingerprint_stable() {
+        let cfg = CFGGenerator::new(5).generate(12).add_sink();
+        let structure = CFS::new(&cfg).get_tree().unwrap();
+        let signature = StructureSignature::new(&structure);
+        // a basic block: FNV-1a of label 0 and 0 children
+        let leaf = signature.subtree(0).unwrap();
+        assert_eq!(leaf.fingerprint(), 0xe4bc_4fd9_252b_e94f);
+    }
+
+    #[test]
+    fn subtrees_min_depth() {
+        let cfg = CFGGenerator::new(3).generate(60).add_sink();
+        let structure = CFS::new(&cfg).get_tree().unwrap();
+        let signature = StructureSignature::new(&structure);
+        let deep = signature.subtrees(2).collect::<Vec<_>>();
+        let expected = preorder(&structure)
+            .into_iter()
+            .filter(|node| node.depth() >= 2)
+            .count();
+        assert_eq!(deep.len(), expected);
+        assert_eq!(deep.last().unwrap().index(), signature.root().index());
+        assert!(signature.subtree(signature.nodes().len()).is_none());
+        // subtrees are compared by identity, not by content
+        let copy = signature.clone();
+        assert_eq!(signature.root(), signature.root());
+        assert_ne!(signature.root(), copy.root());
+    }
+
+    #[test]
+    fn serialization_roundtrip() {
+        let cfg = CFGGenerator::new(11).generate(80).add_sink();
+        let structure = CFS::new(&cfg).get_tree().unwrap();
+        let signature = StructureSignature::new(&structure);
+        let mut bytes = Vec::new();
+        let written = signature.write_to(&mut bytes).unwrap();
+        assert_eq!(written, bytes.len() as u64);
+        let read = StructureSignature::read_from(&mut bytes.as_slice()).unwrap();
+        assert_eq!(read, signature);
+        assert!(StructureSignature::read_from(&mut &bytes[..bytes.len() - 1]).is_err());
+    }
+}
@@ -0,0 +1,685 @@
+use crate::analysis::{BasicBlock, BlockType, CFG};
+use crate::disasm::{Statement, StatementFamily};
+use std::collections::HashMap;
+use std::ops::Range;
+
+/// Maximum amount of basic blocks of a single top-level region.
+const REGION_MAX_BLOCKS: usize = 48;
+/// Maximum nesting of the regions.
+const REGION_MAX_DEPTH: usize = 6;
+/// Maximum amount of cases of a switch.
+const SWITCH_MAX_WIDTH: usize = 16;
+/// Size in bytes of each generated basic block.
+const BLOCK_SIZE: u32 = 16;
+/// Distance between the first offset of two consecutive functions of a corpus.
+const FUNCTION_ALIGNMENT: u64 = 0x100000;
+
+/// Region shapes used by default by the [`CFGGenerator`].
+pub const SYNTHETIC_REGIONS: [BlockType; 9] = [
+    BlockType::Sequence,
+    BlockType::SelfLooping,
+    BlockType::IfThen,
+    BlockType::IfThenElse,
+    BlockType::While,
+    BlockType::DoWhile,
+    BlockType::Switch,
+    BlockType::ProperInterval,
+    BlockType::ImproperInterval,
+];
+
+// opcodes used in the body of the generated basic blocks
+const BODY_OPCODES: [(StatementFamily, &str); 8] = [
+    (StatementFamily::MOV, "mov"),
+    (StatementFamily::ADD, "add"),
+    (StatementFamily::SUB, "sub"),
+    (StatementFamily::LOAD, "ldr"),
+    (StatementFamily::STORE, "str"),
+    (StatementFamily::XOR, "xor"),
+    (StatementFamily::SHL, "shl"),
+    (StatementFamily::MUL, "mul"),
+];
+
+// SplitMix64, enough for generating inputs and without dependencies.
+#[derive(Debug, Clone)]
+struct Rng(u64);
+
+impl Rng {
+    fn next_u64(&mut self) -> u64 {
+        self.0 = self.0.wrapping_add(0x9e3779b97f4a7c15);
+        let mut z = self.0;
+        z = (z ^ (z >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94d049bb133111eb);
+        z ^ (z >> 31)
+    }
+
+    // uniform value in 0..bound, bound must be greater than 0
+    fn below(&mut self, bound: usize) -> usize {
+        ((self.next_u64() as u128 * bound as u128) >> 64) as usize
+    }
+
+    // uniform value in the given range, that must not be empty
+    fn range(&mut self, range: Range<usize>) -> usize {
+        range.start + self.below(range.end - range.start)
+    }
+
+    // true with the given probability
+    fn chance(&mut self, probability: f64) -> bool {
+        ((self.next_u64() >> 11) as f64 / (1_u64 << 53) as f64) < probability
+    }
+}
+
+/// A function generated by the [`CFGGenerator`], with its body, before being assigned offsets.
+///
+/// Node 0 is the entry point, and each node is a basic block.
+#[derive(Debug, Clone, PartialEq, Eq)]
+struct Shape {
+    successors: Vec<Vec<usize>>,
+    // successor following each node with two successors when the conditional jump is not taken
+    fallthrough: Vec<Option<usize>>,
+    // opcodes of each basic block, excluding the final jump
+    bodies: Vec<Vec<usize>>,
+    // position of each node in the function, so each fallthrough follows its node
+    layout: Vec<usize>,
+}
+
+/// Seeded generator of synthetic control flow graphs.
+///
+/// The CFGs are built by composing regions shaped like the [`BlockType`]s recognized by the
+/// [`CFS`](crate::analysis::CFS): sequences, conditionals, loops, switches and intervals. Regions
+/// are nested up to a fixed depth, and a function is a sequence of regions of bounded size, so
+/// functions of any size can be generated without unbounded recursion.
+///
+/// The same seed always generates the same CFGs.
+/// ```
+/// use bincc::analysis::{CFGGenerator, Graph, CFS};
+///
+/// let cfg = CFGGenerator::new(42).generate(200);
+/// assert!(cfg.len() >= 200);
+/// assert_eq!(cfg, CFGGenerator::new(42).generate(200));
+/// let cfs = CFS::new(&cfg);
+/// ```
+#[derive(Debug, Clone)]
+pub struct CFGGenerator {
+    rng: Rng,
+    regions: Vec<BlockType>,
+}
+
+impl CFGGenerator {
+    /// Creates a new generator with the given seed, using all the [`SYNTHETIC_REGIONS`].
+    pub fn new(seed: u64) -> CFGGenerator {
+        CFGGenerator {
+            rng: Rng(seed),
+            regions: SYNTHETIC_REGIONS.to_vec(),
+        }
+    }
+
+    /// Restricts the shapes of the generated regions.
+    ///
+    /// Only the [`BlockType`]s contained in [`SYNTHETIC_REGIONS`] are considered. If none of them
+    /// is given, every function will be a sequence of basic blocks.
+    pub fn with_regions(mut self, regions: &[BlockType]) -> CFGGenerator {
+        self.regions = regions
+            .iter()
+            .copied()
+            .filter(|region| SYNTHETIC_REGIONS.contains(region))
+            .collect();
+        self
+    }
+
+    /// Generates a CFG with at least the given amount of basic blocks.
+    ///
+    /// The CFG starts at offset 0 and each basic block is 16 bytes long.
+    pub fn generate(&mut self, blocks: usize) -> CFG {
+        self.shape(blocks).cfg(0)
+    }
+
+    /// Generates a CFG with at least the given amount of basic blocks, along with its statements.
+    ///
+    /// The statements are consistent with the CFG: each basic block contains some random
+    /// arithmetic and memory statements, followed by a jump or a return matching its successors.
+    /// The block following a conditional jump is the one reached when the jump is not taken, so
+    /// [`CFG::new`] rebuilds the same blocks and edges from the statements, unless the CFG
+    /// contains a switch with more than two cases: they are reached with an indirect jump, whose
+    /// targets are not in the statements. The order of the children may differ, as [`CFG::new`]
+    /// sorts them by offset.
+    pub fn generate_with_statements(&mut self, blocks: usize) -> (CFG, Vec<Statement>) {
+        let shape = self.shape(blocks);
+        (shape.cfg(0), shape.statements(0))
+    }
+
+    /// Generates a corpus of functions, where a fraction of them is a clone of another one.
+    ///
+    /// `functions` functions are generated for each one of the `binaries`, each one with an
+    /// amount of basic blocks in the `blocks` range. With probability `clone_rate` a function is
+    /// an exact structural and semantic copy of a function generated before, at a different
+    /// offset. The functions are generated one at a time by iterating the returned corpus, and
+    /// [`SyntheticCorpus::families`] returns the expected groups of clones.
+    pub fn corpus(
+        &mut self,
+        binaries: u32,
+        functions: u32,
+        blocks: Range<usize>,
+        clone_rate: f64,
+    ) -> SyntheticCorpus {
+        SyntheticCorpus {
+            generator: CFGGenerator {
+                rng: Rng(self.rng.next_u64()),
+                regions: self.regions.clone(),
+            },
+            seed: self.rng.next_u64(),
+            functions,
+            total: binaries as usize * functions as usize,
+            blocks,
+            clone_rate,
+            next: 0,
+            originals: Vec::new(),
+        }
+    }
+
+    fn shape(&mut self, blocks: usize) -> Shape {
+        let mut shape = Shape {
+            successors: Vec::with_capacity(blocks + REGION_MAX_BLOCKS),
+            fallthrough: Vec::with_capacity(blocks + REGION_MAX_BLOCKS),
+            bodies: Vec::new(),
+            layout: Vec::new(),
+        };
+        let mut exit: Option<usize> = None;
+        while shape.successors.len() < blocks.max(1) {
+            let remaining = blocks.saturating_sub(shape.successors.len()).max(1);
+            let budget = self.rng.range(1..remaining.min(REGION_MAX_BLOCKS) + 1);
+            let (entry, region_exit) = self.region(&mut shape, budget, 0);
+            if let Some(previous) = exit {
+                shape.successors[previous].push(entry);
+            }
+            exit = Some(region_exit);
+        }
+        shape.bodies = (0..shape.successors.len())
+            .map(|_| {
+                let len = self.rng.range(1..5);
+                (0..len)
+                    .map(|_| self.rng.below(BODY_OPCODES.len()))
+                    .collect()
+            })
+            .collect();
+        shape.layout = shape.layout();
+        shape
+    }
+
+    // generates a region with approximately `budget` nodes, returning its entry and exit nodes.
+    // the exit node has no successors, so the region can be chained to the next one.
+    // the fallthrough of each conditional is either a node created by the region itself or the
+    // entry of a nested region, so no node is the fallthrough of two different conditionals.
+    fn region(&mut self, shape: &mut Shape, budget: usize, depth: usize) -> (usize, usize) {
+        if budget <= 1 || depth >= REGION_MAX_DEPTH || self.regions.is_empty() {
+            let node = new_node(shape);
+            return (node, node);
+        }
+        match self.regions[self.rng.below(self.regions.len())] {
+            BlockType::SelfLooping => {
+                let node = new_node(shape);
+                let exit = new_node(shape);
+                shape.successors[node].extend([node, exit]);
+                shape.fallthrough[node] = Some(exit);
+                (node, exit)
+            }
+            BlockType::IfThen => {
+                let head = new_node(shape);
+                let (then_entry, then_exit) = self.region(shape, budget - 2, depth + 1);
+                let join = new_node(shape);
+                shape.successors[head].extend([then_entry, join]);
+                shape.fallthrough[head] = Some(join);
+                shape.successors[then_exit].push(join);
+                (head, join)
+            }
+            BlockType::IfThenElse => {
+                let head = new_node(shape);
+                let half = (budget - 2) / 2;
+                let (then_entry, then_exit) = self.region(shape, half, depth + 1);
+                let (else_entry, else_exit) = self.region(shape, budget - 2 - half, depth + 1);
+                let join = new_node(shape);
+                shape.successors[head].extend([then_entry, else_entry]);
+                shape.fallthrough[head] = Some(then_entry);
+                shape.successors[then_exit].push(join);
+                shape.successors[else_exit].push(join);
+                (head, join)
+            }
+            BlockType::While => {
+                let head = new_node(shape);
+                let (body_entry, body_exit) = self.region(shape, budget - 2, depth + 1);
+                let exit = new_node(shape);
+                shape.successors[head].extend([body_entry, exit]);
+                shape.fallthrough[head] = Some(exit);
+                shape.successors[body_exit].push(head);
+                (head, exit)
+            }
+            BlockType::DoWhile => {
+                let (body_entry, body_exit) = self.region(shape, budget - 1, depth + 1);
+                let exit = new_node(shape);
+                shape.successors[body_exit].extend([body_entry, exit]);
+                shape.fallthrough[body_exit] = Some(exit);
+                (body_entry, exit)
+            }
+            BlockType::Switch => {
+                let head = new_node(shape);
+                let width = self
+                    .rng
+                    .range(2..(budget - 1).clamp(3, SWITCH_MAX_WIDTH + 1));
+                let case_budget = (budget - 2) / width;
+                let cases = (0..width)
+                    .map(|_| self.region(shape, case_budget, depth + 1))
+                    .collect::<Vec<_>>();
+                let join = new_node(shape);
+                if let [(first, _), _] = cases.as_slice() {
+                    // with two cases, the head is a conditional jump
+                    shape.fallthrough[head] = Some(*first);
+                }
+                for (case_entry, case_exit) in cases {
+                    shape.successors[head].push(case_entry);
+                    shape.successors[case_exit].push(join);
+                }
+                (head, join)
+            }
+            BlockType::ProperInterval => {
+                // single entry cycle, with a conditional inside
+                let head = new_node(shape);
+                let left = new_node(shape);
+                let right = new_node(shape);
+                let exit = new_node(shape);
+                shape.successors[head].extend([left, right]);
+                shape.successors[left].push(right);
+                shape.successors[right].extend([head, exit]);
+                shape.fallthrough[head] = Some(left);
+                shape.fallthrough[right] = Some(exit);
+                (head, exit)
+            }
+            BlockType::ImproperInterval => {
+                // cycle with two entry points
+                let head = new_node(shape);
+                let left = new_node(shape);
+                let right = new_node(shape);
+                let exit = new_node(shape);
+                shape.successors[head].extend([left, right]);
+                shape.successors[left].extend([right, exit]);
+                shape.successors[right].extend([left, exit]);
+                // head, right, left and exit, as left and right are both entries of the cycle
+                shape.fallthrough[head] = Some(right);
+                shape.fallthrough[right] = Some(left);
+                shape.fallthrough[left] = Some(exit);
+                (head, exit)
+            }
+            _ => {
+                let parts = self.rng.range(2..5).min(budget);
+                let mut entry = None;
+                let mut exit: Option<usize> = None;
+                for part in 0..parts {
+                    let part_budget = budget / parts + (part < budget % parts) as usize;
+                    let (part_entry, part_exit) = self.region(shape, part_budget, depth + 1);
+                    if let Some(previous) = exit {
+                        shape.successors[previous].push(part_entry);
+                    }
+                    entry.get_or_insert(part_entry);
+                    exit = Some(part_exit);
+                }
+                (entry.unwrap(), exit.unwrap())
+            }
+        }
+    }
+}
+
+fn new_node(shape: &mut Shape) -> usize {
+    shape.successors.push(Vec::new());
+    shape.fallthrough.push(None);
+    shape.successors.len() - 1
+}
+
+impl Shape {
+    // places the nodes in chains, each one followed by its fallthrough, starting from the entry
+    fn layout(&self) -> Vec<usize> {
+        let nodes = self.successors.len();
+        let mut has_predecessor = vec![false; nodes];
+        for &next in self.fallthrough.iter().flatten() {
+            has_predecessor[next] = true;
+        }
+        let mut layout = vec![usize::MAX; nodes];
+        let mut position = 0;
+        // the second pass places the cycles of fallthroughs, that the regions never create
+        for chain_start in [false, true] {
+            for first in 0..nodes {
+                if layout[first] != usize::MAX || (has_predecessor[first] && !chain_start) {
+                    continue;
+                }
+                let mut node = Some(first);
+                while let Some(current) = node.filter(|&node| layout[node] == usize::MAX) {
+                    layout[current] = position;
+                    position += 1;
+                    node = self.fallthrough[current];
+                }
+            }
+        }
+        layout
+    }
+
+    fn block(&self, node: usize) -> BasicBlock {
+        BasicBlock {
+            offset: self.layout[node] as u32 * BLOCK_SIZE,
+            length: BLOCK_SIZE,
+        }
+    }
+
+    fn cfg(&self, base: u64) -> CFG {
+        let edges = self
+            .successors
+            .iter()
+            .enumerate()
+            .map(|(node, successors)| {
+                let children = successors.iter().map(|succ| self.block(*succ)).collect();
+                (self.block(node), children)
+            })
+            .collect::<HashMap<_, _>>();
+        CFG {
+            root: Some(self.block(0)),
+            edges,
+            base,
+        }
+    }
+
+    fn statements(&self, base: u64) -> Vec<Statement> {
+        let mut order = (0..self.bodies.len()).collect::<Vec<_>>();
+        order.sort_unstable_by_key(|&node| self.layout[node]);
+        let mut stmts = Vec::new();
+        for node in order {
+            let body = &self.bodies[node];
+            let address = self.block(node).address(base);
+            for (index, opcode) in body.iter().enumerate() {
+                let (family, mnemonic) = BODY_OPCODES[*opcode];
+                let instruction = format!("{} r{}, r{}", mnemonic, index, opcode);
+                stmts.push(Statement::new(address + index as u64, family, &instruction));
+            }
+            let last = address + BLOCK_SIZE as u64 - 1;
+            let successors = &self.successors[node];
+            let jump = match successors.as_slice() {
+                [] => Statement::new(last, StatementFamily::RET, "ret"),
+                [next] => {
+                    let target = self.block(*next).address(base);
+                    Statement::new(last, StatementFamily::JMP, &format!("jmp 0x{:x}", target))
+                }
+                [first, second] => {
+                    // the jump is taken towards the successor not following this block
+                    let cond = if self.fallthrough[node] == Some(*first) {
+                        second
+                    } else {
+                        first
+                    };
+                    let target = self.block(*cond).address(base);
+                    Statement::new(last, StatementFamily::CJMP, &format!("je 0x{:x}", target))
+                }
+                _ => Statement::new(last, StatementFamily::JMP, "jmp rax"),
+            };
+            stmts.push(jump);
+        }
+        stmts
+    }
+}
+
+/// A function of a [`SyntheticCorpus`].
+#[derive(Debug, Clone)]
+pub struct SyntheticFunction {
+    /// Identifier of the binary containing the function.
+    pub binary: u32,
+    /// Identifier of the function, unique only inside its binary.
+    pub function: u32,
+    /// CFG of the function.
+    pub cfg: CFG,
+    /// Statements of the function, consistent with its CFG.
+    pub statements: Vec<Statement>,
+    /// Index, in the corpus, of the function this one is a clone of.
+    ///
+    /// This is the index of the function itself if it is not a clone.
+    pub original: usize,
+}
+
+/// A seeded stream of synthetic functions with a known ground truth for the clones.
+///
+/// The corpus is created by [`CFGGenerator::corpus`] and is an iterator generating one function
+/// at a time, so it can be larger than the memory. Each function that is not a clone is generated
+/// from its own seed, so its clones can generate it again instead of keeping it. Only the index of
+/// each such function is retained.
+#[derive(Debug, Clone)]
+pub struct SyntheticCorpus {
+    // picks the clones and the functions they are copied from
+    generator: CFGGenerator,
+    // combined with the index of a function that is not a clone to obtain its seed
+    seed: u64,
+    functions: u32,
+    total: usize,
+    blocks: Range<usize>,
+    clone_rate: f64,
+    // index of the next function
+    next: usize,
+    // index of every function generated so far that is not a clone
+    originals: Vec<usize>,
+}
+
+impl SyntheticCorpus {
+    /// Returns the groups of functions that are clones of each other.
+    ///
+    /// `originals` contains the [`SyntheticFunction::original`] of each function of the corpus,
+    /// in the order they were generated. Each group contains the indices of the functions in the
+    /// corpus, in increasing order, and has at least two elements. The groups are sorted by their
+    /// first element.
+    pub fn families<I: IntoIterator<Item = usize>>(originals: I) -> Vec<Vec<usize>> {
+        let mut families: Vec<Vec<usize>> = Vec::new();
+        for (index, original) in originals.into_iter().enumerate() {
+            if families.len() <= original.max(index) {
+                families.resize(original.max(index) + 1, Vec::new());
+            }
+            families[original].push(index);
+        }
+        families.retain(|family| family.len() > 1);
+        families
+    }
+
+    // generates the shape of the function with the given index, that must not be a clone
+    fn original_shape(&self, index: usize) -> Shape {
+        let mut generator = CFGGenerator {
+            rng: Rng(self.seed ^ (index as u64).wrapping_mul(0x9e3779b97f4a7c15)),
+            regions: self.generator.regions.clone(),
+        };
+        let size = generator
+            .rng
+            .range(self.blocks.start.max(1)..self.blocks.end.max(2));
+        generator.shape(size)
+    }
+}
+
+impl Iterator for SyntheticCorpus {
+    type Item = SyntheticFunction;
+
+    fn next(&mut self) -> Option<SyntheticFunction> {
+        if self.next >= self.total {
+            return None;
+        }
+        let index = self.next;
+        self.next += 1;
+        let rng = &mut self.generator.rng;
+        let original = if !self.originals.is_empty() && rng.chance(self.clone_rate) {
+            self.originals[rng.below(self.originals.len())]
+        } else {
+            self.originals.push(index);
+            index
+        };
+        let shape = self.original_shape(original);
+        let base = FUNCTION_ALIGNMENT * index as u64;
+        Some(SyntheticFunction {
+            binary: (index / self.functions as usize) as u32,
+            function: (index % self.functions as usize) as u32,
+            cfg: shape.cfg(base),
+            statements: shape.statements(base),
+            original,
+        })
+    }
+
+    fn size_hint(&self) -> (usize, Option<usize>) {
+        let remaining = self.total - self.next;
+        (remaining, Some(remaining))
+    }
+}
+
+impl ExactSizeIterator for SyntheticCorpus {}
+
+#[cfg(test)]
+mod tests {
+    use crate::analysis::{
+        BlockType, CFGGenerator, CFSComparator, FVec, Graph, SemanticComparator,
+        StructureSignature, SyntheticCorpus, CFG, CFS, SYNTHETIC_REGIONS,
+    };
+    use crate::disasm::Architecture;
+    use fnv::FnvHashMap;
+    use std::collections::HashMap;
+
+    #[test]
+    fn generate_deterministic() {
+        let a = CFGGenerator::new(7).generate(500);
+        let b = CFGGenerator::new(7).generate(500);
+        let c = CFGGenerator::new(8).generate(500);
+        assert_eq!(a, b);
+        assert_ne!(a, c);
+    }
+
+    #[test]
+    fn generate_size() {
+        let mut generator = CFGGenerator::new(0);
+        for size in [1, 10, 100, 10_000] {
+            let cfg = generator.generate(size);
+            assert!(cfg.len() >= size);
+            // every block is reachable from the root
+            assert_eq!(cfg.dfs_preorder().count(), cfg.len());
+        }
+    }
+
+    #[test]
+    fn generate_structured_reducible() {
+        let regions = [
+            BlockType::Sequence,
+            BlockType::SelfLooping,
+            BlockType::IfThen,
+            BlockType::IfThenElse,
+            BlockType::While,
+            BlockType::Switch,
+        ];
+        let mut generator = CFGGenerator::new(1).with_regions(&regions);
+        for _ in 0..20 {
+            let cfg = generator.generate(40);
+            assert!(CFS::new(&cfg).get_tree().is_some());
+        }
+    }
+
+    #[test]
+    fn statements_consistent_with_cfg() {
+        let (cfg, stmts) = CFGGenerator::new(3).generate_with_statements(100);
+        let returns = stmts.iter().filter(|stmt| stmt.get_mnemonic() == "ret");
+        let exits = cfg
+            .dfs_preorder()
+            .filter(|bb| cfg.neighbours(bb).is_empty());
+        assert_eq!(returns.count(), exits.count());
+    }
+
+    #[test]
+    fn statements_rebuild_cfg() {
+        let regions = SYNTHETIC_REGIONS
+            .into_iter()
+            .filter(|region| *region != BlockType::Switch)
+            .collect::<Vec<_>>();
+        let mut generator = CFGGenerator::new(9).with_regions(&regions);
+        for blocks in [1, 5, 40, 300] {
+            let (cfg, stmts) = generator.generate_with_statements(blocks);
+            let end = cfg.base() + cfg.len() as u64 * 16;
+            let rebuilt = CFG::new(&stmts, end, Architecture::X86(64));
+            let edges = |cfg: &CFG| {
+                let mut edges = cfg
+                    .edges
+                    .iter()
+                    .flat_map(|(src, children)| children.iter().map(move |dst| (*src, *dst)))
+                    .collect::<Vec<_>>();
+                edges.sort_unstable();
+                edges
+            };
+            assert_eq!(rebuilt.root, cfg.root);
+            assert_eq!(rebuilt.len(), cfg.len());
+            assert_eq!(edges(&rebuilt), edges(&cfg));
+        }
+    }
+
+    #[test]
+    fn corpus_streamed() {
+        let corpus = CFGGenerator::new(4).corpus(3, 10, 5..30, 0.5);
+        assert_eq!(corpus.len(), 30);
+        let functions = corpus.collect::<Vec<_>>();
+        let again = CFGGenerator::new(4).corpus(3, 10, 5..30, 0.5);
+        for (function, other) in functions.iter().zip(again) {
+            assert_eq!(function.cfg, other.cfg);
+            assert_eq!(function.original, other.original);
+        }
+        // a clone is generated again from the seed of its original, at a different offset
+        let clone = functions
+            .iter()
+            .find(|function| {
+                function.original != function.binary as usize * 10 + function.function as usize
+            })
+            .unwrap();
+        let original = &functions[clone.original];
+        assert_eq!(clone.cfg.edges, original.cfg.edges);
+        assert_ne!(clone.cfg.base(), original.cfg.base());
+        assert_eq!(functions[29].binary, 2);
+        assert_eq!(functions[29].function, 9);
+    }
+
+    #[test]
+    fn corpus_ground_truth() {
+        let corpus = CFGGenerator::new(5)
+            .corpus(4, 25, 5..30, 0.3)
+            .collect::<Vec<_>>();
+        assert_eq!(corpus.len(), 100);
+        let families = SyntheticCorpus::families(corpus.iter().map(|function| function.original));
+        assert!(!families.is_empty());
+        let string_cache = (0..100)
+            .map(|id| (id, id.to_string()))
+            .collect::<FnvHashMap<_, _>>();
+        let trees = corpus
+            .iter()
+            .map(|function| CFS::new(&function.cfg).get_tree())
+            .map(|tree| tree.as_ref().map(StructureSignature::new))
+            .collect::<Vec<_>>();
+        let mut structural = CFSComparator::new(1);
+        let mut opcodes = HashMap::new();
+        let fvecs = corpus
+            .iter()
+            .map(|function| FVec::new(function.statements.clone(), &mut opcodes, false))
+            .collect::<Vec<_>>();
+        let mut semantic = SemanticComparator::new(0.999);
+        for (index, function) in corpus.iter().enumerate() {
+            if let Some(tree) = &trees[index] {
+                structural.insert(function.binary, index as u32, tree);
+            }
+            semantic.insert(function.binary, index as u32, &fvecs[index], None);
+        }
+        let structural = structural.clones(&string_cache);
+        let semantic = semantic.clones(&string_cache);
+        for family in families {
+            let ids = family
+                .iter()
+                .map(|index| (corpus[*index].binary, *index as u32))
+                .collect::<Vec<_>>();
+            let contains_family =
+                |ids_class: Vec<(u32, u32)>| ids.iter().all(|id| ids_class.contains(id));
+            assert!(semantic
+                .iter()
+                .any(|class| contains_family(class.iter_ids().collect())));
+            if trees[family[0]].is_some() {
+                assert!(structural
+                    .iter()
+                    .any(|class| contains_family(class.iter_ids().collect())));
+            }
+        }
+    }
+}
@@ -1,32 +1,47 @@
 use bincc::analysis::{
-    CFSComparator, CloneClass, FVec, Graph, SemanticComparator, StructureBlock, CFG, CFS,
+    CFSComparator, CloneClass, CloneRecord, ExportWriter, ExternalCFSComparator, FVec, Graph,
+    LibraryDB, LibrarySignature, SemanticComparator, StructureSignature, CFG,
 };
-use bincc::disasm::radare2::R2Disasm;
+use bincc::disasm::radare2::{R2Disasm, ReplayLatency};
+use bincc::pipeline::{
+    self, OpcodeCache, PipelineError, PipelineOptions, Stage, StageHooks, StringCache,
+};
+use bincc::trace;
 use clap::Parser;
+use cli::allocs::{self, AllocCounters};
+use cli::bench::{self, BenchLevel};
+use cli::budget::{self, Budget};
+use cli::diff;
+use cli::mapreduce::{self, MappedFunction};
+use cli::metadata::{self, BinaryInfo};
+use cli::metrics::{self, BinaryMetrics, Metrics};
+use cli::report::{self, ReportClass, ReportFormat, ReportOptions, SortResult};
+use cli::sampling::{SampleStrategy, Sampling};
+use cli::serve::{self, Request, ServeIndex, ServeStats};
+use cli::session::{self, Sessions};
+use cli::slowest::{FunctionCost, Slowest};
+use cli::watch::Scanner;
 use fnv::FnvHashMap;
 use futures::stream::FuturesUnordered;
 use futures::StreamExt;
 use indicatif::{ProgressBar, ProgressStyle};
-use std::cmp::Reverse;
 use std::collections::HashMap;
+use std::fs::{File, OpenOptions};
+use std::io::{BufWriter, Write};
+use std::os::unix::fs::FileTypeExt;
 use std::path::Path;
-use std::sync::{Arc, Mutex};
+use std::sync::atomic::Ordering;
+use std::sync::{Arc, Mutex, RwLock};
 use std::time::{Duration, Instant};
-use tokio::time::timeout;
-
-#[derive(clap::ValueEnum, Copy, Clone)]
-enum SortResult {
-    /// Do not sort the results.
-    None,
-    /// Sorts by clone class structural depth, ascending.
-    DepthAsc,
-    /// Sorts by clone class structural depth, descending.
-    DepthDesc,
-    /// Sorts by amount of clones inside a clone class, ascending.
-    SizeAsc,
-    /// Sorts by amount of clones inside a clone class, descending.
-    SizeDesc,
-}
+use tokio::net::{UnixListener, UnixStream};
+use tokio::sync::Semaphore;
+use tokio::time::MissedTickBehavior;
+
+mod cli;
+
+#[cfg(feature = "alloc-profile")]
+#[global_allocator]
+static ALLOCATOR: allocs::CountingAllocator = allocs::CountingAllocator;
 
 #[derive(clap::ValueEnum, Copy, Clone, PartialEq, Eq)]
 enum SemanticAnalysisType {
@@ -38,7 +53,8 @@ enum SemanticAnalysisType {
 
 /// Detects code clones in the given binary files.
 ///
-/// The report will be printed to stdout and will contains all the clones divided in clone classes.
+/// The report will be printed to stdout (or to the --output file) and will contains all the clones
+/// divided in clone classes.
 /// Each clone class has the following format:
 ///
 /// CLONE CLASS (depth)
@@ -47,8 +63,17 @@ enum SemanticAnalysisType {
 /// For example CLONE CLASS (3) means that the clone class contains clones of at least 3 nested
 /// structures.
 #[derive(Parser, Clone)]
-#[clap(author, version, about, verbatim_doc_comment)]
+#[clap(
+    author,
+    version,
+    about,
+    verbatim_doc_comment,
+    args_conflicts_with_subcommands = true,
+    subcommand_negates_reqs = true
+)]
 struct Args {
+    #[clap(subcommand)]
+    command: Option<Command>,
     /// Files that will be compared against eachother for function clones.
     #[clap(required = true)]
     input: Vec<String>,
@@ -68,12 +93,21 @@ struct Args {
     /// Prints also the basic blocks offets composing each clone.
     #[clap(short, long)]
     basic_blocks: bool,
-    /// Outputs the result as Comma Separated Value content.
+    /// Outputs the result as Comma Separated Value content. Same as `--format csv`.
     ///
     /// The CSV will have the following structure:
     /// architecture, bits, binary, function, clone_class_id, class_depth
-    #[clap(short, long)]
+    #[clap(short, long, conflicts_with = "format")]
     csv: bool,
+    /// Format of the report.
+    ///
+    /// The JSON Lines format contains a clone class on each line, with an identifier of its
+    /// content (`fingerprint`) that can be used to compare different reports.
+    #[clap(short, long, default_value = "text")]
+    format: ReportFormat,
+    /// Writes the report to the given file instead of stdout.
+    #[clap(short, long)]
+    output: Option<String>,
     /// Disable the structural comparison step.
     ///
     /// WARNING: without this step the execution time may increase dramatically.
@@ -94,11 +128,495 @@ struct Args {
     /// Maximum time limit for a single application analysis, in seconds.
     #[clap(short, long, default_value_t = u64::MAX)]
     timeout: u64,
+    /// Maximum time limit for the whole execution, in seconds.
+    ///
+    /// Smaller binaries are analysed first, and a binary is not started if the expected analysis
+    /// time exceeds the remaining time. When the time is over, the analyses in progress are
+    /// interrupted and the comparison runs on the completed binaries. The inputs that were not
+    /// analysed are listed in the report.
+    #[clap(long)]
+    deadline: Option<u64>,
+    /// Database of known library functions, created with the `libdb` command.
+    ///
+    /// Functions matching the database are excluded from the analysis.
+    #[clap(long)]
+    libdb: Option<String>,
+    /// Analyses only a random fraction of the input binaries and estimates the corpus results.
+    ///
+    /// The estimate (clone rate, total functions and largest classes, with 95% confidence
+    /// intervals) is printed to stderr along with the normal report.
+    #[clap(long, default_value = "1.0", value_parser = parse_fraction)]
+    sample_binaries: f64,
+    /// Analyses only a random fraction of the functions of each binary.
+    #[clap(long, default_value = "1.0", value_parser = parse_fraction)]
+    sample_functions: f64,
+    /// Strategy used to pick the binaries when sampling.
+    #[clap(long, default_value = "uniform")]
+    sample_strategy: SampleStrategy,
+    /// Seed used when sampling, to obtain reproducible estimates.
+    #[clap(long, default_value = "0")]
+    seed: u64,
+    /// Runs the structural comparison on disk, storing temporary files in the given directory.
+    ///
+    /// Use this for corpora whose structural hashes do not fit in memory.
+    #[clap(long)]
+    external_memory: Option<String>,
+    /// Memory used by the structural hashes when running the comparison on disk, in MiB.
+    ///
+    /// This bounds the hashes of the subtrees, the largest part of the comparison. The structures
+    /// of the analysed functions are moved to disk as well, but the clone classes found are still
+    /// kept in memory, as the report sorts and filters them.
+    #[clap(long, default_value = "256", requires = "external_memory")]
+    memory_limit: usize,
+    /// Writes a JSON report with the time spent in each stage of the analysis to the given file.
+    ///
+    /// The report contains aggregate and per-binary timings, including each disassembler
+    /// command, the amount of functions, the reasons of the skipped inputs, the peak memory usage
+    /// and the throughput in functions per second.
+    #[clap(long)]
+    metrics: Option<String>,
+    /// Writes a trace of the analysis to the given file, in the Chrome trace event format.
+    ///
+    /// The trace can be opened with Perfetto or `chrome://tracing`. Each binary is shown on its
+    /// own lane, with the time spent on the disassembler commands, on building the graphs and
+    /// feature vectors, on waiting for the shared caches and on the comparisons.
+    #[clap(long)]
+    trace: Option<String>,
+    /// Reports the given amount of most expensive functions for each stage of the analysis.
+    ///
+    /// For each function the report contains the number of basic blocks and edges of its CFG,
+    /// the amount of reductions needed to build the CFS and if the construction was stopped
+    /// because it was not converging.
+    #[clap(long, default_value = "0")]
+    slowest: usize,
+    /// Writes the CFGs of the functions reported by --slowest in the given directory.
+    ///
+    /// The CFGs are in Graphviz dot format, and can be loaded back with `CFG::from_file`.
+    #[clap(long, requires = "slowest")]
+    dump_slowest: Option<String>,
+    /// Records every command issued to the disassembler in the given directory.
+    ///
+    /// A file is written for each binary, and can be used later with --replay.
+    #[clap(long, conflicts_with = "replay")]
+    record: Option<String>,
+    /// Replays the disassembler sessions recorded with --record in the given directory.
+    ///
+    /// The disassembler is not run and the binaries do not need to exist, so the analysis can be
+    /// benchmarked or tested on any machine with the exact same disassembler output.
+    #[clap(long)]
+    replay: Option<String>,
+    /// Latency of each replayed command.
+    ///
+    /// Either `none`, `recorded` for the latency measured when recording, a factor of the
+    /// recorded latency like `0.5x` or a fixed latency like `20ms`.
+    #[clap(long, default_value = "none", value_parser = session::parse_latency, requires = "replay")]
+    replay_latency: ReplayLatency,
+}
+
+fn parse_fraction(value: &str) -> Result<f64, String> {
+    match value.parse::<f64>() {
+        Ok(fraction) if fraction > 0.0 && fraction <= 1.0 => Ok(fraction),
+        _ => Err("expected a number in the range (0, 1]".to_string()),
+    }
+}
+
+#[derive(clap::Subcommand, Clone)]
+enum Command {
+    /// Creates a database of known library functions from reference builds of a library.
+    ///
+    /// The reference builds should be the library compiled for each architecture and optimization
+    /// level that may appear in the analysed binaries. If the output database already exists, the
+    /// new functions are appended to it, skipping the ones already present.
+    Libdb(LibdbArgs),
+    /// Analyses a shard of the inputs and writes their fingerprints into partition files.
+    ///
+    /// The `map`, `reduce` and `merge` commands split the analysis across several processes or
+    /// machines sharing only a filesystem: each `map` analyses a shard of the inputs, each
+    /// `reduce` builds the clone classes of a partition and `merge` prints the final report.
+    ///
+    /// Fingerprints do not depend on the build or the platform, so the processes may run on
+    /// different machines, as long as they use the same version of bincc.
+    Map(MapArgs),
+    /// Builds the clone classes of a partition written by the `map` command.
+    Reduce(ReduceArgs),
+    /// Combines the clone classes found by the `reduce` command and prints the report.
+    Merge(MergeArgs),
+    /// Exports the features of every function in a compact binary file.
+    ///
+    /// For each function, the file contains name, offset, binary, the fingerprints of its
+    /// structural subtrees and its frequency vector. The file is written while the binaries are
+    /// analysed, and its layout is documented in `bincc::analysis::ExportWriter`.
+    Export(ExportArgs),
+    /// Measures how the analysis scales with the amount of binaries analysed concurrently.
+    ///
+    /// The whole corpus is analysed once for each concurrency level, and a table is printed with
+    /// the throughput in functions per second, the speedup and efficiency relative to the first
+    /// level, the average amount of busy cores, the time spent in the disassembler and in bincc
+    /// itself, the throughput of each stage and the peak memory usage. The busy cores include
+    /// the disassembler processes, and the peak memory of the largest one is shown separately.
+    /// The comparison is not run, as it does not depend on the concurrency level.
+    Bench(BenchArgs),
+    /// Keeps the analysed binaries in memory and answers queries over a Unix domain socket.
+    ///
+    /// Each request and response is a frame: a 32-bit big endian length followed by the payload.
+    /// A request contains its fields separated by tabs, and the response is a JSON object with
+    /// an `ok` field, and an `error` field if the request failed. The requests are:
+    ///
+    /// - `analyse<TAB>path`: analyses the binary (its path as seen by the server), adds it to
+    ///   the index replacing any previous version and returns the clone classes containing it.
+    ///
+    /// - `topk<TAB>binary<TAB>function<TAB>k`: returns the `k` indexed functions most similar to
+    ///   the given one, ranked by the depth of the deepest shared structure and then by semantic
+    ///   similarity.
+    ///
+    /// - `metrics`: returns the amount of analyses waiting and running, the size of the index and
+    ///   the latency percentiles of the recent requests, in microseconds.
+    Serve(ServeArgs),
+    /// Watches a directory and reports the clone classes of the binaries added to it.
+    ///
+    /// The directory and its subdirectories are polled for new or modified files, which are
+    /// analysed once they stop changing and added to an in-memory index, replacing any previous
+    /// version. After each analysis, the clone classes containing the binary that were not
+    /// reported yet are appended to the output, one JSON object per line as in the JSON Lines
+    /// report. Files already in the directory are analysed when the command starts, and removed
+    /// files are dropped from the index.
+    Watch(WatchArgs),
+    /// Compares two reports written with `--format jsonl` and prints the clone classes that
+    /// appeared, disappeared or changed.
+    ///
+    /// Classes are matched by fingerprint, so no analysis is run again. A class whose members
+    /// changed is paired with the class of the other report sharing most of its members, and
+    /// printed with the members added and removed. Binaries are identified by path, so the two
+    /// reports should analyse them from the same location.
+    Diff(DiffArgs),
+}
+
+#[derive(clap::Args, Clone)]
+struct LibdbArgs {
+    /// Reference builds of the library.
+    #[clap(required = true)]
+    input: Vec<String>,
+    /// Name of the library, reported when one of its functions is skipped.
+    #[clap(short, long)]
+    name: String,
+    /// File where the database will be written.
+    #[clap(short, long)]
+    output: String,
+    /// Recognizes also functions with the same CFG shape as a known one, even if their
+    /// instructions differ.
+    ///
+    /// Functions linked at a different address are recognized anyway, as the addresses in their
+    /// instructions are masked. This recognizes also library functions compiled differently, but
+    /// also unrelated
+    /// functions with the same shape, so it should be enabled only if the analysed binaries are
+    /// expected to contain the library. Only CFGs with at least 8 basic blocks are matched this
+    /// way. The setting is saved in the database.
+    #[clap(long)]
+    match_shape: bool,
+}
+
+#[derive(clap::Args, Clone)]
+struct MapArgs {
+    /// Files that will be compared against eachother for function clones.
+    ///
+    /// Every `map` process should receive the same list, in the same order.
+    #[clap(required = true)]
+    input: Vec<String>,
+    /// Directory shared by all the processes, where the partitions will be written.
+    #[clap(short, long)]
+    output: String,
+    /// Shard of the input analysed by this process, in the form INDEX/COUNT (e.g. 0/4).
+    #[clap(long, default_value = "0/1", value_parser = parse_shard)]
+    shard: (u32, u32),
+    /// Amount of partitions, each one reduced independently.
+    #[clap(short, long, default_value = "16")]
+    partitions: u32,
+    /// Specify if the input binaries belongs to the same architecture or not.
+    ///
+    /// Unlike the main command, this cannot be detected as each process sees only a shard.
+    #[clap(short, long)]
+    architecture: SemanticAnalysisType,
+    /// Minimum threshold to consider a structural clone, measured in amount of nested structures.
+    #[clap(short, long, default_value = "3")]
+    min_depth: u32,
+    /// Disable the semantic comparison step.
+    #[clap(long)]
+    disable_semantic: bool,
+    /// Limits the maximum amount of applications analysed concurrently.
+    #[clap(short='l', long="limit", default_value_t = num_cpus::get())]
+    limit_concurrent: usize,
+    /// Maximum time limit for a single application analysis, in seconds.
+    #[clap(short, long, default_value_t = u64::MAX)]
+    timeout: u64,
+    /// Database of known library functions, created with the `libdb` command.
+    #[clap(long)]
+    libdb: Option<String>,
+}
+
+#[derive(clap::Args, Clone)]
+struct ReduceArgs {
+    /// Directory containing the partitions written by the `map` command.
+    dir: String,
+    /// Partition that will be reduced.
+    #[clap(short, long)]
+    partition: u32,
+    /// Minimum threshold to consider a semantic clone, measured in cosine similarity.
+    #[clap(long, default_value = "0.99")]
+    min_similarity: f32,
+    /// Disable the semantic comparison step.
+    #[clap(long)]
+    disable_semantic: bool,
+}
+
+#[derive(clap::Args, Clone)]
+struct MergeArgs {
+    /// Directory containing the results of the `reduce` command.
+    dir: String,
+    /// Prints also the basic blocks offets composing each clone.
+    #[clap(short, long)]
+    basic_blocks: bool,
+    /// Outputs the result as Comma Separated Value content. Same as `--format csv`.
+    #[clap(short, long, conflicts_with = "format")]
+    csv: bool,
+    /// Format of the report.
+    #[clap(short, long, default_value = "text")]
+    format: ReportFormat,
+    /// Writes the report to the given file instead of stdout.
+    #[clap(short, long)]
+    output: Option<String>,
+    /// Sorts the results.
+    #[clap(short, long, default_value = "none")]
+    sort: SortResult,
+    /// Don't remove duplicate clone classes from the results.
+    #[clap(long)]
+    no_filter: bool,
+}
+
+#[derive(clap::Args, Clone)]
+struct ExportArgs {
+    /// Files whose functions will be exported.
+    #[clap(required = true)]
+    input: Vec<String>,
+    /// File where the export will be written.
+    #[clap(short, long)]
+    output: String,
+    /// Specify if the input binaries belongs to the same architecture or not.
+    ///
+    /// Decides if the frequency vectors count mnemonics or opcode families. If this parameter is
+    /// not provided, it will be detected by the disassembler.
+    #[clap(short, long)]
+    architecture: Option<SemanticAnalysisType>,
+    /// Minimum depth of the exported structural subtrees.
+    #[clap(short, long, default_value = "1")]
+    min_depth: u32,
+    /// Limits the maximum amount of applications analysed concurrently.
+    #[clap(short='l', long="limit", default_value_t = num_cpus::get())]
+    limit_concurrent: usize,
+    /// Maximum time limit for a single application analysis, in seconds.
+    #[clap(short, long, default_value_t = u64::MAX)]
+    timeout: u64,
+    /// Database of known library functions, created with the `libdb` command.
+    #[clap(long)]
+    libdb: Option<String>,
+}
+
+#[derive(clap::Args, Clone)]
+struct BenchArgs {
+    /// Files composing the corpus.
+    #[clap(required = true)]
+    input: Vec<String>,
+    /// Concurrency levels, separated by commas.
+    ///
+    /// Defaults to the powers of two up to the amount of cpus, plus the amount of cpus.
+    #[clap(long, value_delimiter = ',', value_parser = parse_limit)]
+    limits: Vec<usize>,
+    /// Specify if the input binaries belongs to the same architecture or not.
+    ///
+    /// If this parameter is not provided, it will be detected by the disassembler.
+    #[clap(short, long)]
+    architecture: Option<SemanticAnalysisType>,
+    /// Disable the structural analysis step.
+    #[clap(long)]
+    disable_structural: bool,
+    /// Disable the semantic analysis step.
+    #[clap(long)]
+    disable_semantic: bool,
+    /// Maximum time limit for a single application analysis, in seconds.
+    #[clap(short, long, default_value_t = u64::MAX)]
+    timeout: u64,
+    /// Replays the disassembler sessions recorded with --record in the given directory.
+    #[clap(long)]
+    replay: Option<String>,
+    /// Latency of each replayed command, as in the main command.
+    #[clap(long, default_value = "none", value_parser = session::parse_latency, requires = "replay")]
+    replay_latency: ReplayLatency,
+}
+
+#[derive(clap::Args, Clone)]
+struct ServeArgs {
+    /// Binaries indexed before accepting requests.
+    input: Vec<String>,
+    /// Path of the Unix domain socket where the requests are received.
+    #[clap(short, long)]
+    socket: String,
+    /// Specify if the binaries belongs to the same architecture or not.
+    ///
+    /// Unlike the main command, this cannot be detected as the binaries are received later.
+    #[clap(short, long)]
+    architecture: SemanticAnalysisType,
+    /// Minimum threshold to consider a structural clone, measured in amount of nested structures.
+    #[clap(short, long, default_value = "3")]
+    min_depth: u32,
+    /// Minimum threshold to consider a semantic clone, measured in cosine similarity.
+    #[clap(long, default_value = "0.99")]
+    min_similarity: f32,
+    /// Disable the semantic comparison step.
+    #[clap(long)]
+    disable_semantic: bool,
+    /// Limits the maximum amount of binaries analysed concurrently.
+    ///
+    /// Further `analyse` requests wait in a queue until an analysis completes.
+    #[clap(short='l', long="limit", default_value_t = num_cpus::get())]
+    limit_concurrent: usize,
+    /// Maximum time limit for a single application analysis, in seconds.
+    #[clap(short, long, default_value_t = u64::MAX)]
+    timeout: u64,
+    /// Database of known library functions, created with the `libdb` command.
+    #[clap(long)]
+    libdb: Option<String>,
+}
+
+#[derive(clap::Args, Clone)]
+struct WatchArgs {
+    /// Directory containing the binaries.
+    dir: String,
+    /// File where the clone classes are appended, instead of the standard output.
+    #[clap(short, long)]
+    output: Option<String>,
+    /// Specify if the binaries belongs to the same architecture or not.
+    ///
+    /// Unlike the main command, this cannot be detected as the binaries are received later.
+    #[clap(short, long)]
+    architecture: SemanticAnalysisType,
+    /// Minimum threshold to consider a structural clone, measured in amount of nested structures.
+    #[clap(short, long, default_value = "3")]
+    min_depth: u32,
+    /// Minimum threshold to consider a semantic clone, measured in cosine similarity.
+    #[clap(long, default_value = "0.99")]
+    min_similarity: f32,
+    /// Disable the semantic comparison step.
+    #[clap(long)]
+    disable_semantic: bool,
+    /// Limits the maximum amount of binaries analysed concurrently.
+    #[clap(short='l', long="limit", default_value_t = num_cpus::get())]
+    limit_concurrent: usize,
+    /// Maximum time limit for a single application analysis, in seconds.
+    #[clap(short, long, default_value_t = u64::MAX)]
+    timeout: u64,
+    /// Database of known library functions, created with the `libdb` command.
+    #[clap(long)]
+    libdb: Option<String>,
+    /// Seconds a file must stay unchanged before being analysed.
+    #[clap(long, default_value = "5")]
+    debounce: u64,
+    /// Interval between two scans of the directory, in milliseconds.
+    #[clap(long, default_value = "1000", value_parser = clap::value_parser!(u64).range(1..))]
+    poll_interval: u64,
+}
+
+#[derive(clap::Args, Clone)]
+struct DiffArgs {
+    /// Report of the previous snapshot.
+    old: String,
+    /// Report of the current snapshot.
+    new: String,
+    /// Writes the differences to the given file instead of stdout.
+    #[clap(short, long)]
+    output: Option<String>,
+    /// Directory removed from the start of the binary paths of the old report.
+    ///
+    /// Binaries are matched by path, so snapshots stored in different directories are
+    /// compared by their paths relative to these roots.
+    #[clap(long)]
+    old_root: Option<String>,
+    /// Directory removed from the start of the binary paths of the new report.
+    #[clap(long)]
+    new_root: Option<String>,
+}
+
+fn parse_limit(value: &str) -> Result<usize, String> {
+    match value.parse::<usize>() {
+        Ok(limit) if limit > 0 => Ok(limit),
+        _ => Err("expected a positive number".to_string()),
+    }
+}
+
+fn parse_shard(value: &str) -> Result<(u32, u32), String> {
+    let parsed = value
+        .split_once('/')
+        .and_then(|(index, count)| Some((index.parse().ok()?, count.parse().ok()?)));
+    match parsed {
+        Some((index, count)) if index < count => Ok((index, count)),
+        _ => Err("expected INDEX/COUNT, with INDEX smaller than COUNT".to_string()),
+    }
+}
+
+// settings for the analysis of each binary, shared by the main command and `map`
+struct AnalysisOptions {
+    limit_concurrent: usize,
+    timeout: u64,
+    libdb: Option<String>,
+    disable_structural: bool,
+    disable_semantic: bool,
+    // if set, the functions are written here as soon as each binary is analysed, and not retained
+    export: Option<Arc<Mutex<Exporter>>>,
+    // empty set of the slowest functions, cloned and filled by each job
+    slowest: Slowest,
+    // if set, the disassembler sessions are recorded or replayed
+    sessions: Option<Arc<Sessions>>,
+}
+
+// destination of the `export` command, shared by all the jobs
+struct Exporter {
+    writer: ExportWriter<BufWriter<File>>,
+    min_depth: u32,
+    // amount of functions written
+    functions: usize,
 }
 
 #[tokio::main]
 async fn main() {
+    let start_t = Instant::now();
     let args = Args::parse();
+    match args.command {
+        Some(Command::Libdb(libdb_args)) => return build_libdb(libdb_args).await,
+        Some(Command::Map(map_args)) => return map(map_args).await,
+        Some(Command::Reduce(reduce_args)) => return reduce(reduce_args),
+        Some(Command::Merge(merge_args)) => return merge(merge_args),
+        Some(Command::Export(export_args)) => return export(export_args).await,
+        Some(Command::Bench(bench_args)) => return bench(bench_args).await,
+        Some(Command::Serve(serve_args)) => return serve(serve_args).await,
+        Some(Command::Watch(watch_args)) => return watch(watch_args).await,
+        Some(Command::Diff(diff_args)) => return diff_reports(diff_args),
+        None => (),
+    }
+    if args.trace.is_some() {
+        trace::enable();
+        trace::name_lane(0, "main");
+    }
+    let sessions = if let Some(dir) = &args.record {
+        match Sessions::record(dir) {
+            Ok(sessions) => Some(Arc::new(sessions)),
+            Err(error) => {
+                eprintln!("Failed to create the directory {}: {}", dir, error);
+                std::process::exit(1);
+            }
+        }
+    } else {
+        args.replay
+            .as_ref()
+            .map(|dir| Arc::new(Sessions::replay(dir, args.replay_latency)))
+    };
     // First detect the architecture for the semantic analysis
     let cross_arch = if let Some(semtype) = args.architecture {
         semtype == SemanticAnalysisType::Cross
@@ -107,56 +625,246 @@ async fn main() {
         true
     } else {
         eprint!("Selecting semantic analysis type... ");
-        let cross_arch = !same_arch(&args.input).await;
+        let cross_arch = !same_arch(&args.input, sessions.as_deref()).await;
         eprintln!("Done");
         cross_arch
     };
+    let sampling = Sampling {
+        binaries: args.sample_binaries,
+        functions: args.sample_functions,
+        strategy: args.sample_strategy,
+        seed: args.seed,
+    };
+    let sample = sampling.sample_binaries(&args.input);
     // storing all opcodes for every function will go out of memory really quickly.
     // I will just store the frequency and use an ID to identify them.
-    let analysis_result = analyse(args.clone(), cross_arch).await;
-    let clones = if args.disable_semantic {
-        structural_analysis_only(&analysis_result, args.min_depth)
+    let deadline = args
+        .deadline
+        .map(|secs| start_t + Duration::from_secs(secs));
+    let options = AnalysisOptions {
+        limit_concurrent: args.limit_concurrent,
+        timeout: args.timeout,
+        libdb: args.libdb.clone(),
+        disable_structural: args.disable_structural,
+        disable_semantic: args.disable_semantic,
+        export: None,
+        slowest: Slowest::new(args.slowest, args.dump_slowest.is_some()),
+        sessions,
+    };
+    let mut analysis_result =
+        analyse(&sample.binaries, &options, cross_arch, sampling, deadline).await;
+    let mut metrics = std::mem::take(&mut analysis_result.metrics);
+    if args.slowest > 0 {
+        analysis_result.slowest.print();
+        if let Some(dir) = &args.dump_slowest {
+            if let Err(error) = analysis_result.slowest.dump(dir) {
+                eprintln!("Failed to write the slowest CFGs to {}: {}", dir, error);
+                std::process::exit(1);
+            }
+        }
+    }
+    // the report needs the base address of each function, not its structure
+    let bases = args.basic_blocks.then(|| {
+        analysis_result
+            .result
+            .iter()
+            .map(|res| ((res.bin, res.func), res.base))
+            .collect::<FnvHashMap<_, _>>()
+    });
+    let mut external = match &args.external_memory {
+        Some(dir) if !args.disable_structural => Some(spill_structures(
+            &mut analysis_result,
+            args.min_depth,
+            dir,
+            args.memory_limit,
+            &mut metrics,
+        )),
+        _ => None,
+    };
+    // every clone class is converted as soon as it is found, without keeping the structures
+    let mut classes = Vec::new();
+    let mut report_class = |class: CloneClass<'_>| {
+        classes.push(ReportClass::from_class(
+            class,
+            bases.as_ref(),
+            &analysis_result.binaries,
+            &analysis_result.string_cache,
+        ))
+    };
+    if args.disable_semantic {
+        structural_analysis_only(
+            &analysis_result,
+            args.min_depth,
+            external.as_mut(),
+            &mut metrics,
+            &mut report_class,
+        );
     } else if args.disable_structural {
-        semantic_analysis_only(&analysis_result, args.min_similarity)
+        semantic_analysis_only(
+            &analysis_result,
+            args.min_similarity,
+            &mut metrics,
+            &mut report_class,
+        );
     } else {
-        structural_semantic_combined(&analysis_result, args.min_depth, args.min_similarity)
+        structural_semantic_combined(
+            &analysis_result,
+            args.min_depth,
+            args.min_similarity,
+            external.as_mut(),
+            &mut metrics,
+            &mut report_class,
+        );
+    }
+    drop(external);
+    if sampling.is_active() {
+        cli::sampling::print_estimate(
+            &sampling,
+            &sample,
+            &analysis_result.functions_per_binary,
+            &classes,
+        );
+    }
+    let options = ReportOptions {
+        sort: args.sort,
+        bbs: args.basic_blocks,
+        format: if args.csv {
+            ReportFormat::Csv
+        } else {
+            args.format
+        },
+        filter: !args.no_filter,
+        output: args.output,
     };
-    print_results(
-        clones,
-        args.sort,
-        args.basic_blocks,
-        args.csv,
-        !args.no_filter,
-    );
+    if let Err(error) = report::print_results(classes, &analysis_result.skipped, &options) {
+        eprintln!("Failed to write the report: {}", error);
+        std::process::exit(1);
+    }
+    if let Some(path) = &args.metrics {
+        if allocs::is_enabled() {
+            metrics.allocations = Some(allocs::report());
+        }
+        let skipped = &analysis_result.skipped;
+        if let Err(error) = metrics::write_metrics(path, &metrics, skipped, start_t.elapsed()) {
+            eprintln!("Failed to write the metrics to {}: {}", path, error);
+            std::process::exit(1);
+        }
+    }
+    if let Some(path) = &args.trace {
+        if let Err(error) = write_trace(path) {
+            eprintln!("Failed to write the trace to {}: {}", path, error);
+            std::process::exit(1);
+        }
+    }
 }
 
-fn structural_analysis_only(analysis_res: &AnalysisResult, threshold: u32) -> Vec<CloneClass> {
-    eprintln!(
-        "Structural analysis: {} candidates",
-        analysis_res
+fn write_trace(path: &str) -> Result<(), std::io::Error> {
+    let mut out = BufWriter::new(File::create(path)?);
+    trace::write_chrome(&mut out)?;
+    out.flush()
+}
+
+/// Moves the structures of the analysed functions to a comparator running on disk.
+///
+/// `dir` is the directory for the temporary files and `memory_limit` the memory used by the
+/// structural hashes in MiB. The structures are taken from the analysis result, so they are never
+/// all in memory again after this point.
+fn spill_structures(
+    analysis_res: &mut AnalysisResult,
+    threshold: u32,
+    dir: &str,
+    memory_limit: usize,
+    metrics: &mut Metrics,
+) -> ExternalCFSComparator {
+    let start_t = Instant::now();
+    let _allocs = allocs::stage(allocs::STRUCTURAL);
+    let max_records = memory_limit * 1024 * 1024 / std::mem::size_of::<CloneRecord>();
+    let comps = ExternalCFSComparator::new(threshold, dir, max_records).and_then(|mut comps| {
+        for res in analysis_res.result.iter_mut() {
+            if let Some(cfs) = res.cfs.take() {
+                comps.insert(res.bin, res.func, &cfs)?;
+            }
+        }
+        Ok(comps)
+    });
+    metrics.structural += start_t.elapsed();
+    match comps {
+        Ok(comps) => comps,
+        Err(e) => {
+            eprintln!("Structural analysis on disk failed: {}", e);
+            std::process::exit(1);
+        }
+    }
+}
+
+/// Runs the structural comparator, in memory or on disk if `external` is set, passing each clone
+/// class found to `sink`.
+///
+/// When running on disk, the structures must be already inserted in `external`, see
+/// [spill_structures].
+fn structural_clones<F>(
+    analysis_res: &AnalysisResult,
+    threshold: u32,
+    external: Option<&mut ExternalCFSComparator>,
+    mut sink: F,
+) where
+    F: FnMut(CloneClass<'_>),
+{
+    let _allocs = allocs::stage(allocs::STRUCTURAL);
+    if let Some(comps) = external {
+        if let Err(e) = comps.for_each_clone(&analysis_res.string_cache, sink) {
+            eprintln!("Structural analysis on disk failed: {}", e);
+            std::process::exit(1);
+        }
+    } else {
+        let functions = analysis_res
+            .result
+            .iter()
+            .filter_map(|res| res.cfs.as_ref().map(|cfs| (res.bin, res.func, cfs)))
+            .collect::<Vec<_>>();
+        let mut comps = CFSComparator::new(threshold);
+        comps.insert_all(&functions);
+        for class in comps.clones(&analysis_res.string_cache) {
+            sink(class);
+        }
+    }
+}
+
+fn structural_analysis_only<F>(
+    analysis_res: &AnalysisResult,
+    threshold: u32,
+    external: Option<&mut ExternalCFSComparator>,
+    metrics: &mut Metrics,
+    sink: F,
+) where
+    F: FnMut(CloneClass<'_>),
+{
+    let candidates = match &external {
+        Some(comps) => comps.functions(),
+        None => analysis_res
             .result
             .iter()
             .filter(|res| res.cfs.is_some())
-            .count()
-    );
-    let mut comps = CFSComparator::new(threshold);
-    let iter = analysis_res
-        .result
-        .iter()
-        .filter(|res| res.cfs.is_some())
-        .map(|res| (res.cfs.as_ref().unwrap(), res.bin, res.func));
+            .count(),
+    };
+    eprintln!("Structural analysis: {} candidates", candidates);
     let start_t = Instant::now();
-    for (cfs, bin, func) in iter {
-        comps.insert(bin, func, cfs);
-    }
-    let clones = comps.clones(&analysis_res.string_cache);
-    let end_t = Instant::now();
-    let sa_time = end_t.checked_duration_since(start_t).unwrap().as_micros() as u64;
-    eprintln!("Structural analysis took {} µs", sa_time);
-    clones
+    structural_clones(analysis_res, threshold, external, sink);
+    metrics.structural += start_t.elapsed();
+    eprintln!(
+        "Structural analysis took {} µs",
+        metrics.structural.as_micros()
+    );
 }
 
-fn semantic_analysis_only(analysis_res: &AnalysisResult, threshold: f32) -> Vec<CloneClass> {
+fn semantic_analysis_only<F>(
+    analysis_res: &AnalysisResult,
+    threshold: f32,
+    metrics: &mut Metrics,
+    sink: F,
+) where
+    F: FnMut(CloneClass<'_>),
+{
     let mut comps = SemanticComparator::new(threshold);
     eprintln!(
         "Semantic analysis: {} candidates",
@@ -167,170 +875,65 @@ fn semantic_analysis_only(analysis_res: &AnalysisResult, threshold: f32) -> Vec<
             .count()
     );
     let start_t = Instant::now();
+    let _allocs = allocs::stage(allocs::SEMANTIC);
     for res in analysis_res.result.iter().filter(|res| res.fvec.is_some()) {
         comps.insert(res.bin, res.func, res.fvec.as_ref().unwrap(), None);
     }
     let clones = comps.clones(&analysis_res.string_cache);
-    let end_t = Instant::now();
-    let se_time = end_t.checked_duration_since(start_t).unwrap().as_micros() as u64;
-    eprintln!("Semantic analysis took {} µs", se_time);
-    clones
+    metrics.semantic = start_t.elapsed();
+    eprintln!("Semantic analysis took {} µs", metrics.semantic.as_micros());
+    clones.into_iter().for_each(sink);
 }
 
-fn structural_semantic_combined(
+fn structural_semantic_combined<F>(
     analysis_res: &AnalysisResult,
     threshold_structural: u32,
     threshold_semantic: f32,
-) -> Vec<CloneClass> {
-    let reverse_map = analysis_res
-        .string_cache
-        .iter()
-        .map(|(k, v)| (v.as_str(), k))
-        .collect::<HashMap<_, _>>();
+    external: Option<&mut ExternalCFSComparator>,
+    metrics: &mut Metrics,
+    mut sink: F,
+) where
+    F: FnMut(CloneClass<'_>),
+{
     let fvec_map = analysis_res
         .result
         .iter()
         .map(|res| ((res.bin, res.func), res.fvec.as_ref().unwrap()))
         .collect::<FnvHashMap<_, _>>();
-    let mut comps = CFSComparator::new(threshold_structural);
-    let iter = analysis_res
-        .result
-        .iter()
-        .filter(|res| res.cfs.is_some())
-        .map(|res| (res.cfs.as_ref().unwrap(), res.bin, res.func));
-    let start_t = Instant::now();
-    for (cfs, bin, func) in iter {
-        comps.insert(bin, func, cfs);
-    }
-    let structural_clones = comps.clones(&analysis_res.string_cache);
-    let end_t = Instant::now();
-    let sa_time = end_t.checked_duration_since(start_t).unwrap().as_micros() as u64;
     let mut comparison_done = 0;
-    let mut retval = Vec::new();
+    let mut semantic = Duration::ZERO;
     let start_t = Instant::now();
-    for clone_class in structural_clones {
-        let mut comps = SemanticComparator::new(threshold_semantic);
-        for (bin, func, structure) in clone_class {
-            let bin_id = **reverse_map.get(bin).unwrap();
-            let fun_id = **reverse_map.get(func).unwrap();
-            let structure = structure.unwrap();
-            let fvec = *fvec_map.get(&(bin_id, fun_id)).unwrap();
-            comps.insert(bin_id, fun_id, fvec, Some(structure));
-            comparison_done += 1;
-        }
-        retval.extend(comps.clones(&analysis_res.string_cache));
-    }
-    let end_t = Instant::now();
-    let se_time = end_t.checked_duration_since(start_t).unwrap().as_micros() as u64;
+    // each structural class is refined as soon as it is found, so they are never all in memory
+    structural_clones(
+        analysis_res,
+        threshold_structural,
+        external,
+        |clone_class| {
+            let semantic_t = Instant::now();
+            let _allocs = allocs::stage(allocs::SEMANTIC);
+            let mut comps = SemanticComparator::new(threshold_semantic);
+            let ids = clone_class.iter_ids().collect::<Vec<_>>();
+            for ((_, _, structure), (bin_id, fun_id)) in clone_class.zip(ids) {
+                let fvec = *fvec_map.get(&(bin_id, fun_id)).unwrap();
+                comps.insert(bin_id, fun_id, fvec, structure);
+                comparison_done += 1;
+            }
+            let clones = comps.clones(&analysis_res.string_cache);
+            semantic += semantic_t.elapsed();
+            clones.into_iter().for_each(&mut sink);
+        },
+    );
+    metrics.structural += start_t.elapsed() - semantic;
+    metrics.semantic = semantic;
     eprintln!(
         "Structural+Semantic analysis: {} comparisons",
         comparison_done
     );
-    eprintln!("Structural analysis took {} µs", sa_time);
-    eprintln!("Semantic analysis took {} µs", se_time);
-    retval
-}
-
-fn print_results(
-    mut classes: Vec<CloneClass>,
-    sort: SortResult,
-    bbs: bool,
-    csv: bool,
-    filter: bool,
-) {
-    if filter {
-        let mut map: HashMap<Vec<(&str, &str)>, CloneClass> = HashMap::new();
-        for class in classes {
-            let mut content = class.iter_names().collect::<Vec<_>>();
-            content.sort_unstable();
-            if let Some(value) = map.get_mut(&content) {
-                if value.depth() < class.depth() {
-                    *value = class;
-                }
-            } else {
-                map.insert(content, class);
-            }
-        }
-        classes = map.into_values().collect::<Vec<_>>();
-    }
-    match sort {
-        SortResult::None => (),
-        SortResult::DepthAsc => classes.sort_unstable_by_key(|a| a.depth()),
-        SortResult::DepthDesc => classes.sort_unstable_by_key(|a| Reverse(a.depth())),
-        SortResult::SizeAsc => classes.sort_unstable_by_key(|a| a.len()),
-        SortResult::SizeDesc => classes.sort_unstable_by_key(|a| Reverse(a.len())),
-    }
-    if csv {
-        print_csv(classes, bbs)
-    } else {
-        print_stdout(classes, bbs)
-    }
-}
-
-fn print_stdout(classes: Vec<CloneClass>, bbs: bool) {
-    let mut clones = 0;
-    let classes_no = classes.len();
-    for class in classes {
-        println!("----- CLONE CLASS ({}) -----", class.depth());
-        for (bin, func, maybe_cfs) in class {
-            clones += 1;
-            if !bbs {
-                println!("{} :: {}", bin, func);
-            } else if let Some(cfs) = maybe_cfs {
-                let bbs = cfs
-                    .basic_blocks()
-                    .into_iter()
-                    .filter(|bb| !bb.is_sink())
-                    .map(|bb| format!("0x{:x}", bb.offset))
-                    .collect::<Vec<_>>()
-                    .join(",");
-                println!("{} :: {} [{}]", bin, func, bbs);
-            }
-        }
-    }
-    println!("----------------------------");
-    println!("Classes: {} Clones: {}", classes_no, clones);
-}
-
-fn print_csv(classes: Vec<CloneClass>, bbs: bool) {
-    print!("arch,bits,binary,function,clone_class_id,class_depth");
-    if bbs {
-        println!(",basic_blocks");
-    } else {
-        println!();
-    }
-    for (class_id, class) in classes.into_iter().enumerate() {
-        let class_depth = class.depth();
-        for (bin, func, maybe_cfs) in class {
-            // arch substring is appended by this program, it's always ASCII so this call is safe
-            let archbits_substring_end = bin.find(']').unwrap();
-            let archbits_substring = &bin[1..archbits_substring_end];
-            let arch_substring_end = archbits_substring.find('_').unwrap();
-            let arch_substring = &bin[1..arch_substring_end + 1];
-            let bits_substring = &bin[arch_substring_end + 2..archbits_substring_end];
-            let bin_substring = &bin[archbits_substring_end + 1..];
-            print!(
-                "{},{},{},{},{},{}",
-                arch_substring, bits_substring, bin_substring, func, class_id, class_depth
-            );
-            if bbs {
-                if let Some(cfs) = maybe_cfs {
-                    let bbs = cfs
-                        .basic_blocks()
-                        .into_iter()
-                        .filter(|bb| !bb.is_sink())
-                        .map(|bb| format!("0x{:x}", bb.offset))
-                        .collect::<Vec<_>>()
-                        .join(",");
-                    println!(",\"{}\"", bbs);
-                } else {
-                    println!();
-                }
-            } else {
-                println!();
-            }
-        }
-    }
+    eprintln!(
+        "Structural analysis took {} µs",
+        metrics.structural.as_micros()
+    );
+    eprintln!("Semantic analysis took {} µs", metrics.semantic.as_micros());
 }
 
 struct AnalysisResult {
@@ -338,65 +941,222 @@ struct AnalysisResult {
     string_cache: FnvHashMap<u32, String>,
     // result of the analysis
     result: Vec<AnalysisStepResult>,
+    // amount of analysed functions for each binary analysed successfully, indexed by path
+    functions_per_binary: FnvHashMap<String, usize>,
+    // binaries that were not analysed, with the reason
+    skipped: Vec<(String, &'static str)>,
+    // reversed cache containing all the opcode names used by the FVecs
+    opcodes: HashMap<u16, String>,
+    // metadata of the analysed binaries, indexed by binary id
+    binaries: FnvHashMap<u32, BinaryInfo>,
+    // time spent in each stage of the analysis
+    metrics: Metrics,
+    // most expensive functions of each stage
+    slowest: Slowest,
+}
+
+// result of the analysis of a single binary
+struct AnalysisJobResult {
+    // path of the analysed binary
+    binary: String,
+    // reason of the failure, if the binary could not be analysed
+    failure: Option<&'static str>,
+    // time spent analysing the binary
+    elapsed: Duration,
+    // metadata of the binary, if the disassembler could analyse it
+    info: Option<BinaryInfo>,
+    // result of the analysis for each function
+    functions: Vec<AnalysisStepResult>,
+    // amount of functions skipped because belonging to a known library, per library
+    known: FnvHashMap<String, usize>,
+    // time spent in each stage of the analysis
+    metrics: BinaryMetrics,
+    // most expensive functions of each stage
+    slowest: Slowest,
 }
 
-async fn analyse(args: Args, cross_arch: bool) -> AnalysisResult {
+async fn analyse(
+    input: &[String],
+    args: &AnalysisOptions,
+    cross_arch: bool,
+    sampling: Sampling,
+    deadline: Option<Instant>,
+) -> AnalysisResult {
+    let start_t = Instant::now();
+    let mut input = input.to_vec();
+    let mut budget = deadline.map(Budget::new);
+    if budget.is_some() {
+        budget::prioritize(&mut input);
+    }
     let style = ProgressStyle::default_bar()
         .template("{msg} {pos:>7}/{len:7} [{bar:40.cyan/blue}] [{elapsed_precise}]")
         .unwrap()
         .progress_chars("#>-");
     let pb = Arc::new(
-        ProgressBar::new(args.input.len() as u64)
+        ProgressBar::new(input.len() as u64)
             .with_style(style)
             .with_message("Disassembling..."),
     );
+    let libdb = args.libdb.as_deref().map(load_libdb);
     let mut tasks = FuturesUnordered::new();
     let string_cache = Arc::new(Mutex::new(HashMap::new()));
     let opcode_cache = Arc::new(Mutex::new(HashMap::new()));
     let mut analysis_all_res = Vec::new();
-    for job in args.input {
-        let fut = tokio::spawn(gather_analysis_data_job(
-            job,
-            Arc::clone(&pb),
-            Arc::clone(&string_cache),
-            Arc::clone(&opcode_cache),
-            args.disable_structural,
-            args.disable_semantic,
-            args.timeout,
-            cross_arch,
-        ));
-        tasks.push(fut);
-        if tasks.len() == args.limit_concurrent {
-            if let Some(Ok(result)) = tasks.next().await {
-                analysis_all_res.extend(result);
+    let mut known_all = FnvHashMap::default();
+    let mut functions_per_binary = FnvHashMap::default();
+    let mut skipped = Vec::new();
+    let mut binaries = FnvHashMap::default();
+    let mut metrics = Vec::with_capacity(input.len());
+    let mut slowest = args.slowest.clone();
+    // binaries currently being analysed, with their size
+    let mut in_flight = HashMap::new();
+    // each job is traced on its own lane, lane 0 is the main one
+    let mut lane = 0;
+    let mut jobs = input.into_iter();
+    loop {
+        while tasks.len() < args.limit_concurrent {
+            let job = match jobs.next() {
+                Some(job) => job,
+                None => break,
+            };
+            let size = budget::file_size(&job);
+            if let Some(budget) = &budget {
+                if !budget.fits(size) {
+                    skipped.push((job, "not enough time left before the deadline"));
+                    pb.inc(1);
+                    continue;
+                }
             }
+            in_flight.insert(job.clone(), size);
+            lane += 1;
+            trace::name_lane(lane, &job);
+            let job = gather_analysis_data_job(
+                job,
+                Arc::clone(&pb),
+                Arc::clone(&string_cache),
+                Arc::clone(&opcode_cache),
+                libdb.clone(),
+                sampling,
+                args.disable_structural,
+                args.disable_semantic,
+                args.timeout,
+                cross_arch,
+                args.export.clone(),
+                args.slowest.clone(),
+                args.sessions.clone(),
+            );
+            // allocations outside the stages of the pipeline are attributed to `other`
+            let counters = Arc::new(AllocCounters::default());
+            let job = allocs::in_binary(Arc::clone(&counters), allocs::OTHER, job);
+            let job = async move {
+                let mut result = job.await;
+                if allocs::is_enabled() {
+                    result.metrics.allocations = Some(counters.report());
+                }
+                result
+            };
+            tasks.push(tokio::spawn(trace::in_lane(lane, job)));
         }
-    }
-    // wait until completion or everything is killed
-    while !tasks.is_empty() {
-        if let Some(Ok(result)) = tasks.next().await {
-            analysis_all_res.extend(result);
+        if tasks.is_empty() {
+            break;
+        }
+        let next = if let Some(budget) = &budget {
+            let deadline = tokio::time::Instant::from_std(budget.deadline());
+            match tokio::time::timeout_at(deadline, tasks.next()).await {
+                Ok(next) => next,
+                Err(_) => {
+                    // deadline expired: stop everything and keep what is already done
+                    tasks.iter().for_each(|task| task.abort());
+                    // waits for the aborted jobs to be dropped, killing their disassemblers
+                    while tasks.next().await.is_some() {}
+                    for (job, _) in in_flight.drain() {
+                        skipped.push((job, "analysis interrupted by the deadline"));
+                        pb.inc(1);
+                    }
+                    for job in jobs.by_ref() {
+                        skipped.push((job, "deadline expired"));
+                        pb.inc(1);
+                    }
+                    break;
+                }
+            }
+        } else {
+            tasks.next().await
+        };
+        if let Some(Ok(result)) = next {
+            let size = in_flight.remove(&result.binary).unwrap_or(0);
+            if let Some(budget) = &mut budget {
+                budget.record(size, result.elapsed);
+            }
+            if let Some(info) = result.info {
+                binaries.insert(info.id, info);
+            }
+            if let Some(reason) = result.failure {
+                skipped.push((result.binary, reason));
+            } else {
+                functions_per_binary.insert(result.binary, result.functions.len());
+            }
+            analysis_all_res.extend(result.functions);
+            for (library, count) in result.known {
+                *known_all.entry(library).or_insert(0) += count;
+            }
+            metrics.push(result.metrics);
+            slowest.merge(result.slowest);
         }
     }
+    // jobs still in flight at this point crashed without returning any result
+    skipped.extend(in_flight.into_keys().map(|job| (job, "analysis crashed")));
     pb.finish();
-    let string_cache = Arc::try_unwrap(string_cache)
-        .unwrap()
-        .into_inner()
-        .unwrap()
+    if libdb.is_some() {
+        let mut known_all = known_all.into_iter().collect::<Vec<_>>();
+        known_all.sort_unstable();
+        let total = known_all.iter().map(|(_, count)| count).sum::<usize>();
+        eprintln!("Skipped {} known library functions", total);
+        for (library, count) in known_all {
+            eprintln!("    {}: {}", library, count);
+        }
+    }
+    // aborted jobs may still hold a reference to the cache, so the content is moved out.
+    let string_cache = std::mem::take(&mut *string_cache.lock().unwrap())
         .into_iter()
         .map(|(k, v)| (v, k))
         .collect::<FnvHashMap<_, _>>();
+    let opcodes = std::mem::take(&mut *opcode_cache.lock().unwrap())
+        .into_iter()
+        .map(|(k, v)| (v, k))
+        .collect::<HashMap<_, _>>();
+    skipped.sort_unstable();
     AnalysisResult {
         string_cache,
         result: analysis_all_res,
+        functions_per_binary,
+        skipped,
+        opcodes,
+        binaries,
+        metrics: Metrics {
+            binaries: metrics,
+            analysis: start_t.elapsed(),
+            ..Default::default()
+        },
+        slowest,
+    }
+}
+
+fn load_libdb(path: &str) -> Arc<LibraryDB> {
+    match LibraryDB::from_file(path) {
+        Ok(db) => Arc::new(db),
+        Err(error) => {
+            eprintln!("Failed to read library database {}: {}", path, error);
+            std::process::exit(1);
+        }
     }
 }
 
-async fn same_arch(jobs: &[String]) -> bool {
+async fn same_arch(jobs: &[String], sessions: Option<&Sessions>) -> bool {
     let mut archs = Vec::with_capacity(jobs.len());
     for job in jobs {
         let job_path = Path::new(&job);
-        if let Ok(mut disassembler) = R2Disasm::new(job_path.to_str().unwrap()).await {
+        if let Ok(mut disassembler) = Sessions::open(sessions, job_path.to_str().unwrap()).await {
             if let Some(arch) = disassembler.get_arch().await {
                 archs.push(arch);
             } else {
@@ -418,7 +1178,10 @@ async fn same_arch(jobs: &[String]) -> bool {
 struct AnalysisStepResult {
     bin: u32,
     func: u32,
-    cfs: Option<StructureBlock>,
+    offset: u64,
+    // address the offsets of the basic blocks of `cfs` are relative to
+    base: u64,
+    cfs: Option<StructureSignature>,
     fvec: Option<FVec>,
 }
 
@@ -426,73 +1189,848 @@ struct AnalysisStepResult {
 async fn gather_analysis_data_job(
     job: String,
     pb: Arc<ProgressBar>,
-    string_cache: Arc<Mutex<HashMap<String, u32>>>,
-    opcode_cache: Arc<Mutex<HashMap<String, u16>>>,
+    string_cache: StringCache,
+    opcode_cache: OpcodeCache,
+    libdb: Option<Arc<LibraryDB>>,
+    sampling: Sampling,
     disable_structural: bool,
     disable_semantic: bool,
     timeout_secs: u64,
     cross_arch: bool,
-) -> Vec<AnalysisStepResult> {
+    export: Option<Arc<Mutex<Exporter>>>,
+    mut slowest: Slowest,
+    sessions: Option<Arc<Sessions>>,
+) -> AnalysisJobResult {
+    let start_t = Instant::now();
     let job_path = Path::new(&job);
     let bin = job_path.to_str().unwrap().to_string();
     let mut result = Vec::new();
-    if let Ok(mut disassembler) = R2Disasm::new(job_path.to_str().unwrap()).await {
-        let analysis_res = timeout(Duration::from_secs(timeout_secs), disassembler.analyse()).await;
-        if analysis_res.is_ok() {
-            let arch = disassembler
-                .get_arch()
-                .await
-                .expect("Unsupported architecture");
-            let bin_with_arch = format!("[{}_{}]{}", arch.name(), arch.bits(), bin);
-            let funcs = disassembler.get_function_offsets().await;
+    let mut known = FnvHashMap::default();
+    let mut failure = None;
+    let mut info = None;
+    let mut metrics = BinaryMetrics {
+        path: bin.clone(),
+        ..Default::default()
+    };
+    let disassembler = allocs::in_stage(
+        allocs::DISASSEMBLER,
+        Sessions::open(sessions.as_deref(), job_path.to_str().unwrap()),
+    )
+    .await;
+    if let Ok(disassembler) = disassembler {
+        metrics.spawn = start_t.elapsed();
+        let mut function_filter = sampling.function_filter(&bin);
+        let options = PipelineOptions {
+            structural: !disable_structural,
+            semantic: !disable_semantic,
+            cross_arch,
+            timeout: Duration::from_secs(timeout_secs),
+            libdb,
+            filter: Some(Box::new(move |_| function_filter.keep())),
+            // without the alloc-profile feature the pipeline does not mark its stages at all
+            on_stage: allocs::is_enabled().then_some(StageHooks {
+                enter: alloc_stage,
+                exit: allocs::exit,
+            }),
+            ..Default::default()
+        };
+        let (analysis, mut functions) = pipeline::analyse_functions(
+            bin.clone(),
+            disassembler,
+            Arc::clone(&string_cache),
+            Arc::clone(&opcode_cache),
+            options,
+        );
+        // names of the analysed functions, by offset
+        let mut names = FnvHashMap::default();
+        let consumer = async {
+            while let Some(function) = functions.recv().await {
+                // time spent on this function, in the order of slowest::STAGES
+                let timings = function.timings;
+                let elapsed = [timings.cfg, timings.cfs, timings.fvec];
+                metrics.cfg += timings.cfg;
+                metrics.cfs += timings.cfs;
+                metrics.fvec += timings.fvec;
+                let base = function.cfg.base();
+                let reductions = function.reductions.unwrap_or_default();
+                if function.reductions.is_some() {
+                    metrics.reductions.add(&reductions);
+                }
+                if slowest.would_keep(&elapsed) {
+                    let cost = FunctionCost {
+                        binary: bin.clone(),
+                        function: function.name.clone(),
+                        blocks: function.cfg.len(),
+                        edges: function.cfg.edges_len(),
+                        iterations: reductions.iterations,
+                        tolerance_exceeded: reductions.tolerance_exceeded,
+                        elapsed,
+                    };
+                    slowest.push(cost, function.cfg);
+                }
+                names.insert(function.offset, function.name);
+                result.push(AnalysisStepResult {
+                    bin: function.bin,
+                    func: function.func,
+                    offset: function.offset,
+                    base,
+                    cfs: function.cfs.as_ref().map(StructureSignature::new),
+                    fvec: function.fvec,
+                });
+            }
+        };
+        let (mut summary, ()) = tokio::join!(analysis, consumer);
+        metrics.analysis = summary.analysis;
+        match summary.outcome {
+            Ok((bin_id, arch)) => {
+                let hash_path = bin.clone();
+                let hash = tokio::task::spawn_blocking(move || metadata::file_hash(hash_path))
+                    .await
+                    .ok()
+                    .and_then(|hash| hash.ok())
+                    .unwrap_or(0);
+                info = Some(BinaryInfo {
+                    id: bin_id,
+                    path: bin.clone(),
+                    arch: arch.name().to_string(),
+                    bits: arch.bits(),
+                    size: budget::file_size(&bin),
+                    hash,
+                    elapsed: Duration::ZERO,
+                });
+                known = summary.known;
+                metrics.functions = result.len();
+                metrics.known = known.values().sum();
+                metrics.discarded = summary.visited - metrics.functions - metrics.known;
+                if let (Some(export), Some(info)) = (&export, &info) {
+                    let mut exporter = {
+                        let _span = trace::span("wait export");
+                        export.lock().unwrap()
+                    };
+                    let exported =
+                        export_functions(&mut exporter, info, &result, &names, &opcode_cache);
+                    if let Err(error) = exported {
+                        eprintln!("Failed to export {}: {}", job, error);
+                        failure = Some("export error");
+                    }
+                    result.clear();
+                }
+            }
+            Err(PipelineError::Timeout) => {
+                eprintln!("Killed {} (timeout)", job);
+                failure = Some("timeout");
+            }
+            Err(PipelineError::UnsupportedArchitecture) => {
+                eprintln!("Unsupported architecture for {}", job);
+                failure = Some("unsupported architecture");
+            }
+        }
+        let disassembler = &mut summary.disassembler;
+        if let Some(sessions) = &sessions {
+            if let Err(error) = sessions.save(&bin, disassembler) {
+                eprintln!("Failed to record the session of {}: {}", bin, error);
+            }
+        }
+        metrics.commands = disassembler.command_stats().clone();
+    } else {
+        eprintln!("Disassembler error for {}", bin);
+        failure = Some("disassembler error");
+    }
+    pb.inc(1);
+    let elapsed = start_t.elapsed();
+    if let Some(info) = &mut info {
+        info.elapsed = elapsed;
+    }
+    metrics.failure = failure;
+    metrics.elapsed = elapsed;
+    AnalysisJobResult {
+        binary: job,
+        failure,
+        elapsed,
+        info,
+        functions: result,
+        known,
+        metrics,
+        slowest,
+    }
+}
+
+// attributes the allocations of each stage of the pipeline
+fn alloc_stage(stage: Stage) -> usize {
+    allocs::enter(match stage {
+        Stage::Disassembler => allocs::DISASSEMBLER,
+        Stage::Cfg => allocs::CFG,
+        Stage::Cfs => allocs::CFS,
+        Stage::FVec => allocs::FVEC,
+    })
+}
+
+// writes the analysed functions of a binary to the export
+fn export_functions(
+    exporter: &mut Exporter,
+    info: &BinaryInfo,
+    functions: &[AnalysisStepResult],
+    names: &FnvHashMap<u64, String>,
+    opcode_cache: &Mutex<HashMap<String, u16>>,
+) -> Result<(), std::io::Error> {
+    let writer = &mut exporter.writer;
+    writer.write_binary(
+        info.id, &info.path, &info.arch, info.bits, info.size, info.hash,
+    )?;
+    // the opcodes lock is released immediately, to not block the other jobs
+    writer.write_opcodes(&opcode_cache.lock().unwrap())?;
+    for function in functions {
+        writer.write_function(
+            info.id,
+            &names[&function.offset],
+            function.offset,
+            function.cfs.as_ref(),
+            exporter.min_depth,
+            function.fvec.as_ref(),
+        )?;
+    }
+    exporter.functions += functions.len();
+    Ok(())
+}
+
+async fn build_libdb(args: LibdbArgs) {
+    let mut libdb = if Path::new(&args.output).exists() {
+        match LibraryDB::from_file(&args.output) {
+            Ok(db) => db,
+            Err(error) => {
+                eprintln!("Failed to read library database {}: {}", args.output, error);
+                std::process::exit(1);
+            }
+        }
+    } else {
+        LibraryDB::new()
+    };
+    if args.match_shape {
+        libdb.set_match_shape(true);
+    }
+    let mut added = 0;
+    let mut duplicates = 0;
+    for job in args.input {
+        if let Ok(mut disassembler) = R2Disasm::new(&job).await {
+            disassembler.analyse().await;
             let names = disassembler
                 .get_function_names()
                 .await
                 .into_iter()
                 .map(|(k, v)| (v, k))
                 .collect::<FnvHashMap<_, _>>();
-            for func in funcs {
-                if let Some(bare) = disassembler.get_function_cfg(func).await {
-                    if let Some(func_name) = names.get(&func) {
-                        let cfg = CFG::from(bare);
-                        if cfg.len() > 1 {
-                            let cfs = if !disable_structural {
-                                CFS::new(&cfg).get_tree()
-                            } else {
-                                None
-                            };
-                            let fvec = if !disable_semantic {
-                                disassembler.get_function_body(func).await.map(|stmts| {
-                                    FVec::new(stmts, &mut opcode_cache.lock().unwrap(), cross_arch)
-                                })
-                            } else {
-                                None
-                            };
-                            if let Ok(mut cache) = string_cache.lock() {
-                                let next_id = cache.len() as u32;
-                                let bin_id = *cache.entry(bin_with_arch.clone()).or_insert(next_id);
-                                let next_id = cache.len() as u32;
-                                let func_id =
-                                    *cache.entry(func_name.to_string()).or_insert(next_id);
-                                result.push(AnalysisStepResult {
-                                    bin: bin_id,
-                                    func: func_id,
-                                    cfs,
-                                    fvec,
-                                })
-                            } else {
-                                panic!("Mutex poisoned")
-                            }
+            for func in disassembler.get_function_offsets().await {
+                if let (Some(bare), Some(func_name)) =
+                    (disassembler.get_function_cfg(func).await, names.get(&func))
+                {
+                    if let Some(stmts) = disassembler.get_function_body(func).await {
+                        let signature = LibrarySignature::new(&stmts, &CFG::from(bare));
+                        if libdb.insert(&args.name, func_name, signature) {
+                            added += 1;
+                        } else {
+                            duplicates += 1;
                         }
                     }
                 }
             }
         } else {
-            eprintln!("Killed {} (timeout)", job);
+            eprintln!("Disassembler error for {}", job);
+        }
+    }
+    if let Err(error) = libdb.to_file(&args.output) {
+        eprintln!(
+            "Failed to write library database {}: {}",
+            args.output, error
+        );
+        std::process::exit(1);
+    }
+    eprintln!(
+        "Added {} functions of {} to {} ({} already present)",
+        added, args.name, args.output, duplicates
+    );
+}
+
+async fn map(args: MapArgs) {
+    let (shard, shards) = args.shard;
+    let input = args
+        .input
+        .into_iter()
+        .enumerate()
+        .filter(|(index, _)| *index as u32 % shards == shard)
+        .map(|(_, job)| job)
+        .collect::<Vec<_>>();
+    let options = AnalysisOptions {
+        limit_concurrent: args.limit_concurrent,
+        timeout: args.timeout,
+        libdb: args.libdb,
+        disable_structural: false,
+        disable_semantic: args.disable_semantic,
+        export: None,
+        slowest: Slowest::new(0, false),
+        sessions: None,
+    };
+    let cross_arch = args.architecture == SemanticAnalysisType::Cross;
+    let analysis_result = analyse(&input, &options, cross_arch, Sampling::default(), None).await;
+    let functions = analysis_result
+        .result
+        .iter()
+        .filter(|res| res.cfs.is_some())
+        .map(|res| MappedFunction {
+            binary: analysis_result.string_cache.get(&res.bin).unwrap(),
+            function: analysis_result.string_cache.get(&res.func).unwrap(),
+            structure: res.cfs.as_ref().unwrap(),
+            base: res.base,
+            fvec: res.fvec.as_ref(),
+        });
+    let binaries = analysis_result.binaries.values();
+    if let Err(error) = mapreduce::write_binaries(binaries, Path::new(&args.output), shard) {
+        eprintln!("Failed to write binaries to {}: {}", args.output, error);
+        std::process::exit(1);
+    }
+    match mapreduce::write_partitions(
+        functions,
+        &analysis_result.opcodes,
+        Path::new(&args.output),
+        args.partitions,
+        shard,
+        args.min_depth,
+    ) {
+        Ok(written) => eprintln!("Written {} fingerprints to {}", written, args.output),
+        Err(error) => {
+            eprintln!("Failed to write partitions to {}: {}", args.output, error);
+            std::process::exit(1);
+        }
+    }
+    for (binary, reason) in analysis_result.skipped {
+        eprintln!("Skipped {} ({})", binary, reason);
+    }
+}
+
+fn reduce(args: ReduceArgs) {
+    let min_similarity = if args.disable_semantic {
+        None
+    } else {
+        Some(args.min_similarity)
+    };
+    match mapreduce::reduce(Path::new(&args.dir), args.partition, min_similarity) {
+        Ok(classes) => eprintln!("Partition {}: {} clone classes", args.partition, classes),
+        Err(error) => {
+            eprintln!("Failed to reduce partition {}: {}", args.partition, error);
+            std::process::exit(1);
+        }
+    }
+}
+
+fn merge(args: MergeArgs) {
+    let dir = Path::new(&args.dir);
+    let loaded = mapreduce::read_binaries(dir)
+        .and_then(|binaries| Ok((binaries, mapreduce::read_reports(dir)?)));
+    let (binaries, contents) = match loaded {
+        Ok(loaded) => loaded,
+        Err(error) => {
+            eprintln!("Failed to read the reports in {}: {}", args.dir, error);
+            std::process::exit(1);
+        }
+    };
+    let mut classes = Vec::new();
+    for content in &contents {
+        match mapreduce::parse_report(content, &binaries, args.basic_blocks) {
+            Ok(parsed) => classes.extend(parsed),
+            Err(error) => {
+                eprintln!("Failed to read the reports in {}: {}", args.dir, error);
+                std::process::exit(1);
+            }
+        }
+    }
+    let options = ReportOptions {
+        sort: args.sort,
+        bbs: args.basic_blocks,
+        format: if args.csv {
+            ReportFormat::Csv
+        } else {
+            args.format
+        },
+        filter: !args.no_filter,
+        output: args.output,
+    };
+    if let Err(error) = report::print_results(classes, &[], &options) {
+        eprintln!("Failed to write the report: {}", error);
+        std::process::exit(1);
+    }
+}
+
+fn diff_reports(args: DiffArgs) {
+    let mut reports = Vec::with_capacity(2);
+    for (path, root) in [(&args.old, &args.old_root), (&args.new, &args.new_root)] {
+        let root = root.as_deref().map(Path::new);
+        let parsed = std::fs::read_to_string(path)
+            .map_err(|error| error.into())
+            .and_then(|content| diff::parse_jsonl(&content, root));
+        match parsed {
+            Ok(classes) => reports.push(classes),
+            Err(error) => {
+                eprintln!("Failed to read the report {}: {}", path, error);
+                std::process::exit(1);
+            }
         }
+    }
+    let changes = diff::diff(&reports[0], &reports[1]);
+    let written = match &args.output {
+        Some(path) => File::create(path).and_then(|file| {
+            let mut writer = BufWriter::new(file);
+            diff::write_diff(&mut writer, &changes)?;
+            writer.flush()
+        }),
+        None => diff::write_diff(&mut std::io::stdout().lock(), &changes),
+    };
+    if let Err(error) = written {
+        eprintln!("Failed to write the differences: {}", error);
+        std::process::exit(1);
+    }
+    eprintln!(
+        "{} appeared, {} disappeared, {} changed, {} unchanged",
+        changes.appeared.len(),
+        changes.disappeared.len(),
+        changes.changed.len(),
+        changes.unchanged
+    );
+}
+
+async fn export(args: ExportArgs) {
+    let cross_arch = if let Some(semtype) = args.architecture {
+        semtype == SemanticAnalysisType::Cross
     } else {
-        eprintln!("Disassembler error for {}", bin);
+        eprint!("Selecting semantic analysis type... ");
+        let cross_arch = !same_arch(&args.input, None).await;
+        eprintln!("Done");
+        cross_arch
+    };
+    let writer = match File::create(&args.output).and_then(|f| ExportWriter::new(BufWriter::new(f)))
+    {
+        Ok(writer) => writer,
+        Err(error) => {
+            eprintln!("Failed to create {}: {}", args.output, error);
+            std::process::exit(1);
+        }
+    };
+    let exporter = Arc::new(Mutex::new(Exporter {
+        writer,
+        min_depth: args.min_depth,
+        functions: 0,
+    }));
+    let options = AnalysisOptions {
+        limit_concurrent: args.limit_concurrent,
+        timeout: args.timeout,
+        libdb: args.libdb,
+        disable_structural: false,
+        disable_semantic: false,
+        export: Some(Arc::clone(&exporter)),
+        slowest: Slowest::new(0, false),
+        sessions: None,
+    };
+    let analysis_result =
+        analyse(&args.input, &options, cross_arch, Sampling::default(), None).await;
+    drop(options);
+    // every job is completed, so this is the only reference left
+    let exporter = match Arc::try_unwrap(exporter) {
+        Ok(exporter) => exporter.into_inner().unwrap(),
+        Err(_) => unreachable!("export still in use after the analysis"),
+    };
+    let functions = exporter.functions;
+    if let Err(error) = exporter.writer.finish() {
+        eprintln!("Failed to write {}: {}", args.output, error);
+        std::process::exit(1);
+    }
+    eprintln!(
+        "Exported {} functions of {} binaries to {}",
+        functions,
+        analysis_result.binaries.len(),
+        args.output
+    );
+    for (binary, reason) in analysis_result.skipped {
+        eprintln!("Skipped {} ({})", binary, reason);
+    }
+}
+
+async fn bench(args: BenchArgs) {
+    let sessions = args
+        .replay
+        .as_ref()
+        .map(|dir| Arc::new(Sessions::replay(dir, args.replay_latency)));
+    let cross_arch = if let Some(semtype) = args.architecture {
+        semtype == SemanticAnalysisType::Cross
+    } else {
+        eprint!("Selecting semantic analysis type... ");
+        let cross_arch = !same_arch(&args.input, sessions.as_deref()).await;
+        eprintln!("Done");
+        cross_arch
+    };
+    let limits = if args.limits.is_empty() {
+        bench::default_limits(num_cpus::get())
+    } else {
+        args.limits
+    };
+    let mut levels = Vec::with_capacity(limits.len());
+    for limit in limits {
+        eprintln!("Analysing {} binaries at a time", limit);
+        let options = AnalysisOptions {
+            limit_concurrent: limit,
+            timeout: args.timeout,
+            libdb: None,
+            disable_structural: args.disable_structural,
+            disable_semantic: args.disable_semantic,
+            export: None,
+            slowest: Slowest::new(0, false),
+            sessions: sessions.clone(),
+        };
+        bench::reset_peak_rss();
+        let cpu_start = bench::cpu_time();
+        let start_t = Instant::now();
+        let analysis_result =
+            analyse(&args.input, &options, cross_arch, Sampling::default(), None).await;
+        let wall = start_t.elapsed();
+        let cpu = cpu_start
+            .zip(bench::cpu_time())
+            .map(|(start, end)| end.saturating_sub(start));
+        let binaries = &analysis_result.metrics.binaries;
+        levels.push(BenchLevel::new(
+            limit,
+            binaries,
+            wall,
+            cpu,
+            metrics::peak_rss(),
+            bench::children_peak_rss(),
+        ));
+    }
+    if let Err(error) = bench::write_table(&mut std::io::stdout().lock(), &levels) {
+        eprintln!("Failed to write the results: {}", error);
+        std::process::exit(1);
+    }
+}
+
+// state of the `serve` command, shared by all the connections
+struct Server {
+    index: RwLock<ServeIndex>,
+    // interners kept between the requests, so ids are stable for the whole server lifetime
+    string_cache: StringCache,
+    opcode_cache: OpcodeCache,
+    libdb: Option<Arc<LibraryDB>>,
+    // a permit for each binary that can be analysed concurrently
+    slots: Semaphore,
+    limit_concurrent: usize,
+    stats: ServeStats,
+    cross_arch: bool,
+    disable_semantic: bool,
+    timeout: u64,
+}
+
+impl Server {
+    fn new(
+        min_depth: u32,
+        min_similarity: Option<f32>,
+        architecture: SemanticAnalysisType,
+        limit_concurrent: usize,
+        timeout: u64,
+        libdb: Option<&str>,
+    ) -> Server {
+        Server {
+            index: RwLock::new(ServeIndex::new(min_depth, min_similarity)),
+            string_cache: Arc::new(Mutex::new(HashMap::new())),
+            opcode_cache: Arc::new(Mutex::new(HashMap::new())),
+            libdb: libdb.map(load_libdb),
+            slots: Semaphore::new(limit_concurrent),
+            limit_concurrent,
+            stats: ServeStats::default(),
+            cross_arch: architecture == SemanticAnalysisType::Cross,
+            disable_semantic: min_similarity.is_none(),
+            timeout,
+        }
+    }
+}
+
+async fn serve(args: ServeArgs) {
+    let min_similarity = if args.disable_semantic {
+        None
+    } else {
+        Some(args.min_similarity)
+    };
+    let server = Arc::new(Server::new(
+        args.min_depth,
+        min_similarity,
+        args.architecture,
+        args.limit_concurrent,
+        args.timeout,
+        args.libdb.as_deref(),
+    ));
+    // each analysis is spawned, so they run in parallel up to the limit of slots
+    let mut tasks = args
+        .input
+        .into_iter()
+        .map(|job| {
+            let server = Arc::clone(&server);
+            tokio::spawn(async move { (serve_analyse(&server, job.clone()).await, job) })
+        })
+        .collect::<FuturesUnordered<_>>();
+    while let Some(joined) = tasks.next().await {
+        match joined {
+            Ok((Err(reason), job)) => eprintln!("Skipped {} ({})", job, reason),
+            Ok((Ok(_), _)) => {}
+            Err(error) => eprintln!("Analysis crashed: {}", error),
+        }
+    }
+    {
+        let index = server.index.read().unwrap();
+        eprintln!(
+            "Indexed {} binaries, {} functions",
+            index.binaries(),
+            index.functions()
+        );
+    }
+    // a leftover socket is replaced, unless another server is still listening on it
+    let stale = std::fs::metadata(&args.socket)
+        .map(|meta| meta.file_type().is_socket())
+        .unwrap_or(false);
+    if stale && std::os::unix::net::UnixStream::connect(&args.socket).is_err() {
+        let _ = std::fs::remove_file(&args.socket);
+    }
+    let listener = match UnixListener::bind(&args.socket) {
+        Ok(listener) => listener,
+        Err(error) => {
+            eprintln!("Failed to listen on {}: {}", args.socket, error);
+            std::process::exit(1);
+        }
+    };
+    eprintln!("Listening on {}", args.socket);
+    loop {
+        match listener.accept().await {
+            Ok((stream, _)) => {
+                tokio::spawn(serve_connection(Arc::clone(&server), stream));
+            }
+            Err(error) => eprintln!("Failed to accept a connection: {}", error),
+        }
+    }
+}
+
+async fn watch(args: WatchArgs) {
+    if !Path::new(&args.dir).is_dir() {
+        eprintln!("{} is not a directory", args.dir);
+        std::process::exit(1);
+    }
+    let mut output: Box<dyn Write> = match &args.output {
+        Some(path) => match OpenOptions::new().create(true).append(true).open(path) {
+            Ok(file) => Box::new(file),
+            Err(error) => {
+                eprintln!("Failed to open {}: {}", path, error);
+                std::process::exit(1);
+            }
+        },
+        None => Box::new(std::io::stdout()),
+    };
+    let min_similarity = if args.disable_semantic {
+        None
+    } else {
+        Some(args.min_similarity)
+    };
+    let server = Arc::new(Server::new(
+        args.min_depth,
+        min_similarity,
+        args.architecture,
+        args.limit_concurrent,
+        args.timeout,
+        args.libdb.as_deref(),
+    ));
+    let mut scanner = Scanner::new(&args.dir, Duration::from_secs(args.debounce));
+    let mut poll = tokio::time::interval(Duration::from_millis(args.poll_interval));
+    poll.set_missed_tick_behavior(MissedTickBehavior::Delay);
+    // fingerprints of the classes already written, with the binaries they contain. A class
+    // gaining a clone is written again, and the classes of a removed or replaced binary are
+    // forgotten, so the set does not grow with every version of a binary
+    let mut reported = FnvHashMap::<u64, Vec<u32>>::default();
+    let mut classes = 0;
+    let mut tasks = FuturesUnordered::new();
+    loop {
+        tokio::select! {
+            _ = poll.tick() => {
+                let changes = match scanner.scan(Instant::now()) {
+                    Ok(changes) => changes,
+                    Err(error) => {
+                        eprintln!("Failed to scan {}: {}", args.dir, error);
+                        continue;
+                    }
+                };
+                for path in changes.removed {
+                    let job = path.to_string_lossy().into_owned();
+                    let id = server.string_cache.lock().unwrap().get(&job).copied();
+                    if let Some(bin) = id {
+                        server.index.write().unwrap().remove(bin);
+                        reported.retain(|_, bins| !bins.contains(&bin));
+                    }
+                }
+                // a slot is acquired by each analysis, so the analyses beyond the limit wait
+                for path in changes.ready {
+                    let job = path.to_string_lossy().into_owned();
+                    let server = Arc::clone(&server);
+                    tasks.push(tokio::spawn(async move {
+                        (serve_analyse(&server, job.clone()).await, job)
+                    }));
+                }
+            }
+            Some(joined) = tasks.next() => {
+                let ((bin, functions), job) = match joined {
+                    Ok((Ok(analysed), job)) => (analysed, job),
+                    Ok((Err(reason), job)) => {
+                        eprintln!("Skipped {} ({})", job, reason);
+                        continue;
+                    }
+                    Err(error) => {
+                        eprintln!("Analysis crashed: {}", error);
+                        continue;
+                    }
+                };
+                // the binary may have replaced a previous version, whose classes are stale
+                reported.retain(|_, bins| !bins.contains(&bin));
+                let index = server.index.read().unwrap();
+                let mut written = 0;
+                for class in index.clones(bin) {
+                    let bins = class.clones.iter().map(|clone| clone.binary.id).collect();
+                    if reported.insert(class.fingerprint(), bins).is_none() {
+                        classes += 1;
+                        report::write_json_class(&mut output, &class, classes, false)
+                            .and_then(|_| output.write_all(b"\n"))
+                            .and_then(|_| output.flush())
+                            .unwrap_or_else(|error| {
+                                eprintln!("Failed to write the clone classes: {}", error);
+                                std::process::exit(1);
+                            });
+                        written += 1;
+                    }
+                }
+                eprintln!(
+                    "Analysed {} ({} functions, {} new clone classes)",
+                    job, functions, written
+                );
+            }
+        }
+    }
+}
+
+// answers the requests of a client until it disconnects
+async fn serve_connection(server: Arc<Server>, mut stream: UnixStream) {
+    loop {
+        let payload = match serve::read_frame(&mut stream).await {
+            Ok(Some(payload)) => payload,
+            Ok(None) => break,
+            Err(error) => {
+                eprintln!("Failed to read a request: {}", error);
+                break;
+            }
+        };
+        let start_t = Instant::now();
+        let mut response = Vec::new();
+        let kind = match Request::parse(&payload) {
+            Ok(request) => {
+                let kind = request.kind();
+                serve_request(&server, request, &mut response)
+                    .await
+                    .unwrap();
+                Some(kind)
+            }
+            Err(error) => {
+                serve::write_error(&mut response, &error).unwrap();
+                None
+            }
+        };
+        if let Err(error) = serve::write_frame(&mut stream, &response).await {
+            eprintln!("Failed to send a response: {}", error);
+            break;
+        }
+        if let Some(kind) = kind {
+            server.stats.record(kind, start_t.elapsed());
+        }
+    }
+}
+
+// writes the response to a request in the buffer
+async fn serve_request(
+    server: &Server,
+    request: Request,
+    out: &mut Vec<u8>,
+) -> Result<(), std::io::Error> {
+    match request {
+        Request::Analyse(job) => match serve_analyse(server, job).await {
+            Ok((bin, functions)) => {
+                let index = server.index.read().unwrap();
+                let classes = index.clones(bin);
+                serve::write_clones(out, index.binary(bin).unwrap(), functions, &classes)
+            }
+            Err(reason) => serve::write_error(out, reason),
+        },
+        Request::TopK {
+            binary,
+            function,
+            k,
+        } => {
+            let ids = {
+                let cache = server.string_cache.lock().unwrap();
+                cache
+                    .get(&binary)
+                    .copied()
+                    .zip(cache.get(&function).copied())
+            };
+            let index = server.index.read().unwrap();
+            match ids.and_then(|(bin, func)| index.top_k(bin, func, k)) {
+                Some(neighbours) => serve::write_neighbours(out, &index, &neighbours),
+                None => serve::write_error(out, "function not indexed"),
+            }
+        }
+        Request::Metrics => {
+            let index = server.index.read().unwrap();
+            server
+                .stats
+                .write_json(out, server.limit_concurrent, &index)
+        }
+    }
+}
+
+// analyses a binary as soon as a slot is free and adds it to the index.
+// Returns the id of the binary and its amount of functions.
+async fn serve_analyse(server: &Server, job: String) -> Result<(u32, usize), &'static str> {
+    server.stats.waiting.fetch_add(1, Ordering::Relaxed);
+    let permit = server.slots.acquire().await;
+    server.stats.waiting.fetch_sub(1, Ordering::Relaxed);
+    server.stats.running.fetch_add(1, Ordering::Relaxed);
+    let result = gather_analysis_data_job(
+        job,
+        Arc::new(ProgressBar::hidden()),
+        Arc::clone(&server.string_cache),
+        Arc::clone(&server.opcode_cache),
+        server.libdb.clone(),
+        Sampling::default(),
+        false,
+        server.disable_semantic,
+        server.timeout,
+        server.cross_arch,
+        None,
+        Slowest::new(0, false),
+        None,
+    )
+    .await;
+    server.stats.running.fetch_sub(1, Ordering::Relaxed);
+    drop(permit);
+    match (result.failure, result.info) {
+        (None, Some(info)) => {
+            let bin = info.id;
+            let functions = result
+                .functions
+                .into_iter()
+                .map(|res| (res.func, res.cfs, res.fvec))
+                .collect::<Vec<_>>();
+            let amount = functions.len();
+            let mut index = server.index.write().unwrap();
+            index.update_names(&server.string_cache.lock().unwrap());
+            index.insert(info, functions);
+            Ok((bin, amount))
+        }
+        (failure, _) => Err(failure.unwrap_or("disassembler error")),
     }
-    pb.inc(1);
-    result
 }
@@ -0,0 +1,348 @@
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::cell::Cell;
+#[cfg(any(feature = "alloc-profile", test))]
+use std::future::poll_fn;
+use std::future::Future;
+#[cfg(any(feature = "alloc-profile", test))]
+use std::pin::{pin, Pin};
+use std::sync::atomic::{AtomicI64, AtomicU64, Ordering};
+use std::sync::Arc;
+#[cfg(any(feature = "alloc-profile", test))]
+use std::task::{Context, Poll};
+
+/// Stages of the pipeline the allocations are attributed to.
+///
+/// `other` contains everything happening outside the other stages, `disassembler` the commands
+/// sent to the disassembler and the parsing of their output.
+pub const ALLOC_STAGES: [&str; 7] = [
+    "other",
+    "disassembler",
+    "cfg",
+    "cfs",
+    "fvec",
+    "structural",
+    "semantic",
+];
+/// Index of the `other` stage in [ALLOC_STAGES].
+pub const OTHER: usize = 0;
+/// Index of the `disassembler` stage in [ALLOC_STAGES].
+pub const DISASSEMBLER: usize = 1;
+/// Index of the `cfg` stage in [ALLOC_STAGES].
+pub const CFG: usize = 2;
+/// Index of the `cfs` stage in [ALLOC_STAGES].
+pub const CFS: usize = 3;
+/// Index of the `fvec` stage in [ALLOC_STAGES].
+pub const FVEC: usize = 4;
+/// Index of the `structural` stage in [ALLOC_STAGES].
+pub const STRUCTURAL: usize = 5;
+/// Index of the `semantic` stage in [ALLOC_STAGES].
+pub const SEMANTIC: usize = 6;
+
+/// Allocations attributed to a single stage.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct AllocStats {
+    /// Amount of allocations, including reallocations.
+    pub count: u64,
+    /// Bytes allocated, never decreased by deallocations.
+    pub bytes: u64,
+    /// Highest amount of live bytes observed while allocating in this stage.
+    pub peak: u64,
+}
+
+/// Allocations of each stage, in the same order of [ALLOC_STAGES].
+pub type AllocReport = [AllocStats; ALLOC_STAGES.len()];
+
+#[derive(Default)]
+struct StageCounters {
+    count: AtomicU64,
+    bytes: AtomicU64,
+    peak: AtomicU64,
+}
+
+/// Counters of the allocations of each stage, updated by the [CountingAllocator].
+#[derive(Default)]
+pub struct AllocCounters {
+    stages: [StageCounters; ALLOC_STAGES.len()],
+    // bytes allocated and not yet deallocated. Can be negative for a single binary, if it frees
+    // memory allocated elsewhere
+    live: AtomicI64,
+}
+
+impl AllocCounters {
+    const fn new() -> AllocCounters {
+        // only used to initialize the array, each element is a distinct copy
+        #[allow(clippy::declare_interior_mutable_const)]
+        const EMPTY: StageCounters = StageCounters {
+            count: AtomicU64::new(0),
+            bytes: AtomicU64::new(0),
+            peak: AtomicU64::new(0),
+        };
+        AllocCounters {
+            stages: [EMPTY; ALLOC_STAGES.len()],
+            live: AtomicI64::new(0),
+        }
+    }
+
+    fn alloc(&self, stage: usize, size: usize) {
+        let live = self.live.fetch_add(size as i64, Ordering::Relaxed) + size as i64;
+        let counters = &self.stages[stage];
+        counters.count.fetch_add(1, Ordering::Relaxed);
+        counters.bytes.fetch_add(size as u64, Ordering::Relaxed);
+        counters
+            .peak
+            .fetch_max(live.max(0) as u64, Ordering::Relaxed);
+    }
+
+    fn dealloc(&self, size: usize) {
+        self.live.fetch_sub(size as i64, Ordering::Relaxed);
+    }
+
+    /// Returns the allocations counted so far.
+    pub fn report(&self) -> AllocReport {
+        let mut report = AllocReport::default();
+        for (stats, counters) in report.iter_mut().zip(&self.stages) {
+            stats.count = counters.count.load(Ordering::Relaxed);
+            stats.bytes = counters.bytes.load(Ordering::Relaxed);
+            stats.peak = counters.peak.load(Ordering::Relaxed);
+        }
+        report
+    }
+}
+
+// allocations of the whole process
+static GLOBAL: AllocCounters = AllocCounters::new();
+
+thread_local! {
+    // stage currently running on this thread
+    static STAGE: Cell<usize> = const { Cell::new(0) };
+    // counters of the binary whose task is currently running on this thread, or null
+    static BINARY: Cell<*const AllocCounters> = const { Cell::new(std::ptr::null()) };
+}
+
+/// Returns true if the [CountingAllocator] is the global allocator.
+///
+/// This happens only if bincc was built with the `alloc-profile` feature.
+pub fn is_enabled() -> bool {
+    cfg!(feature = "alloc-profile")
+}
+
+/// Returns the allocations of the whole process.
+pub fn report() -> AllocReport {
+    GLOBAL.report()
+}
+
+/// Allocator counting the allocations of each stage, for the process and for each binary.
+///
+/// Wraps the system allocator, and is the global allocator only if bincc was built with the
+/// `alloc-profile` feature.
+pub struct CountingAllocator;
+
+impl CountingAllocator {
+    fn record_alloc(size: usize) {
+        let stage = STAGE.try_with(|stage| stage.get()).unwrap_or(0);
+        GLOBAL.alloc(stage, size);
+        if let Some(binary) = current_binary() {
+            binary.alloc(stage, size);
+        }
+    }
+
+    fn record_dealloc(size: usize) {
+        GLOBAL.dealloc(size);
+        if let Some(binary) = current_binary() {
+            binary.dealloc(size);
+        }
+    }
+}
+
+// the counters set by InBinary, valid for as long as the future is being polled
+fn current_binary() -> Option<&'static AllocCounters> {
+    let binary = BINARY.try_with(|binary| binary.get()).ok()?;
+    // SAFETY: the pointer is set only by InBinary::poll, that holds an Arc to the counters and
+    // restores the previous value before returning
+    unsafe { binary.as_ref() }
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        let ptr = System.alloc(layout);
+        if !ptr.is_null() {
+            CountingAllocator::record_alloc(layout.size());
+        }
+        ptr
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        let ptr = System.alloc_zeroed(layout);
+        if !ptr.is_null() {
+            CountingAllocator::record_alloc(layout.size());
+        }
+        ptr
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout);
+        CountingAllocator::record_dealloc(layout.size());
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let new_ptr = System.realloc(ptr, layout, new_size);
+        if !new_ptr.is_null() {
+            CountingAllocator::record_dealloc(layout.size());
+            CountingAllocator::record_alloc(new_size);
+        }
+        new_ptr
+    }
+}
+
+/// Attributes the allocations of the current thread to a stage, until dropped.
+///
+/// Without the `alloc-profile` feature this is empty and does nothing.
+#[must_use = "the stage ends as soon as it is dropped"]
+pub struct StageGuard {
+    #[cfg(any(feature = "alloc-profile", test))]
+    previous: usize,
+}
+
+#[cfg(any(feature = "alloc-profile", test))]
+impl Drop for StageGuard {
+    fn drop(&mut self) {
+        exit(self.previous);
+    }
+}
+
+/// Starts a stage, at the given index of [ALLOC_STAGES].
+///
+/// The stage must not span an `.await`, as the task may continue on another thread.
+#[cfg(any(feature = "alloc-profile", test))]
+#[inline]
+pub fn stage(index: usize) -> StageGuard {
+    StageGuard {
+        previous: enter(index),
+    }
+}
+
+/// Does nothing, as nothing is counted without the `alloc-profile` feature.
+#[cfg(not(any(feature = "alloc-profile", test)))]
+#[inline]
+pub fn stage(_index: usize) -> StageGuard {
+    StageGuard {}
+}
+
+/// Starts a stage, at the given index of [ALLOC_STAGES], returning the stage to restore with
+/// [exit].
+#[inline]
+pub fn enter(index: usize) -> usize {
+    STAGE.try_with(|stage| stage.replace(index)).unwrap_or(0)
+}
+
+/// Ends a stage started by [enter], restoring the previous one.
+#[inline]
+pub fn exit(previous: usize) {
+    let _ = STAGE.try_with(|stage| stage.set(previous));
+}
+
+/// Runs a future spanning several `.await`, attributing its allocations to a stage.
+///
+/// The stage is started again each time the future is polled, and ended before returning.
+#[cfg(any(feature = "alloc-profile", test))]
+pub async fn in_stage<F: Future>(index: usize, future: F) -> F::Output {
+    let mut future = pin!(future);
+    poll_fn(|cx| {
+        let _stage = stage(index);
+        future.as_mut().poll(cx)
+    })
+    .await
+}
+
+/// Returns the future unchanged, as nothing is counted without the `alloc-profile` feature.
+#[cfg(not(any(feature = "alloc-profile", test)))]
+#[inline]
+pub fn in_stage<F: Future>(_index: usize, future: F) -> F {
+    future
+}
+
+/// Runs the analysis of a binary, attributing its allocations to the given counters too.
+///
+/// Allocations are attributed to the `stage` while the future is running, unless another
+/// stage is started with [stage].
+#[cfg(any(feature = "alloc-profile", test))]
+pub fn in_binary<F: Future>(counters: Arc<AllocCounters>, stage: usize, future: F) -> InBinary<F> {
+    InBinary {
+        counters,
+        stage,
+        inner: Box::pin(future),
+    }
+}
+
+/// Returns the future unchanged, as nothing is counted without the `alloc-profile` feature.
+#[cfg(not(any(feature = "alloc-profile", test)))]
+#[inline]
+pub fn in_binary<F: Future>(_counters: Arc<AllocCounters>, _stage: usize, future: F) -> F {
+    future
+}
+
+/// Future returned by [in_binary].
+#[cfg(any(feature = "alloc-profile", test))]
+pub struct InBinary<F> {
+    counters: Arc<AllocCounters>,
+    stage: usize,
+    inner: Pin<Box<F>>,
+}
+
+#[cfg(any(feature = "alloc-profile", test))]
+impl<F: Future> Future for InBinary<F> {
+    type Output = F::Output;
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let counters = Arc::as_ptr(&self.counters);
+        let previous_binary = BINARY.with(|binary| binary.replace(counters));
+        let previous_stage = STAGE.with(|stage| stage.replace(self.stage));
+        let result = self.inner.as_mut().poll(cx);
+        STAGE.with(|stage| stage.set(previous_stage));
+        BINARY.with(|binary| binary.set(previous_binary));
+        result
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{in_binary, stage, AllocCounters, CountingAllocator, CFS, DISASSEMBLER};
+    use std::alloc::{GlobalAlloc, Layout};
+    use std::sync::Arc;
+
+    // the allocator is called directly, so this works without the alloc-profile feature
+    #[tokio::test]
+    async fn attribution() {
+        let counters = Arc::new(AllocCounters::default());
+        let layout = Layout::from_size_align(1000, 8).unwrap();
+        let allocator = CountingAllocator;
+        in_binary(Arc::clone(&counters), DISASSEMBLER, async {
+            unsafe {
+                let a = allocator.alloc(layout);
+                let b = {
+                    let _stage = stage(CFS);
+                    allocator.alloc(layout)
+                };
+                allocator.dealloc(a, layout);
+                let c = allocator.realloc(b, layout, 3000);
+                allocator.dealloc(c, Layout::from_size_align(3000, 8).unwrap());
+            }
+        })
+        .await;
+        let report = counters.report();
+        assert_eq!(report[CFS].count, 1);
+        assert_eq!(report[CFS].bytes, 1000);
+        assert_eq!(report[CFS].peak, 2000);
+        // the realloc happened after leaving the cfs stage
+        assert_eq!(report[DISASSEMBLER].count, 2);
+        assert_eq!(report[DISASSEMBLER].bytes, 4000);
+        assert_eq!(report[DISASSEMBLER].peak, 3000);
+        assert_eq!(report[0].count, 0);
+        // outside the binary nothing is counted
+        unsafe {
+            let d = allocator.alloc(layout);
+            allocator.dealloc(d, layout);
+        }
+        assert_eq!(counters.report(), report);
+    }
+}
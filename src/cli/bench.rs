@@ -0,0 +1,287 @@
+use crate::cli::metrics::BinaryMetrics;
+use std::io::{self, Write};
+use std::time::Duration;
+
+// clock ticks per second of the times in /proc/self/stat, fixed to 100 by the Linux ABI
+const USER_HZ: u64 = 100;
+
+/// Resources used by the analysis of the whole corpus at a single concurrency level.
+#[derive(Debug, Clone, Default)]
+pub struct BenchLevel {
+    /// Maximum amount of binaries analysed concurrently.
+    pub limit: usize,
+    /// Wall time spent analysing the corpus.
+    pub wall: Duration,
+    /// CPU time (user and system) spent by the whole process and by the disassembler processes,
+    /// if available.
+    pub cpu: Option<Duration>,
+    /// Peak resident memory of the process, in KiB, if available.
+    pub peak_rss: Option<u64>,
+    /// Peak resident memory of the largest disassembler process, in KiB, if available.
+    pub children_peak_rss: Option<u64>,
+    /// Amount of binaries that could not be analysed.
+    pub failed: usize,
+    /// Amount of analysed functions.
+    pub functions: usize,
+    /// Time spent waiting for the disassembler, summed over all the binaries.
+    pub disassembler: Duration,
+    /// Time spent building the CFGs, CFSs and feature vectors, summed over all the binaries.
+    pub stages: [Duration; 3],
+}
+
+impl BenchLevel {
+    /// Summarizes the metrics of the binaries analysed at the given concurrency level.
+    pub fn new(
+        limit: usize,
+        binaries: &[BinaryMetrics],
+        wall: Duration,
+        cpu: Option<Duration>,
+        peak_rss: Option<u64>,
+        children_peak_rss: Option<u64>,
+    ) -> BenchLevel {
+        let mut level = BenchLevel {
+            limit,
+            wall,
+            cpu,
+            peak_rss,
+            children_peak_rss,
+            ..Default::default()
+        };
+        for binary in binaries {
+            level.failed += binary.failure.is_some() as usize;
+            level.functions += binary.functions;
+            level.disassembler += binary.spawn;
+            level.disassembler += binary
+                .commands
+                .values()
+                .map(|cmd| cmd.elapsed)
+                .sum::<Duration>();
+            level.stages[0] += binary.cfg;
+            level.stages[1] += binary.cfs;
+            level.stages[2] += binary.fvec;
+        }
+        level
+    }
+
+    /// Returns the amount of functions analysed per second of wall time.
+    pub fn throughput(&self) -> f64 {
+        rate(self.functions, self.wall)
+    }
+
+    /// Returns the average amount of cores busy during the analysis.
+    pub fn cpu_utilization(&self) -> Option<f64> {
+        self.cpu
+            .map(|cpu| cpu.as_secs_f64() / self.wall.as_secs_f64().max(f64::EPSILON))
+    }
+}
+
+// amount of elements per second, 0 if no time was spent
+fn rate(elements: usize, elapsed: Duration) -> f64 {
+    if elapsed.is_zero() {
+        0.0
+    } else {
+        elements as f64 / elapsed.as_secs_f64()
+    }
+}
+
+/// Returns the default concurrency levels: the powers of two up to the amount of cpus, plus the
+/// amount of cpus itself.
+pub fn default_limits(cpus: usize) -> Vec<usize> {
+    let mut limits = std::iter::successors(Some(1_usize), |limit| limit.checked_mul(2))
+        .take_while(|limit| *limit < cpus)
+        .collect::<Vec<_>>();
+    limits.push(cpus.max(1));
+    limits
+}
+
+/// Returns the CPU time spent so far by the process and by its terminated children, if available.
+///
+/// The children are the disassembler processes, and their time is counted once they have been
+/// waited for.
+pub fn cpu_time() -> Option<Duration> {
+    let stat = std::fs::read_to_string("/proc/self/stat").ok()?;
+    // the process name may contain spaces, so the fields are counted after its closing bracket.
+    // utime, stime, cutime and cstime are the fields from the 14th to the 17th, from the 12th to
+    // the 15th after the name.
+    let fields = stat
+        .get(stat.rfind(')')? + 1..)?
+        .split_whitespace()
+        .skip(11)
+        .take(4)
+        .map(|field| field.parse::<u64>().ok())
+        .collect::<Option<Vec<_>>>()?;
+    if fields.len() != 4 {
+        return None;
+    }
+    let ticks = fields.iter().sum::<u64>();
+    Some(Duration::from_millis(ticks * 1000 / USER_HZ))
+}
+
+/// Returns the peak resident memory of the largest terminated child process, in KiB, if available.
+///
+/// Unlike the one of the process, this cannot be reset, so it is the peak of all the children
+/// waited for since the process started.
+#[cfg(unix)]
+pub fn children_peak_rss() -> Option<u64> {
+    let mut usage = std::mem::MaybeUninit::<libc::rusage>::zeroed();
+    // SAFETY: getrusage only writes the struct it is given, and it is initialized on success.
+    let usage = unsafe {
+        if libc::getrusage(libc::RUSAGE_CHILDREN, usage.as_mut_ptr()) != 0 {
+            return None;
+        }
+        usage.assume_init()
+    };
+    let maxrss = u64::try_from(usage.ru_maxrss).ok()?;
+    // reported in bytes on macOS and in KiB elsewhere
+    if cfg!(target_os = "macos") {
+        Some(maxrss / 1024)
+    } else {
+        Some(maxrss)
+    }
+}
+
+/// Returns the peak resident memory of the largest terminated child process, in KiB, if available.
+#[cfg(not(unix))]
+pub fn children_peak_rss() -> Option<u64> {
+    None
+}
+
+/// Resets the peak resident memory of the process, so it can be measured again.
+///
+/// Does nothing if not supported by the OS.
+pub fn reset_peak_rss() {
+    let _ = std::fs::write("/proc/self/clear_refs", "5");
+}
+
+/// Writes a table with the results of each concurrency level.
+///
+/// Speedup and efficiency are relative to the first level: an efficiency well below 1 means
+/// that adding concurrency no longer improves the throughput.
+pub fn write_table<W: Write>(out: &mut W, levels: &[BenchLevel]) -> Result<(), io::Error> {
+    writeln!(
+        out,
+        "{:>6} {:>9} {:>9} {:>8} {:>6} {:>6} {:>10} {:>10} {:>10} {:>10} {:>10} {:>9} {:>9}",
+        "limit",
+        "wall(s)",
+        "fn/s",
+        "speedup",
+        "eff",
+        "cores",
+        "r2(s)",
+        "local(s)",
+        "cfg fn/s",
+        "cfs fn/s",
+        "fvec fn/s",
+        "peak(MiB)",
+        "r2(MiB)"
+    )?;
+    let base = levels.first();
+    for level in levels {
+        let (speedup, efficiency) = match base {
+            Some(base) if base.throughput() > 0.0 => {
+                let speedup = level.throughput() / base.throughput();
+                (speedup, speedup * base.limit as f64 / level.limit as f64)
+            }
+            _ => (0.0, 0.0),
+        };
+        let optional = |value: Option<f64>, precision: usize| match value {
+            Some(value) => format!("{:.*}", precision, value),
+            None => "-".to_string(),
+        };
+        let local = level.stages.iter().sum::<Duration>();
+        writeln!(
+            out,
+            "{:>6} {:>9.2} {:>9.1} {:>8.2} {:>6.2} {:>6} {:>10.2} {:>10.2} {:>10.1} {:>10.1} {:>10.1} {:>9} {:>9}",
+            level.limit,
+            level.wall.as_secs_f64(),
+            level.throughput(),
+            speedup,
+            efficiency,
+            optional(level.cpu_utilization(), 2),
+            level.disassembler.as_secs_f64(),
+            local.as_secs_f64(),
+            rate(level.functions, level.stages[0]),
+            rate(level.functions, level.stages[1]),
+            rate(level.functions, level.stages[2]),
+            optional(level.peak_rss.map(|kib| kib as f64 / 1024.0), 1),
+            optional(level.children_peak_rss.map(|kib| kib as f64 / 1024.0), 1),
+        )?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{default_limits, write_table, BenchLevel};
+    use crate::cli::metrics::BinaryMetrics;
+    use bincc::disasm::radare2::CommandStats;
+    use std::time::Duration;
+
+    #[test]
+    fn limits() {
+        assert_eq!(default_limits(1), vec![1]);
+        assert_eq!(default_limits(6), vec![1, 2, 4, 6]);
+        assert_eq!(default_limits(8), vec![1, 2, 4, 8]);
+    }
+
+    #[test]
+    #[cfg(target_os = "linux")]
+    fn cpu_time_available() {
+        assert!(super::cpu_time().is_some());
+    }
+
+    #[test]
+    #[cfg(unix)]
+    fn children_counted() {
+        let cpu_start = super::cpu_time();
+        // burns some CPU in a child process, then waits for it
+        std::process::Command::new("sh")
+            .arg("-c")
+            .arg("i=0; while [ $i -lt 100000 ]; do i=$((i+1)); done")
+            .status()
+            .unwrap();
+        assert!(super::children_peak_rss().unwrap() > 0);
+        if let (Some(start), Some(end)) = (cpu_start, super::cpu_time()) {
+            assert!(end - start >= Duration::from_millis(50));
+        }
+    }
+
+    #[test]
+    fn levels_table() {
+        let mut binary = BinaryMetrics {
+            spawn: Duration::from_millis(100),
+            cfg: Duration::from_secs(1),
+            cfs: Duration::from_secs(2),
+            functions: 100,
+            ..Default::default()
+        };
+        let stats = CommandStats {
+            calls: 3,
+            elapsed: Duration::from_millis(400),
+        };
+        binary.commands.insert("aaa".to_string(), stats);
+        let failed = BinaryMetrics {
+            failure: Some("timeout"),
+            ..Default::default()
+        };
+        let binaries = [binary, failed];
+        let one = BenchLevel::new(1, &binaries, Duration::from_secs(4), None, None, None);
+        let cpu = Some(Duration::from_secs(6));
+        let rss = (Some(2048), Some(4096));
+        let four = BenchLevel::new(4, &binaries, Duration::from_secs(2), cpu, rss.0, rss.1);
+        assert_eq!(one.failed, 1);
+        assert_eq!(one.functions, 100);
+        assert_eq!(one.disassembler, Duration::from_millis(500));
+        assert_eq!(four.throughput(), 50.0);
+        assert_eq!(four.cpu_utilization(), Some(3.0));
+        let mut out = Vec::new();
+        write_table(&mut out, &[one, four]).unwrap();
+        let table = String::from_utf8(out).unwrap();
+        let rows = table.lines().collect::<Vec<_>>();
+        assert_eq!(rows.len(), 3);
+        // half the throughput of the ideal scaling, and the fvec stage never ran
+        assert!(rows[2].starts_with("     4      2.00      50.0     2.00   0.50   3.00"));
+        assert!(rows[2].ends_with("100.0       50.0        0.0       2.0       4.0"));
+        assert!(rows[1].ends_with("-"));
+    }
+}
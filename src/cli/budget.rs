@@ -0,0 +1,91 @@
+use std::fs;
+use std::time::{Duration, Instant};
+
+/// Wall-clock budget shared by the whole analysis.
+///
+/// The budget learns the disassembly throughput (in bytes per second) from the binaries already
+/// analysed, and uses it to predict whether the next binary can complete before the deadline.
+pub struct Budget {
+    deadline: Instant,
+    bytes_done: u64,
+    time_done: Duration,
+}
+
+impl Budget {
+    /// Creates a new budget expiring at the given instant.
+    pub fn new(deadline: Instant) -> Budget {
+        Budget {
+            deadline,
+            bytes_done: 0,
+            time_done: Duration::ZERO,
+        }
+    }
+
+    /// Returns the instant when the budget expires.
+    pub fn deadline(&self) -> Instant {
+        self.deadline
+    }
+
+    /// Records the time spent analysing a binary of the given size.
+    pub fn record(&mut self, size: u64, elapsed: Duration) {
+        self.bytes_done += size;
+        self.time_done += elapsed;
+    }
+
+    /// Returns true if a binary of the given size is expected to complete before the deadline.
+    ///
+    /// Until the first binary completes there is no estimate, so any binary is accepted as long
+    /// as the deadline is not expired.
+    pub fn fits(&self, size: u64) -> bool {
+        let remaining = self.deadline.saturating_duration_since(Instant::now());
+        if remaining.is_zero() {
+            false
+        } else if self.bytes_done == 0 || self.time_done.is_zero() {
+            true
+        } else {
+            let throughput = self.bytes_done as f64 / self.time_done.as_secs_f64();
+            Duration::from_secs_f64(size as f64 / throughput) <= remaining
+        }
+    }
+}
+
+/// Returns the size of a file, or 0 if the file can not be read.
+pub fn file_size(path: &str) -> u64 {
+    fs::metadata(path).map(|m| m.len()).unwrap_or(0)
+}
+
+/// Sorts the binaries by expected value per cost, highest first.
+///
+/// The value of a binary (its amount of functions) grows roughly linearly with its size, while
+/// the cost of the disassembler analysis grows faster than linearly, so smaller binaries yield
+/// more functions per second and are analysed first.
+pub fn prioritize(input: &mut [String]) {
+    input.sort_by_cached_key(|path| file_size(path));
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Budget;
+    use std::time::{Duration, Instant};
+
+    #[test]
+    fn budget_no_estimate() {
+        let budget = Budget::new(Instant::now() + Duration::from_secs(60));
+        assert!(budget.fits(u64::MAX));
+    }
+
+    #[test]
+    fn budget_expired() {
+        let budget = Budget::new(Instant::now());
+        assert!(!budget.fits(0));
+    }
+
+    #[test]
+    fn budget_estimate() {
+        let mut budget = Budget::new(Instant::now() + Duration::from_secs(60));
+        // 1000 bytes per second
+        budget.record(10_000, Duration::from_secs(10));
+        assert!(budget.fits(1_000));
+        assert!(!budget.fits(1_000_000));
+    }
+}
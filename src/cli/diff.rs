@@ -0,0 +1,358 @@
+use crate::cli::report;
+use fnv::FnvHashMap;
+use std::cmp::Ordering;
+use std::error::Error;
+use std::io::{self, Write};
+use std::path::Path;
+
+/// Binary path and function name of a clone.
+pub type Member = (String, String);
+
+/// A clone class read from a JSON Lines report.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct SavedClass {
+    /// Fingerprint of the class, as written in the report.
+    pub fingerprint: u64,
+    /// Structural depth of the class.
+    pub depth: u32,
+    /// Binary path and function name of each clone, sorted.
+    pub members: Vec<Member>,
+}
+
+/// A class of the old report whose members or depth changed in the new one.
+///
+/// A class with the same members at a different depth has no added or removed members.
+pub struct ChangedClass<'a> {
+    /// The class in the old report.
+    pub old: &'a SavedClass,
+    /// The class in the new report.
+    pub new: &'a SavedClass,
+    /// Members only in the new class.
+    pub added: Vec<&'a Member>,
+    /// Members only in the old class.
+    pub removed: Vec<&'a Member>,
+}
+
+/// Differences between two reports.
+pub struct ReportDiff<'a> {
+    /// Classes only in the new report, not matching any class of the old one.
+    pub appeared: Vec<&'a SavedClass>,
+    /// Classes only in the old report, not matching any class of the new one.
+    pub disappeared: Vec<&'a SavedClass>,
+    /// Classes of the old report that gained or lost members, or changed depth.
+    pub changed: Vec<ChangedClass<'a>>,
+    /// Amount of classes present in both reports.
+    pub unchanged: usize,
+}
+
+/// Reads the clone classes of a report written with `--format jsonl`.
+///
+/// If `root` is given, it is removed from the start of the binary paths and the fingerprints
+/// are calculated again, so reports of snapshots stored in different directories can be
+/// compared. Paths outside `root` are kept as they are.
+///
+/// The same functions can be clones at several depths, so the returned classes are sorted by
+/// fingerprint and depth, without duplicates of both.
+pub fn parse_jsonl(content: &str, root: Option<&Path>) -> Result<Vec<SavedClass>, Box<dyn Error>> {
+    let mut classes = Vec::new();
+    for (number, line) in content.lines().enumerate() {
+        if line.trim().is_empty() {
+            continue;
+        }
+        let invalid = || format!("invalid clone class at line {}", number + 1);
+        let value = serde_json::from_str::<serde_json::Value>(line)?;
+        let fingerprint = value["fingerprint"]
+            .as_str()
+            .and_then(|hex| u64::from_str_radix(hex, 16).ok())
+            .ok_or_else(invalid)?;
+        let depth = value["depth"].as_u64().ok_or_else(invalid)? as u32;
+        let mut members = value["clones"]
+            .as_array()
+            .ok_or_else(invalid)?
+            .iter()
+            .map(|clone| {
+                let binary = clone["binary"].as_str()?;
+                let function = clone["function"].as_str()?;
+                Some((relative(binary, root), function.to_string()))
+            })
+            .collect::<Option<Vec<_>>>()
+            .ok_or_else(invalid)?;
+        members.sort_unstable();
+        members.dedup();
+        let fingerprint = match root {
+            Some(_) => report::fingerprint(
+                members
+                    .iter()
+                    .map(|(binary, function)| (binary.as_str(), function.as_str())),
+            ),
+            None => fingerprint,
+        };
+        classes.push(SavedClass {
+            fingerprint,
+            depth,
+            members,
+        });
+    }
+    classes.sort_unstable_by_key(|class| (class.fingerprint, class.depth));
+    classes.dedup_by_key(|class| (class.fingerprint, class.depth));
+    Ok(classes)
+}
+
+// the path relative to the root, or the path itself if outside the root
+fn relative(path: &str, root: Option<&Path>) -> String {
+    root.and_then(|root| Path::new(path).strip_prefix(root).ok())
+        .and_then(Path::to_str)
+        .unwrap_or(path)
+        .to_string()
+}
+
+/// Compares the classes of two reports, both sorted by fingerprint and depth as returned by
+/// [`parse_jsonl`].
+///
+/// Classes with the same fingerprint and depth are matched in a single merge pass. Each
+/// remaining class of the new report is then paired with the remaining class of the old report
+/// sharing most of its members, preferring the same fingerprint, if any, and reported as
+/// changed.
+pub fn diff<'a>(old: &'a [SavedClass], new: &'a [SavedClass]) -> ReportDiff<'a> {
+    let mut old_only = Vec::new();
+    let mut new_only = Vec::new();
+    let mut unchanged = 0;
+    let (mut i, mut j) = (0, 0);
+    while i < old.len() && j < new.len() {
+        let key = |class: &SavedClass| (class.fingerprint, class.depth);
+        match key(&old[i]).cmp(&key(&new[j])) {
+            Ordering::Less => {
+                old_only.push(&old[i]);
+                i += 1;
+            }
+            Ordering::Greater => {
+                new_only.push(&new[j]);
+                j += 1;
+            }
+            Ordering::Equal => {
+                unchanged += 1;
+                i += 1;
+                j += 1;
+            }
+        }
+    }
+    old_only.extend(&old[i..]);
+    new_only.extend(&new[j..]);
+    // classes of the old report containing each member
+    let mut containing = FnvHashMap::<&Member, Vec<usize>>::default();
+    for (index, class) in old_only.iter().enumerate() {
+        for member in &class.members {
+            containing.entry(member).or_default().push(index);
+        }
+    }
+    let mut paired = vec![false; old_only.len()];
+    let mut appeared = Vec::new();
+    let mut changed = Vec::new();
+    for class in new_only {
+        let mut shared = FnvHashMap::<usize, usize>::default();
+        for member in &class.members {
+            for &index in containing.get(member).into_iter().flatten() {
+                if !paired[index] {
+                    *shared.entry(index).or_default() += 1;
+                }
+            }
+        }
+        // most shared members first, then same fingerprint, then lowest fingerprint and depth
+        let best = shared.into_iter().max_by_key(|&(index, count)| {
+            let same = old_only[index].fingerprint == class.fingerprint;
+            (count, same, std::cmp::Reverse(index))
+        });
+        match best {
+            Some((index, _)) => {
+                paired[index] = true;
+                let (added, removed) = member_changes(old_only[index], class);
+                changed.push(ChangedClass {
+                    old: old_only[index],
+                    new: class,
+                    added,
+                    removed,
+                });
+            }
+            None => appeared.push(class),
+        }
+    }
+    let disappeared = old_only
+        .into_iter()
+        .zip(paired)
+        .filter(|(_, paired)| !paired)
+        .map(|(class, _)| class)
+        .collect();
+    ReportDiff {
+        appeared,
+        disappeared,
+        changed,
+        unchanged,
+    }
+}
+
+// merge pass over the sorted members, returning the ones added and removed
+fn member_changes<'a>(
+    old: &'a SavedClass,
+    new: &'a SavedClass,
+) -> (Vec<&'a Member>, Vec<&'a Member>) {
+    let mut added = Vec::new();
+    let mut removed = Vec::new();
+    let (mut i, mut j) = (0, 0);
+    while i < old.members.len() && j < new.members.len() {
+        match old.members[i].cmp(&new.members[j]) {
+            Ordering::Less => {
+                removed.push(&old.members[i]);
+                i += 1;
+            }
+            Ordering::Greater => {
+                added.push(&new.members[j]);
+                j += 1;
+            }
+            Ordering::Equal => {
+                i += 1;
+                j += 1;
+            }
+        }
+    }
+    removed.extend(&old.members[i..]);
+    added.extend(&new.members[j..]);
+    (added, removed)
+}
+
+/// Writes the differences in human readable form.
+///
+/// Appeared classes are prefixed by `+`, disappeared classes by `-` and changed classes by `~`,
+/// followed by the members added and removed.
+pub fn write_diff<W: Write>(out: &mut W, diff: &ReportDiff) -> Result<(), io::Error> {
+    for (prefix, classes) in [("+", &diff.appeared), ("-", &diff.disappeared)] {
+        for class in classes {
+            writeln!(
+                out,
+                "{} {:016x} depth {}",
+                prefix, class.fingerprint, class.depth
+            )?;
+            for (binary, function) in &class.members {
+                writeln!(out, "    {} {}", binary, function)?;
+            }
+        }
+    }
+    for class in &diff.changed {
+        writeln!(
+            out,
+            "~ {:016x} -> {:016x} depth {} -> {}",
+            class.old.fingerprint, class.new.fingerprint, class.old.depth, class.new.depth
+        )?;
+        for (binary, function) in &class.added {
+            writeln!(out, "  + {} {}", binary, function)?;
+        }
+        for (binary, function) in &class.removed {
+            writeln!(out, "  - {} {}", binary, function)?;
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{diff, parse_jsonl, write_diff};
+    use std::path::Path;
+
+    fn line(fingerprint: u64, depth: u32, members: &[(&str, &str)]) -> String {
+        let clones = members
+            .iter()
+            .map(|(binary, function)| {
+                format!(
+                    "{{\"arch\":\"x86\",\"bits\":64,\"binary\":\"{}\",\"function\":\"{}\"}}",
+                    binary, function
+                )
+            })
+            .collect::<Vec<_>>()
+            .join(",");
+        format!(
+            "{{\"class\":0,\"fingerprint\":\"{:016x}\",\"depth\":{},\"clones\":[{}]}}\n",
+            fingerprint, depth, clones
+        )
+    }
+
+    #[test]
+    fn parse_sorted() {
+        let content = line(9, 4, &[("b", "g"), ("a", "f")]) + &line(2, 3, &[("a", "f")]);
+        let classes = parse_jsonl(&content, None).unwrap();
+        assert_eq!(classes.len(), 2);
+        assert_eq!(classes[0].fingerprint, 2);
+        assert_eq!(classes[1].depth, 4);
+        assert_eq!(classes[1].members[0], ("a".to_string(), "f".to_string()));
+        assert!(parse_jsonl("{\"depth\":3}", None).is_err());
+        assert!(parse_jsonl("not json", None).is_err());
+    }
+
+    #[test]
+    fn appeared_disappeared_changed() {
+        let old = parse_jsonl(
+            &(line(1, 3, &[("a", "f"), ("b", "f")])
+                + &line(2, 5, &[("a", "g"), ("b", "g"), ("c", "g")])
+                + &line(3, 4, &[("a", "h"), ("b", "h")])),
+            None,
+        )
+        .unwrap();
+        let new = parse_jsonl(
+            &(line(1, 3, &[("a", "f"), ("b", "f")])
+                + &line(4, 5, &[("a", "g"), ("b", "g"), ("d", "g")])
+                + &line(5, 3, &[("x", "y"), ("z", "y")])),
+            None,
+        )
+        .unwrap();
+        let diff = diff(&old, &new);
+        assert_eq!(diff.unchanged, 1);
+        assert_eq!(diff.appeared.len(), 1);
+        assert_eq!(diff.appeared[0].fingerprint, 5);
+        assert_eq!(diff.disappeared.len(), 1);
+        assert_eq!(diff.disappeared[0].fingerprint, 3);
+        assert_eq!(diff.changed.len(), 1);
+        let changed = &diff.changed[0];
+        assert_eq!((changed.old.fingerprint, changed.new.fingerprint), (2, 4));
+        assert_eq!(changed.added, vec![&("d".to_string(), "g".to_string())]);
+        assert_eq!(changed.removed, vec![&("c".to_string(), "g".to_string())]);
+        let mut out = Vec::new();
+        write_diff(&mut out, &diff).unwrap();
+        let text = String::from_utf8(out).unwrap();
+        assert!(text.starts_with("+ 0000000000000005 depth 3\n    x y\n"));
+        assert!(text.contains("~ 0000000000000002 -> 0000000000000004 depth 5 -> 5\n  + d g\n"));
+    }
+
+    #[test]
+    fn same_members_at_several_depths() {
+        let members = [("a", "f"), ("b", "f")];
+        let old = parse_jsonl(&(line(1, 3, &members) + &line(1, 5, &members)), None).unwrap();
+        assert_eq!(old.len(), 2);
+        // the deepest clone is gone, and another class got deeper
+        let new = parse_jsonl(&(line(1, 3, &members) + &line(1, 6, &members)), None).unwrap();
+        let diff = diff(&old, &new);
+        assert_eq!(diff.unchanged, 1);
+        assert!(diff.appeared.is_empty() && diff.disappeared.is_empty());
+        assert_eq!(diff.changed.len(), 1);
+        let changed = &diff.changed[0];
+        assert_eq!((changed.old.depth, changed.new.depth), (5, 6));
+        assert!(changed.added.is_empty() && changed.removed.is_empty());
+        let mut out = Vec::new();
+        write_diff(&mut out, &diff).unwrap();
+        let text = String::from_utf8(out).unwrap();
+        assert_eq!(
+            text,
+            "~ 0000000000000001 -> 0000000000000001 depth 5 -> 6\n"
+        );
+    }
+
+    #[test]
+    fn relative_to_root() {
+        let old = line(1, 3, &[("/snap/v1/bin/ls", "f"), ("/usr/lib/libc.so", "f")]);
+        let new = line(2, 3, &[("/snap/v2/bin/ls", "f"), ("/usr/lib/libc.so", "f")]);
+        let old = parse_jsonl(&old, Some(Path::new("/snap/v1"))).unwrap();
+        let new = parse_jsonl(&new, Some(Path::new("/snap/v2/"))).unwrap();
+        // paths outside the root are kept, and sort first
+        assert_eq!(old[0].members[0].0, "/usr/lib/libc.so");
+        assert_eq!(old[0].members[1].0, "bin/ls");
+        assert_eq!(old[0].fingerprint, new[0].fingerprint);
+        assert_eq!(diff(&old, &new).unchanged, 1);
+    }
+}
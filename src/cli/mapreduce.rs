@@ -0,0 +1,691 @@
+use crate::cli::metadata::BinaryInfo;
+use crate::cli::report::{format_basic_blocks, ReportClass, ReportClone};
+use bincc::analysis::{FVec, StructureSignature};
+use fnv::FnvHashMap;
+use std::collections::{HashMap, HashSet};
+use std::error::Error;
+use std::fmt;
+use std::fs::{self, File};
+use std::io;
+use std::io::{BufWriter, ErrorKind, Write};
+use std::path::{Path, PathBuf};
+use std::time::Duration;
+
+/// First line of a partition file written by the `map` command.
+const PARTITION_HEADER: &str = "# bincc partition v3";
+/// First line of a partial report written by the `reduce` command.
+const REPORT_HEADER: &str = "# bincc report v2";
+/// First line of a binaries table written by the `map` command.
+const BINARIES_HEADER: &str = "# bincc binaries v2";
+
+/// A function analysed by the `map` command.
+pub struct MappedFunction<'a> {
+    /// Path of the binary containing the function.
+    pub binary: &'a str,
+    /// Name of the function.
+    pub function: &'a str,
+    /// Structure of the function.
+    pub structure: &'a StructureSignature,
+    /// Address the offsets of the basic blocks in `structure` are relative to.
+    pub base: u64,
+    /// Frequency vector of the function, if the semantic analysis is enabled.
+    pub fvec: Option<&'a FVec>,
+}
+
+/// Returns the partition of a fingerprint.
+///
+/// The fingerprint space is split in `partitions` ranges of the same size.
+pub fn partition_of(fingerprint: u64, partitions: u32) -> u32 {
+    ((fingerprint as u128 * partitions as u128) >> 64) as u32
+}
+
+/// Returns the path of the file containing the given partition written by the given shard.
+pub fn partition_path(dir: &Path, partition: u32, shard: u32) -> PathBuf {
+    dir.join(format!("part-{:04}-{:04}.bcc", partition, shard))
+}
+
+/// Returns the path of the partial report of the given partition.
+pub fn report_path(dir: &Path, partition: u32) -> PathBuf {
+    dir.join(format!("report-{:04}.bcc", partition))
+}
+
+// returns the files in the directory whose name starts with the prefix, sorted
+fn files_with_prefix(dir: &Path, prefix: &str) -> Result<Vec<PathBuf>, io::Error> {
+    let mut paths = fs::read_dir(dir)?
+        .filter_map(|entry| entry.ok().map(|entry| entry.path()))
+        .filter(|path| {
+            path.file_name()
+                .and_then(|name| name.to_str())
+                .map(|name| name.starts_with(prefix))
+                .unwrap_or(false)
+        })
+        .collect::<Vec<_>>();
+    paths.sort_unstable();
+    Ok(paths)
+}
+
+// a string field of the files written by this module, which may contain tabs and newlines.
+//
+// The string is written prefixed by its length in bytes and a colon, so it can be read back with
+// FieldReader::string without escaping.
+struct Prefixed<'a>(&'a str);
+
+impl fmt::Display for Prefixed<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{}:{}", self.0.len(), self.0)
+    }
+}
+
+// reads the tab separated fields of the lines of a file, after its header
+struct FieldReader<'a> {
+    rest: &'a str,
+    // true if the last field read was the last of its line
+    line_end: bool,
+}
+
+impl<'a> FieldReader<'a> {
+    fn new(content: &'a str) -> Self {
+        let rest = content.split_once('\n').map(|(_, rest)| rest).unwrap_or("");
+        FieldReader {
+            rest,
+            line_end: true,
+        }
+    }
+
+    // moves to the next non-empty line, returning false at the end of the file
+    fn next_line(&mut self) -> Result<bool, Box<dyn Error>> {
+        if !self.line_end {
+            return Err(inconsistent_data());
+        }
+        self.rest = self.rest.trim_start_matches('\n');
+        self.line_end = self.rest.is_empty();
+        Ok(!self.rest.is_empty())
+    }
+
+    // skips the separator following a field, remembering if it ended the line
+    fn separator(&mut self) -> Result<(), Box<dyn Error>> {
+        match self.rest.as_bytes().first() {
+            Some(b'\t') => self.rest = &self.rest[1..],
+            Some(b'\n') => {
+                self.rest = &self.rest[1..];
+                self.line_end = true;
+            }
+            None => self.line_end = true,
+            Some(_) => return Err(inconsistent_data()),
+        }
+        Ok(())
+    }
+
+    // reads a field up to the next tab or newline
+    fn field(&mut self) -> Result<&'a str, Box<dyn Error>> {
+        if self.line_end {
+            return Err(inconsistent_data());
+        }
+        let end = self.rest.find(['\t', '\n']).unwrap_or(self.rest.len());
+        let field = &self.rest[..end];
+        self.rest = &self.rest[end..];
+        self.separator()?;
+        Ok(field)
+    }
+
+    // reads a field written with Prefixed
+    fn string(&mut self) -> Result<&'a str, Box<dyn Error>> {
+        if self.line_end {
+            return Err(inconsistent_data());
+        }
+        let (len, rest) = self.rest.split_once(':').ok_or_else(inconsistent_data)?;
+        let len = len.parse::<usize>()?;
+        if !rest.is_char_boundary(len) {
+            return Err(inconsistent_data());
+        }
+        let field = &rest[..len];
+        self.rest = &rest[len..];
+        self.separator()?;
+        Ok(field)
+    }
+
+    // checks that the last field read was the last of its line
+    fn end_line(&self) -> Result<(), Box<dyn Error>> {
+        if self.line_end {
+            Ok(())
+        } else {
+            Err(inconsistent_data())
+        }
+    }
+}
+
+/// Writes the metadata of the binaries analysed by a shard.
+///
+/// The metadata is stored once for each binary, and later retrieved with [`read_binaries`].
+pub fn write_binaries<'a, I: Iterator<Item = &'a BinaryInfo>>(
+    binaries: I,
+    dir: &Path,
+    shard: u32,
+) -> Result<(), io::Error> {
+    fs::create_dir_all(dir)?;
+    let path = dir.join(format!("binaries-{:04}.bcc", shard));
+    let mut file = BufWriter::new(File::create(path)?);
+    writeln!(file, "{}", BINARIES_HEADER)?;
+    for info in binaries {
+        writeln!(
+            file,
+            "{}\t{}\t{}\t{:016x}\t{}\t{}",
+            info.arch,
+            info.bits,
+            info.size,
+            info.hash,
+            info.elapsed.as_micros(),
+            Prefixed(&info.path)
+        )?;
+    }
+    file.flush()
+}
+
+/// Reads the metadata of the binaries analysed by every shard, indexed by path.
+///
+/// Ids are assigned in reading order, as the ones used by each shard are not unique.
+pub fn read_binaries(dir: &Path) -> Result<HashMap<String, BinaryInfo>, Box<dyn Error>> {
+    let mut binaries = HashMap::new();
+    for path in files_with_prefix(dir, "binaries-")? {
+        let content = read_with_header(&path, BINARIES_HEADER)?;
+        let mut reader = FieldReader::new(&content);
+        while reader.next_line()? {
+            let arch = reader.field()?.to_string();
+            let bits = reader.field()?.parse::<u32>()?;
+            let size = reader.field()?.parse::<u64>()?;
+            let hash = u64::from_str_radix(reader.field()?, 16)?;
+            let elapsed = Duration::from_micros(reader.field()?.parse::<u64>()?);
+            let path = reader.string()?.to_string();
+            reader.end_line()?;
+            let info = BinaryInfo {
+                id: binaries.len() as u32,
+                path,
+                arch,
+                bits,
+                size,
+                hash,
+                elapsed,
+            };
+            binaries.insert(info.path.clone(), info);
+        }
+    }
+    Ok(binaries)
+}
+
+/// Writes the fingerprint of every subtree of the given functions into the partition files.
+///
+/// A partition file contains two kinds of lines:
+/// - `F`, with an id unique in the file, binary, function and frequency vector of a function.
+///   It is written once in each partition containing at least a subtree of the function, before
+///   them. Opcodes are written by name, as their identifiers are valid only inside the process
+///   that created them.
+/// - `S`, with fingerprint, depth, id of the function and basic blocks of a subtree.
+///
+/// Binaries and functions are prefixed by their length, as they may contain tabs or newlines.
+///
+/// Returns the amount of subtrees written.
+pub fn write_partitions<'a, I: Iterator<Item = MappedFunction<'a>>>(
+    functions: I,
+    opcodes: &HashMap<u16, String>,
+    dir: &Path,
+    partitions: u32,
+    shard: u32,
+    min_depth: u32,
+) -> Result<usize, io::Error> {
+    fs::create_dir_all(dir)?;
+    let mut files = Vec::with_capacity(partitions as usize);
+    for partition in 0..partitions {
+        let mut file = BufWriter::new(File::create(partition_path(dir, partition, shard))?);
+        writeln!(file, "{}", PARTITION_HEADER)?;
+        files.push(file);
+    }
+    let mut written = 0;
+    // partitions where the current function was already written
+    let mut declared = vec![false; partitions as usize];
+    for (id, func) in functions.enumerate() {
+        let mut fvec = None;
+        declared.iter_mut().for_each(|declared| *declared = false);
+        for node in func.structure.subtrees(min_depth) {
+            let fingerprint = node.fingerprint();
+            let partition = partition_of(fingerprint, partitions) as usize;
+            let file = &mut files[partition];
+            if !declared[partition] {
+                let fvec = fvec.get_or_insert_with(|| match func.fvec {
+                    Some(fvec) => fvec
+                        .frequencies()
+                        .map(|(id, frequency)| format!("{}={}", opcodes[&id], frequency))
+                        .collect::<Vec<_>>()
+                        .join(","),
+                    None => "-".to_string(),
+                });
+                writeln!(
+                    file,
+                    "F\t{}\t{}\t{}\t{}",
+                    id,
+                    Prefixed(func.binary),
+                    Prefixed(func.function),
+                    fvec
+                )?;
+                declared[partition] = true;
+            }
+            let offsets = node
+                .basic_blocks()
+                .into_iter()
+                .filter(|bb| !bb.is_sink())
+                .map(|bb| bb.address(func.base))
+                .collect::<Vec<_>>();
+            writeln!(
+                file,
+                "S\t{:016x}\t{}\t{}\t{}",
+                fingerprint,
+                node.depth(),
+                id,
+                format_basic_blocks(&offsets),
+            )?;
+            written += 1;
+        }
+    }
+    for mut file in files {
+        file.flush()?;
+    }
+    Ok(written)
+}
+
+// a function read from a partition file
+struct PartitionFunction<'a> {
+    binary: &'a str,
+    function: &'a str,
+    fvec: Option<FVec>,
+}
+
+// a subtree read from a partition file
+struct PartitionRecord<'a> {
+    fingerprint: u64,
+    depth: u32,
+    // index of the function in the list of all the functions read
+    function: usize,
+    basic_blocks: &'a str,
+}
+
+fn inconsistent_data() -> Box<dyn Error> {
+    Box::new(io::Error::new(ErrorKind::InvalidInput, "inconsistent data"))
+}
+
+// returns the content of the file, or an error if the first line is not the expected header
+fn read_with_header(path: &Path, header: &str) -> Result<String, Box<dyn Error>> {
+    let content = fs::read_to_string(path)?;
+    if content.lines().next() != Some(header) {
+        return Err(Box::new(io::Error::new(
+            ErrorKind::InvalidInput,
+            "unexpected input filetype",
+        )));
+    }
+    Ok(content)
+}
+
+fn parse_partition<'a>(
+    content: &'a str,
+    opcode_map: &mut HashMap<&'a str, u16>,
+    functions: &mut Vec<PartitionFunction<'a>>,
+    records: &mut Vec<PartitionRecord<'a>>,
+) -> Result<(), Box<dyn Error>> {
+    // ids are unique only inside each file
+    let mut ids = FnvHashMap::default();
+    let mut reader = FieldReader::new(content);
+    while reader.next_line()? {
+        match reader.field()? {
+            "F" => {
+                let id = reader.field()?.parse::<u64>()?;
+                let binary = reader.string()?;
+                let function = reader.string()?;
+                let fvec = match reader.field()? {
+                    "-" => None,
+                    frequencies => {
+                        let mut parsed = Vec::new();
+                        for pair in frequencies.split(',') {
+                            let (name, frequency) =
+                                pair.rsplit_once('=').ok_or_else(inconsistent_data)?;
+                            let next = opcode_map.len() as u16;
+                            let id = *opcode_map.entry(name).or_insert(next);
+                            parsed.push((id, frequency.parse::<f32>()?));
+                        }
+                        Some(FVec::from_frequencies(parsed))
+                    }
+                };
+                ids.insert(id, functions.len());
+                functions.push(PartitionFunction {
+                    binary,
+                    function,
+                    fvec,
+                });
+            }
+            "S" => {
+                let fingerprint = u64::from_str_radix(reader.field()?, 16)?;
+                let depth = reader.field()?.parse::<u32>()?;
+                let id = reader.field()?.parse::<u64>()?;
+                let function = *ids.get(&id).ok_or_else(inconsistent_data)?;
+                records.push(PartitionRecord {
+                    fingerprint,
+                    depth,
+                    function,
+                    basic_blocks: reader.field()?,
+                });
+            }
+            _ => return Err(inconsistent_data()),
+        }
+        reader.end_line()?;
+    }
+    Ok(())
+}
+
+/// Builds the clone classes of a partition and writes them as a partial report.
+///
+/// All the files of the partition contained in `dir` are read, regardless of the shard that
+/// wrote them. If `min_similarity` is given, each structural clone class is further split by
+/// comparing the frequency vectors, like the in-memory combined analysis.
+///
+/// Returns the amount of clone classes written.
+pub fn reduce(
+    dir: &Path,
+    partition: u32,
+    min_similarity: Option<f32>,
+) -> Result<usize, Box<dyn Error>> {
+    let paths = files_with_prefix(dir, &format!("part-{:04}-", partition))?;
+    let contents = paths
+        .iter()
+        .map(|path| read_with_header(path, PARTITION_HEADER))
+        .collect::<Result<Vec<_>, _>>()?;
+    let mut opcode_map = HashMap::new();
+    let mut functions = Vec::new();
+    let mut records = Vec::new();
+    for content in &contents {
+        parse_partition(content, &mut opcode_map, &mut functions, &mut records)?;
+    }
+    let fvec = |index: usize| functions[records[index].function].fvec.as_ref();
+    let mut groups = FnvHashMap::default();
+    for (index, record) in records.iter().enumerate() {
+        groups
+            .entry(record.fingerprint)
+            .or_insert_with(Vec::new)
+            .push(index);
+    }
+    let mut groups = groups
+        .into_iter()
+        .filter(|(_, group)| group.len() > 1)
+        .collect::<Vec<_>>();
+    groups.sort_unstable();
+    let mut classes = Vec::new();
+    for (_, group) in groups {
+        let semantic = group.iter().all(|&index| fvec(index).is_some());
+        match min_similarity {
+            Some(threshold) if semantic => {
+                let mut found = HashSet::new();
+                for &a in &group {
+                    let fvec_a = fvec(a).unwrap();
+                    let class = group
+                        .iter()
+                        .copied()
+                        .filter(|&b| fvec_a.cosine_similarity(fvec(b).unwrap()) > threshold)
+                        .collect::<Vec<_>>();
+                    if class.len() > 1 && found.insert(class.clone()) {
+                        classes.push(class);
+                    }
+                }
+            }
+            _ => classes.push(group),
+        }
+    }
+    let mut file = BufWriter::new(File::create(report_path(dir, partition))?);
+    writeln!(file, "{}", REPORT_HEADER)?;
+    for class in &classes {
+        writeln!(file, "C\t{}", records[class[0]].depth)?;
+        for &index in class {
+            let record = &records[index];
+            let function = &functions[record.function];
+            writeln!(
+                file,
+                "M\t{}\t{}\t{}",
+                Prefixed(function.binary),
+                Prefixed(function.function),
+                record.basic_blocks
+            )?;
+        }
+    }
+    file.flush()?;
+    Ok(classes.len())
+}
+
+/// Reads all the partial reports written by [`reduce`] in the given directory.
+pub fn read_reports(dir: &Path) -> Result<Vec<String>, Box<dyn Error>> {
+    files_with_prefix(dir, "report-")?
+        .iter()
+        .map(|path| read_with_header(path, REPORT_HEADER))
+        .collect()
+}
+
+/// Parses a partial report previously read with [`read_reports`].
+///
+/// `binaries` is the table returned by [`read_binaries`]. Basic blocks are parsed only if `bbs`
+/// is true.
+pub fn parse_report<'a>(
+    content: &'a str,
+    binaries: &'a HashMap<String, BinaryInfo>,
+    bbs: bool,
+) -> Result<Vec<ReportClass<'a>>, Box<dyn Error>> {
+    let mut classes: Vec<ReportClass> = Vec::new();
+    let mut reader = FieldReader::new(content);
+    while reader.next_line()? {
+        match reader.field()? {
+            "C" => classes.push(ReportClass {
+                depth: reader.field()?.parse::<u32>()?,
+                clones: Vec::new(),
+            }),
+            "M" => {
+                let binary = reader.string()?;
+                let function = reader.string()?;
+                let offsets = reader.field()?;
+                let basic_blocks = if bbs {
+                    let parsed = offsets
+                        .split(',')
+                        .filter(|offset| !offset.is_empty())
+                        .map(parse_int::parse::<u64>)
+                        .collect::<Result<Vec<_>, _>>()?;
+                    Some(parsed)
+                } else {
+                    None
+                };
+                let class = classes.last_mut().ok_or_else(inconsistent_data)?;
+                class.clones.push(ReportClone {
+                    binary: binaries.get(binary).ok_or_else(inconsistent_data)?,
+                    function,
+                    basic_blocks,
+                });
+            }
+            _ => return Err(inconsistent_data()),
+        }
+        reader.end_line()?;
+    }
+    Ok(classes)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        parse_report, partition_of, partition_path, read_binaries, read_reports, reduce,
+        write_binaries, write_partitions,
+    };
+    use crate::cli::mapreduce::MappedFunction;
+    use crate::cli::metadata::BinaryInfo;
+    use bincc::analysis::{FVec, StructureSignature, CFG, CFS};
+    use bincc::disasm::{Architecture, Statement, StatementFamily};
+    use std::collections::{HashMap, HashSet};
+    use std::error::Error;
+    use std::time::Duration;
+    use tempfile::tempdir;
+
+    fn create_structure() -> StructureSignature {
+        let stmts = vec![
+            Statement::new(0x00, StatementFamily::CMP, "test eax, eax"),
+            Statement::new(0x04, StatementFamily::CJMP, "je 0x10"),
+            Statement::new(0x08, StatementFamily::ADD, "add ebx, 5"),
+            Statement::new(0x0C, StatementFamily::JMP, "jmp 0x14"),
+            Statement::new(0x10, StatementFamily::SUB, "sub ebx, 5"),
+            Statement::new(0x14, StatementFamily::CMP, "cmp eax, ebx"),
+            Statement::new(0x18, StatementFamily::CJMP, "jne 0x00"),
+            Statement::new(0x1C, StatementFamily::RET, "ret"),
+        ];
+        let cfg = CFG::new(&stmts, 0x20, Architecture::X86(64)).add_sink();
+        StructureSignature::new(&CFS::new(&cfg).get_tree().unwrap())
+    }
+
+    #[test]
+    fn partitions_are_ranges() {
+        assert_eq!(partition_of(0, 16), 0);
+        assert_eq!(partition_of(u64::MAX, 16), 15);
+        assert_eq!(partition_of(u64::MAX / 2, 2), 0);
+        assert_eq!(partition_of(u64::MAX / 2 + 1, 2), 1);
+        assert_eq!(partition_of(u64::MAX, 1), 0);
+    }
+
+    #[test]
+    fn map_reduce_merge() -> Result<(), Box<dyn Error>> {
+        let structure = create_structure();
+        let similar = FVec::from_frequencies(vec![(0, 0.5), (1, 0.5)]);
+        let different = FVec::from_frequencies(vec![(2, 1.0)]);
+        let opcodes = (0..3)
+            .map(|id| (id, format!("op{}", id)))
+            .collect::<HashMap<_, _>>();
+        let dir = tempdir()?;
+        // two shards, as written by two different processes
+        for (shard, binary) in ["/bin/a", "/bin/b"].iter().enumerate() {
+            let info = BinaryInfo {
+                id: 0,
+                path: binary.to_string(),
+                arch: "x86".to_string(),
+                bits: 64,
+                size: 1024,
+                hash: 0xCAFE,
+                elapsed: Duration::from_millis(10),
+            };
+            write_binaries([info].iter(), dir.path(), shard as u32)?;
+            let functions = vec![
+                MappedFunction {
+                    binary,
+                    function: "main",
+                    structure: &structure,
+                    base: 0,
+                    fvec: Some(&similar),
+                },
+                MappedFunction {
+                    binary,
+                    function: if shard == 0 { "odd" } else { "other" },
+                    structure: &structure,
+                    base: 0,
+                    fvec: Some(&different),
+                },
+            ];
+            let written = write_partitions(
+                functions.into_iter(),
+                &opcodes,
+                dir.path(),
+                4,
+                shard as u32,
+                1,
+            )?;
+            assert!(written > 0);
+        }
+        // the frequency vector of a function is written once in each of its partitions
+        let partitions = structure
+            .subtrees(1)
+            .map(|node| partition_of(node.fingerprint(), 4))
+            .collect::<HashSet<_>>();
+        let mut declared = 0;
+        for partition in 0..4 {
+            let content = std::fs::read_to_string(partition_path(dir.path(), partition, 0))?;
+            declared += content
+                .lines()
+                .filter(|line| line.starts_with("F\t"))
+                .count();
+        }
+        assert_eq!(declared, 2 * partitions.len());
+        let mut total = 0;
+        for partition in 0..4 {
+            total += reduce(dir.path(), partition, Some(0.99))?;
+        }
+        assert!(total > 0);
+        let binaries = read_binaries(dir.path())?;
+        assert_eq!(binaries.len(), 2);
+        assert_eq!(binaries["/bin/b"].hash, 0xCAFE);
+        assert_eq!(binaries["/bin/b"].elapsed, Duration::from_millis(10));
+        let contents = read_reports(dir.path())?;
+        assert_eq!(contents.len(), 4);
+        let classes = contents
+            .iter()
+            .map(|content| parse_report(content, &binaries, true))
+            .collect::<Result<Vec<_>, _>>()?
+            .into_iter()
+            .flatten()
+            .collect::<Vec<_>>();
+        assert_eq!(classes.len(), total);
+        for class in classes {
+            // the semantic step separates the functions with different frequency vectors
+            assert_eq!(class.len(), 2);
+            let mut names = class
+                .clones
+                .iter()
+                .map(|clone| clone.function)
+                .collect::<Vec<_>>();
+            names.sort_unstable();
+            assert!(names == ["main", "main"] || names == ["odd", "other"]);
+            assert!(class.clones[0].basic_blocks.is_some());
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn names_with_separators() -> Result<(), Box<dyn Error>> {
+        let structure = create_structure();
+        let binary = "/bin/tab\tand\nnewline";
+        let dir = tempdir()?;
+        let info = BinaryInfo {
+            id: 0,
+            path: binary.to_string(),
+            arch: "x86".to_string(),
+            bits: 64,
+            size: 1024,
+            hash: 0xCAFE,
+            elapsed: Duration::from_millis(10),
+        };
+        write_binaries([info].iter(), dir.path(), 0)?;
+        let functions = ["sym.a\tb", "sym.c\nd"].map(|function| MappedFunction {
+            binary,
+            function,
+            structure: &structure,
+            base: 0,
+            fvec: None,
+        });
+        write_partitions(functions.into_iter(), &HashMap::new(), dir.path(), 1, 0, 1)?;
+        assert!(reduce(dir.path(), 0, None)? > 0);
+        let binaries = read_binaries(dir.path())?;
+        assert!(binaries.contains_key(binary));
+        let contents = read_reports(dir.path())?;
+        for class in parse_report(&contents[0], &binaries, true)? {
+            let mut names = class
+                .clones
+                .iter()
+                .map(|clone| (clone.binary.path.as_str(), clone.function))
+                .collect::<Vec<_>>();
+            names.sort_unstable();
+            assert_eq!(names, [(binary, "sym.a\tb"), (binary, "sym.c\nd")]);
+        }
+        Ok(())
+    }
+
+    #[test]
+    fn reduce_wrong_file() -> Result<(), Box<dyn Error>> {
+        let dir = tempdir()?;
+        std::fs::write(dir.path().join("part-0000-0000.bcc"), "digraph{\n}\n")?;
+        assert!(reduce(dir.path(), 0, None).is_err());
+        Ok(())
+    }
+}
@@ -0,0 +1,69 @@
+use fnv::FnvHasher;
+use std::fs::File;
+use std::hash::Hasher;
+use std::io;
+use std::io::Read;
+use std::path::Path;
+use std::time::Duration;
+
+/// Size of the chunks read when hashing a file.
+const HASH_CHUNK_SIZE: usize = 1 << 16;
+
+/// Information about an analysed binary.
+///
+/// This is stored once for each binary, and referenced by the clones using its id.
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+pub struct BinaryInfo {
+    /// Unique identifier of the binary, the same used in the comparators.
+    pub id: u32,
+    /// Path of the binary.
+    pub path: String,
+    /// Name of the binary architecture.
+    pub arch: String,
+    /// Bits of the binary architecture.
+    pub bits: u32,
+    /// Size of the binary, in bytes.
+    pub size: u64,
+    /// FNV hash of the binary content.
+    pub hash: u64,
+    /// Time spent disassembling and analysing the binary.
+    pub elapsed: Duration,
+}
+
+/// Returns the FNV hash of a file content.
+///
+/// The file is read in chunks, so it is never loaded entirely in memory.
+pub fn file_hash<S: AsRef<Path>>(path: S) -> Result<u64, io::Error> {
+    let mut file = File::open(path)?;
+    let mut hasher = FnvHasher::default();
+    let mut buffer = vec![0; HASH_CHUNK_SIZE];
+    loop {
+        let read = file.read(&mut buffer)?;
+        if read == 0 {
+            break;
+        }
+        hasher.write(&buffer[..read]);
+    }
+    Ok(hasher.finish())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::file_hash;
+    use fnv::FnvHasher;
+    use std::error::Error;
+    use std::hash::Hasher;
+    use tempfile::NamedTempFile;
+
+    #[test]
+    fn hash_in_chunks() -> Result<(), Box<dyn Error>> {
+        // bigger than a single chunk
+        let content = (0..200_000).map(|i| (i % 251) as u8).collect::<Vec<_>>();
+        let file = NamedTempFile::new()?;
+        std::fs::write(file.path(), &content)?;
+        let mut hasher = FnvHasher::default();
+        hasher.write(&content);
+        assert_eq!(file_hash(file.path())?, hasher.finish());
+        Ok(())
+    }
+}
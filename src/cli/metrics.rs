@@ -0,0 +1,378 @@
+use crate::cli::allocs::{AllocReport, ALLOC_STAGES};
+use crate::cli::report::write_json_str;
+use bincc::analysis::{ReductionSummary, REDUCTION_RULES};
+use bincc::disasm::radare2::CommandStats;
+use fnv::FnvHashMap;
+use std::collections::BTreeMap;
+use std::fs::File;
+use std::io::{self, BufWriter, Write};
+use std::time::Duration;
+
+/// Time spent in each stage of the analysis of a single binary.
+#[derive(Debug, Clone, Default)]
+pub struct BinaryMetrics {
+    /// Path of the binary.
+    pub path: String,
+    /// Reason of the failure, if the binary could not be analysed.
+    pub failure: Option<&'static str>,
+    /// Total time spent on the binary.
+    pub elapsed: Duration,
+    /// Time spent spawning the disassembler.
+    pub spawn: Duration,
+    /// Time spent in the disassembler analysis of the whole binary.
+    pub analysis: Duration,
+    /// Time spent building the CFGs.
+    pub cfg: Duration,
+    /// Time spent building the CFSs.
+    pub cfs: Duration,
+    /// Time spent building the feature vectors.
+    pub fvec: Duration,
+    /// Amount of analysed functions.
+    pub functions: usize,
+    /// Amount of functions skipped because belonging to a known library.
+    pub known: usize,
+    /// Amount of functions discarded because too small or without a CFG.
+    pub discarded: usize,
+    /// Time spent on each disassembler command.
+    pub commands: FnvHashMap<String, CommandStats>,
+    /// Counters of the CFS reductions.
+    pub reductions: ReductionSummary,
+    /// Allocations of each stage, if built with the `alloc-profile` feature.
+    pub allocations: Option<AllocReport>,
+}
+
+/// Performance metrics of a whole run.
+#[derive(Debug, Clone, Default)]
+pub struct Metrics {
+    /// Metrics of each binary that was analysed, or at least attempted.
+    pub binaries: Vec<BinaryMetrics>,
+    /// Wall time spent analysing all the binaries.
+    pub analysis: Duration,
+    /// Time spent in the structural comparison.
+    pub structural: Duration,
+    /// Time spent in the semantic comparison.
+    pub semantic: Duration,
+    /// Allocations of each stage in the whole process, if built with the `alloc-profile`
+    /// feature.
+    pub allocations: Option<AllocReport>,
+}
+
+impl Metrics {
+    /// Writes the metrics as a single JSON object.
+    ///
+    /// The object contains the aggregate numbers, followed by the ones of each binary.
+    /// `skipped` are the inputs that could not be analysed, with the reason, and `elapsed` the
+    /// total running time. All the durations are in microseconds.
+    pub fn write_json<W: Write>(
+        &self,
+        out: &mut W,
+        skipped: &[(String, &str)],
+        elapsed: Duration,
+    ) -> Result<(), io::Error> {
+        let functions = self.binaries.iter().map(|b| b.functions).sum::<usize>();
+        let throughput = if self.analysis.is_zero() {
+            0.0
+        } else {
+            functions as f64 / self.analysis.as_secs_f64()
+        };
+        write!(
+            out,
+            "{{\"version\":\"{}\",\"elapsed_us\":{},",
+            env!("CARGO_PKG_VERSION"),
+            elapsed.as_micros()
+        )?;
+        match peak_rss() {
+            Some(kib) => write!(out, "\"peak_rss_kib\":{},", kib)?,
+            None => write!(out, "\"peak_rss_kib\":null,")?,
+        }
+        write!(
+            out,
+            "\"throughput\":{:.3},\"binaries\":{{\"analysed\":{},\"skipped\":{}}},",
+            throughput,
+            self.binaries.iter().filter(|b| b.failure.is_none()).count(),
+            skipped.len()
+        )?;
+        write!(
+            out,
+            "\"functions\":{{\"analysed\":{},\"known\":{},\"discarded\":{}}},",
+            functions,
+            self.binaries.iter().map(|b| b.known).sum::<usize>(),
+            self.binaries.iter().map(|b| b.discarded).sum::<usize>()
+        )?;
+        let sum = |stage: fn(&BinaryMetrics) -> Duration| {
+            self.binaries
+                .iter()
+                .map(stage)
+                .sum::<Duration>()
+                .as_micros()
+        };
+        write!(
+            out,
+            "\"stages_us\":{{\"analysis\":{},\"spawn\":{},\"disassembly\":{},\"cfg\":{},\
+             \"cfs\":{},\"fvec\":{},\"structural\":{},\"semantic\":{}}},",
+            self.analysis.as_micros(),
+            sum(|b| b.spawn),
+            sum(|b| b.analysis),
+            sum(|b| b.cfg),
+            sum(|b| b.cfs),
+            sum(|b| b.fvec),
+            self.structural.as_micros(),
+            self.semantic.as_micros()
+        )?;
+        let mut commands = BTreeMap::new();
+        for (name, stats) in self.binaries.iter().flat_map(|b| b.commands.iter()) {
+            let total: &mut CommandStats = commands.entry(name.as_str()).or_default();
+            total.calls += stats.calls;
+            total.elapsed += stats.elapsed;
+        }
+        out.write_all(b"\"commands\":")?;
+        write_commands(out, commands.into_iter())?;
+        let mut reductions = ReductionSummary::default();
+        for binary in &self.binaries {
+            reductions.merge(&binary.reductions);
+        }
+        out.write_all(b",\"reductions\":")?;
+        write_reductions(out, &reductions)?;
+        out.write_all(b",\"allocations\":")?;
+        write_allocations(out, self.allocations.as_ref())?;
+        let mut reasons = BTreeMap::new();
+        for (_, reason) in skipped {
+            *reasons.entry(*reason).or_insert(0_usize) += 1;
+        }
+        out.write_all(b",\"skipped\":{")?;
+        for (index, (reason, count)) in reasons.into_iter().enumerate() {
+            if index > 0 {
+                out.write_all(b",")?;
+            }
+            write_json_str(out, reason)?;
+            write!(out, ":{}", count)?;
+        }
+        out.write_all(b"},\"per_binary\":[")?;
+        let mut binaries = self.binaries.iter().collect::<Vec<_>>();
+        binaries.sort_unstable_by(|a, b| a.path.cmp(&b.path));
+        for (index, binary) in binaries.into_iter().enumerate() {
+            if index > 0 {
+                out.write_all(b",")?;
+            }
+            write_binary(out, binary)?;
+        }
+        out.write_all(b"]}\n")
+    }
+}
+
+// writes the metrics of a single binary
+fn write_binary<W: Write>(out: &mut W, binary: &BinaryMetrics) -> Result<(), io::Error> {
+    out.write_all(b"{\"path\":")?;
+    write_json_str(out, &binary.path)?;
+    out.write_all(b",\"failure\":")?;
+    match binary.failure {
+        Some(reason) => write_json_str(out, reason)?,
+        None => out.write_all(b"null")?,
+    }
+    write!(
+        out,
+        ",\"functions\":{},\"known\":{},\"discarded\":{},\"elapsed_us\":{},\"spawn_us\":{},\
+         \"disassembly_us\":{},\"cfg_us\":{},\"cfs_us\":{},\"fvec_us\":{},\"commands\":",
+        binary.functions,
+        binary.known,
+        binary.discarded,
+        binary.elapsed.as_micros(),
+        binary.spawn.as_micros(),
+        binary.analysis.as_micros(),
+        binary.cfg.as_micros(),
+        binary.cfs.as_micros(),
+        binary.fvec.as_micros()
+    )?;
+    let mut commands = binary
+        .commands
+        .iter()
+        .map(|(name, stats)| (name.as_str(), *stats))
+        .collect::<Vec<_>>();
+    commands.sort_unstable_by_key(|(name, _)| *name);
+    write_commands(out, commands.into_iter())?;
+    out.write_all(b",\"reductions\":")?;
+    write_reductions(out, &binary.reductions)?;
+    out.write_all(b",\"allocations\":")?;
+    write_allocations(out, binary.allocations.as_ref())?;
+    out.write_all(b"}")
+}
+
+// writes the allocations of each stage as a JSON object, or null if not profiled
+fn write_allocations<W: Write>(out: &mut W, report: Option<&AllocReport>) -> Result<(), io::Error> {
+    let report = match report {
+        Some(report) => report,
+        None => return out.write_all(b"null"),
+    };
+    out.write_all(b"{")?;
+    for (index, (stage, stats)) in ALLOC_STAGES.iter().zip(report).enumerate() {
+        if index > 0 {
+            out.write_all(b",")?;
+        }
+        write!(
+            out,
+            "\"{}\":{{\"count\":{},\"bytes\":{},\"peak_live_bytes\":{}}}",
+            stage, stats.count, stats.bytes, stats.peak
+        )?;
+    }
+    out.write_all(b"}")
+}
+
+// writes the CFS reduction counters as a JSON object
+fn write_reductions<W: Write>(out: &mut W, summary: &ReductionSummary) -> Result<(), io::Error> {
+    write!(
+        out,
+        "{{\"functions\":{},\"iterations\":{},\"attempts\":{},\"tolerance_exceeded\":{},\
+         \"incomplete\":{},\"rules\":{{",
+        summary.functions,
+        summary.iterations,
+        summary.attempts,
+        summary.tolerance_exceeded,
+        summary.incomplete
+    )?;
+    for (index, (rule, count)) in REDUCTION_RULES.iter().zip(summary.rules).enumerate() {
+        if index > 0 {
+            out.write_all(b",")?;
+        }
+        write!(out, "\"{}\":{}", rule, count)?;
+    }
+    out.write_all(b"},\"iterations_histogram\":")?;
+    write_histogram(out, &summary.iterations_histogram)?;
+    out.write_all(b",\"remaining_histogram\":")?;
+    write_histogram(out, &summary.remaining_histogram)?;
+    out.write_all(b"}")
+}
+
+// writes a histogram as an array, without the trailing empty buckets
+fn write_histogram<W: Write>(out: &mut W, buckets: &[usize]) -> Result<(), io::Error> {
+    let used = buckets
+        .iter()
+        .rposition(|&count| count > 0)
+        .map_or(0, |last| last + 1);
+    out.write_all(b"[")?;
+    for (index, count) in buckets[..used].iter().enumerate() {
+        if index > 0 {
+            out.write_all(b",")?;
+        }
+        write!(out, "{}", count)?;
+    }
+    out.write_all(b"]")
+}
+
+// writes the disassembler commands statistics as a JSON object
+fn write_commands<'a, W: Write>(
+    out: &mut W,
+    commands: impl Iterator<Item = (&'a str, CommandStats)>,
+) -> Result<(), io::Error> {
+    out.write_all(b"{")?;
+    for (index, (name, stats)) in commands.enumerate() {
+        if index > 0 {
+            out.write_all(b",")?;
+        }
+        write_json_str(out, name)?;
+        write!(
+            out,
+            ":{{\"calls\":{},\"elapsed_us\":{}}}",
+            stats.calls,
+            stats.elapsed.as_micros()
+        )?;
+    }
+    out.write_all(b"}")
+}
+
+/// Writes the metrics in JSON format to the given file.
+pub fn write_metrics(
+    path: &str,
+    metrics: &Metrics,
+    skipped: &[(String, &str)],
+    elapsed: Duration,
+) -> Result<(), io::Error> {
+    let mut out = BufWriter::new(File::create(path)?);
+    metrics.write_json(&mut out, skipped, elapsed)?;
+    out.flush()
+}
+
+/// Returns the peak resident set size of the current process, in KiB.
+///
+/// This is available only on Linux, None is returned otherwise.
+pub fn peak_rss() -> Option<u64> {
+    let status = std::fs::read_to_string("/proc/self/status").ok()?;
+    status
+        .lines()
+        .find_map(|line| line.strip_prefix("VmHWM:"))
+        .and_then(|value| value.trim().trim_end_matches("kB").trim().parse().ok())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{BinaryMetrics, Metrics};
+    use bincc::analysis::{ReductionStats, ReductionSummary};
+    use bincc::disasm::radare2::CommandStats;
+    use fnv::FnvHashMap;
+    use std::time::Duration;
+
+    fn binary(path: &str, functions: usize, seeks: u32) -> BinaryMetrics {
+        let mut reductions = ReductionSummary::default();
+        reductions.add(&ReductionStats {
+            iterations: 2,
+            rules: [0, 0, 0, 0, 2, 0, 0, 0],
+            attempts: 10,
+            tolerance_exceeded: false,
+            remaining_nodes: 1,
+        });
+        let mut commands = FnvHashMap::default();
+        commands.insert(
+            "s".to_string(),
+            CommandStats {
+                calls: seeks,
+                elapsed: Duration::from_micros(seeks as u64 * 10),
+            },
+        );
+        BinaryMetrics {
+            path: path.to_string(),
+            functions,
+            cfg: Duration::from_micros(100),
+            commands,
+            reductions,
+            ..Default::default()
+        }
+    }
+
+    #[test]
+    fn aggregate_metrics() {
+        let metrics = Metrics {
+            binaries: vec![binary("/bin/b", 30, 4), binary("/bin/a", 10, 2)],
+            analysis: Duration::from_secs(2),
+            ..Default::default()
+        };
+        let skipped = vec![
+            ("/bin/c".to_string(), "timeout"),
+            ("/bin/d".to_string(), "timeout"),
+        ];
+        let mut out = Vec::new();
+        metrics
+            .write_json(&mut out, &skipped, Duration::from_secs(3))
+            .unwrap();
+        let json = String::from_utf8(out).unwrap();
+        assert!(json.contains("\"elapsed_us\":3000000,"));
+        assert!(json.contains("\"throughput\":20.000,"));
+        assert!(json.contains("\"binaries\":{\"analysed\":2,\"skipped\":2}"));
+        assert!(json.contains("\"cfg\":200,"));
+        assert!(json.contains("\"commands\":{\"s\":{\"calls\":6,\"elapsed_us\":60}}"));
+        assert!(json.contains("\"skipped\":{\"timeout\":2}"));
+        assert!(json.contains(
+            "\"reductions\":{\"functions\":2,\"iterations\":4,\"attempts\":20,\
+             \"tolerance_exceeded\":0,\"incomplete\":0,\"rules\":{\"self_loop\":0,\"loop\":0,\
+             \"if_then\":0,\"if_else\":0,\"sequence\":4,\"switch\":0,\"proper_interval\":0,\
+             \"improper_interval\":0},\"iterations_histogram\":[0,0,2],\"remaining_histogram\":[]}"
+        ));
+        // binaries are sorted by path
+        assert!(json.find("/bin/a").unwrap() < json.find("/bin/b").unwrap());
+        assert!(json.ends_with("]}\n"));
+    }
+
+    #[test]
+    #[cfg(target_os = "linux")]
+    fn peak_rss_available() {
+        assert!(super::peak_rss().unwrap() > 0);
+    }
+}
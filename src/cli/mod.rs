@@ -0,0 +1,30 @@
+// Modules used only by the bincc executable.
+
+/// Allocations of each stage of the analysis.
+// the allocator is used only when profiling
+#[cfg_attr(not(feature = "alloc-profile"), allow(dead_code))]
+pub mod allocs;
+/// Throughput of the analysis at different concurrency levels.
+pub mod bench;
+/// Scheduling of the analysis under a global time limit.
+pub mod budget;
+/// Comparison of the clone classes of two reports.
+pub mod diff;
+/// Analysis split across several processes sharing a filesystem.
+pub mod mapreduce;
+/// Information about the analysed binaries.
+pub mod metadata;
+/// Performance metrics of the analysis.
+pub mod metrics;
+/// Formatting of the clone classes found by the analysis.
+pub mod report;
+/// Random sampling of the input binaries and functions.
+pub mod sampling;
+/// Index and protocol of the analysis server.
+pub mod serve;
+/// Recording and replay of the disassembler sessions.
+pub mod session;
+/// Tracking of the most expensive functions to analyse.
+pub mod slowest;
+/// Polling of a directory for new binaries.
+pub mod watch;
@@ -0,0 +1,537 @@
+use crate::cli::metadata::BinaryInfo;
+use bincc::analysis::CloneClass;
+use fnv::{FnvHashMap, FnvHasher};
+use std::cmp::Reverse;
+use std::collections::HashMap;
+use std::fs::File;
+use std::hash::Hasher;
+use std::io::{self, BufWriter, Write};
+
+/// Amount of classes formatted by each thread before writing them.
+const CLASSES_PER_THREAD: usize = 1024;
+/// Size of the buffer of the report writer.
+const WRITER_CAPACITY: usize = 1 << 20;
+
+#[derive(clap::ValueEnum, Copy, Clone)]
+pub enum SortResult {
+    /// Do not sort the results.
+    None,
+    /// Sorts by clone class structural depth, ascending.
+    DepthAsc,
+    /// Sorts by clone class structural depth, descending.
+    DepthDesc,
+    /// Sorts by amount of clones inside a clone class, ascending.
+    SizeAsc,
+    /// Sorts by amount of clones inside a clone class, descending.
+    SizeDesc,
+}
+
+#[derive(clap::ValueEnum, Copy, Clone, PartialEq, Eq)]
+pub enum ReportFormat {
+    /// Human readable clone classes.
+    Text,
+    /// Comma Separated Values, one clone for each row.
+    Csv,
+    /// JSON Lines, one clone class for each line.
+    Jsonl,
+}
+
+/// Settings used when writing the report.
+pub struct ReportOptions {
+    /// Order of the clone classes.
+    pub sort: SortResult,
+    /// Whether the basic blocks offsets should be written.
+    pub bbs: bool,
+    /// Format of the report.
+    pub format: ReportFormat,
+    /// Whether duplicate clone classes should be removed.
+    pub filter: bool,
+    /// File where the report is written, stdout if [`None`].
+    pub output: Option<String>,
+}
+
+/// A clone class as printed in the report.
+///
+/// Unlike [`CloneClass`], this does not depend on the structures of the analysis, so it can be
+/// created also from a report written by a different process.
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+pub struct ReportClass<'a> {
+    /// Structural depth of the class.
+    pub depth: u32,
+    /// Clones contained in the class.
+    pub clones: Vec<ReportClone<'a>>,
+}
+
+/// A single clone of a [`ReportClass`].
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+pub struct ReportClone<'a> {
+    /// Binary containing the clone.
+    pub binary: &'a BinaryInfo,
+    /// Name of the function containing the clone.
+    pub function: &'a str,
+    /// Offsets of the basic blocks composing the clone, if known.
+    pub basic_blocks: Option<Vec<u64>>,
+}
+
+impl<'a> ReportClass<'a> {
+    /// Converts a clone class to its report form.
+    ///
+    /// `binaries` contains the metadata of every binary and `names` the name of every function,
+    /// both indexed by id, so the report class does not borrow from the clone class. Basic blocks
+    /// are retrieved only if `bases` is given, containing the base address of the CFG of each
+    /// function indexed by binary and function id, as their offsets are relative to it.
+    pub fn from_class(
+        class: CloneClass<'_>,
+        bases: Option<&FnvHashMap<(u32, u32), u64>>,
+        binaries: &'a FnvHashMap<u32, BinaryInfo>,
+        names: &'a FnvHashMap<u32, String>,
+    ) -> ReportClass<'a> {
+        let depth = class.depth();
+        let ids = class.iter_ids().collect::<Vec<_>>();
+        let clones = class
+            .zip(ids)
+            .map(|((_, _, maybe_cfs), (bin_id, func_id))| ReportClone {
+                binary: &binaries[&bin_id],
+                function: names[&func_id].as_str(),
+                basic_blocks: maybe_cfs.zip(bases).map(|(cfs, bases)| {
+                    let base = bases[&(bin_id, func_id)];
+                    cfs.basic_blocks()
+                        .into_iter()
+                        .filter(|bb| !bb.is_sink())
+                        .map(|bb| bb.address(base))
+                        .collect()
+                }),
+            })
+            .collect();
+        ReportClass { depth, clones }
+    }
+
+    /// Returns the amount of clones contained in this class.
+    pub fn len(&self) -> usize {
+        self.clones.len()
+    }
+
+    /// Returns an hash identifying the clones contained in this class, regardless of their order.
+    ///
+    /// The hash is calculated with FNV, so it is stable between different executions and can be
+    /// used to compare reports.
+    pub fn fingerprint(&self) -> u64 {
+        fingerprint(
+            self.clones
+                .iter()
+                .map(|clone| (clone.binary.path.as_str(), clone.function)),
+        )
+    }
+}
+
+/// Returns the fingerprint of a class given the binary path and function name of its clones,
+/// as in [ReportClass::fingerprint].
+pub fn fingerprint<'a, I: IntoIterator<Item = (&'a str, &'a str)>>(clones: I) -> u64 {
+    let mut content = clones.into_iter().collect::<Vec<_>>();
+    content.sort_unstable();
+    let mut hasher = FnvHasher::default();
+    for (binary, function) in content {
+        hasher.write(binary.as_bytes());
+        hasher.write_u8(0);
+        hasher.write(function.as_bytes());
+        hasher.write_u8(0);
+    }
+    hasher.finish()
+}
+
+/// Formats the basic blocks offsets as a comma separated list of hex numbers.
+pub fn format_basic_blocks(offsets: &[u64]) -> String {
+    let mut buffer = Vec::new();
+    write_basic_blocks(&mut buffer, offsets).unwrap();
+    String::from_utf8(buffer).unwrap()
+}
+
+// writes the offsets as a comma separated list of hex numbers, without intermediate strings
+fn write_basic_blocks<W: Write>(out: &mut W, offsets: &[u64]) -> Result<(), io::Error> {
+    for (index, offset) in offsets.iter().enumerate() {
+        if index > 0 {
+            out.write_all(b",")?;
+        }
+        write!(out, "0x{:x}", offset)?;
+    }
+    Ok(())
+}
+
+// writes a JSON string, quotes included
+pub fn write_json_str<W: Write>(out: &mut W, value: &str) -> Result<(), io::Error> {
+    out.write_all(b"\"")?;
+    let mut start = 0;
+    for (index, c) in value.char_indices() {
+        if c == '"' || c == '\\' || c < ' ' {
+            out.write_all(&value.as_bytes()[start..index])?;
+            match c {
+                '"' => out.write_all(b"\\\"")?,
+                '\\' => out.write_all(b"\\\\")?,
+                '\n' => out.write_all(b"\\n")?,
+                '\t' => out.write_all(b"\\t")?,
+                _ => write!(out, "\\u{:04x}", c as u32)?,
+            }
+            start = index + 1;
+        }
+    }
+    out.write_all(&value.as_bytes()[start..])?;
+    out.write_all(b"\"")
+}
+
+/// Writes the clone classes, followed by the inputs that could not be analysed.
+///
+/// The report is written to the output file or to stdout, using a buffered writer. The
+/// formatting of the classes is split between all the available cores.
+///
+/// Before applying the requested sort, the classes are ordered by fingerprint and depth, so the
+/// report does not depend on the order the comparators found them.
+pub fn print_results(
+    mut classes: Vec<ReportClass>,
+    skipped: &[(String, &str)],
+    options: &ReportOptions,
+) -> Result<(), io::Error> {
+    if options.filter {
+        let mut map: HashMap<Vec<(&str, &str)>, ReportClass> = HashMap::new();
+        for class in classes {
+            let mut content = class
+                .clones
+                .iter()
+                .map(|clone| (clone.binary.path.as_str(), clone.function))
+                .collect::<Vec<_>>();
+            content.sort_unstable();
+            if let Some(value) = map.get_mut(&content) {
+                if value.depth < class.depth {
+                    *value = class;
+                }
+            } else {
+                map.insert(content, class);
+            }
+        }
+        classes = map.into_values().collect::<Vec<_>>();
+    }
+    // the classes come from hash maps and sets, so they are sorted to make the output
+    // deterministic. The requested sort is stable, to keep this order between equal keys
+    classes.sort_by_cached_key(|class| (class.fingerprint(), class.depth));
+    match options.sort {
+        SortResult::None => (),
+        SortResult::DepthAsc => classes.sort_by_key(|a| a.depth),
+        SortResult::DepthDesc => classes.sort_by_key(|a| Reverse(a.depth)),
+        SortResult::SizeAsc => classes.sort_by_key(|a| a.len()),
+        SortResult::SizeDesc => classes.sort_by_key(|a| Reverse(a.len())),
+    }
+    let out: Box<dyn Write> = match &options.output {
+        Some(path) => Box::new(File::create(path)?),
+        None => Box::new(io::stdout().lock()),
+    };
+    let mut out = BufWriter::with_capacity(WRITER_CAPACITY, out);
+    if options.format == ReportFormat::Csv {
+        out.write_all(b"arch,bits,binary,function,clone_class_id,class_depth")?;
+        if options.bbs {
+            out.write_all(b",basic_blocks")?;
+        }
+        out.write_all(b"\n")?;
+    }
+    write_classes(&mut out, &classes, options)?;
+    if options.format == ReportFormat::Text {
+        let clones = classes.iter().map(|class| class.len()).sum::<usize>();
+        writeln!(out, "----------------------------")?;
+        writeln!(out, "Classes: {} Clones: {}", classes.len(), clones)?;
+        if !skipped.is_empty() {
+            writeln!(out, "----- SKIPPED INPUTS ({}) -----", skipped.len())?;
+            for (binary, reason) in skipped {
+                writeln!(out, "{} ({})", binary, reason)?;
+            }
+        }
+    } else {
+        // keep the CSV and JSON Lines parsable
+        for (binary, reason) in skipped {
+            eprintln!("Skipped {} ({})", binary, reason);
+        }
+    }
+    out.flush()
+}
+
+// formats the classes in parallel, and writes them in order
+fn write_classes<W: Write>(
+    out: &mut W,
+    classes: &[ReportClass],
+    options: &ReportOptions,
+) -> Result<(), io::Error> {
+    let threads = std::thread::available_parallelism()
+        .map(|threads| threads.get())
+        .unwrap_or(1);
+    let batch_size = CLASSES_PER_THREAD * threads;
+    for (batch_index, batch) in classes.chunks(batch_size).enumerate() {
+        let chunk_size = batch.len().div_ceil(threads);
+        let buffers = std::thread::scope(|scope| {
+            let handles = batch
+                .chunks(chunk_size)
+                .enumerate()
+                .map(|(chunk_index, chunk)| {
+                    let first_id = batch_index * batch_size + chunk_index * chunk_size;
+                    scope.spawn(move || format_classes(chunk, first_id, options))
+                })
+                .collect::<Vec<_>>();
+            handles
+                .into_iter()
+                .map(|handle| handle.join().unwrap())
+                .collect::<Vec<_>>()
+        });
+        for buffer in buffers {
+            out.write_all(&buffer?)?;
+        }
+    }
+    Ok(())
+}
+
+// formats the given classes in memory. first_id is the id of the first class in the report
+fn format_classes(
+    classes: &[ReportClass],
+    first_id: usize,
+    options: &ReportOptions,
+) -> Result<Vec<u8>, io::Error> {
+    let mut out = Vec::new();
+    for (index, class) in classes.iter().enumerate() {
+        match options.format {
+            ReportFormat::Text => write_text(&mut out, class, options.bbs)?,
+            ReportFormat::Csv => write_csv(&mut out, class, first_id + index, options.bbs)?,
+            ReportFormat::Jsonl => write_jsonl(&mut out, class, first_id + index, options.bbs)?,
+        }
+    }
+    Ok(out)
+}
+
+fn write_text<W: Write>(out: &mut W, class: &ReportClass, bbs: bool) -> Result<(), io::Error> {
+    writeln!(out, "----- CLONE CLASS ({}) -----", class.depth)?;
+    for clone in &class.clones {
+        let binary = clone.binary;
+        if !bbs {
+            writeln!(
+                out,
+                "[{}_{}]{} :: {}",
+                binary.arch, binary.bits, binary.path, clone.function
+            )?;
+        } else if let Some(offsets) = &clone.basic_blocks {
+            write!(
+                out,
+                "[{}_{}]{} :: {} [",
+                binary.arch, binary.bits, binary.path, clone.function
+            )?;
+            write_basic_blocks(out, offsets)?;
+            out.write_all(b"]\n")?;
+        }
+    }
+    Ok(())
+}
+
+fn write_csv<W: Write>(
+    out: &mut W,
+    class: &ReportClass,
+    class_id: usize,
+    bbs: bool,
+) -> Result<(), io::Error> {
+    for clone in &class.clones {
+        let binary = clone.binary;
+        write!(
+            out,
+            "{},{},{},{},{},{}",
+            binary.arch, binary.bits, binary.path, clone.function, class_id, class.depth
+        )?;
+        if bbs {
+            if let Some(offsets) = &clone.basic_blocks {
+                out.write_all(b",\"")?;
+                write_basic_blocks(out, offsets)?;
+                out.write_all(b"\"")?;
+            }
+        }
+        out.write_all(b"\n")?;
+    }
+    Ok(())
+}
+
+fn write_jsonl<W: Write>(
+    out: &mut W,
+    class: &ReportClass,
+    class_id: usize,
+    bbs: bool,
+) -> Result<(), io::Error> {
+    write_json_class(out, class, class_id, bbs)?;
+    out.write_all(b"\n")
+}
+
+/// Writes a clone class as a single JSON object, in the same form of the JSON Lines report.
+pub fn write_json_class<W: Write>(
+    out: &mut W,
+    class: &ReportClass,
+    class_id: usize,
+    bbs: bool,
+) -> Result<(), io::Error> {
+    write!(
+        out,
+        "{{\"class\":{},\"fingerprint\":\"{:016x}\",\"depth\":{},\"clones\":[",
+        class_id,
+        class.fingerprint(),
+        class.depth
+    )?;
+    for (index, clone) in class.clones.iter().enumerate() {
+        if index > 0 {
+            out.write_all(b",")?;
+        }
+        let binary = clone.binary;
+        out.write_all(b"{\"arch\":")?;
+        write_json_str(out, &binary.arch)?;
+        write!(out, ",\"bits\":{},\"binary\":", binary.bits)?;
+        write_json_str(out, &binary.path)?;
+        out.write_all(b",\"function\":")?;
+        write_json_str(out, clone.function)?;
+        if bbs {
+            if let Some(offsets) = &clone.basic_blocks {
+                out.write_all(b",\"basic_blocks\":[")?;
+                for (index, offset) in offsets.iter().enumerate() {
+                    if index > 0 {
+                        out.write_all(b",")?;
+                    }
+                    write!(out, "{}", offset)?;
+                }
+                out.write_all(b"]")?;
+            }
+        }
+        out.write_all(b"}")?;
+    }
+    out.write_all(b"]}")
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        format_classes, print_results, write_json_str, ReportClass, ReportClone, ReportFormat,
+        ReportOptions, SortResult,
+    };
+    use crate::cli::metadata::BinaryInfo;
+    use std::time::Duration;
+    use tempfile::NamedTempFile;
+
+    fn create_binaries() -> [BinaryInfo; 2] {
+        let info = |id: u32, path: &str, arch: &str, bits| BinaryInfo {
+            id,
+            path: path.to_string(),
+            arch: arch.to_string(),
+            bits,
+            size: 1024,
+            hash: 0,
+            elapsed: Duration::ZERO,
+        };
+        [info(0, "/bin/a", "x86", 64), info(1, "/bin/b", "arm", 32)]
+    }
+
+    fn create_class(binaries: &[BinaryInfo]) -> ReportClass<'_> {
+        ReportClass {
+            depth: 3,
+            clones: vec![
+                ReportClone {
+                    binary: &binaries[0],
+                    function: "main",
+                    basic_blocks: Some(vec![0x10, 0x20]),
+                },
+                ReportClone {
+                    binary: &binaries[1],
+                    function: "sym.\"quoted\"",
+                    basic_blocks: Some(vec![0x400]),
+                },
+            ],
+        }
+    }
+
+    fn format(format: ReportFormat) -> String {
+        let options = ReportOptions {
+            sort: SortResult::None,
+            bbs: true,
+            format,
+            filter: false,
+            output: None,
+        };
+        let binaries = create_binaries();
+        let classes = [create_class(&binaries)];
+        String::from_utf8(format_classes(&classes, 7, &options).unwrap()).unwrap()
+    }
+
+    #[test]
+    fn format_text() {
+        let expected = "----- CLONE CLASS (3) -----\n\
+                        [x86_64]/bin/a :: main [0x10,0x20]\n\
+                        [arm_32]/bin/b :: sym.\"quoted\" [0x400]\n";
+        assert_eq!(format(ReportFormat::Text), expected);
+    }
+
+    #[test]
+    fn format_csv() {
+        let expected = "x86,64,/bin/a,main,7,3,\"0x10,0x20\"\n\
+                        arm,32,/bin/b,sym.\"quoted\",7,3,\"0x400\"\n";
+        assert_eq!(format(ReportFormat::Csv), expected);
+    }
+
+    #[test]
+    fn format_jsonl() {
+        let line = format(ReportFormat::Jsonl);
+        assert!(line.starts_with("{\"class\":7,\"fingerprint\":\""));
+        assert!(line.ends_with(
+            "\"arch\":\"arm\",\"bits\":32,\"binary\":\"/bin/b\",\
+             \"function\":\"sym.\\\"quoted\\\"\",\"basic_blocks\":[1024]}]}\n"
+        ));
+        assert_eq!(line.lines().count(), 1);
+    }
+
+    #[test]
+    fn json_escape() {
+        let mut out = Vec::new();
+        write_json_str(&mut out, "a\\b\n\u{1}è").unwrap();
+        assert_eq!(String::from_utf8(out).unwrap(), "\"a\\\\b\\n\\u0001è\"");
+    }
+
+    #[test]
+    fn fingerprint_ignores_order() {
+        let binaries = create_binaries();
+        let class = create_class(&binaries);
+        let mut reversed = class.clone();
+        reversed.clones.reverse();
+        reversed.depth = 5;
+        assert_eq!(class.fingerprint(), reversed.fingerprint());
+    }
+
+    #[test]
+    fn print_results_deterministic() -> Result<(), Box<dyn std::error::Error>> {
+        let binaries = create_binaries();
+        let class = create_class(&binaries);
+        let mut classes = vec![class.clone()];
+        for (depth, function) in [(3, "init"), (2, "fini"), (4, "exit")] {
+            let mut other = class.clone();
+            other.depth = depth;
+            other.clones[0].function = function;
+            classes.push(other);
+        }
+        // a duplicate of the first class, removed by the filter
+        let mut shallower = class.clone();
+        shallower.depth = 1;
+        classes.push(shallower);
+        let mut reports = Vec::new();
+        for sort in [SortResult::None, SortResult::SizeDesc] {
+            for _ in 0..2 {
+                let file = NamedTempFile::new()?;
+                let options = ReportOptions {
+                    sort,
+                    bbs: false,
+                    format: ReportFormat::Csv,
+                    filter: true,
+                    output: Some(file.path().to_str().unwrap().to_string()),
+                };
+                print_results(classes.clone(), &[], &options)?;
+                reports.push(std::fs::read_to_string(file.path())?);
+                classes.reverse();
+            }
+        }
+        assert_eq!(reports[0], reports[1]);
+        assert_eq!(reports[2], reports[3]);
+        assert_eq!(reports[0].lines().count(), 9);
+        Ok(())
+    }
+}
@@ -0,0 +1,400 @@
+use crate::cli::report::ReportClass;
+use fnv::{FnvHashMap, FnvHashSet, FnvHasher};
+use rand::rngs::StdRng;
+use rand::{Rng, SeedableRng};
+use std::cmp::Reverse;
+use std::fs;
+use std::hash::Hasher;
+
+/// z-score for a 95% confidence interval.
+const Z_95: f64 = 1.96;
+/// Amount of clone classes reported in the estimate.
+const TOP_CLASSES: usize = 10;
+
+#[derive(clap::ValueEnum, Copy, Clone, PartialEq, Eq)]
+pub enum SampleStrategy {
+    /// Every binary has the same probability of being picked.
+    Uniform,
+    /// Binaries are grouped by size (powers of two) and each group is sampled separately.
+    Stratified,
+}
+
+/// Settings for the sampling mode.
+#[derive(Copy, Clone)]
+pub struct Sampling {
+    /// Fraction of the input binaries that will be analysed.
+    pub binaries: f64,
+    /// Fraction of the functions that will be analysed inside each binary.
+    pub functions: f64,
+    /// Strategy used to pick the binaries.
+    pub strategy: SampleStrategy,
+    /// Seed of the random number generator.
+    pub seed: u64,
+}
+
+impl Default for Sampling {
+    /// Returns the settings analysing every binary and function.
+    fn default() -> Self {
+        Sampling {
+            binaries: 1.0,
+            functions: 1.0,
+            strategy: SampleStrategy::Uniform,
+            seed: 0,
+        }
+    }
+}
+
+/// Binaries picked by [`Sampling::sample_binaries`].
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct Sample {
+    /// Picked binaries, in their original order.
+    pub binaries: Vec<String>,
+    /// Stratum of each picked binary.
+    pub strata: Vec<usize>,
+    /// Amount of input binaries in each stratum.
+    pub population: Vec<usize>,
+}
+
+impl Sampling {
+    /// Returns true if the sampling mode analyses only a portion of the input.
+    pub fn is_active(&self) -> bool {
+        self.binaries < 1.0 || self.functions < 1.0
+    }
+
+    /// Picks the binaries that will be analysed, keeping their original order.
+    pub fn sample_binaries(&self, input: &[String]) -> Sample {
+        if self.binaries >= 1.0 {
+            return Sample {
+                binaries: input.to_vec(),
+                strata: vec![0; input.len()],
+                population: vec![input.len()],
+            };
+        }
+        let mut rng = StdRng::seed_from_u64(self.seed);
+        let strata = match self.strategy {
+            SampleStrategy::Uniform => vec![(0..input.len()).collect::<Vec<_>>()],
+            SampleStrategy::Stratified => {
+                let mut by_size = FnvHashMap::default();
+                for (index, path) in input.iter().enumerate() {
+                    let size = fs::metadata(path).map(|m| m.len()).unwrap_or(0);
+                    let bucket = u64::BITS - size.leading_zeros();
+                    by_size.entry(bucket).or_insert_with(Vec::new).push(index);
+                }
+                let mut strata = by_size.into_iter().collect::<Vec<_>>();
+                strata.sort_unstable();
+                strata.into_iter().map(|(_, indices)| indices).collect()
+            }
+        };
+        let mut picked = Vec::new();
+        for (stratum_index, stratum) in strata.iter().enumerate() {
+            // at least one binary per stratum, otherwise small strata would never be represented
+            let amount =
+                ((stratum.len() as f64 * self.binaries).round() as usize).clamp(1, stratum.len());
+            let chosen = rand::seq::index::sample(&mut rng, stratum.len(), amount);
+            picked.extend(chosen.iter().map(|i| (stratum[i], stratum_index)));
+        }
+        picked.sort_unstable();
+        Sample {
+            binaries: picked.iter().map(|&(i, _)| input[i].clone()).collect(),
+            strata: picked.iter().map(|&(_, stratum)| stratum).collect(),
+            population: strata.iter().map(Vec::len).collect(),
+        }
+    }
+
+    /// Returns a function filter for the given binary.
+    ///
+    /// The filter must be queried with the function offsets in ascending order: the result does
+    /// not depend on the scheduling of the various binaries, only on the seed and the binary path.
+    pub fn function_filter(&self, binary: &str) -> FunctionFilter {
+        let mut hasher = FnvHasher::default();
+        hasher.write(binary.as_bytes());
+        FunctionFilter {
+            rng: StdRng::seed_from_u64(self.seed ^ hasher.finish()),
+            fraction: self.functions,
+        }
+    }
+}
+
+/// Decides which functions of a binary will be analysed.
+pub struct FunctionFilter {
+    rng: StdRng,
+    fraction: f64,
+}
+
+impl FunctionFilter {
+    /// Returns true if the next function should be analysed.
+    pub fn keep(&mut self) -> bool {
+        self.fraction >= 1.0 || self.rng.gen_bool(self.fraction)
+    }
+}
+
+// Wilson score interval for a proportion `p` observed over `n` trials
+fn wilson(p: f64, n: f64) -> (f64, f64) {
+    if n <= 0.0 {
+        return (0.0, 1.0);
+    }
+    let z2 = Z_95 * Z_95;
+    let center = (p + z2 / (2.0 * n)) / (1.0 + z2 / n);
+    let margin = Z_95 * (p * (1.0 - p) / n + z2 / (4.0 * n * n)).sqrt() / (1.0 + z2 / n);
+    ((center - margin).max(0.0), (center + margin).min(1.0))
+}
+
+// per-stratum statistics of the analysed binaries
+#[derive(Default)]
+struct StratumStats {
+    // amount of analysed functions of each binary analysed successfully
+    functions: Vec<f64>,
+    // amount of cloned functions in the stratum
+    cloned: usize,
+}
+
+// estimates the total of a quantity over the population, given the population of each stratum
+// and the values observed in it. Returns the estimate and its variance, with finite population
+// correction. Strata without observations are not estimated.
+fn stratified_total<'a, I: Iterator<Item = &'a [f64]>>(
+    population: &[usize],
+    values: I,
+) -> (f64, f64) {
+    let mut total = 0.0;
+    let mut variance = 0.0;
+    for (&population, values) in population.iter().zip(values) {
+        if values.is_empty() {
+            continue;
+        }
+        let size = population as f64;
+        let n = values.len() as f64;
+        let mean = values.iter().sum::<f64>() / n;
+        total += size * mean;
+        if values.len() > 1 {
+            let s2 = values.iter().map(|x| (x - mean) * (x - mean)).sum::<f64>() / (n - 1.0);
+            variance += size * size * (1.0 - n / size) * s2 / n;
+        }
+    }
+    (total, variance)
+}
+
+/// Prints to stderr the corpus-level estimates extrapolated from a sampled run.
+///
+/// `functions_per_binary` contains the amount of analysed functions for every sampled binary that
+/// was analysed successfully, indexed by path. Binaries of the sample not contained in it (e.g.
+/// because the disassembler failed) are excluded from the estimate and reported separately.
+///
+/// The estimates are stratified: each stratum is extrapolated to its own population, weighting
+/// each analysed binary by the amount of input binaries it represents in its stratum.
+pub fn print_estimate(
+    sampling: &Sampling,
+    sample: &Sample,
+    functions_per_binary: &FnvHashMap<String, usize>,
+    classes: &[ReportClass],
+) {
+    let fraction_fun = sampling.functions.min(1.0);
+    let mut strata = (0..sample.population.len())
+        .map(|_| StratumStats::default())
+        .collect::<Vec<_>>();
+    let mut stratum_of = FnvHashMap::default();
+    let mut failed = 0;
+    for (binary, &stratum) in sample.binaries.iter().zip(&sample.strata) {
+        match functions_per_binary.get(binary) {
+            Some(&functions) => {
+                strata[stratum].functions.push(functions as f64);
+                stratum_of.insert(binary.as_str(), stratum);
+            }
+            None => failed += 1,
+        }
+    }
+    let analysed_binaries = stratum_of.len();
+    if analysed_binaries == 0 {
+        eprintln!("Sampling: no binary analysed, no estimate available");
+        return;
+    }
+    // a function is cloned if it appears in at least one clone class
+    for (binary, _) in classes
+        .iter()
+        .flat_map(|class| &class.clones)
+        .map(|clone| (clone.binary.path.as_str(), clone.function))
+        .collect::<FnvHashSet<_>>()
+    {
+        if let Some(&stratum) = stratum_of.get(binary) {
+            strata[stratum].cloned += 1;
+        }
+    }
+    // amount of input binaries represented by each analysed binary of a stratum
+    let weights = strata
+        .iter()
+        .zip(&sample.population)
+        .map(|(stats, &population)| {
+            if stats.functions.is_empty() {
+                0.0
+            } else {
+                population as f64 / stats.functions.len() as f64
+            }
+        })
+        .collect::<Vec<_>>();
+    let mut analysed = 0.0;
+    let mut cloned = 0.0;
+    let mut unrepresented = 0;
+    for ((stats, &population), &weight) in strata.iter().zip(&sample.population).zip(&weights) {
+        if stats.functions.is_empty() {
+            unrepresented += population;
+        }
+        analysed += weight * stats.functions.iter().sum::<f64>();
+        cloned += weight * stats.cloned as f64;
+    }
+    let functions = strata.iter().map(|stats| stats.functions.as_slice());
+    let (total, variance) = stratified_total(&sample.population, functions);
+    let total = total / fraction_fun;
+    let total_margin = Z_95 * variance.sqrt() / fraction_fun;
+    let sampled_functions = functions_per_binary.values().sum::<usize>();
+    let rate = if analysed > 0.0 {
+        cloned / analysed
+    } else {
+        0.0
+    };
+    let (rate_low, rate_high) = wilson(rate, sampled_functions as f64);
+    eprintln!("----- SAMPLING ESTIMATE (95% confidence) -----");
+    eprintln!(
+        "Sampled {} of {} binaries, {:.1}% of their functions (seed {})",
+        sample.binaries.len(),
+        sample.population.iter().sum::<usize>(),
+        fraction_fun * 100.0,
+        sampling.seed
+    );
+    if failed > 0 {
+        eprintln!(
+            "{} sampled binaries could not be analysed and are excluded from the estimate",
+            failed
+        );
+    }
+    if unrepresented > 0 {
+        eprintln!(
+            "{} binaries belong to strata without any analysed binary and are not estimated",
+            unrepresented
+        );
+    }
+    eprintln!(
+        "Estimated functions: {:.0} [{:.0}, {:.0}]",
+        total,
+        (total - total_margin).max(sampled_functions as f64),
+        total + total_margin
+    );
+    eprintln!(
+        "Estimated clone rate: {:.2}% [{:.2}%, {:.2}%]",
+        rate * 100.0,
+        rate_low * 100.0,
+        rate_high * 100.0
+    );
+    eprintln!(
+        "Estimated cloned functions: {:.0} [{:.0}, {:.0}]",
+        rate * total,
+        rate_low * (total - total_margin).max(0.0),
+        rate_high * (total + total_margin)
+    );
+    eprintln!("NOTE: sampling removes clone partners, so the clone rate is a lower bound");
+    let mut largest = classes.iter().collect::<Vec<_>>();
+    largest.sort_unstable_by_key(|class| Reverse(class.len()));
+    for class in largest.into_iter().take(TOP_CLASSES) {
+        let first = &class.clones[0];
+        let estimated = class
+            .clones
+            .iter()
+            .map(|clone| {
+                let binary = clone.binary.path.as_str();
+                stratum_of.get(binary).map_or(0.0, |&s| weights[s])
+            })
+            .sum::<f64>()
+            / fraction_fun;
+        eprintln!(
+            "Class ({}) of {} sampled clones, ~{:.0} estimated: {} :: {}",
+            class.depth,
+            class.len(),
+            estimated,
+            first.binary.path,
+            first.function
+        );
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{stratified_total, wilson, SampleStrategy, Sampling};
+    use std::error::Error;
+    use tempfile::TempDir;
+
+    fn sampling(binaries: f64, functions: f64) -> Sampling {
+        Sampling {
+            binaries,
+            functions,
+            strategy: SampleStrategy::Uniform,
+            seed: 42,
+        }
+    }
+
+    #[test]
+    fn sample_binaries_deterministic() {
+        let input = (0..100).map(|i| format!("bin{}", i)).collect::<Vec<_>>();
+        let a = sampling(0.1, 1.0).sample_binaries(&input);
+        let b = sampling(0.1, 1.0).sample_binaries(&input);
+        assert_eq!(a.binaries.len(), 10);
+        assert_eq!(a.population, vec![100]);
+        assert_eq!(a, b);
+    }
+
+    #[test]
+    fn sample_binaries_all() {
+        let input = (0..10).map(|i| format!("bin{}", i)).collect::<Vec<_>>();
+        assert_eq!(sampling(1.0, 0.5).sample_binaries(&input).binaries, input);
+    }
+
+    #[test]
+    fn sample_binaries_stratified() -> Result<(), Box<dyn Error>> {
+        let dir = TempDir::new()?;
+        let mut input = Vec::new();
+        // 20 small binaries and a single big one
+        for (index, size) in [1; 20].into_iter().chain([4096]).enumerate() {
+            let path = dir.path().join(index.to_string());
+            std::fs::write(&path, vec![0; size])?;
+            input.push(path.to_str().unwrap().to_string());
+        }
+        let mut sampling = sampling(0.1, 1.0);
+        sampling.strategy = SampleStrategy::Stratified;
+        let sample = sampling.sample_binaries(&input);
+        assert_eq!(sample.population, vec![20, 1]);
+        assert_eq!(sample.binaries.len(), 3);
+        assert_eq!(sample.strata.iter().filter(|&&s| s == 1).count(), 1);
+        assert_eq!(sample.binaries.last(), input.last());
+        Ok(())
+    }
+
+    #[test]
+    fn function_filter_deterministic() {
+        let sampling = sampling(1.0, 0.5);
+        let mut a = sampling.function_filter("bin");
+        let mut b = sampling.function_filter("bin");
+        let picks_a = (0..1000).map(|_| a.keep()).collect::<Vec<_>>();
+        let picks_b = (0..1000).map(|_| b.keep()).collect::<Vec<_>>();
+        assert_eq!(picks_a, picks_b);
+        let kept = picks_a.into_iter().filter(|&x| x).count();
+        assert!(kept > 400 && kept < 600);
+    }
+
+    #[test]
+    fn stratified_total_weighted() {
+        // 100 small binaries sampled twice, a single big one sampled once
+        let values = [vec![10.0, 10.0], vec![1000.0]];
+        let (total, variance) = stratified_total(&[100, 1], values.iter().map(Vec::as_slice));
+        assert_eq!(total, 2000.0);
+        assert_eq!(variance, 0.0);
+        let values = [vec![5.0, 15.0], vec![]];
+        let (total, variance) = stratified_total(&[10, 3], values.iter().map(Vec::as_slice));
+        assert_eq!(total, 100.0);
+        assert_eq!(variance, 10.0 * 10.0 * 0.8 * 50.0 / 2.0);
+    }
+
+    #[test]
+    fn wilson_interval() {
+        let (low, high) = wilson(0.5, 100.0);
+        assert!(low < 0.5 && high > 0.5);
+        assert!((0.5 - low - (high - 0.5)).abs() < 1e-9);
+        assert_eq!(wilson(0.0, 0.0), (0.0, 1.0));
+    }
+}
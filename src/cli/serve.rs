@@ -0,0 +1,792 @@
+use crate::cli::metadata::BinaryInfo;
+use crate::cli::report::{self, write_json_str, ReportClass, ReportClone};
+use bincc::analysis::{FVec, SemanticComparator, StructureSignature};
+use fnv::{FnvHashMap, FnvHashSet};
+use std::collections::{BTreeMap, HashMap, VecDeque};
+use std::io::{self, ErrorKind, Write};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+use tokio::io::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+
+/// Maximum size of a single frame, in bytes.
+pub const MAX_FRAME: usize = 16 << 20;
+/// Amount of latencies kept for each kind of request when computing the percentiles.
+const LATENCY_WINDOW: usize = 4096;
+/// Names of the kinds of request, in the order of [Request::kind].
+pub const REQUEST_KINDS: [&str; 3] = ["analyse", "topk", "metrics"];
+/// Amount of bands of the locality sensitive hash of the frequency vectors.
+const LSH_BANDS: usize = 8;
+/// Bits of each band of the locality sensitive hash of the frequency vectors.
+const LSH_BAND_BITS: u32 = 8;
+
+/// Reads a frame: a 32-bit big endian length followed by the payload.
+///
+/// Returns [None] if the stream ended before the frame started.
+pub async fn read_frame<R: AsyncRead + Unpin>(input: &mut R) -> Result<Option<Vec<u8>>, io::Error> {
+    let mut len = [0; 4];
+    match input.read_exact(&mut len).await {
+        Ok(_) => (),
+        Err(error) if error.kind() == ErrorKind::UnexpectedEof => return Ok(None),
+        Err(error) => return Err(error),
+    }
+    let len = u32::from_be_bytes(len) as usize;
+    if len > MAX_FRAME {
+        return Err(io::Error::new(
+            ErrorKind::InvalidData,
+            format!("frame of {} bytes exceeds the maximum size", len),
+        ));
+    }
+    let mut payload = vec![0; len];
+    input.read_exact(&mut payload).await?;
+    Ok(Some(payload))
+}
+
+/// Writes a frame: a 32-bit big endian length followed by the payload.
+pub async fn write_frame<W: AsyncWrite + Unpin>(
+    output: &mut W,
+    payload: &[u8],
+) -> Result<(), io::Error> {
+    output
+        .write_all(&(payload.len() as u32).to_be_bytes())
+        .await?;
+    output.write_all(payload).await?;
+    output.flush().await
+}
+
+/// A request received by the server.
+///
+/// Each request is a frame containing its fields separated by tabs, the first one being the
+/// kind of request.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Request {
+    /// `analyse <path>`: analyses a binary, adds it to the index and returns its clone classes.
+    Analyse(String),
+    /// `topk <binary> <function> <k>`: returns the `k` indexed functions most similar to the
+    /// given one.
+    TopK {
+        binary: String,
+        function: String,
+        k: usize,
+    },
+    /// `metrics`: returns the queue depth and the latencies of each kind of request.
+    Metrics,
+}
+
+impl Request {
+    /// Parses the payload of a frame.
+    pub fn parse(payload: &[u8]) -> Result<Request, String> {
+        let payload = std::str::from_utf8(payload).map_err(|_| "request is not UTF-8")?;
+        let fields = payload.split('\t').collect::<Vec<_>>();
+        match fields.as_slice() {
+            ["analyse", path] if !path.is_empty() => Ok(Request::Analyse(path.to_string())),
+            ["topk", binary, function, k] => match k.parse::<usize>() {
+                Ok(k) => Ok(Request::TopK {
+                    binary: binary.to_string(),
+                    function: function.to_string(),
+                    k,
+                }),
+                Err(_) => Err(format!("invalid amount of results {}", k)),
+            },
+            ["metrics"] => Ok(Request::Metrics),
+            _ => Err(format!(
+                "expected one of: analyse<TAB>path, topk<TAB>binary<TAB>function<TAB>k, metrics. \
+                 Got {}",
+                payload.escape_debug()
+            )),
+        }
+    }
+
+    /// Returns the index of the kind of this request in [REQUEST_KINDS].
+    pub fn kind(&self) -> usize {
+        match self {
+            Request::Analyse(_) => 0,
+            Request::TopK { .. } => 1,
+            Request::Metrics => 2,
+        }
+    }
+}
+
+// a subtree of an indexed function
+struct IndexedSubtree {
+    bin: u32,
+    func: u32,
+    // index of the subtree in the signature of the function
+    node: usize,
+    depth: u32,
+}
+
+// an indexed function
+struct IndexedFunction {
+    structure: Option<StructureSignature>,
+    fvec: Option<FVec>,
+    // structural hashes of the subtrees, without duplicates, to remove them from the index
+    hashes: Vec<u64>,
+    // locality sensitive hash of the fvec, empty without fvec
+    bands: Vec<u16>,
+}
+
+// the entries of each binary in a bucket, so a binary is removed without scanning the others
+type Bucket<T> = BTreeMap<u32, Vec<T>>;
+
+// removes the entries of a binary from a bucket, and the bucket if it is left empty
+fn remove_from_bucket<K: std::hash::Hash + Eq, T>(
+    buckets: &mut FnvHashMap<K, Bucket<T>>,
+    key: K,
+    bin: u32,
+) {
+    if let Some(bucket) = buckets.get_mut(&key) {
+        bucket.remove(&bin);
+        if bucket.is_empty() {
+            buckets.remove(&key);
+        }
+    }
+}
+
+// finalizer of splitmix64, spreading the bits of an opcode id over the whole word
+fn mix(mut x: u64) -> u64 {
+    x = (x ^ (x >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)).wrapping_mul(0x94d049bb133111eb);
+    x ^ (x >> 31)
+}
+
+// random hyperplane hash of a frequency vector, split in bands: vectors with a high cosine
+// similarity share at least a band with high probability. Bit i of mix(opcode) is the sign of
+// the opcode component of hyperplane i, so no hyperplane is stored
+fn lsh_bands(fvec: &FVec) -> Vec<u16> {
+    let mut projections = [0.0f32; LSH_BANDS * LSH_BAND_BITS as usize];
+    for (opcode, frequency) in fvec.frequencies() {
+        let signs = mix(opcode as u64);
+        for (plane, projection) in projections.iter_mut().enumerate() {
+            if signs & (1 << plane) != 0 {
+                *projection += frequency;
+            } else {
+                *projection -= frequency;
+            }
+        }
+    }
+    projections
+        .chunks(LSH_BAND_BITS as usize)
+        .enumerate()
+        .map(|(band, planes)| {
+            let bits = planes
+                .iter()
+                .enumerate()
+                .filter(|(_, projection)| **projection >= 0.0)
+                .fold(0, |bits, (bit, _)| bits | 1 << bit);
+            (band as u16) << LSH_BAND_BITS | bits
+        })
+        .collect()
+}
+
+/// An indexed function similar to the one given to [ServeIndex::top_k].
+#[derive(Debug, Clone, PartialEq)]
+pub struct Neighbour {
+    /// Id of the binary containing the function.
+    pub bin: u32,
+    /// Id of the function.
+    pub func: u32,
+    /// Depth of the deepest structure shared with the queried function, 0 if none.
+    pub depth: u32,
+    /// Cosine similarity with the queried function, if both have a frequency vector.
+    pub similarity: Option<f32>,
+}
+
+/// In-memory index of the functions analysed by the server.
+///
+/// The subtrees of each function are indexed by structural hash, as in
+/// [CFSComparator](bincc::analysis::CFSComparator), so the clones of a new binary are found
+/// without comparing again the whole corpus. Frequency vectors are indexed by a locality
+/// sensitive hash, so [ServeIndex::top_k] scores only the functions likely to be similar.
+pub struct ServeIndex {
+    min_depth: u32,
+    // None if the semantic comparison is disabled
+    min_similarity: Option<f32>,
+    hashes: FnvHashMap<u64, Bucket<IndexedSubtree>>,
+    // function ids of each band of the locality sensitive hash
+    bands: FnvHashMap<u16, Bucket<u32>>,
+    functions: FnvHashMap<(u32, u32), IndexedFunction>,
+    // ids of the functions of each binary
+    by_binary: FnvHashMap<u32, Vec<u32>>,
+    binaries: FnvHashMap<u32, BinaryInfo>,
+    // binary and function names, indexed by id
+    names: FnvHashMap<u32, String>,
+}
+
+impl ServeIndex {
+    /// Creates an empty index.
+    ///
+    /// Clones must be at least `min_depth` nested structures deep and, if `min_similarity` is
+    /// set, have a cosine similarity greater than it.
+    pub fn new(min_depth: u32, min_similarity: Option<f32>) -> ServeIndex {
+        ServeIndex {
+            min_depth,
+            min_similarity,
+            hashes: FnvHashMap::default(),
+            bands: FnvHashMap::default(),
+            functions: FnvHashMap::default(),
+            by_binary: FnvHashMap::default(),
+            binaries: FnvHashMap::default(),
+            names: FnvHashMap::default(),
+        }
+    }
+
+    /// Returns the amount of indexed binaries.
+    pub fn binaries(&self) -> usize {
+        self.binaries.len()
+    }
+
+    /// Returns the amount of indexed functions.
+    pub fn functions(&self) -> usize {
+        self.functions.len()
+    }
+
+    /// Returns the metadata of an indexed binary.
+    pub fn binary(&self, bin: u32) -> Option<&BinaryInfo> {
+        self.binaries.get(&bin)
+    }
+
+    /// Returns the name of a binary or function, given its id.
+    pub fn name(&self, id: u32) -> &str {
+        self.names.get(&id).map(String::as_str).unwrap_or("")
+    }
+
+    /// Adds the names assigned by the interner since the last update.
+    ///
+    /// The interner assigns ids sequentially, so only the ids not yet known are copied.
+    pub fn update_names(&mut self, interner: &HashMap<String, u32>) {
+        if interner.len() != self.names.len() {
+            for (name, id) in interner {
+                self.names.entry(*id).or_insert_with(|| name.clone());
+            }
+        }
+    }
+
+    /// Adds a binary and its functions, given as `(function id, structure, fvec)`.
+    ///
+    /// If the binary was already indexed, its previous functions are replaced.
+    pub fn insert(
+        &mut self,
+        info: BinaryInfo,
+        functions: Vec<(u32, Option<StructureSignature>, Option<FVec>)>,
+    ) {
+        let bin = info.id;
+        self.remove(bin);
+        let mut ids = Vec::with_capacity(functions.len());
+        for (func, structure, fvec) in functions {
+            let mut hashes = Vec::new();
+            if let Some(structure) = &structure {
+                for subtree in structure.subtrees(self.min_depth) {
+                    let indexed = IndexedSubtree {
+                        bin,
+                        func,
+                        node: subtree.index(),
+                        depth: subtree.depth(),
+                    };
+                    let hash = subtree.fingerprint();
+                    hashes.push(hash);
+                    self.hashes
+                        .entry(hash)
+                        .or_default()
+                        .entry(bin)
+                        .or_default()
+                        .push(indexed);
+                }
+            }
+            hashes.sort_unstable();
+            hashes.dedup();
+            let bands = fvec.as_ref().map(lsh_bands).unwrap_or_default();
+            for band in &bands {
+                let bucket = self.bands.entry(*band).or_default();
+                bucket.entry(bin).or_default().push(func);
+            }
+            let function = IndexedFunction {
+                structure,
+                fvec,
+                hashes,
+                bands,
+            };
+            self.functions.insert((bin, func), function);
+            ids.push(func);
+        }
+        self.by_binary.insert(bin, ids);
+        self.binaries.insert(bin, info);
+    }
+
+    /// Removes a binary and its functions from the index.
+    pub fn remove(&mut self, bin: u32) {
+        if let Some(ids) = self.by_binary.remove(&bin) {
+            for func in ids {
+                if let Some(function) = self.functions.remove(&(bin, func)) {
+                    for hash in function.hashes {
+                        remove_from_bucket(&mut self.hashes, hash, bin);
+                    }
+                    for band in function.bands {
+                        remove_from_bucket(&mut self.bands, band, bin);
+                    }
+                }
+            }
+        }
+        self.binaries.remove(&bin);
+    }
+
+    /// Returns the clone classes containing at least a function of the given binary.
+    ///
+    /// Classes are sorted by depth, deepest first.
+    pub fn clones(&self, bin: u32) -> Vec<ReportClass<'_>> {
+        let mut touched = FnvHashSet::default();
+        for func in self.by_binary.get(&bin).into_iter().flatten() {
+            touched.extend(&self.functions[&(bin, *func)].hashes);
+        }
+        let mut seen = FnvHashSet::default();
+        let mut classes = Vec::new();
+        for hash in touched {
+            let bucket = &self.hashes[&hash];
+            if bucket.values().map(Vec::len).sum::<usize>() < 2 {
+                continue;
+            }
+            let candidates = if let Some(min_similarity) = self.min_similarity {
+                // same refinement of the structural classes done by the main command
+                let mut comps = SemanticComparator::new(min_similarity);
+                for indexed in bucket.values().flatten() {
+                    let function = &self.functions[&(indexed.bin, indexed.func)];
+                    if let (Some(fvec), Some(structure)) = (&function.fvec, &function.structure) {
+                        let subtree = structure.subtree(indexed.node);
+                        comps.insert(indexed.bin, indexed.func, fvec, subtree);
+                    }
+                }
+                comps
+                    .clones(&self.names)
+                    .into_iter()
+                    .map(|class| ReportClass::from_class(class, None, &self.binaries, &self.names))
+                    .collect()
+            } else {
+                let mut subtrees = bucket.values().flatten().peekable();
+                vec![ReportClass {
+                    depth: subtrees.peek().map(|subtree| subtree.depth).unwrap_or(0),
+                    clones: subtrees
+                        .map(|subtree| ReportClone {
+                            binary: &self.binaries[&subtree.bin],
+                            function: self.name(subtree.func),
+                            basic_blocks: None,
+                        })
+                        .collect(),
+                }]
+            };
+            for class in candidates {
+                if class.clones.iter().any(|clone| clone.binary.id == bin)
+                    && seen.insert((class.depth, class.fingerprint()))
+                {
+                    classes.push(class);
+                }
+            }
+        }
+        classes.sort_unstable_by_key(|class| (std::cmp::Reverse(class.depth), class.fingerprint()));
+        classes
+    }
+
+    /// Returns the `k` indexed functions most similar to the given one, or [None] if the
+    /// function is not indexed.
+    ///
+    /// Functions are ranked by the depth of the deepest structure shared with the given one,
+    /// and then by the cosine similarity of their frequency vectors.
+    ///
+    /// Only the functions sharing a structure or a band of the locality sensitive hash of the
+    /// frequency vector are scored, so a function sharing no structure and with a low
+    /// similarity may be missing even if fewer than `k` results are returned.
+    pub fn top_k(&self, bin: u32, func: u32, k: usize) -> Option<Vec<Neighbour>> {
+        let query = self.functions.get(&(bin, func))?;
+        // candidates, with the depth of the deepest structure shared with the query
+        let mut depths = FnvHashMap::default();
+        for hash in &query.hashes {
+            for other in self.hashes[hash].values().flatten() {
+                let depth = depths.entry((other.bin, other.func)).or_insert(0);
+                *depth = other.depth.max(*depth);
+            }
+        }
+        for band in &query.bands {
+            for (other_bin, funcs) in &self.bands[band] {
+                for other_func in funcs {
+                    depths.entry((*other_bin, *other_func)).or_insert(0);
+                }
+            }
+        }
+        let mut neighbours = Vec::new();
+        for ((other_bin, other_func), depth) in depths {
+            if (other_bin, other_func) == (bin, func) {
+                continue;
+            }
+            let other = &self.functions[&(other_bin, other_func)];
+            let similarity = match (&query.fvec, &other.fvec) {
+                (Some(a), Some(b)) => Some(a.cosine_similarity(b)),
+                _ => None,
+            };
+            if depth > 0 || similarity.is_some() {
+                neighbours.push(Neighbour {
+                    bin: other_bin,
+                    func: other_func,
+                    depth,
+                    similarity,
+                });
+            }
+        }
+        neighbours.sort_unstable_by(|a, b| {
+            b.depth
+                .cmp(&a.depth)
+                .then(
+                    b.similarity
+                        .unwrap_or(-1.0)
+                        .total_cmp(&a.similarity.unwrap_or(-1.0)),
+                )
+                .then((a.bin, a.func).cmp(&(b.bin, b.func)))
+        });
+        neighbours.truncate(k);
+        Some(neighbours)
+    }
+}
+
+/// Latencies of the most recent requests of a single kind.
+#[derive(Debug, Clone, Default)]
+pub struct Latencies {
+    window: VecDeque<Duration>,
+    // amount of requests ever recorded
+    count: u64,
+}
+
+impl Latencies {
+    /// Records the latency of a request, forgetting the oldest one if the window is full.
+    pub fn record(&mut self, latency: Duration) {
+        if self.window.len() == LATENCY_WINDOW {
+            self.window.pop_front();
+        }
+        self.window.push_back(latency);
+        self.count += 1;
+    }
+
+    /// Returns the given percentiles (in the range [0, 1]) of the recent latencies, using the
+    /// nearest rank.
+    pub fn percentiles(&self, percentiles: &[f64]) -> Vec<Option<Duration>> {
+        let mut sorted = self.window.iter().copied().collect::<Vec<_>>();
+        sorted.sort_unstable();
+        percentiles
+            .iter()
+            .map(|p| {
+                let rank = (p * sorted.len() as f64).ceil() as usize;
+                sorted.get(rank.max(1) - 1).copied()
+            })
+            .collect()
+    }
+}
+
+/// Load of the server, shared by all the connections.
+pub struct ServeStats {
+    started: Instant,
+    /// Amount of analyses waiting for a free slot.
+    pub waiting: AtomicUsize,
+    /// Amount of analyses in progress.
+    pub running: AtomicUsize,
+    latencies: Mutex<[Latencies; REQUEST_KINDS.len()]>,
+}
+
+impl Default for ServeStats {
+    fn default() -> Self {
+        ServeStats {
+            started: Instant::now(),
+            waiting: AtomicUsize::new(0),
+            running: AtomicUsize::new(0),
+            latencies: Mutex::default(),
+        }
+    }
+}
+
+impl ServeStats {
+    /// Records the latency of a request of the given kind.
+    pub fn record(&self, kind: usize, latency: Duration) {
+        self.latencies.lock().unwrap()[kind].record(latency);
+    }
+
+    /// Writes the metrics of the server as a JSON object.
+    ///
+    /// Latencies are the 50th, 90th and 99th percentile and the maximum of the most recent
+    /// requests of each kind, in microseconds.
+    pub fn write_json<W: Write>(
+        &self,
+        out: &mut W,
+        slots: usize,
+        index: &ServeIndex,
+    ) -> Result<(), io::Error> {
+        write!(
+            out,
+            "{{\"ok\":true,\"uptime_us\":{},\"queue\":{{\"waiting\":{},\"running\":{},\
+             \"slots\":{}}},\"index\":{{\"binaries\":{},\"functions\":{}}},\"latency_us\":{{",
+            self.started.elapsed().as_micros(),
+            self.waiting.load(Ordering::Relaxed),
+            self.running.load(Ordering::Relaxed),
+            slots,
+            index.binaries(),
+            index.functions(),
+        )?;
+        let latencies = self.latencies.lock().unwrap().clone();
+        for (index, (kind, latencies)) in REQUEST_KINDS.iter().zip(&latencies).enumerate() {
+            if index > 0 {
+                out.write_all(b",")?;
+            }
+            write!(out, "\"{}\":{{\"count\":{}", kind, latencies.count)?;
+            let names = ["p50", "p90", "p99", "max"];
+            let values = latencies.percentiles(&[0.5, 0.9, 0.99, 1.0]);
+            for (name, value) in names.iter().zip(values) {
+                match value {
+                    Some(value) => write!(out, ",\"{}\":{}", name, value.as_micros())?,
+                    None => write!(out, ",\"{}\":null", name)?,
+                }
+            }
+            out.write_all(b"}")?;
+        }
+        out.write_all(b"}}")
+    }
+}
+
+/// Writes the response to a failed request.
+pub fn write_error<W: Write>(out: &mut W, error: &str) -> Result<(), io::Error> {
+    out.write_all(b"{\"ok\":false,\"error\":")?;
+    write_json_str(out, error)?;
+    out.write_all(b"}")
+}
+
+/// Writes the response to an `analyse` request: the analysed binary and its clone classes.
+pub fn write_clones<W: Write>(
+    out: &mut W,
+    binary: &BinaryInfo,
+    functions: usize,
+    classes: &[ReportClass],
+) -> Result<(), io::Error> {
+    out.write_all(b"{\"ok\":true,\"binary\":")?;
+    write_json_str(out, &binary.path)?;
+    write!(
+        out,
+        ",\"functions\":{},\"elapsed_us\":{},\"classes\":[",
+        functions,
+        binary.elapsed.as_micros()
+    )?;
+    for (index, class) in classes.iter().enumerate() {
+        if index > 0 {
+            out.write_all(b",")?;
+        }
+        report::write_json_class(out, class, index, false)?;
+    }
+    out.write_all(b"]}")
+}
+
+/// Writes the response to a `topk` request.
+pub fn write_neighbours<W: Write>(
+    out: &mut W,
+    index: &ServeIndex,
+    neighbours: &[Neighbour],
+) -> Result<(), io::Error> {
+    out.write_all(b"{\"ok\":true,\"functions\":[")?;
+    for (position, neighbour) in neighbours.iter().enumerate() {
+        if position > 0 {
+            out.write_all(b",")?;
+        }
+        out.write_all(b"{\"binary\":")?;
+        write_json_str(out, index.name(neighbour.bin))?;
+        out.write_all(b",\"function\":")?;
+        write_json_str(out, index.name(neighbour.func))?;
+        write!(out, ",\"depth\":{},\"similarity\":", neighbour.depth)?;
+        match neighbour.similarity {
+            Some(similarity) => write!(out, "{:.4}", similarity)?,
+            None => out.write_all(b"null")?,
+        }
+        out.write_all(b"}")?;
+    }
+    out.write_all(b"]}")
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{read_frame, write_frame, Latencies, Request, ServeIndex, ServeStats};
+    use crate::cli::metadata::BinaryInfo;
+    use bincc::analysis::{BlockType, CFGGenerator, FVec, StructureSignature, CFS};
+    use std::collections::HashMap;
+    use std::time::Duration;
+
+    fn info(id: u32, path: &str) -> BinaryInfo {
+        BinaryInfo {
+            id,
+            path: path.to_string(),
+            arch: "x86".to_string(),
+            bits: 64,
+            size: 0,
+            hash: 0,
+            elapsed: Duration::ZERO,
+        }
+    }
+
+    fn structure(seed: u64) -> StructureSignature {
+        let regions = [BlockType::IfThenElse, BlockType::While];
+        let cfg = CFGGenerator::new(seed).with_regions(&regions).generate(20);
+        StructureSignature::new(&CFS::new(&cfg).get_tree().unwrap())
+    }
+
+    // ids 0..3 are the binaries a, b, c, ids 10.. the functions
+    fn index(min_similarity: Option<f32>) -> ServeIndex {
+        let mut index = ServeIndex::new(2, min_similarity);
+        let mut names = HashMap::new();
+        for (name, id) in [
+            ("a", 0),
+            ("b", 1),
+            ("c", 2),
+            ("f", 10),
+            ("g", 11),
+            ("h", 12),
+        ] {
+            names.insert(name.to_string(), id);
+        }
+        index.update_names(&names);
+        let fvec = |x: f32| Some(FVec::from_frequencies([(0, x), (1, 1.0)]));
+        index.insert(
+            info(0, "a"),
+            vec![
+                (10, Some(structure(1)), fvec(1.0)),
+                (11, Some(structure(2)), fvec(1.0)),
+            ],
+        );
+        index.insert(info(1, "b"), vec![(10, Some(structure(1)), fvec(1.0))]);
+        index.insert(info(2, "c"), vec![(12, Some(structure(1)), fvec(10.0))]);
+        index
+    }
+
+    #[tokio::test]
+    async fn frames() {
+        let mut buffer = Vec::new();
+        write_frame(&mut buffer, b"metrics").await.unwrap();
+        write_frame(&mut buffer, b"").await.unwrap();
+        assert_eq!(&buffer[..4], &[0, 0, 0, 7]);
+        let mut input = buffer.as_slice();
+        assert_eq!(read_frame(&mut input).await.unwrap().unwrap(), b"metrics");
+        assert_eq!(read_frame(&mut input).await.unwrap().unwrap(), b"");
+        assert!(read_frame(&mut input).await.unwrap().is_none());
+        let mut truncated: &[u8] = &[0, 0, 0, 7, b'm'];
+        assert!(read_frame(&mut truncated).await.is_err());
+        let mut huge: &[u8] = &[0xFF, 0, 0, 0];
+        assert!(read_frame(&mut huge).await.is_err());
+    }
+
+    #[test]
+    fn requests() {
+        assert_eq!(
+            Request::parse(b"analyse\t/bin/my ls"),
+            Ok(Request::Analyse("/bin/my ls".to_string()))
+        );
+        assert_eq!(
+            Request::parse(b"topk\t/bin/ls\tmain\t5"),
+            Ok(Request::TopK {
+                binary: "/bin/ls".to_string(),
+                function: "main".to_string(),
+                k: 5
+            })
+        );
+        assert_eq!(Request::parse(b"metrics"), Ok(Request::Metrics));
+        assert!(Request::parse(b"topk\t/bin/ls\tmain").is_err());
+        assert!(Request::parse(b"analyse\t").is_err());
+        assert!(Request::parse(&[0xFF]).is_err());
+    }
+
+    #[test]
+    fn clones_of_binary() {
+        let structural = index(None);
+        let classes = structural.clones(1);
+        assert!(!classes.is_empty());
+        // every class contains b, and the deepest one is the whole function in a, b and c
+        assert!(classes
+            .iter()
+            .all(|class| class.clones.iter().any(|clone| clone.binary.path == "b")));
+        assert_eq!(classes[0].len(), 3);
+        assert!(classes.windows(2).all(|w| w[0].depth >= w[1].depth));
+        // c has a different frequency vector, so it is not a semantic clone
+        let combined = index(Some(0.99));
+        let classes = combined.clones(1);
+        assert_eq!(classes[0].len(), 2);
+        assert!(classes
+            .iter()
+            .all(|class| class.clones.iter().all(|clone| clone.binary.path != "c")));
+    }
+
+    #[test]
+    fn replace_and_remove() {
+        let mut index = index(None);
+        assert_eq!(index.functions(), 4);
+        index.insert(info(1, "b"), vec![(11, Some(structure(2)), None)]);
+        assert_eq!(index.functions(), 4);
+        // the whole function is now shared only with a
+        let depth = structure(2).root().depth();
+        let classes = index.clones(1);
+        assert_eq!(classes[0].depth, depth);
+        assert_eq!(classes[0].len(), 2);
+        index.remove(0);
+        assert_eq!(index.binaries(), 2);
+        assert!(index.clones(1).iter().all(|class| class.depth < depth));
+        index.remove(1);
+        index.remove(2);
+        assert!(index.hashes.is_empty() && index.bands.is_empty());
+    }
+
+    #[test]
+    fn top_k() {
+        let index = index(Some(0.99));
+        let neighbours = index.top_k(0, 10, 10).unwrap();
+        assert_eq!(neighbours.len(), 3);
+        assert_eq!((neighbours[0].bin, neighbours[0].func), (1, 10));
+        assert_eq!(neighbours[0].depth, structure(1).root().depth());
+        assert!(neighbours[0].similarity.unwrap() > 0.99);
+        assert_eq!((neighbours[1].bin, neighbours[1].func), (2, 12));
+        assert_eq!(index.top_k(0, 10, 1).unwrap().len(), 1);
+        assert!(index.top_k(0, 12, 1).is_none());
+    }
+
+    #[test]
+    fn top_k_candidates() {
+        let mut index = index(Some(0.99));
+        // no structure and an orthogonal frequency vector: never scored
+        let orthogonal = FVec::from_frequencies([(7, 1.0)]);
+        index.insert(info(3, "d"), vec![(13, None, Some(orthogonal))]);
+        let neighbours = index.top_k(0, 10, 10).unwrap();
+        assert_eq!(neighbours.len(), 3);
+        assert!(neighbours.iter().all(|neighbour| neighbour.bin != 3));
+        // a scaled copy has the same hash, so it is found without sharing any structure
+        let scaled = FVec::from_frequencies([(0, 2.0), (1, 2.0)]);
+        index.insert(info(3, "d"), vec![(13, None, Some(scaled))]);
+        let neighbours = index.top_k(0, 10, 10).unwrap();
+        let found = neighbours
+            .iter()
+            .find(|neighbour| neighbour.bin == 3)
+            .unwrap();
+        assert_eq!(found.depth, 0);
+        assert!(found.similarity.unwrap() > 0.99);
+    }
+
+    #[test]
+    fn latency_percentiles() {
+        let mut latencies = Latencies::default();
+        assert_eq!(latencies.percentiles(&[0.5]), vec![None]);
+        for millis in (1..=100).rev() {
+            latencies.record(Duration::from_millis(millis));
+        }
+        let values = latencies.percentiles(&[0.5, 0.99, 1.0]);
+        let expected = [50, 99, 100].map(|millis| Some(Duration::from_millis(millis)));
+        assert_eq!(values, expected);
+    }
+
+    #[test]
+    fn metrics_json() {
+        let stats = ServeStats::default();
+        stats.record(1, Duration::from_micros(30));
+        let mut out = Vec::new();
+        stats.write_json(&mut out, 4, &index(None)).unwrap();
+        let json = serde_json::from_slice::<serde_json::Value>(&out).unwrap();
+        assert_eq!(json["queue"]["slots"], 4);
+        assert_eq!(json["index"]["functions"], 4);
+        assert_eq!(json["latency_us"]["topk"]["p99"], 30);
+        assert!(json["latency_us"]["analyse"]["p50"].is_null());
+    }
+}
@@ -0,0 +1,141 @@
+use bincc::disasm::radare2::{R2Disasm, R2Session, ReplayLatency};
+use std::io::{self, ErrorKind};
+use std::path::PathBuf;
+use std::time::Duration;
+
+/// Directory of radare2 sessions, with a file for each analysed binary.
+///
+/// When recording, every command issued to radare2 is saved in the directory. When replaying,
+/// the recorded outputs are served instead of running radare2, so the analysis can be repeated
+/// on any machine even without the original binaries.
+#[derive(Debug, Clone)]
+pub struct Sessions {
+    dir: PathBuf,
+    // None if recording
+    replay: Option<ReplayLatency>,
+}
+
+impl Sessions {
+    /// Records the sessions in the given directory, creating it if missing.
+    pub fn record(dir: &str) -> Result<Sessions, io::Error> {
+        std::fs::create_dir_all(dir)?;
+        Ok(Sessions {
+            dir: PathBuf::from(dir),
+            replay: None,
+        })
+    }
+
+    /// Replays the sessions recorded in the given directory.
+    pub fn replay(dir: &str, latency: ReplayLatency) -> Sessions {
+        Sessions {
+            dir: PathBuf::from(dir),
+            replay: Some(latency),
+        }
+    }
+
+    /// Creates the disassembler for a binary.
+    ///
+    /// If replaying, the disassembler serves the recorded session of the binary. Otherwise
+    /// radare2 is spawned and, if recording, every command is recorded.
+    pub async fn open(sessions: Option<&Sessions>, binary: &str) -> Result<R2Disasm, io::Error> {
+        match sessions {
+            Some(Sessions {
+                dir,
+                replay: Some(latency),
+            }) => match R2Session::from_file(dir.join(session_name(binary))) {
+                Ok(session) => Ok(R2Disasm::replay(session, *latency)),
+                Err(error) => Err(io::Error::new(ErrorKind::NotFound, error.to_string())),
+            },
+            Some(Sessions { replay: None, .. }) => {
+                let mut disassembler = R2Disasm::new(binary).await?;
+                disassembler.record();
+                Ok(disassembler)
+            }
+            None => R2Disasm::new(binary).await,
+        }
+    }
+
+    /// Saves the session recorded by the disassembler of a binary, if any.
+    pub fn save(&self, binary: &str, disassembler: &mut R2Disasm) -> Result<(), io::Error> {
+        match disassembler.take_session() {
+            Some(session) => session.to_file(self.dir.join(session_name(binary))),
+            None => Ok(()),
+        }
+    }
+}
+
+// name of the file containing the session of a binary, unique for each path
+fn session_name(binary: &str) -> String {
+    let name = binary
+        .chars()
+        .map(|c| {
+            if c.is_ascii_alphanumeric() || c == '.' {
+                c
+            } else {
+                '_'
+            }
+        })
+        .collect::<String>();
+    format!("{}-{:016x}.r2session", name, path_hash(binary))
+}
+
+// FNV-1a of the path, so paths differing only in replaced characters are kept apart
+fn path_hash(binary: &str) -> u64 {
+    binary.bytes().fold(0xcbf29ce484222325, |hash, byte| {
+        (hash ^ byte as u64).wrapping_mul(0x100000001b3)
+    })
+}
+
+/// Parses the latency of the replayed commands.
+///
+/// Accepts `none`, `recorded`, a factor of the recorded latency like `0.5x` or a fixed latency
+/// in milliseconds like `20ms`.
+pub fn parse_latency(value: &str) -> Result<ReplayLatency, String> {
+    let parsed = match value {
+        "none" => Some(ReplayLatency::None),
+        "recorded" => Some(ReplayLatency::Recorded(1.0)),
+        _ => {
+            if let Some(factor) = value.strip_suffix('x') {
+                factor
+                    .parse::<f64>()
+                    .ok()
+                    .filter(|factor| factor.is_finite() && *factor >= 0.0)
+                    .map(ReplayLatency::Recorded)
+            } else if let Some(millis) = value.strip_suffix("ms") {
+                millis
+                    .parse::<u64>()
+                    .ok()
+                    .map(|millis| ReplayLatency::Fixed(Duration::from_millis(millis)))
+            } else {
+                None
+            }
+        }
+    };
+    parsed.ok_or_else(|| "expected none, recorded, a factor like 0.5x or a time like 20ms".into())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{parse_latency, session_name};
+    use bincc::disasm::radare2::ReplayLatency;
+    use std::time::Duration;
+
+    #[test]
+    fn latency() {
+        assert_eq!(parse_latency("none"), Ok(ReplayLatency::None));
+        assert_eq!(parse_latency("recorded"), Ok(ReplayLatency::Recorded(1.0)));
+        assert_eq!(parse_latency("0.5x"), Ok(ReplayLatency::Recorded(0.5)));
+        assert_eq!(
+            parse_latency("20ms"),
+            Ok(ReplayLatency::Fixed(Duration::from_millis(20)))
+        );
+        assert!(parse_latency("-1x").is_err());
+        assert!(parse_latency("20").is_err());
+    }
+
+    #[test]
+    fn session_names() {
+        assert!(session_name("/bin/ls").starts_with("_bin_ls-"));
+        assert_ne!(session_name("/bin/a_b"), session_name("/bin/a/b"));
+    }
+}
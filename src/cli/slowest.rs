@@ -0,0 +1,264 @@
+use bincc::analysis::CFG;
+use std::cmp::{Ordering, Reverse};
+use std::collections::BinaryHeap;
+use std::io;
+use std::path::Path;
+use std::sync::Arc;
+use std::time::Duration;
+
+/// Stages of the analysis of a single function tracked by [Slowest].
+pub const STAGES: [&str; 3] = ["cfg", "cfs", "fvec"];
+
+/// Cost of the analysis of a single function.
+#[derive(Debug, Clone)]
+pub struct FunctionCost {
+    /// Path of the binary containing the function.
+    pub binary: String,
+    /// Name of the function.
+    pub function: String,
+    /// Amount of basic blocks in the CFG.
+    pub blocks: usize,
+    /// Amount of edges in the CFG.
+    pub edges: usize,
+    /// Amount of reductions applied while building the CFS.
+    pub iterations: usize,
+    /// True if the CFS construction was stopped by the build tolerance.
+    pub tolerance_exceeded: bool,
+    /// Time spent in each stage, in the same order of [STAGES].
+    pub elapsed: [Duration; 3],
+}
+
+// a retained function, with its CFG only if it will be dumped
+#[derive(Debug)]
+struct Retained {
+    cost: FunctionCost,
+    cfg: Option<CFG>,
+}
+
+// a function in the heap of a stage, ordered by the time spent in that stage only
+#[derive(Debug, Clone)]
+struct Entry(Duration, Arc<Retained>);
+
+impl PartialEq for Entry {
+    fn eq(&self, other: &Self) -> bool {
+        self.0 == other.0
+    }
+}
+
+impl Eq for Entry {}
+
+impl PartialOrd for Entry {
+    fn partial_cmp(&self, other: &Self) -> Option<Ordering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for Entry {
+    fn cmp(&self, other: &Self) -> Ordering {
+        self.0.cmp(&other.0)
+    }
+}
+
+/// The most expensive functions of each stage of the analysis.
+///
+/// Each stage keeps a bounded min-heap, so only the `capacity` slowest functions are retained.
+#[derive(Debug, Clone)]
+pub struct Slowest {
+    capacity: usize,
+    keep_cfgs: bool,
+    heaps: [BinaryHeap<Reverse<Entry>>; 3],
+}
+
+impl Slowest {
+    /// Creates an empty set of slowest functions, retaining at most `capacity` of them per stage.
+    ///
+    /// If `keep_cfgs` is true, the CFG of the retained functions is kept so it can be dumped with
+    /// [Slowest::dump].
+    pub fn new(capacity: usize, keep_cfgs: bool) -> Slowest {
+        Slowest {
+            capacity,
+            keep_cfgs,
+            heaps: Default::default(),
+        }
+    }
+
+    /// Returns true if a function with the given stage times would be retained.
+    ///
+    /// Use this to avoid building the [FunctionCost] of a function that would be discarded.
+    pub fn would_keep(&self, elapsed: &[Duration; 3]) -> bool {
+        self.heaps.iter().zip(elapsed).any(|(heap, elapsed)| {
+            self.capacity > 0
+                && (heap.len() < self.capacity
+                    || heap.peek().map(|Reverse(min)| *elapsed > min.0) == Some(true))
+        })
+    }
+
+    /// Inserts a function, along with its CFG.
+    pub fn push(&mut self, cost: FunctionCost, cfg: CFG) {
+        let cfg = if self.keep_cfgs { Some(cfg) } else { None };
+        self.push_shared(Arc::new(Retained { cost, cfg }));
+    }
+
+    fn push_shared(&mut self, cost: Arc<Retained>) {
+        for (stage, heap) in self.heaps.iter_mut().enumerate() {
+            let elapsed = cost.cost.elapsed[stage];
+            if heap.len() < self.capacity {
+                heap.push(Reverse(Entry(elapsed, cost.clone())));
+            } else if let Some(mut min) = heap.peek_mut() {
+                if elapsed > min.0 .0 {
+                    *min = Reverse(Entry(elapsed, cost.clone()));
+                }
+            }
+        }
+    }
+
+    /// Adds the functions retained by another instance.
+    pub fn merge(&mut self, other: Slowest) {
+        for cost in other.functions() {
+            self.push_shared(cost);
+        }
+    }
+
+    // every retained function, once
+    fn functions(self) -> Vec<Arc<Retained>> {
+        let mut functions = self
+            .heaps
+            .into_iter()
+            .flat_map(|heap| heap.into_iter().map(|Reverse(entry)| entry.1))
+            .collect::<Vec<_>>();
+        functions.sort_unstable_by_key(|cost| Arc::as_ptr(cost) as usize);
+        functions.dedup_by_key(|cost| Arc::as_ptr(cost) as usize);
+        functions
+    }
+
+    // functions retained for the stage at the given index of STAGES, slowest first
+    fn ranking(&self, stage: usize) -> Vec<&Retained> {
+        let mut entries = self.heaps[stage].iter().collect::<Vec<_>>();
+        entries.sort_unstable();
+        entries
+            .into_iter()
+            .map(|Reverse(entry)| &*entry.1)
+            .collect()
+    }
+
+    /// Prints the slowest functions of each stage to stderr.
+    ///
+    /// If the CFGs were dumped, the name of the file of each function is printed too.
+    pub fn print(&self) {
+        for (stage, name) in STAGES.iter().enumerate() {
+            let ranking = self.ranking(stage);
+            if ranking.is_empty() {
+                continue;
+            }
+            eprintln!("Slowest functions ({}):", name);
+            for (rank, Retained { cost, cfg }) in ranking.into_iter().enumerate() {
+                let dump = if cfg.is_some() {
+                    format!(" [{}]", dump_name(name, rank))
+                } else {
+                    String::new()
+                };
+                eprintln!(
+                    "    {:>10} µs {} :: {} ({} blocks, {} edges, {} iterations{}){}",
+                    cost.elapsed[stage].as_micros(),
+                    cost.binary,
+                    cost.function,
+                    cost.blocks,
+                    cost.edges,
+                    cost.iterations,
+                    if cost.tolerance_exceeded {
+                        ", tolerance exceeded"
+                    } else {
+                        ""
+                    },
+                    dump
+                );
+            }
+        }
+    }
+
+    /// Writes the CFG of the retained functions in the given directory.
+    ///
+    /// Each CFG is written with [CFG::to_file] and named after the stage and the rank of the
+    /// function, as printed by [Slowest::print].
+    pub fn dump<S: AsRef<Path>>(&self, dir: S) -> Result<(), io::Error> {
+        std::fs::create_dir_all(&dir)?;
+        for (stage, name) in STAGES.iter().enumerate() {
+            for (rank, retained) in self.ranking(stage).into_iter().enumerate() {
+                if let Some(cfg) = &retained.cfg {
+                    cfg.to_file(dir.as_ref().join(dump_name(name, rank)))?;
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
+// name of the file containing the CFG of a function in the ranking of a stage
+fn dump_name(stage: &str, rank: usize) -> String {
+    format!("{}-{:03}.dot", stage, rank + 1)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{FunctionCost, Slowest};
+    use bincc::analysis::CFG;
+    use bincc::disasm::Architecture;
+    use std::error::Error;
+    use std::time::Duration;
+    use tempfile::TempDir;
+
+    fn cost(function: &str, cfg: u64, cfs: u64) -> FunctionCost {
+        FunctionCost {
+            binary: "bin".to_string(),
+            function: function.to_string(),
+            blocks: 0,
+            edges: 0,
+            iterations: 0,
+            tolerance_exceeded: false,
+            elapsed: [
+                Duration::from_micros(cfg),
+                Duration::from_micros(cfs),
+                Duration::ZERO,
+            ],
+        }
+    }
+
+    fn empty() -> CFG {
+        CFG::new(&[], 0, Architecture::X86(64))
+    }
+
+    fn names(slowest: &Slowest, stage: usize) -> Vec<&str> {
+        slowest
+            .ranking(stage)
+            .into_iter()
+            .map(|retained| retained.cost.function.as_str())
+            .collect()
+    }
+
+    #[test]
+    fn bounded_per_stage() {
+        let mut slowest = Slowest::new(2, false);
+        let mut other = Slowest::new(2, false);
+        slowest.push(cost("a", 10, 1), empty());
+        slowest.push(cost("b", 30, 2), empty());
+        assert!(slowest.would_keep(&cost("", 20, 0).elapsed));
+        assert!(!slowest.would_keep(&cost("", 5, 0).elapsed));
+        other.push(cost("c", 20, 3), empty());
+        other.push(cost("d", 1, 50), empty());
+        slowest.merge(other);
+        assert_eq!(names(&slowest, 0), vec!["b", "c"]);
+        assert_eq!(names(&slowest, 1), vec!["d", "c"]);
+        assert!(!Slowest::new(0, false).would_keep(&cost("", 20, 0).elapsed));
+    }
+
+    #[test]
+    fn dump_cfgs() -> Result<(), Box<dyn Error>> {
+        let dir = TempDir::new()?;
+        let mut slowest = Slowest::new(1, true);
+        slowest.push(cost("a", 10, 1), empty());
+        slowest.dump(dir.path())?;
+        assert!(dir.path().join("cfg-001.dot").exists());
+        assert!(dir.path().join("cfs-001.dot").exists());
+        Ok(())
+    }
+}
@@ -0,0 +1,155 @@
+use std::collections::{HashMap, HashSet};
+use std::io;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, Instant, SystemTime};
+
+/// Changes found by a [Scanner].
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct ScanResult {
+    /// Files added or modified, that did not change for the whole debounce time.
+    pub ready: Vec<PathBuf>,
+    /// Files previously reported as ready, that no longer exist.
+    pub removed: Vec<PathBuf>,
+}
+
+// last observed state of a file
+struct FileState {
+    size: u64,
+    modified: Option<SystemTime>,
+    // when this state was first observed
+    since: Instant,
+    // whether this state was already reported as ready
+    reported: bool,
+}
+
+/// Polls a directory and its subdirectories for new or modified files.
+///
+/// A file is reported only after its size and modification time stayed the same for the
+/// debounce time, so files still being copied are not analysed halfway. Hidden files, whose
+/// name starts with a dot, are ignored as they are often temporary files of a copy in progress.
+pub struct Scanner {
+    dir: PathBuf,
+    debounce: Duration,
+    files: HashMap<PathBuf, FileState>,
+}
+
+impl Scanner {
+    /// Creates a scanner for the given directory.
+    ///
+    /// Files already in the directory are reported as new by the first scans.
+    pub fn new<S: AsRef<Path>>(dir: S, debounce: Duration) -> Scanner {
+        Scanner {
+            dir: dir.as_ref().to_path_buf(),
+            debounce,
+            files: HashMap::new(),
+        }
+    }
+
+    /// Looks for changes since the previous scan, `now` being the current time.
+    pub fn scan(&mut self, now: Instant) -> Result<ScanResult, io::Error> {
+        let mut result = ScanResult::default();
+        let mut seen = HashSet::new();
+        let mut stack = vec![self.dir.clone()];
+        while let Some(dir) = stack.pop() {
+            for entry in std::fs::read_dir(&dir)? {
+                let entry = entry?;
+                if entry.file_name().to_string_lossy().starts_with('.') {
+                    continue;
+                }
+                // the file may have been removed in the meantime
+                let meta = match entry.metadata() {
+                    Ok(meta) => meta,
+                    Err(_) => continue,
+                };
+                let path = entry.path();
+                if meta.is_dir() {
+                    stack.push(path);
+                    continue;
+                } else if !meta.is_file() {
+                    continue;
+                }
+                let size = meta.len();
+                let modified = meta.modified().ok();
+                match self.files.get_mut(&path) {
+                    Some(state) if state.size == size && state.modified == modified => {
+                        if !state.reported && now.duration_since(state.since) >= self.debounce {
+                            state.reported = true;
+                            result.ready.push(path.clone());
+                        }
+                    }
+                    _ => {
+                        let state = FileState {
+                            size,
+                            modified,
+                            since: now,
+                            reported: self.debounce.is_zero(),
+                        };
+                        if state.reported {
+                            result.ready.push(path.clone());
+                        }
+                        self.files.insert(path.clone(), state);
+                    }
+                }
+                seen.insert(path);
+            }
+        }
+        let removed = &mut result.removed;
+        self.files.retain(|path, state| {
+            let keep = seen.contains(path);
+            if !keep && state.reported {
+                removed.push(path.clone());
+            }
+            keep
+        });
+        result.ready.sort_unstable();
+        result.removed.sort_unstable();
+        Ok(result)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Scanner;
+    use std::error::Error;
+    use std::fs;
+    use std::time::{Duration, Instant};
+    use tempfile::TempDir;
+
+    #[test]
+    fn debounced_changes() -> Result<(), Box<dyn Error>> {
+        let dir = TempDir::new()?;
+        let binary = dir.path().join("nested").join("a.out");
+        fs::create_dir(dir.path().join("nested"))?;
+        fs::write(&binary, b"partial")?;
+        fs::write(dir.path().join(".copying"), b"temporary")?;
+        let start = Instant::now();
+        let at = |secs| start + Duration::from_secs(secs);
+        let mut scanner = Scanner::new(dir.path(), Duration::from_secs(10));
+        assert!(scanner.scan(at(0))?.ready.is_empty());
+        assert!(scanner.scan(at(5))?.ready.is_empty());
+        // still being written: the debounce restarts
+        fs::write(&binary, b"partial and complete")?;
+        assert!(scanner.scan(at(9))?.ready.is_empty());
+        assert!(scanner.scan(at(15))?.ready.is_empty());
+        assert_eq!(scanner.scan(at(19))?.ready, vec![binary.clone()]);
+        // reported only once
+        assert!(scanner.scan(at(40))?.ready.is_empty());
+        fs::remove_file(&binary)?;
+        let result = scanner.scan(at(41))?;
+        assert!(result.ready.is_empty());
+        assert_eq!(result.removed, vec![binary]);
+        Ok(())
+    }
+
+    #[test]
+    fn no_debounce() -> Result<(), Box<dyn Error>> {
+        let dir = TempDir::new()?;
+        fs::write(dir.path().join("b"), b"b")?;
+        fs::write(dir.path().join("a"), b"a")?;
+        let mut scanner = Scanner::new(dir.path(), Duration::ZERO);
+        let ready = scanner.scan(Instant::now())?.ready;
+        assert_eq!(ready, vec![dir.path().join("a"), dir.path().join("b")]);
+        assert!(scanner.scan(Instant::now())?.ready.is_empty());
+        Ok(())
+    }
+}
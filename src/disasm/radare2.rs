@@ -1,14 +1,23 @@
 use crate::disasm::architectures::Architecture;
 use crate::disasm::{Statement, StatementFamily};
+use crate::trace;
 use fnv::{FnvHashMap, FnvHashSet};
 use lazy_static::lazy_static;
 use r2pipe::{R2PipeAsync, R2PipeSpawnOptions};
 use regex::Regex;
-use std::collections::HashMap;
-use std::io::ErrorKind;
+use std::collections::{HashMap, VecDeque};
+use std::error::Error;
+use std::fs::File;
+use std::future::Future;
+use std::io::{BufRead, BufReader, BufWriter, ErrorKind, Read, Write};
+use std::path::Path;
 use std::str::FromStr;
+use std::time::{Duration, Instant};
 use std::{fs, io};
 
+/// First line of a file written by [R2Session::to_file].
+const SESSION_HEADER: &str = "bincc-r2-session 1";
+
 /// A very basic Control Flow Graph.
 ///
 /// This crate provide a more advanced version in [crate::analysis::CFG].
@@ -30,14 +39,278 @@ pub struct BareCFG {
     pub edges: Vec<(u64, u64)>,
 }
 
-/// Disassembler using the radare2 backend.
+/// Time spent by radare2 executing a single command.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct CommandStats {
+    /// Number of times the command was issued.
+    pub calls: u32,
+    /// Total time spent waiting for the command output.
+    pub elapsed: Duration,
+}
+
+/// A command issued to radare2, along with its output.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct R2Command {
+    /// The command, including its arguments.
+    pub command: String,
+    /// Output of the command, or the error message if it failed.
+    ///
+    /// The output of the commands returning JSON is stored as JSON text.
+    pub response: Result<String, String>,
+    /// Time spent by radare2 executing the command.
+    pub elapsed: Duration,
+}
+
+/// Every command issued to radare2 while analysing a binary, in order.
 ///
-/// Using this struct requires having installed radare2, with the `r2` binary on the path.
-pub struct R2Disasm {
+/// A session is recorded with [R2Disasm::record] and can be served back by [R2Disasm::replay]
+/// without radare2 installed, so the analysis of a binary can be repeated on any machine with
+/// exactly the same disassembler output.
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct R2Session {
+    /// Commands issued in the session.
+    pub commands: Vec<R2Command>,
+}
+
+impl R2Session {
+    /// Saves the session to a file.
+    ///
+    /// The file starts with a header line, followed by each command in the form
+    /// `command\tok|err\telapsed_ns\tlength`, a newline, `length` bytes of output and another
+    /// newline.
+    pub fn to_file<S: AsRef<Path>>(&self, filename: S) -> Result<(), io::Error> {
+        let mut file = BufWriter::new(File::create(filename)?);
+        writeln!(file, "{}", SESSION_HEADER)?;
+        for cmd in &self.commands {
+            let (status, response) = match &cmd.response {
+                Ok(response) => ("ok", response),
+                Err(error) => ("err", error),
+            };
+            writeln!(
+                file,
+                "{}\t{}\t{}\t{}",
+                cmd.command,
+                status,
+                cmd.elapsed.as_nanos(),
+                response.len()
+            )?;
+            file.write_all(response.as_bytes())?;
+            writeln!(file)?;
+        }
+        file.flush()
+    }
+
+    /// Retrieves a session previously saved with the [`R2Session::to_file`] method.
+    ///
+    /// This method returns [std::io::Error] in case of malformed input or
+    /// [std::num::ParseIntError] in case the input file contains non-parsable numbers.
+    pub fn from_file<S: AsRef<Path>>(filename: S) -> Result<R2Session, Box<dyn Error>> {
+        let mut file = BufReader::new(File::open(filename)?);
+        let mut line = String::new();
+        file.read_line(&mut line)?;
+        if line.trim_end() != SESSION_HEADER {
+            return Err(Box::new(io::Error::new(
+                ErrorKind::InvalidInput,
+                "unexpected input filetype",
+            )));
+        }
+        let mut session = R2Session::default();
+        loop {
+            line.clear();
+            if file.read_line(&mut line)? == 0 {
+                break;
+            }
+            let fields = line.trim_end_matches('\n').split('\t').collect::<Vec<_>>();
+            if fields.len() != 4 {
+                return Err(Box::new(io::Error::new(
+                    ErrorKind::InvalidData,
+                    "malformed command",
+                )));
+            }
+            let elapsed = Duration::from_nanos(fields[2].parse()?);
+            let mut response = vec![0; fields[3].parse::<usize>()? + 1];
+            file.read_exact(&mut response)?;
+            response.pop();
+            let response = String::from_utf8(response)?;
+            let response = match fields[1] {
+                "ok" => Ok(response),
+                "err" => Err(response),
+                _ => {
+                    return Err(Box::new(io::Error::new(
+                        ErrorKind::InvalidData,
+                        "unknown command status",
+                    )))
+                }
+            };
+            session.commands.push(R2Command {
+                command: fields[0].to_string(),
+                response,
+                elapsed,
+            });
+        }
+        Ok(session)
+    }
+}
+
+/// Delay added to each command served by [R2Disasm::replay].
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum ReplayLatency {
+    /// Commands are answered immediately.
+    None,
+    /// Each command takes the time it took when recorded, multiplied by the given factor.
+    Recorded(f64),
+    /// Each command takes the given time.
+    Fixed(Duration),
+}
+
+// pipe to the external r2 process
+struct Pipe {
+    pipe: R2PipeAsync,
+    // process id of r2, if it could be retrieved
+    pid: Option<i32>,
+    // true while waiting for the output of a command
+    busy: bool,
+}
+
+impl Drop for Pipe {
+    // an idle r2 quits when its input is closed, but one dropped while executing a command (e.g.
+    // because the task analysing the binary was aborted) would keep running until the command
+    // ends, which for the analysis of a big binary may take hours
+    fn drop(&mut self) {
+        #[cfg(unix)]
+        if let (true, Some(pid)) = (self.busy, self.pid) {
+            // SAFETY: kill has no memory safety requirements. The process is still running, as
+            // it did not answer the last command yet, so the pid was not reused.
+            unsafe {
+                libc::kill(pid, libc::SIGKILL);
+            }
+        }
+    }
+}
+
+// source of the commands output
+enum Backend {
     // pipe to the external r2 command.
     // no need for a mutex as it is not possible to invoke commands to the same external process
     // at the same time (this struct does not implement copy or clone)
-    pipe: R2PipeAsync,
+    Pipe(Pipe),
+    Replay(Replay),
+}
+
+// recorded session served back to the disassembler
+struct Replay {
+    // recorded outputs, indexed by the seek at the time of the command and the command itself,
+    // in the order they were issued
+    commands: FnvHashMap<(Option<u64>, String), VecDeque<R2Command>>,
+    // recorded outputs of the seek commands, indexed by the target offset
+    seeks: FnvHashMap<u64, R2Command>,
+    // current seek, None until the first successful seek
+    seek: Option<u64>,
+    latency: ReplayLatency,
+}
+
+impl Replay {
+    fn new(session: R2Session, latency: ReplayLatency) -> Replay {
+        let mut commands = FnvHashMap::<_, VecDeque<_>>::default();
+        let mut seeks = FnvHashMap::default();
+        let mut seek = None;
+        for cmd in session.commands {
+            if let Some(target) = seek_target(&cmd.command) {
+                if cmd.response.is_ok() {
+                    seek = Some(target);
+                }
+                seeks.entry(target).or_insert(cmd);
+            } else {
+                commands
+                    .entry((seek, cmd.command.clone()))
+                    .or_default()
+                    .push_back(cmd);
+            }
+        }
+        Replay {
+            commands,
+            seeks,
+            seek: None,
+            latency,
+        }
+    }
+
+    // returns the recorded output of a command, updating the seek
+    fn next(&mut self, cmd: &str) -> Result<R2Command, String> {
+        let recorded = match seek_target(cmd) {
+            // seeking does not depend on the state of radare2, so it can be repeated freely
+            Some(target) => {
+                let recorded = self.seeks.get(&target).cloned();
+                if matches!(&recorded, Some(recorded) if recorded.response.is_ok()) {
+                    self.seek = Some(target);
+                }
+                recorded
+            }
+            None => self
+                .commands
+                .get_mut(&(self.seek, cmd.to_string()))
+                .and_then(VecDeque::pop_front),
+        };
+        recorded.ok_or_else(|| match self.seek {
+            Some(seek) => format!(
+                "command {} at offset {} not found in the session",
+                cmd, seek
+            ),
+            None => format!("command {} not found in the session", cmd),
+        })
+    }
+}
+
+impl Backend {
+    async fn cmd(&mut self, cmd: &str) -> Result<String, String> {
+        match self {
+            Backend::Pipe(pipe) => {
+                pipe.busy = true;
+                let result = pipe.pipe.cmd(cmd).await.map_err(|error| error.to_string());
+                pipe.busy = false;
+                result
+            }
+            Backend::Replay(replay) => {
+                let recorded = replay.next(cmd)?;
+                let delay = match replay.latency {
+                    ReplayLatency::None => Duration::ZERO,
+                    ReplayLatency::Recorded(factor) => recorded.elapsed.mul_f64(factor),
+                    ReplayLatency::Fixed(delay) => delay,
+                };
+                if !delay.is_zero() {
+                    tokio::time::sleep(delay).await;
+                }
+                recorded.response
+            }
+        }
+    }
+
+    async fn cmdj(&mut self, cmd: &str) -> Result<serde_json::Value, String> {
+        match self {
+            Backend::Pipe(pipe) => {
+                pipe.busy = true;
+                let result = pipe.pipe.cmdj(cmd).await.map_err(|error| error.to_string());
+                pipe.busy = false;
+                result
+            }
+            Backend::Replay(..) => {
+                let text = self.cmd(cmd).await?;
+                serde_json::from_str(&text).map_err(|error| error.to_string())
+            }
+        }
+    }
+}
+
+/// Disassembler using the radare2 backend.
+///
+/// Using this struct requires having installed radare2, with the `r2` binary on the path, unless
+/// it is replaying a recorded session.
+pub struct R2Disasm {
+    backend: Backend,
+    // commands issued so far, if recording
+    session: Option<R2Session>,
+    // time spent on each command, indexed by the command name without arguments
+    stats: FnvHashMap<String, CommandStats>,
 }
 
 impl R2Disasm {
@@ -56,7 +329,24 @@ impl R2Disasm {
             };
             let maybe_pipe = R2PipeAsync::spawn(binary, Some(flags)).await;
             match maybe_pipe {
-                Ok(pipe) => Ok(Self { pipe }),
+                Ok(mut pipe) => {
+                    // `$p` is the pid of r2, used to kill it if dropped while busy
+                    let pid = pipe
+                        .cmd("?vi $p")
+                        .await
+                        .ok()
+                        .and_then(|pid| pid.trim().parse().ok());
+                    let pipe = Pipe {
+                        pipe,
+                        pid,
+                        busy: false,
+                    };
+                    Ok(Self {
+                        backend: Backend::Pipe(pipe),
+                        session: None,
+                        stats: FnvHashMap::default(),
+                    })
+                }
                 Err(err) => Err(io::Error::new(ErrorKind::BrokenPipe, err)),
             }
         } else {
@@ -64,9 +354,44 @@ impl R2Disasm {
         }
     }
 
+    /// Creates a disassembler answering with the output recorded in a session.
+    ///
+    /// Each command receives the output it received when recorded at the same seek, so the
+    /// functions can be retrieved in any order or only partially (e.g. with a different function
+    /// filter). A command issued at the same seek more times than recorded receives the outputs in
+    /// the recorded order. Commands never recorded at the current seek, or issued more times than
+    /// recorded, fail as if radare2 returned an error.
+    pub fn replay(session: R2Session, latency: ReplayLatency) -> Self {
+        Self {
+            backend: Backend::Replay(Replay::new(session, latency)),
+            session: None,
+            stats: FnvHashMap::default(),
+        }
+    }
+
+    /// Starts recording every command issued to radare2, along with its output.
+    ///
+    /// The recorded session can be retrieved with [R2Disasm::take_session].
+    pub fn record(&mut self) {
+        self.session = Some(R2Session::default());
+    }
+
+    /// Stops recording and returns the commands recorded since calling [R2Disasm::record].
+    pub fn take_session(&mut self) -> Option<R2Session> {
+        self.session.take()
+    }
+
+    /// Returns the time spent on each command issued to radare2 so far.
+    ///
+    /// The map is indexed by the command name, without its arguments, so every seek is accounted
+    /// under `s` regardless of the offset.
+    pub fn command_stats(&self) -> &FnvHashMap<String, CommandStats> {
+        &self.stats
+    }
+
     /// Performs analysis on the underlying binary.
     pub async fn analyse(&mut self) {
-        match self.pipe.cmd("aaa").await {
+        match self.cmd("aaa").await {
             Ok(_) => {}
             Err(error) => {
                 log::error!("{}", error);
@@ -79,8 +404,8 @@ impl R2Disasm {
     /// The default implementation calls [R2Disasm::analyse] thus performing a full-binary
     /// analysis.
     pub async fn analyse_functions(&mut self) {
-        match self.pipe.cmd("aa").await {
-            Ok(_) => match self.pipe.cmd("aac").await {
+        match self.cmd("aa").await {
+            Ok(_) => match self.cmd("aac").await {
                 Ok(_) => {}
                 Err(error) => {
                     log::error!("{}", error);
@@ -98,7 +423,7 @@ impl R2Disasm {
     ///
     /// If the architecture can not be recognized, None is returned.
     pub async fn get_arch(&mut self) -> Option<Architecture> {
-        match self.pipe.cmdj("ij").await {
+        match self.cmdj("ij").await {
             Ok(json) => {
                 let bits = json["bin"]["bits"].as_u64()?;
                 let arch = json["bin"]["arch"].as_str()?;
@@ -137,7 +462,7 @@ impl R2Disasm {
     ///
     /// This operation requires calling [R2Disasm::analyse] first.
     pub async fn get_function_offsets(&mut self) -> FnvHashSet<u64> {
-        match self.pipe.cmdj("aflqj").await {
+        match self.cmdj("aflqj").await {
             Ok(json) => {
                 if let Some(offsets) = json.as_array() {
                     offsets
@@ -162,7 +487,7 @@ impl R2Disasm {
     /// The returned map contains pairs `(function name, offset in the binary)`.
     pub async fn get_function_names(&mut self) -> HashMap<String, u64> {
         let mut retval = HashMap::new();
-        match self.pipe.cmdj("aflj").await {
+        match self.cmdj("aflj").await {
             Ok(json) => {
                 if let Some(funcs) = json.as_array() {
                     for func in funcs {
@@ -187,9 +512,9 @@ impl R2Disasm {
     pub async fn get_basic_block_body(&mut self, offset: u64) -> Option<Vec<Statement>> {
         let mut retval = None;
         let cmd_change_offset = format!("s {}", offset);
-        match self.pipe.cmd(&cmd_change_offset).await {
+        match self.cmd(&cmd_change_offset).await {
             Ok(_) => {
-                if let Ok(json) = self.pipe.cmdj("pdbj").await {
+                if let Ok(json) = self.cmdj("pdbj").await {
                     if let Some(stmts) = json.as_array() {
                         let mut list = Vec::new();
                         for stmt in stmts {
@@ -223,7 +548,7 @@ impl R2Disasm {
     /// This operation requires calling [R2Disasm::analyse] first.
     pub async fn get_function_bodies(&mut self) -> FnvHashMap<u64, Vec<Statement>> {
         let mut retval = FnvHashMap::default();
-        let maybe_json = self.pipe.cmdj("aflqj").await;
+        let maybe_json = self.cmdj("aflqj").await;
         match maybe_json {
             Ok(json) => {
                 if let Some(offsets) = json.as_array() {
@@ -253,9 +578,9 @@ impl R2Disasm {
     pub async fn get_function_body(&mut self, function: u64) -> Option<Vec<Statement>> {
         let mut retval = None;
         let cmd_change_offset = format!("s {}", function);
-        match self.pipe.cmd(&cmd_change_offset).await {
+        match self.cmd(&cmd_change_offset).await {
             Ok(_) => {
-                if let Ok(json) = self.pipe.cmdj("pdfj").await {
+                if let Ok(json) = self.cmdj("pdfj").await {
                     let ops = &json["ops"];
                     if let Some(stmts) = ops.as_array() {
                         let mut list = Vec::new();
@@ -283,6 +608,34 @@ impl R2Disasm {
         retval
     }
 
+    /// Returns the raw bytes composing the given function.
+    ///
+    /// This method takes as input the function offset in the binary and returns its bytes, as
+    /// seen linearly from the function start to its end. None if the function can not be found.
+    ///
+    /// This operation requires calling [R2Disasm::analyse] first.
+    pub async fn get_function_bytes(&mut self, function: u64) -> Option<Vec<u8>> {
+        let mut retval = None;
+        let cmd_change_offset = format!("s {}", function);
+        match self.cmd(&cmd_change_offset).await {
+            Ok(_) => {
+                if let Ok(hex) = self.cmd("p8f").await {
+                    let hex = hex.trim();
+                    if !hex.is_empty() && hex.len() % 2 == 0 {
+                        retval = (0..hex.len())
+                            .step_by(2)
+                            .map(|i| u8::from_str_radix(&hex[i..i + 2], 16).ok())
+                            .collect::<Option<Vec<_>>>();
+                    }
+                }
+            }
+            Err(error) => {
+                log::error!("{}", error);
+            }
+        }
+        retval
+    }
+
     /// Returns a simple CFG for the given function.
     ///
     /// This method takes as input the function offset in the binary and returns its CFG generated
@@ -293,11 +646,9 @@ impl R2Disasm {
     pub async fn get_function_cfg(&mut self, function: u64) -> Option<BareCFG> {
         let mut retval = None;
         let cmd_change_offset = format!("s {}", function);
-        match self.pipe.cmd(&cmd_change_offset).await {
+        match self.cmd(&cmd_change_offset).await {
             Ok(_) => {
-                if let (Ok(bbs), Ok(dot)) =
-                    (self.pipe.cmd("afb").await, self.pipe.cmd("agfdm").await)
-                {
+                if let (Ok(bbs), Ok(dot)) = (self.cmd("afb").await, self.cmd("agfdm").await) {
                     if !bbs.is_empty() && !dot.is_empty() {
                         let blocks = radare_dot_to_bare_cfg_nodes(&bbs);
                         let edges = radare_dot_to_bare_cfg_edges(&dot);
@@ -317,6 +668,63 @@ impl R2Disasm {
     }
 }
 
+impl R2Disasm {
+    // issues a command, recording it if requested
+    async fn cmd(&mut self, cmd: &str) -> Result<String, String> {
+        let start_t = Instant::now();
+        let output = timed(&mut self.stats, cmd, self.backend.cmd(cmd)).await;
+        if let Some(session) = &mut self.session {
+            session.commands.push(R2Command {
+                command: cmd.to_string(),
+                response: output.clone(),
+                elapsed: start_t.elapsed(),
+            });
+        }
+        output
+    }
+
+    // issues a command returning JSON, recording it if requested
+    async fn cmdj(&mut self, cmd: &str) -> Result<serde_json::Value, String> {
+        let start_t = Instant::now();
+        let output = timed(&mut self.stats, cmd, self.backend.cmdj(cmd)).await;
+        if let Some(session) = &mut self.session {
+            session.commands.push(R2Command {
+                command: cmd.to_string(),
+                response: output
+                    .as_ref()
+                    .map(|json| json.to_string())
+                    .map_err(Clone::clone),
+                elapsed: start_t.elapsed(),
+            });
+        }
+        output
+    }
+}
+
+// awaits a command sent to radare2, recording the time spent in the command statistics
+async fn timed<F: Future>(
+    stats: &mut FnvHashMap<String, CommandStats>,
+    cmd: &str,
+    command: F,
+) -> F::Output {
+    let _span = trace::span_with(|| format!("r2 {}", cmd));
+    let start_t = Instant::now();
+    let output = command.await;
+    let name = cmd.split_whitespace().next().unwrap_or_default();
+    let entry = match stats.get_mut(name) {
+        Some(entry) => entry,
+        None => stats.entry(name.to_string()).or_default(),
+    };
+    entry.calls += 1;
+    entry.elapsed += start_t.elapsed();
+    output
+}
+
+// returns the offset of a seek command, as issued by this module
+fn seek_target(cmd: &str) -> Option<u64> {
+    cmd.strip_prefix("s ")?.parse().ok()
+}
+
 fn radare_dot_to_bare_cfg_edges(dot: &str) -> Vec<(u64, u64)> {
     let mut edges = Vec::new();
     lazy_static! {
@@ -367,11 +775,14 @@ fn radare_dot_to_bare_cfg_nodes(bbs: &str) -> Vec<(u64, u64)> {
 
 #[cfg(test)]
 mod tests {
-    use crate::disasm::radare2::{BareCFG, R2Disasm};
+    use crate::disasm::radare2::{BareCFG, R2Command, R2Disasm, R2Session, ReplayLatency};
     use crate::disasm::Architecture;
     use serial_test::serial;
+    use std::error::Error;
     use std::io::ErrorKind;
+    use std::time::Duration;
     use std::{fs, io};
+    use tempfile::TempDir;
 
     #[tokio::test]
     #[serial]
@@ -494,6 +905,22 @@ mod tests {
         Ok(())
     }
 
+    #[tokio::test]
+    async fn command_stats() -> Result<(), io::Error> {
+        let project_root = env!("CARGO_MANIFEST_DIR");
+        let x86_64 = format!("{}/{}", project_root, "resources/tests/x86_64");
+        let mut disassembler = R2Disasm::new(&x86_64).await?;
+        disassembler.analyse().await;
+        disassembler.get_function_body(0x1149).await;
+        disassembler.get_function_body(0x1149).await;
+        let stats = disassembler.command_stats();
+        assert_eq!(stats["aaa"].calls, 1);
+        assert_eq!(stats["s"].calls, 2);
+        assert_eq!(stats["pdfj"].calls, 2);
+        assert!(!stats.contains_key("aflj"));
+        Ok(())
+    }
+
     #[tokio::test]
     async fn function_names() -> Result<(), io::Error> {
         let project_root = env!("CARGO_MANIFEST_DIR");
@@ -589,6 +1016,20 @@ mod tests {
         Ok(())
     }
 
+    #[tokio::test]
+    async fn function_bytes_exist() -> Result<(), io::Error> {
+        let project_root = env!("CARGO_MANIFEST_DIR");
+        let x86_64 = format!("{}/{}", project_root, "resources/tests/x86_64");
+        let mut disassembler = R2Disasm::new(&x86_64).await?;
+        disassembler.analyse().await;
+        let bytes = disassembler.get_function_bytes(0x1000).await;
+        assert!(bytes.is_some());
+        let bytes = bytes.unwrap();
+        assert_eq!(bytes.len(), 0x1B);
+        assert_eq!(bytes.last(), Some(&0xC3));
+        Ok(())
+    }
+
     #[tokio::test]
     async fn function_cfg_not_exist() -> Result<(), io::Error> {
         let project_root = env!("CARGO_MANIFEST_DIR");
@@ -616,4 +1057,98 @@ mod tests {
         assert_eq!(cfg, expected);
         Ok(())
     }
+
+    #[tokio::test]
+    async fn record_replay() -> Result<(), Box<dyn Error>> {
+        let project_root = env!("CARGO_MANIFEST_DIR");
+        let x86_64 = format!("{}/{}", project_root, "resources/tests/x86_64");
+        let mut disassembler = R2Disasm::new(&x86_64).await?;
+        disassembler.record();
+        disassembler.analyse().await;
+        let arch = disassembler.get_arch().await;
+        let body = disassembler.get_function_body(0x1149).await;
+        let cfg = disassembler.get_function_cfg(0x1000).await;
+        let session = disassembler.take_session().unwrap();
+        let dir = TempDir::new()?;
+        let file = dir.path().join("x86_64.r2session");
+        session.to_file(&file)?;
+        let mut replay = R2Disasm::replay(R2Session::from_file(&file)?, ReplayLatency::None);
+        replay.analyse().await;
+        assert_eq!(replay.get_arch().await, arch);
+        assert_eq!(replay.get_function_body(0x1149).await, body);
+        assert_eq!(replay.get_function_cfg(0x1000).await, cfg);
+        assert_eq!(replay.command_stats()["s"].calls, 2);
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn replay_session() -> Result<(), Box<dyn Error>> {
+        let command = |command: &str, response: Result<&str, &str>| R2Command {
+            command: command.to_string(),
+            response: response.map(str::to_string).map_err(str::to_string),
+            elapsed: Duration::from_millis(20),
+        };
+        let session = R2Session {
+            commands: vec![
+                command("ij", Ok("{\"bin\":{\"arch\":\"x86\",\"bits\":64}}")),
+                command("aaa", Ok("")),
+                command("aflqj", Ok("[4096,4352]")),
+                command("aflqj", Ok("[4096]")),
+                command("s 4096", Err("broken pipe\nwith a newline")),
+            ],
+        };
+        let dir = TempDir::new()?;
+        let file = dir.path().join("session");
+        session.to_file(&file)?;
+        assert_eq!(R2Session::from_file(&file)?, session);
+        let latency = ReplayLatency::Fixed(Duration::from_millis(5));
+        let mut replay = R2Disasm::replay(session, latency);
+        replay.record();
+        assert_eq!(replay.get_arch().await, Some(Architecture::X86(64)));
+        assert_eq!(replay.get_function_offsets().await.len(), 2);
+        assert_eq!(replay.get_function_offsets().await.len(), 1);
+        assert!(replay.get_function_offsets().await.is_empty());
+        assert!(replay.get_function_body(4096).await.is_none());
+        assert!(replay.get_function_names().await.is_empty());
+        assert!(replay.command_stats()["ij"].elapsed >= Duration::from_millis(5));
+        let recorded = replay.take_session().unwrap();
+        assert_eq!(recorded.commands.len(), 6);
+        assert_eq!(recorded.commands[2].response, Ok("[4096]".to_string()));
+        assert!(recorded.commands[3].response.is_err());
+        assert!(recorded.commands[5].response.is_err());
+        Ok(())
+    }
+
+    #[tokio::test]
+    async fn replay_different_filter() {
+        let command = |command: &str, response: &str| R2Command {
+            command: command.to_string(),
+            response: Ok(response.to_string()),
+            elapsed: Duration::ZERO,
+        };
+        // recorded analysing the function at 4096 and then the one at 8192
+        let session = R2Session {
+            commands: vec![
+                command("afb", "0x0 0x1 00:0000 1\n"),
+                command("s 4096", ""),
+                command("afb", "0x1000 0x1002 00:0000 2\n"),
+                command("agfdm", "digraph code {\n}\n"),
+                command("s 8192", ""),
+                command("afb", "0x2000 0x2004 00:0000 4\n"),
+                command("agfdm", "digraph code {\n}\n"),
+            ],
+        };
+        let mut replay = R2Disasm::replay(session, ReplayLatency::None);
+        let cfg = replay.get_function_cfg(8192).await.unwrap();
+        assert_eq!(cfg.blocks, vec![(0x2000, 4)]);
+        let cfg = replay.get_function_cfg(4096).await.unwrap();
+        assert_eq!(cfg.blocks, vec![(0x1000, 2)]);
+        // outputs are not repeated, and are served only at the recorded seek
+        assert!(replay.get_function_cfg(4096).await.is_none());
+        assert!(replay.get_function_cfg(12288).await.is_none());
+        assert_eq!(
+            replay.cmd("afb").await.unwrap_err(),
+            "command afb at offset 4096 not found in the session"
+        );
+    }
 }
@@ -8,3 +8,7 @@
 pub mod analysis;
 /// Module providing disassembler bindings.
 pub mod disasm;
+/// Asynchronous analysis of whole binaries, streaming the results of each function.
+pub mod pipeline;
+/// Span instrumentation of the analysis, exported in the Chrome trace event format.
+pub mod trace;
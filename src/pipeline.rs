@@ -0,0 +1,707 @@
+use crate::analysis::{
+    FVec, Graph, LibraryDB, LibrarySignature, ReductionStats, StructureBlock, CFG, CFS,
+};
+use crate::disasm::radare2::R2Disasm;
+use crate::disasm::Architecture;
+use crate::trace;
+use fnv::FnvHashMap;
+use futures_core::Stream;
+use std::collections::HashMap;
+use std::error::Error;
+use std::fmt::{Display, Formatter};
+use std::future::{poll_fn, Future};
+use std::io;
+use std::pin::{pin, Pin};
+use std::sync::{Arc, Mutex};
+use std::task::{Context, Poll};
+use std::time::{Duration, Instant};
+use tokio::sync::mpsc;
+use tokio::time::timeout;
+
+/// Ids assigned to the binary and function names, shared by concurrent analyses.
+///
+/// Ids are assigned sequentially, in order of first appearance.
+pub type StringCache = Arc<Mutex<HashMap<String, u32>>>;
+
+/// Ids assigned to the opcodes counted by the [FVec]s, shared by concurrent analyses.
+pub type OpcodeCache = Arc<Mutex<HashMap<String, u16>>>;
+
+/// Stages of the analysis of a single function.
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum Stage {
+    /// Waiting for the disassembler and parsing its output.
+    ///
+    /// The disassembler runs across several `.await`, so this stage is started again each time
+    /// its future is polled.
+    Disassembler,
+    /// Building the [CFG] from the disassembler output.
+    Cfg,
+    /// Building the [CFS] from the [CFG].
+    Cfs,
+    /// Building the [FVec] from the function statements.
+    FVec,
+}
+
+/// Settings for the analysis of a binary.
+pub struct PipelineOptions {
+    /// Whether the structure of each function is built.
+    pub structural: bool,
+    /// Whether the frequency vector of each function is built.
+    pub semantic: bool,
+    /// Whether the frequency vectors count opcode families, to compare different architectures,
+    /// instead of mnemonics.
+    pub cross_arch: bool,
+    /// Maximum time spent by the disassembler analysing the whole binary.
+    pub timeout: Duration,
+    /// Database of known library functions, excluded from the results.
+    pub libdb: Option<Arc<LibraryDB>>,
+    /// Maximum amount of results produced but not yet consumed.
+    ///
+    /// When the buffer is full, the analysis waits for the consumer.
+    pub buffer: usize,
+    /// Decides which functions are analysed, given their offset.
+    ///
+    /// Functions are visited in increasing order of offset.
+    pub filter: Option<Box<dyn FnMut(u64) -> bool + Send>>,
+    /// Called when each stage of the analysis of a function starts and ends, to attribute
+    /// resources to the stages.
+    pub on_stage: Option<StageHooks>,
+}
+
+/// Functions called at the boundaries of each [Stage].
+///
+/// Plain function pointers, so marking a stage allocates nothing.
+#[derive(Debug, Copy, Clone)]
+pub struct StageHooks {
+    /// Called when a stage starts. The returned value is passed to `exit`.
+    pub enter: fn(Stage) -> usize,
+    /// Called when the stage ends, with the value returned by the matching `enter`.
+    pub exit: fn(usize),
+}
+
+// ends the stage started by StageScope::enter when dropped
+struct StageScope {
+    hooks: Option<StageHooks>,
+    entered: usize,
+}
+
+impl StageScope {
+    #[inline]
+    fn enter(hooks: Option<StageHooks>, stage: Stage) -> StageScope {
+        let entered = match hooks {
+            Some(hooks) => (hooks.enter)(stage),
+            None => 0,
+        };
+        StageScope { hooks, entered }
+    }
+}
+
+impl Drop for StageScope {
+    #[inline]
+    fn drop(&mut self) {
+        if let Some(hooks) = self.hooks {
+            (hooks.exit)(self.entered);
+        }
+    }
+}
+
+impl Default for PipelineOptions {
+    /// Returns the settings building both structures and frequency vectors, for binaries of
+    /// the same architecture.
+    fn default() -> Self {
+        PipelineOptions {
+            structural: true,
+            semantic: true,
+            cross_arch: false,
+            timeout: Duration::MAX,
+            libdb: None,
+            buffer: 64,
+            filter: None,
+            on_stage: None,
+        }
+    }
+}
+
+/// Time spent in each stage of the analysis of a function.
+#[derive(Debug, Copy, Clone, Default, PartialEq, Eq)]
+pub struct FunctionTimings {
+    /// Time spent building the [CFG].
+    pub cfg: Duration,
+    /// Time spent building the [CFS].
+    pub cfs: Duration,
+    /// Time spent building the [FVec], excluding the retrieval of the statements.
+    pub fvec: Duration,
+}
+
+/// Result of the analysis of a single function.
+#[derive(Debug, Clone)]
+pub struct FunctionResult {
+    /// Id of the binary containing the function, assigned by the [StringCache].
+    pub bin: u32,
+    /// Id of the function name, assigned by the [StringCache].
+    pub func: u32,
+    /// Name of the function.
+    pub name: String,
+    /// Offset of the function in the binary.
+    pub offset: u64,
+    /// Control flow graph of the function.
+    pub cfg: CFG,
+    /// Structure of the function, if built and reducible.
+    pub cfs: Option<StructureBlock>,
+    /// Statistics of the construction of the structure, if built.
+    pub reductions: Option<ReductionStats>,
+    /// Frequency vector of the function, if built.
+    pub fvec: Option<FVec>,
+    /// Time spent in each stage.
+    pub timings: FunctionTimings,
+}
+
+/// Reason why a binary could not be analysed.
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum PipelineError {
+    /// The disassembler analysis took longer than [PipelineOptions::timeout].
+    Timeout,
+    /// The disassembler could not recognize the architecture of the binary.
+    UnsupportedArchitecture,
+}
+
+impl Display for PipelineError {
+    fn fmt(&self, f: &mut Formatter<'_>) -> std::fmt::Result {
+        match self {
+            PipelineError::Timeout => write!(f, "timeout"),
+            PipelineError::UnsupportedArchitecture => write!(f, "unsupported architecture"),
+        }
+    }
+}
+
+impl Error for PipelineError {}
+
+/// Summary of the analysis of a binary, available once all its functions have been produced.
+pub struct BinarySummary {
+    /// The disassembler used, to retrieve its statistics or its recorded session.
+    pub disassembler: R2Disasm,
+    /// Id and architecture of the binary, or the reason why it could not be analysed.
+    pub outcome: Result<(u32, Architecture), PipelineError>,
+    /// Time spent by the disassembler analysing the whole binary.
+    pub analysis: Duration,
+    /// Amount of functions accepted by [PipelineOptions::filter].
+    pub visited: usize,
+    /// Amount of functions excluded because found in [PipelineOptions::libdb], per library.
+    pub known: FnvHashMap<String, usize>,
+}
+
+/// Stream of the functions of a binary, in the order they are analysed.
+///
+/// Created by [analyse_functions]. Dropping the stream stops the analysis after the function
+/// currently in progress.
+pub struct FunctionStream {
+    receiver: mpsc::Receiver<FunctionResult>,
+}
+
+impl FunctionStream {
+    /// Waits for the next function, returning [None] when the analysis is over.
+    pub async fn recv(&mut self) -> Option<FunctionResult> {
+        self.receiver.recv().await
+    }
+}
+
+impl Stream for FunctionStream {
+    type Item = FunctionResult;
+
+    fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+        self.receiver.poll_recv(cx)
+    }
+}
+
+/// Opens a binary with radare2 and analyses its functions.
+///
+/// See [analyse_functions] for the returned values.
+pub async fn analyse_binary(
+    binary: &str,
+    strings: StringCache,
+    opcodes: OpcodeCache,
+    options: PipelineOptions,
+) -> Result<(impl Future<Output = BinarySummary> + Send, FunctionStream), io::Error> {
+    let disassembler = R2Disasm::new(binary).await?;
+    Ok(analyse_functions(
+        binary.to_string(),
+        disassembler,
+        strings,
+        opcodes,
+        options,
+    ))
+}
+
+/// Analyses the functions of a binary, streaming each result as soon as it is produced.
+///
+/// `binary` is the name assigned an id in the `strings` cache, usually the path opened by the
+/// disassembler. Function names are assigned an id in the same cache.
+///
+/// Returns the future performing the analysis, resolving to the summary of the binary, and the
+/// stream of its functions. The stream advances only while the future is polled, so the future
+/// should be spawned or joined with the consumer:
+/// ```no_run
+/// use bincc::disasm::radare2::R2Disasm;
+/// use bincc::pipeline::{analyse_functions, PipelineOptions};
+///
+/// # async fn run() -> Result<(), std::io::Error> {
+/// let disassembler = R2Disasm::new("/bin/ls").await?;
+/// let (analysis, mut functions) = analyse_functions(
+///     "/bin/ls".to_string(),
+///     disassembler,
+///     Default::default(),
+///     Default::default(),
+///     PipelineOptions::default(),
+/// );
+/// let consumer = async {
+///     while let Some(function) = functions.recv().await {
+///         println!("{} took {:?}", function.name, function.timings.cfs);
+///     }
+/// };
+/// let (summary, _) = tokio::join!(analysis, consumer);
+/// println!("{} functions visited", summary.visited);
+/// # Ok(())
+/// # }
+/// ```
+pub fn analyse_functions(
+    binary: String,
+    disassembler: R2Disasm,
+    strings: StringCache,
+    opcodes: OpcodeCache,
+    options: PipelineOptions,
+) -> (impl Future<Output = BinarySummary> + Send, FunctionStream) {
+    let (sender, receiver) = mpsc::channel(options.buffer.max(1));
+    let analysis = produce(binary, disassembler, strings, opcodes, options, sender);
+    (analysis, FunctionStream { receiver })
+}
+
+// awaits a command sent to the disassembler inside the disassembler stage
+async fn disassembling<F: Future>(on_stage: Option<StageHooks>, future: F) -> F::Output {
+    if on_stage.is_none() {
+        return future.await;
+    }
+    let mut future = pin!(future);
+    // a stage can not span an .await, so it is started and ended on each poll
+    poll_fn(|cx| {
+        let _stage = StageScope::enter(on_stage, Stage::Disassembler);
+        future.as_mut().poll(cx)
+    })
+    .await
+}
+
+// analyses every function of the binary, sending the results until the stream is dropped
+async fn produce(
+    binary: String,
+    disassembler: R2Disasm,
+    strings: StringCache,
+    opcodes: OpcodeCache,
+    mut options: PipelineOptions,
+    sender: mpsc::Sender<FunctionResult>,
+) -> BinarySummary {
+    let mut summary = BinarySummary {
+        disassembler,
+        outcome: Err(PipelineError::Timeout),
+        analysis: Duration::ZERO,
+        visited: 0,
+        known: FnvHashMap::default(),
+    };
+    let disassembler = &mut summary.disassembler;
+    let on_stage = options.on_stage;
+    let stage = |stage| StageScope::enter(on_stage, stage);
+    let analysis_t = Instant::now();
+    let analysed = timeout(
+        options.timeout,
+        disassembling(on_stage, disassembler.analyse()),
+    )
+    .await;
+    summary.analysis = analysis_t.elapsed();
+    if analysed.is_err() {
+        return summary;
+    }
+    let arch = match disassembling(on_stage, disassembler.get_arch()).await {
+        Some(arch) => arch,
+        None => {
+            summary.outcome = Err(PipelineError::UnsupportedArchitecture);
+            return summary;
+        }
+    };
+    let bin = intern(&strings, &binary);
+    summary.outcome = Ok((bin, arch));
+    let mut funcs = disassembling(on_stage, disassembler.get_function_offsets())
+        .await
+        .into_iter()
+        .collect::<Vec<_>>();
+    funcs.sort_unstable();
+    let names = disassembling(on_stage, disassembler.get_function_names())
+        .await
+        .into_iter()
+        .map(|(k, v)| (v, k))
+        .collect::<FnvHashMap<_, _>>();
+    for func in funcs {
+        if let Some(filter) = &mut options.filter {
+            if !filter(func) {
+                continue;
+            }
+        }
+        summary.visited += 1;
+        let bare = disassembling(on_stage, disassembler.get_function_cfg(func)).await;
+        let (bare, name) = match (bare, names.get(&func)) {
+            (Some(bare), Some(name)) => (bare, name),
+            _ => continue,
+        };
+        let mut timings = FunctionTimings::default();
+        let cfg_t = Instant::now();
+        let cfg = {
+            let _stage = stage(Stage::Cfg);
+            CFG::from(bare)
+        };
+        timings.cfg = cfg_t.elapsed();
+        if cfg.len() <= 1 {
+            continue;
+        }
+        // the statements are retrieved once, for both the library lookup and the fvec
+        let mut body = None;
+        if let Some(libdb) = &options.libdb {
+            let stmts = disassembling(on_stage, disassembler.get_function_body(func)).await;
+            if let Some(stmts) = &stmts {
+                let signature = LibrarySignature::new(stmts, &cfg);
+                if let Some(library) = libdb.lookup(&signature) {
+                    *summary.known.entry(library.to_string()).or_insert(0) += 1;
+                    continue;
+                }
+            }
+            body = Some(stmts);
+        }
+        let (cfs, reductions) = if options.structural {
+            let _stage = stage(Stage::Cfs);
+            let cfs_t = Instant::now();
+            let cfs = CFS::new(&cfg);
+            timings.cfs = cfs_t.elapsed();
+            (cfs.get_tree(), Some(*cfs.stats()))
+        } else {
+            (None, None)
+        };
+        let fvec = if options.semantic {
+            let body = match body {
+                Some(body) => body,
+                None => disassembling(on_stage, disassembler.get_function_body(func)).await,
+            };
+            body.map(|stmts| {
+                let _stage = stage(Stage::FVec);
+                let mut opcodes = {
+                    let _span = trace::span("wait opcode cache");
+                    opcodes.lock().unwrap()
+                };
+                let fvec_t = Instant::now();
+                let fvec = FVec::new(stmts, &mut opcodes, options.cross_arch);
+                timings.fvec = fvec_t.elapsed();
+                fvec
+            })
+        } else {
+            None
+        };
+        let result = FunctionResult {
+            bin,
+            func: intern(&strings, name),
+            name: name.clone(),
+            offset: func,
+            cfg,
+            cfs,
+            reductions,
+            fvec,
+            timings,
+        };
+        if sender.send(result).await.is_err() {
+            // nobody is listening anymore
+            break;
+        }
+    }
+    summary
+}
+
+// returns the id of a name, assigning the next one if missing
+fn intern(strings: &Mutex<HashMap<String, u32>>, name: &str) -> u32 {
+    let mut cache = {
+        let _span = trace::span("wait string cache");
+        strings.lock().unwrap()
+    };
+    let next_id = cache.len() as u32;
+    *cache.entry(name.to_string()).or_insert(next_id)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{analyse_functions, PipelineError, PipelineOptions, Stage, StageHooks};
+    use crate::analysis::{LibraryDB, LibrarySignature, CFG};
+    use crate::disasm::radare2::{R2Command, R2Disasm, R2Session, ReplayLatency};
+    use crate::disasm::{Architecture, Statement, StatementFamily};
+    use std::cell::{Cell, RefCell};
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use std::sync::Arc;
+    use std::time::Duration;
+
+    fn command(command: &str, response: &str) -> R2Command {
+        R2Command {
+            command: command.to_string(),
+            response: Ok(response.to_string()),
+            elapsed: Duration::ZERO,
+        }
+    }
+
+    // a binary with an if-then function at 0x1000 and 0x2000
+    fn session(arch: &str) -> R2Session {
+        session_with(arch, 2)
+    }
+
+    // a binary with `count` if-then functions, main at 0x1000, helper at 0x2000 and then fN
+    fn session_with(arch: &str, count: u64) -> R2Session {
+        let bases = (1..=count).map(|i| i * 0x1000).collect::<Vec<_>>();
+        let offsets = bases.iter().rev().map(u64::to_string).collect::<Vec<_>>();
+        let names = bases
+            .iter()
+            .enumerate()
+            .map(|(i, base)| {
+                let name = match i {
+                    0 => "main".to_string(),
+                    1 => "helper".to_string(),
+                    _ => format!("f{}", i),
+                };
+                format!("{{\"offset\":{},\"name\":\"{}\"}}", base, name)
+            })
+            .collect::<Vec<_>>();
+        let mut commands = vec![
+            command("aaa", ""),
+            command(
+                "ij",
+                &format!("{{\"bin\":{{\"arch\":\"{}\",\"bits\":64}}}}", arch),
+            ),
+            command("aflqj", &format!("[{}]", offsets.join(","))),
+            command("aflj", &format!("[{}]", names.join(","))),
+        ];
+        for base in bases {
+            let bbs = format!(
+                "0x{:x} 0x{:x} 00:0000 20 j 0x{:x} f 0x{:x}\n0x{:x} 0x{:x} 00:0000 2 j 0x{:x}\n\
+                 0x{:x} 0x{:x} 00:0000 5\n",
+                base,
+                base + 0x14,
+                base + 0x16,
+                base + 0x14,
+                base + 0x14,
+                base + 0x16,
+                base + 0x16,
+                base + 0x16,
+                base + 0x1b
+            );
+            let dot = format!(
+                "digraph code {{\n\"0x{:08x}\" -> \"0x{:08x}\" [color=\"#13a10e\"];\n\
+                 \"0x{:08x}\" -> \"0x{:08x}\" [color=\"#c50f1f\"];\n\
+                 \"0x{:08x}\" -> \"0x{:08x}\" [color=\"#3a96dd\"];\n}}\n",
+                base,
+                base + 0x16,
+                base,
+                base + 0x14,
+                base + 0x14,
+                base + 0x16
+            );
+            let ops = format!(
+                "{{\"ops\":[{{\"offset\":{},\"type\":\"mov\",\"opcode\":\"mov eax, 1\"}},\
+                 {{\"offset\":{},\"type\":\"ret\",\"opcode\":\"ret\"}}]}}",
+                base,
+                base + 4
+            );
+            commands.push(command(&format!("s {}", base), ""));
+            commands.push(command("afb", &bbs));
+            commands.push(command("agfdm", &dot));
+            commands.push(command("pdfj", &ops));
+        }
+        R2Session { commands }
+    }
+
+    fn replay(arch: &str) -> R2Disasm {
+        R2Disasm::replay(session(arch), ReplayLatency::None)
+    }
+
+    thread_local! {
+        // stages entered by the test running on this thread, and the one currently running
+        static ENTERED: RefCell<Vec<Stage>> = const { RefCell::new(Vec::new()) };
+        static RUNNING: Cell<Option<Stage>> = const { Cell::new(None) };
+    }
+
+    fn enter_stage(stage: Stage) -> usize {
+        assert_eq!(RUNNING.replace(Some(stage)), None, "stages must not nest");
+        ENTERED.with_borrow_mut(|entered| entered.push(stage));
+        0
+    }
+
+    fn exit_stage(_: usize) {
+        assert!(RUNNING.take().is_some(), "stage ended twice");
+    }
+
+    #[tokio::test]
+    async fn stream_functions() {
+        let options = PipelineOptions {
+            buffer: 1,
+            on_stage: Some(StageHooks {
+                enter: enter_stage,
+                exit: exit_stage,
+            }),
+            ..Default::default()
+        };
+        let strings = Default::default();
+        let (analysis, mut functions) = analyse_functions(
+            "bin".to_string(),
+            replay("x86"),
+            strings,
+            Default::default(),
+            options,
+        );
+        let consumer = async {
+            let mut results = Vec::new();
+            while let Some(function) = functions.recv().await {
+                results.push(function);
+            }
+            results
+        };
+        let (summary, results) = tokio::join!(analysis, consumer);
+        assert_eq!(summary.outcome, Ok((0, Architecture::X86(64))));
+        assert_eq!(summary.visited, 2);
+        assert_eq!(results.len(), 2);
+        assert_eq!(results[0].name, "main");
+        assert_eq!((results[0].bin, results[0].func), (0, 1));
+        assert_eq!((results[1].offset, results[1].func), (0x2000, 2));
+        assert!(results
+            .iter()
+            .all(|function| function.cfs.is_some() && function.fvec.is_some()));
+        assert!(results[0].reductions.is_some());
+        // the tokio test runs on this thread, so these are the stages of this analysis only
+        assert_eq!(RUNNING.get(), None);
+        let entered = ENTERED.take();
+        let count = |stage| entered.iter().filter(|entered| **entered == stage).count();
+        assert_eq!(count(Stage::Cfs), results.len());
+        assert_eq!(count(Stage::FVec), results.len());
+        assert!(count(Stage::Disassembler) > 0);
+    }
+
+    #[tokio::test]
+    async fn bounded_in_flight() {
+        const BUFFER: usize = 2;
+        let started = Arc::new(AtomicUsize::new(0));
+        let counter = Arc::clone(&started);
+        let options = PipelineOptions {
+            buffer: BUFFER,
+            semantic: false,
+            // called once when the analysis of each function starts
+            filter: Some(Box::new(move |_| {
+                counter.fetch_add(1, Ordering::Relaxed);
+                true
+            })),
+            ..Default::default()
+        };
+        let disassembler = R2Disasm::replay(session_with("x86", 16), ReplayLatency::None);
+        let (analysis, mut functions) = analyse_functions(
+            "bin".to_string(),
+            disassembler,
+            Default::default(),
+            Default::default(),
+            options,
+        );
+        let consumer = async {
+            let mut received = 0;
+            let mut ahead = 0;
+            loop {
+                // a slow consumer, so the analysis runs as far ahead as it can
+                for _ in 0..8 {
+                    tokio::task::yield_now().await;
+                }
+                // the functions started and not yet received: the buffered ones, the one
+                // waiting to be sent and the one being analysed
+                ahead = (started.load(Ordering::Relaxed) - received).max(ahead);
+                assert!(ahead <= BUFFER + 2);
+                match functions.recv().await {
+                    Some(_) => received += 1,
+                    None => return (received, ahead),
+                }
+            }
+        };
+        let (summary, (received, ahead)) = tokio::join!(analysis, consumer);
+        assert_eq!(summary.visited, 16);
+        assert_eq!(received, 16);
+        // the analysis did not wait for each function to be consumed
+        assert!(ahead > 1);
+    }
+
+    #[tokio::test]
+    async fn filter_and_early_drop() {
+        let options = PipelineOptions {
+            semantic: false,
+            filter: Some(Box::new(|offset| offset != 0x1000)),
+            ..Default::default()
+        };
+        let (analysis, mut functions) = analyse_functions(
+            "bin".to_string(),
+            replay("x86"),
+            Default::default(),
+            Default::default(),
+            options,
+        );
+        let (summary, first) = tokio::join!(analysis, functions.recv());
+        let first = first.unwrap();
+        assert_eq!(first.name, "helper");
+        assert!(first.fvec.is_none());
+        assert_eq!(summary.visited, 1);
+        // the analysis does not wait for a consumer that is gone
+        let (analysis, functions) = analyse_functions(
+            "bin".to_string(),
+            replay("x86"),
+            Default::default(),
+            Default::default(),
+            PipelineOptions {
+                buffer: 1,
+                ..Default::default()
+            },
+        );
+        drop(functions);
+        assert_eq!(analysis.await.visited, 1);
+    }
+
+    #[tokio::test]
+    async fn skip_library_functions() {
+        // both functions of the session have the same instructions
+        let stmts = [
+            Statement::new(0x400, StatementFamily::MOV, "mov eax, 1"),
+            Statement::new(0x404, StatementFamily::RET, "ret"),
+        ];
+        let cfg = CFG::new(&stmts, 0x405, Architecture::X86(64));
+        let mut libdb = LibraryDB::new();
+        libdb.insert("libc", "one", LibrarySignature::new(&stmts, &cfg));
+        let options = PipelineOptions {
+            libdb: Some(Arc::new(libdb)),
+            ..Default::default()
+        };
+        let (analysis, mut functions) = analyse_functions(
+            "bin".to_string(),
+            replay("x86"),
+            Default::default(),
+            Default::default(),
+            options,
+        );
+        let (summary, first) = tokio::join!(analysis, functions.recv());
+        assert!(first.is_none());
+        assert_eq!(summary.visited, 2);
+        assert_eq!(summary.known["libc"], 2);
+    }
+
+    #[tokio::test]
+    async fn unsupported_architecture() {
+        let (analysis, mut functions) = analyse_functions(
+            "bin".to_string(),
+            replay("unknown"),
+            Default::default(),
+            Default::default(),
+            PipelineOptions::default(),
+        );
+        let summary = analysis.await;
+        assert_eq!(summary.outcome, Err(PipelineError::UnsupportedArchitecture));
+        assert!(functions.recv().await.is_none());
+    }
+}
@@ -0,0 +1,269 @@
+use std::borrow::Cow;
+use std::cell::Cell;
+use std::fmt::Write as _;
+use std::future::Future;
+use std::io::{self, Write};
+use std::pin::Pin;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Mutex};
+use std::task::{Context, Poll};
+use std::time::Instant;
+
+// checked by every span before doing anything else
+static ENABLED: AtomicBool = AtomicBool::new(false);
+// lane names, plus the instant corresponding to timestamp 0
+static TRACE: Mutex<Option<Trace>> = Mutex::new(None);
+// spans recorded by each thread, merged only when the trace is written
+static BUFFERS: Mutex<Vec<Arc<Mutex<Vec<Event>>>>> = Mutex::new(Vec::new());
+
+thread_local! {
+    // lane of the task currently running on this thread
+    static LANE: Cell<u32> = const { Cell::new(0) };
+    // spans ended on this thread, registered in BUFFERS by the first one. The lock is contended
+    // only while the trace is being written or reset.
+    static BUFFER: Arc<Mutex<Vec<Event>>> = {
+        let buffer = Arc::default();
+        BUFFERS.lock().unwrap().push(Arc::clone(&buffer));
+        buffer
+    };
+}
+
+struct Trace {
+    epoch: Instant,
+    lanes: Vec<(u32, String)>,
+}
+
+// a completed span
+struct Event {
+    name: Cow<'static, str>,
+    lane: u32,
+    start: Instant,
+    end: Instant,
+}
+
+/// Starts recording the spans.
+///
+/// Spans created before calling this function are not recorded. Calling this function again
+/// discards everything recorded so far.
+pub fn enable() {
+    *TRACE.lock().unwrap() = Some(Trace {
+        epoch: Instant::now(),
+        lanes: Vec::new(),
+    });
+    for buffer in BUFFERS.lock().unwrap().iter() {
+        buffer.lock().unwrap().clear();
+    }
+    ENABLED.store(true, Ordering::Release);
+}
+
+/// Returns true if the spans are being recorded.
+#[inline]
+pub fn is_enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// A region of code being traced.
+///
+/// The span starts when created with [span] or [span_with] and ends when dropped. If tracing is
+/// not enabled the span is empty and dropping it does nothing.
+#[must_use = "the span ends as soon as it is dropped"]
+pub struct Span {
+    inner: Option<(Cow<'static, str>, u32, Instant)>,
+}
+
+impl Drop for Span {
+    fn drop(&mut self) {
+        if let Some((name, lane, start)) = self.inner.take() {
+            let event = Event {
+                name,
+                lane,
+                start,
+                end: Instant::now(),
+            };
+            // the thread local is already destroyed if the span ends while the thread exits
+            let _ = BUFFER.try_with(|buffer| buffer.lock().unwrap().push(event));
+        }
+    }
+}
+
+/// Starts a span with the given name, in the lane of the current task.
+#[inline]
+pub fn span(name: &'static str) -> Span {
+    if is_enabled() {
+        start(Cow::Borrowed(name))
+    } else {
+        Span { inner: None }
+    }
+}
+
+/// Starts a span whose name is built by the given function.
+///
+/// The function is called only if tracing is enabled, so building the name costs nothing
+/// otherwise.
+#[inline]
+pub fn span_with<F: FnOnce() -> String>(name: F) -> Span {
+    if is_enabled() {
+        start(Cow::Owned(name()))
+    } else {
+        Span { inner: None }
+    }
+}
+
+fn start(name: Cow<'static, str>) -> Span {
+    Span {
+        inner: Some((name, LANE.with(|lane| lane.get()), Instant::now())),
+    }
+}
+
+/// Gives a name to a lane, shown in the trace viewer.
+///
+/// Lane 0 is the one of the code not running inside [in_lane].
+pub fn name_lane(lane: u32, name: &str) {
+    if is_enabled() {
+        if let Some(trace) = TRACE.lock().unwrap().as_mut() {
+            trace.lanes.push((lane, name.to_string()));
+        }
+    }
+}
+
+/// Runs a future with all its spans assigned to the given lane.
+///
+/// The lane follows the future even if it is moved between threads by the executor, so each
+/// task can be shown on its own row of the trace.
+pub fn in_lane<F: Future>(lane: u32, future: F) -> InLane<F> {
+    InLane {
+        lane,
+        inner: Box::pin(future),
+    }
+}
+
+/// Future returned by [in_lane].
+pub struct InLane<F> {
+    lane: u32,
+    inner: Pin<Box<F>>,
+}
+
+impl<F: Future> Future for InLane<F> {
+    type Output = F::Output;
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let lane = self.lane;
+        let previous = LANE.with(|current| current.replace(lane));
+        let result = self.inner.as_mut().poll(cx);
+        LANE.with(|current| current.set(previous));
+        result
+    }
+}
+
+/// Writes the recorded spans in the Chrome trace event format.
+///
+/// The output can be opened with `chrome://tracing` or with Perfetto. Each lane is a thread of
+/// a single process, and each span a complete event with timestamps in microseconds.
+pub fn write_chrome<W: Write>(out: &mut W) -> Result<(), io::Error> {
+    let guard = TRACE.lock().unwrap();
+    out.write_all(b"{\"traceEvents\":[")?;
+    let mut first = true;
+    if let Some(trace) = guard.as_ref() {
+        let mut line = String::new();
+        for (lane, name) in &trace.lanes {
+            line.clear();
+            line.push_str("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":");
+            write!(line, "{},\"args\":{{\"name\":", lane).unwrap();
+            push_json_str(&mut line, name);
+            line.push_str("}}");
+            write_event(out, &line, &mut first)?;
+        }
+        let buffers = BUFFERS.lock().unwrap();
+        // spans ending meanwhile wait for the trace to be written
+        let events = buffers
+            .iter()
+            .map(|buffer| buffer.lock().unwrap())
+            .collect::<Vec<_>>();
+        for event in events.iter().flat_map(|events| events.iter()) {
+            line.clear();
+            line.push_str("{\"ph\":\"X\",\"name\":");
+            push_json_str(&mut line, &event.name);
+            let start = event.start.saturating_duration_since(trace.epoch);
+            let duration = event.end.saturating_duration_since(event.start);
+            write!(
+                line,
+                ",\"pid\":1,\"tid\":{},\"ts\":{:.3},\"dur\":{:.3}}}",
+                event.lane,
+                start.as_secs_f64() * 1e6,
+                duration.as_secs_f64() * 1e6
+            )
+            .unwrap();
+            write_event(out, &line, &mut first)?;
+        }
+    }
+    out.write_all(b"],\"displayTimeUnit\":\"ms\"}\n")
+}
+
+// writes a single event of the array, one per line
+fn write_event<W: Write>(out: &mut W, event: &str, first: &mut bool) -> Result<(), io::Error> {
+    if !*first {
+        out.write_all(b",")?;
+    }
+    *first = false;
+    out.write_all(b"\n")?;
+    out.write_all(event.as_bytes())
+}
+
+// appends a JSON string, quotes included
+fn push_json_str(out: &mut String, value: &str) {
+    out.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if c < ' ' => write!(out, "\\u{:04x}", c as u32).unwrap(),
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::trace;
+
+    // a single test, as the trace is global
+    #[tokio::test]
+    async fn chrome_trace() {
+        trace::enable();
+        trace::name_lane(7, "job \"a\"");
+        {
+            let _outer = trace::span("outer");
+            let _inner = trace::span_with(|| format!("inner {}", 1));
+        }
+        trace::in_lane(7, async {
+            let _span = trace::span("task");
+        })
+        .await;
+        let mut out = Vec::new();
+        trace::write_chrome(&mut out).unwrap();
+        let json = String::from_utf8(out).unwrap();
+        assert!(json.starts_with("{\"traceEvents\":["));
+        assert!(json.contains("\"args\":{\"name\":\"job \\\"a\\\"\"}"));
+        assert!(json.contains("\"name\":\"outer\",\"pid\":1,\"tid\":0,"));
+        assert!(json.contains("\"name\":\"inner 1\",\"pid\":1,\"tid\":0,"));
+        assert!(json.contains("\"name\":\"task\",\"pid\":1,\"tid\":7,"));
+        // the lane is restored after polling
+        {
+            let _span = trace::span("after");
+        }
+        // spans of other threads are kept after the thread exits
+        std::thread::spawn(|| {
+            let _span = trace::span("thread");
+        })
+        .join()
+        .unwrap();
+        let mut out = Vec::new();
+        trace::write_chrome(&mut out).unwrap();
+        let json = String::from_utf8(out).unwrap();
+        assert!(json.contains("\"name\":\"after\",\"pid\":1,\"tid\":0,"));
+        assert!(json.contains("\"name\":\"thread\",\"pid\":1,\"tid\":0,"));
+        assert!(json.contains("\"name\":\"outer\","));
+        assert!(json.ends_with("],\"displayTimeUnit\":\"ms\"}\n"));
+    }
+}